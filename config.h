@@ -12,6 +12,18 @@
 /* Uncomment to compile with tcpd/libwrap support. */
 //#define WITH_WRAP
 
+/* Uncomment to compile with zlib support, for compressing message payloads in
+ * the persistent database. */
+//#define WITH_ZLIB
+
+/* Uncomment to compile with support for hashed passwords in the password file,
+ * which needs openssl. */
+//#define WITH_PASSWORD_HASHES
+
+/* Uncomment to compile with support for authentication plugins, which needs
+ * libdl and pthreads. */
+//#define WITH_AUTH_PLUGIN
+
 /* Compile with database upgrading support? If disabled, mosquitto won't
  * automatically upgrade old database versions. */
 //#define WITH_DB_UPGRADE
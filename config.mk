@@ -16,6 +16,9 @@ endif
 
 LDFLAGS=
 # Add -lwrap to LDFLAGS if compiling with tcp wrappers support.
+# Add -lz to LDFLAGS if compiling with zlib support.
+# Add -lcrypto to LDFLAGS if compiling with password hash support.
+# Add -ldl -lpthread to LDFLAGS if compiling with auth plugin support.
 
 CC=gcc
 INSTALL=install
@@ -37,6 +37,69 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <messages_mosq.h>
 #include <send_mosq.h>
 
+/* Acknowledgements are matched to messages using a hash of (mid, direction)
+ * rather than a walk of the whole message list, which is slow when many
+ * messages are in flight. See the broker message index in database.c. */
+#define MSG_INDEX_BUCKET(mid, dir, size) ((((unsigned int)(mid))*2 + (unsigned int)(dir)) & ((unsigned int)(size)-1))
+
+static void _message_index_link(struct mosquitto *mosq, struct mosquitto_message_all *message)
+{
+	struct mosquitto_message_all **bucket;
+
+	bucket = &mosq->msg_index[MSG_INDEX_BUCKET(message->msg.mid, message->direction, mosq->msg_index_size)];
+	while(*bucket){
+		bucket = &(*bucket)->mid_next;
+	}
+	message->mid_next = NULL;
+	*bucket = message;
+}
+
+static int _message_index_resize(struct mosquitto *mosq, int size)
+{
+	struct mosquitto_message_all **index;
+	struct mosquitto_message_all *message;
+
+	index = _mosquitto_calloc(size, sizeof(struct mosquitto_message_all *));
+	if(!index) return MOSQ_ERR_NOMEM;
+
+	if(mosq->msg_index) _mosquitto_free(mosq->msg_index);
+	mosq->msg_index = index;
+	mosq->msg_index_size = size;
+
+	message = mosq->messages;
+	while(message){
+		if(message->msg.mid){
+			_message_index_link(mosq, message);
+		}
+		message = message->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct mosquitto_message_all *_message_index_find(struct mosquitto *mosq, uint16_t mid, enum mosquitto_msg_direction dir)
+{
+	struct mosquitto_message_all *message;
+
+	if(mosq->msg_index){
+		message = mosq->msg_index[MSG_INDEX_BUCKET(mid, dir, mosq->msg_index_size)];
+		while(message){
+			if(message->msg.mid == mid && message->direction == dir){
+				return message;
+			}
+			message = message->mid_next;
+		}
+	}else{
+		message = mosq->messages;
+		while(message){
+			if(message->msg.mid == mid && message->direction == dir){
+				return message;
+			}
+			message = message->next;
+		}
+	}
+	return NULL;
+}
+
 void _mosquitto_message_cleanup(struct mosquitto_message_all **message)
 {
 	struct mosquitto_message_all *msg;
@@ -61,6 +124,13 @@ void _mosquitto_message_cleanup_all(struct mosquitto *mosq)
 		_mosquitto_message_cleanup(&mosq->messages);
 		mosq->messages = tmp;
 	}
+	mosq->messages_last = NULL;
+	if(mosq->msg_index){
+		_mosquitto_free(mosq->msg_index);
+		mosq->msg_index = NULL;
+	}
+	mosq->msg_index_size = 0;
+	mosq->msg_index_count = 0;
 }
 
 int mosquitto_message_copy(struct mosquitto_message *dst, const struct mosquitto_message *src)
@@ -115,44 +185,71 @@ void mosquitto_message_free(struct mosquitto_message **message)
 
 void _mosquitto_message_queue(struct mosquitto *mosq, struct mosquitto_message_all *message)
 {
-	struct mosquitto_message_all *tail;
-
 	assert(mosq);
 	assert(message);
 
 	message->next = NULL;
-	if(mosq->messages){
-		tail = mosq->messages;
-		while(tail->next){
-			tail = tail->next;
-		}
-		tail->next = message;
+	message->prev = mosq->messages_last;
+	message->mid_next = NULL;
+	if(mosq->messages_last){
+		mosq->messages_last->next = message;
 	}else{
 		mosq->messages = message;
 	}
+	mosq->messages_last = message;
+
+	if(message->msg.mid){
+		mosq->msg_index_count++;
+		if(mosq->msg_index_count > mosq->msg_index_size){
+			/* The message is already in the list so a successful resize
+			 * indexes it as well. */
+			if(!_message_index_resize(mosq, mosq->msg_index_size ? mosq->msg_index_size*2 : 16)){
+				return;
+			}
+		}
+		if(mosq->msg_index){
+			_message_index_link(mosq, message);
+		}
+	}
 }
 
 int _mosquitto_message_remove(struct mosquitto *mosq, uint16_t mid, enum mosquitto_msg_direction dir, struct mosquitto_message_all **message)
 {
-	struct mosquitto_message_all *cur, *prev = NULL;
+	struct mosquitto_message_all *cur, **bucket;
 	assert(mosq);
 	assert(message);
 
-	cur = mosq->messages;
-	while(cur){
-		if(cur->msg.mid == mid && cur->direction == dir){
-			if(prev){
-				prev->next = cur->next;
-			}else{
-				mosq->messages = cur->next;
+	cur = _message_index_find(mosq, mid, dir);
+	if(!cur) return MOSQ_ERR_NOT_FOUND;
+
+	if(cur->msg.mid){
+		mosq->msg_index_count--;
+		if(mosq->msg_index){
+			bucket = &mosq->msg_index[MSG_INDEX_BUCKET(mid, dir, mosq->msg_index_size)];
+			while(*bucket){
+				if(*bucket == cur){
+					*bucket = cur->mid_next;
+					break;
+				}
+				bucket = &(*bucket)->mid_next;
 			}
-			*message = cur;
-			return MOSQ_ERR_SUCCESS;
 		}
-		prev = cur;
-		cur = cur->next;
 	}
-	return MOSQ_ERR_NOT_FOUND;
+	if(cur->prev){
+		cur->prev->next = cur->next;
+	}else{
+		mosq->messages = cur->next;
+	}
+	if(cur->next){
+		cur->next->prev = cur->prev;
+	}else{
+		mosq->messages_last = cur->prev;
+	}
+	cur->next = NULL;
+	cur->prev = NULL;
+	cur->mid_next = NULL;
+	*message = cur;
+	return MOSQ_ERR_SUCCESS;
 }
 
 void _mosquitto_message_retry_check(struct mosquitto *mosq)
@@ -198,14 +295,11 @@ int _mosquitto_message_update(struct mosquitto *mosq, uint16_t mid, enum mosquit
 	struct mosquitto_message_all *message;
 	assert(mosq);
 
-	message = mosq->messages;
-	while(message){
-		if(message->msg.mid == mid && message->direction == dir){
-			message->state = state;
-			message->timestamp = time(NULL);
-			return MOSQ_ERR_SUCCESS;
-		}
-		message = message->next;
+	message = _message_index_find(mosq, mid, dir);
+	if(message){
+		message->state = state;
+		message->timestamp = time(NULL);
+		return MOSQ_ERR_SUCCESS;
 	}
 	return MOSQ_ERR_NOT_FOUND;
 }
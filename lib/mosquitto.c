@@ -108,6 +108,10 @@ struct mosquitto *mosquitto_new(const char *id, void *obj)
 		mosq->last_mid = 0;
 		mosq->state = mosq_cs_new;
 		mosq->messages = NULL;
+		mosq->messages_last = NULL;
+		mosq->msg_index = NULL;
+		mosq->msg_index_size = 0;
+		mosq->msg_index_count = 0;
 		mosq->will = NULL;
 		mosq->on_connect = NULL;
 		mosq->on_publish = NULL;
@@ -97,6 +97,7 @@ extern "C" {
 #define MOSQ_ERR_ACL_DENIED 12
 #define MOSQ_ERR_UNKNOWN 13
 #define MOSQ_ERR_ERRNO 14
+#define MOSQ_ERR_AUTH_PENDING 15
 
 struct mosquitto_message{
 	uint16_t mid;
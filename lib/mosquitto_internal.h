@@ -76,11 +76,20 @@ struct _mosquitto_packet{
 	uint32_t to_process;
 	uint32_t pos;
 	uint8_t *payload;
+#ifdef WITH_BROKER
+	struct _mosquitto_packet *shared; /* Packet that owns payload, if it is shared. */
+	int ref_count;
+	struct mosquitto_msg_store *store; /* Message whose payload is sent after the headers in payload. */
+	uint32_t store_pos; /* Packet offset at which the store payload starts. */
+	uint32_t mapped_length; /* Non-zero if payload is a file backed mapping. */
+#endif
 	struct _mosquitto_packet *next;
 };
 
 struct mosquitto_message_all{
 	struct mosquitto_message_all *next;
+	struct mosquitto_message_all *prev;
+	struct mosquitto_message_all *mid_next; /* Next entry in the mid index bucket. */
 	time_t timestamp;
 	enum mosquitto_msg_direction direction;
 	enum mosquitto_msg_state state;
@@ -98,6 +107,14 @@ struct _mosquitto_ssl{
 };
 #endif
 
+/* A token bucket for rate limiting, see src/ratelimit.c. Outside
+ * WITH_BROKER because the listener and user structs in src/mqtt3.h hold
+ * them, and src/db_dump includes that without WITH_BROKER. */
+struct _mosquitto_bucket {
+	int64_t tokens; /* In thousandths, negative once overdrawn. */
+	uint64_t updated; /* When tokens was last topped up, in ms. */
+};
+
 struct mosquitto {
 #ifndef WIN32
 	int sock;
@@ -123,14 +140,68 @@ struct mosquitto {
 #ifdef WITH_BROKER
 	struct _mqtt3_bridge *bridge;
 	struct _mosquitto_client_msg *msgs;
+	struct _mosquitto_client_msg *msgs_last;
+	struct _mosquitto_client_msg **msg_index;
+	int msg_index_size;
+	int msg_index_count;
+	int msg_count;
+	int msg_count12;
+	unsigned long msg_bytes;
+	unsigned long msgs_dropped;
+	unsigned long msgs_dropped_sys;
+	/* To be disconnected by queue_drop_policy disconnect once the message
+	 * being delivered has gone to all its subscribers. */
+	bool queue_overflow;
+	/* Conflation entries, hashed by topic. */
+	struct _mosquitto_conflated **conflated;
+	int conflated_size;
+	int conflated_count;
+	bool conflate_held;
+	/* Next client with conflation entries. */
+	struct mosquitto *conflate_next;
+	bool conflate_listed;
+	struct mosquitto *write_next;
+	bool write_ready;
+	bool db_dirty;
+	/* Queued messages left in the persistent database file until the
+	 * client reconnects. */
+	size_t db_lazy_pos;
+	size_t db_lazy_len;
+	/* File that queued messages have been spilled to, and its length. */
+	char *db_spill_path;
+	size_t db_spill_len;
 	struct _mosquitto_acl_user *acl_list;
+	struct _mosquitto_acl_cache *acl_cache;
+	/* Changed whenever the ACLs that apply to the client may have changed. */
+	unsigned int acl_generation;
+	/* CONNECT waiting for the auth plugin to check the password. */
+	struct _mosquitto_auth_job *auth_job;
 	struct _mqtt3_listener *listener;
+	struct _mosquitto_quota_user *quota_user;
+	int sub_count;
+	/* The only tree holding the client's subscriptions, or NULL if they may
+	 * be in any of them. */
+	struct _mosquitto_mount *mount;
+	/* PUBLISH packets and bytes received, and bytes sent. */
+	struct _mosquitto_bucket in_msgs;
+	struct _mosquitto_bucket in_bytes;
+	struct _mosquitto_bucket out_bytes;
+	/* Bytes waiting in out_packet. */
+	unsigned long out_packet_bytes;
+	/* PUBLISH bytes received since src/overload.c last looked, and whether
+	 * it has stopped reading from the client. */
+	unsigned long overload_bytes;
+	bool overload_paused;
 #else
 	void *obj;
 	bool in_callback;
 	unsigned int message_retry;
 	time_t last_retry_check;
 	struct mosquitto_message_all *messages;
+	struct mosquitto_message_all *messages_last;
+	struct mosquitto_message_all **msg_index;
+	int msg_index_size;
+	int msg_index_count;
 	int log_priorities;
 	int log_destinations;
 	void (*on_connect)(void *obj, int rc);
@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2012 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _MOSQUITTO_PLUGIN_H_
+#define _MOSQUITTO_PLUGIN_H_
+
+/*
+ * Interface for authentication plugins, loaded by the broker with the
+ * auth_plugin option.
+ *
+ * A plugin is a shared library that exports every function below. The return
+ * values are those of mosquitto.h.
+ *
+ * mosquitto_auth_unpwd_check() is called from a pool of worker threads, so it
+ * may block - for example while a database or directory server answers - but
+ * must be safe to call from several threads at once. The client is left
+ * waiting for its CONNACK until the check returns, without holding up any
+ * other client.
+ *
+ * mosquitto_auth_acl_check() is called from the main broker thread and must
+ * not block. Its results are remembered for each client until the client
+ * disconnects or the broker is sent a reload signal.
+ */
+
+#define MOSQ_AUTH_PLUGIN_VERSION 1
+
+#define MOSQ_ACL_NONE 0x00
+#define MOSQ_ACL_READ 0x01
+#define MOSQ_ACL_WRITE 0x02
+
+/* An "auth_opt_<key> <value>" line from the config file. */
+struct mosquitto_auth_opt {
+	char *key;
+	char *value;
+};
+
+/*
+ * Function: mosquitto_auth_plugin_version
+ *
+ * Returns:
+ * 	MOSQ_AUTH_PLUGIN_VERSION
+ */
+int mosquitto_auth_plugin_version(void);
+
+/*
+ * Function: mosquitto_auth_plugin_init
+ *
+ * Called once, when the broker starts.
+ *
+ * Parameters:
+ * 	user_data -      set this to point at any data the plugin needs. It is
+ * 	                 passed to all of the other functions.
+ * 	auth_opts -      the auth_opt_ options from the config file.
+ * 	auth_opt_count - the number of auth_opts.
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS, or any other value to stop the broker starting.
+ */
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count);
+
+/*
+ * Function: mosquitto_auth_plugin_cleanup
+ *
+ * Called once, when the broker stops. No checks are running.
+ */
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count);
+
+/*
+ * Function: mosquitto_auth_unpwd_check
+ *
+ * Check the username and password of a connecting client. password is NULL
+ * if the client didn't send one.
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS - if the client may connect.
+ * 	MOSQ_ERR_AUTH -    if the client isn't allowed to connect.
+ * 	Anything else is taken to mean the check couldn't be made, and the
+ * 	client is told that the server is unavailable.
+ */
+int mosquitto_auth_unpwd_check(void *user_data, const char *username, const char *password);
+
+/*
+ * Function: mosquitto_auth_acl_check
+ *
+ * Check whether a client may publish to (MOSQ_ACL_WRITE) or receive messages
+ * on (MOSQ_ACL_READ) topic. username is NULL for anonymous clients.
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS -    if access is allowed.
+ * 	MOSQ_ERR_ACL_DENIED - otherwise.
+ */
+int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *username, const char *topic, int access);
+
+#endif
@@ -36,6 +36,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <netdb.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#ifdef WITH_BROKER
+#include <sys/mman.h>
+#endif
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -104,12 +107,47 @@ void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
+#ifdef WITH_BROKER
+	if(packet->shared){
+		/* payload belongs to the shared packet. */
+		_mosquitto_shared_packet_release(packet->shared);
+		packet->shared = NULL;
+		packet->payload = NULL;
+	}
+	if(packet->store){
+		packet->store->ref_count--;
+		packet->store = NULL;
+		packet->store_pos = 0;
+	}
+#ifndef WIN32
+	if(packet->mapped_length){
+		munmap(packet->payload, packet->mapped_length);
+		packet->mapped_length = 0;
+		packet->payload = NULL;
+	}
+#endif
+#endif
 	if(packet->payload) _mosquitto_free(packet->payload);
 	packet->payload = NULL;
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
+#ifdef WITH_BROKER
+/* Drop a reference to a packet created for _mosquitto_send_shared_packet(),
+ * freeing it when there are no more. */
+void _mosquitto_shared_packet_release(struct _mosquitto_packet *shared)
+{
+	if(!shared) return;
+
+	shared->ref_count--;
+	if(shared->ref_count <= 0){
+		_mosquitto_packet_cleanup(shared);
+		_mosquitto_free(shared);
+	}
+}
+#endif
+
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
 {
 	struct _mosquitto_packet *tail;
@@ -131,6 +169,7 @@ int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *pa
 		mosq->out_packet = packet;
 	}
 #ifdef WITH_BROKER
+	mqtt3_db_out_packet_bytes(mosq, packet->packet_length);
 	return _mosquitto_packet_write(mosq);
 #else
 	if(mosq->in_callback == false){
@@ -302,6 +341,13 @@ void _mosquitto_write_bytes(struct _mosquitto_packet *packet, const uint8_t *byt
 }
 
 int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str)
+{
+	return _mosquitto_read_string_prefix(packet, NULL, 0, str);
+}
+
+/* Read a string into a new buffer that starts with the first prefix_len
+ * characters of prefix, such as a listener mount_point. */
+int _mosquitto_read_string_prefix(struct _mosquitto_packet *packet, const char *prefix, int prefix_len, char **str)
 {
 	uint16_t len;
 	int rc;
@@ -312,9 +358,10 @@ int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str)
 
 	if(packet->pos+len > packet->remaining_length) return MOSQ_ERR_PROTOCOL;
 
-	*str = _mosquitto_calloc(len+1, sizeof(char));
+	*str = _mosquitto_calloc(prefix_len+len+1, sizeof(char));
 	if(*str){
-		memcpy(*str, &(packet->payload[packet->pos]), len);
+		if(prefix_len) memcpy(*str, prefix, prefix_len);
+		memcpy(&(*str)[prefix_len], &(packet->payload[packet->pos]), len);
 		packet->pos += len;
 	}else{
 		return MOSQ_ERR_NOMEM;
@@ -433,6 +480,8 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
 	struct _mosquitto_packet *packet;
+	uint8_t *buf;
+	uint32_t len;
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
@@ -441,10 +490,27 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		packet = mosq->out_packet;
 
 		while(packet->to_process > 0){
-			write_length = _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+			buf = &(packet->payload[packet->pos]);
+			len = packet->to_process;
+#ifdef WITH_BROKER
+			if(packet->store){
+				/* Headers come from the packet, the payload from the store. */
+				if(packet->pos < packet->store_pos){
+					len = packet->store_pos - packet->pos;
+				}else{
+					buf = &(packet->store->msg.payload[packet->pos - packet->store_pos]);
+				}
+			}
+			/* The rest is sent once the outbound rate allows. */
+			len = mqtt3_rate_outbound_allowed(mosq, len);
+			if(!len) return MOSQ_ERR_SUCCESS;
+#endif
+			write_length = _mosquitto_net_write(mosq, buf, len);
 			if(write_length > 0){
 #ifdef WITH_BROKER
 				bytes_sent += write_length;
+				mqtt3_db_out_packet_bytes(mosq, -write_length);
+				mqtt3_rate_outbound_take(mosq, write_length);
 #endif
 				packet->to_process -= write_length;
 				packet->pos += write_length;
@@ -581,9 +647,27 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 			}
 		}while((byte & 128) != 0);
 
-		if(mosq->in_packet.remaining_length > 0){
+#ifdef WITH_BROKER
+		/* Refuse oversized packets before allocating anything for them. */
+		if(mosq->listener && mosq->listener->max_packet_size
+				&& mosq->in_packet.remaining_length > mosq->listener->max_packet_size){
+
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Packet of %u bytes from %s exceeds max_packet_size, disconnecting.",
+					mosq->in_packet.remaining_length, mosq->id?mosq->id:mosq->address);
+			return MOSQ_ERR_PAYLOAD_SIZE;
+		}
+		if(db->config->payload_spill_size
+				&& (mosq->in_packet.command&0xF0) == PUBLISH
+				&& mosq->in_packet.remaining_length > db->config->payload_spill_size){
+
+			mqtt3_net_payload_spill(db, &mosq->in_packet);
+		}
+#endif
+		if(mosq->in_packet.remaining_length > 0 && !mosq->in_packet.payload){
 			mosq->in_packet.payload = _mosquitto_malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
 			if(!mosq->in_packet.payload) return MOSQ_ERR_NOMEM;
+		}
+		if(mosq->in_packet.remaining_length > 0){
 			mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 		}
 		mosq->in_packet.have_remaining = 1;
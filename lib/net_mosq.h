@@ -62,6 +62,9 @@ void _mosquitto_net_init(void);
 void _mosquitto_net_cleanup(void);
 
 void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet);
+#ifdef WITH_BROKER
+void _mosquitto_shared_packet_release(struct _mosquitto_packet *shared);
+#endif
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet);
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port);
 int _mosquitto_socket_close(struct mosquitto *mosq);
@@ -69,6 +72,7 @@ int _mosquitto_socket_close(struct mosquitto *mosq);
 int _mosquitto_read_byte(struct _mosquitto_packet *packet, uint8_t *byte);
 int _mosquitto_read_bytes(struct _mosquitto_packet *packet, uint8_t *bytes, uint32_t count);
 int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str);
+int _mosquitto_read_string_prefix(struct _mosquitto_packet *packet, const char *prefix, int prefix_len, char **str);
 int _mosquitto_read_uint16(struct _mosquitto_packet *packet, uint16_t *word);
 
 void _mosquitto_write_byte(struct _mosquitto_packet *packet, uint8_t byte);
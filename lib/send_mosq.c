@@ -84,25 +84,35 @@ int _mosquitto_send_pubcomp(struct mosquitto *mosq, uint16_t mid)
 	return _mosquitto_send_command_with_mid(mosq, PUBCOMP, mid, false);
 }
 
-int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const uint8_t *payload, int qos, bool retain, bool dup)
-{
 #ifdef WITH_BROKER
-	int len;
+/* Returns topic with the listener mount_point removed, or NULL if the message
+ * should not be sent. */
+static const char *_mosquitto_publish_topic(struct mosquitto *mosq, const char *topic)
+{
+	struct _mosquitto_mount *mount;
+
+	if(mosq->listener && mosq->listener->mount){
+		mount = mosq->listener->mount;
+		if(!strncmp(topic, mount->mount_point, mount->len)){
+			topic += mount->len;
+		}else{
+			/* Invalid topic string. Should never happen, but silently swallow the message anyway. */
+			return NULL;
+		}
+	}
+	return topic;
+}
 #endif
+
+int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const uint8_t *payload, int qos, bool retain, bool dup)
+{
 	assert(mosq);
 	assert(topic);
 
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 #ifdef WITH_BROKER
-	if(mosq->listener && mosq->listener->mount_point){
-		len = strlen(mosq->listener->mount_point);
-		if(len > strlen(topic)){
-			topic += strlen(mosq->listener->mount_point);
-		}else{
-			/* Invalid topic string. Should never happen, but silently swallow the message anyway. */
-			return MOSQ_ERR_SUCCESS;
-		}
-	}
+	topic = _mosquitto_publish_topic(mosq, topic);
+	if(!topic) return MOSQ_ERR_SUCCESS;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
 #else
 	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Sending PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", dup, qos, retain, mid, topic, (long)payloadlen);
@@ -182,12 +192,27 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const uint8_t *payload, int qos, bool retain, bool dup)
 {
 	struct _mosquitto_packet *packet = NULL;
-	int packetlen;
 	int rc;
 
 	assert(mosq);
 	assert(topic);
 
+	rc = _mosquitto_publish_packet_create(&packet, mid, topic, payloadlen, payload, qos, retain, dup);
+	if(rc) return rc;
+
+	return _mosquitto_packet_queue(mosq, packet);
+}
+
+/* Serialise a PUBLISH into a new packet, without queueing it. */
+int _mosquitto_publish_packet_create(struct _mosquitto_packet **packet_out, uint16_t mid, const char *topic, uint32_t payloadlen, const uint8_t *payload, int qos, bool retain, bool dup)
+{
+	struct _mosquitto_packet *packet = NULL;
+	int packetlen;
+	int rc;
+
+	assert(packet_out);
+	assert(topic);
+
 	packetlen = 2+strlen(topic) + payloadlen;
 	if(qos > 0) packetlen += 2; /* For message id */
 	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
@@ -212,5 +237,76 @@ int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const cha
 		_mosquitto_write_bytes(packet, payload, payloadlen);
 	}
 
+	*packet_out = packet;
+	return MOSQ_ERR_SUCCESS;
+}
+
+#ifdef WITH_BROKER
+/* Queue a packet that refers to the payload of shared rather than a copy of
+ * it. This allows a serialised message to be sent to many clients. shared
+ * should have a ref_count of 1 for its creator, who must drop it with
+ * _mosquitto_shared_packet_release() once it is finished with. */
+int _mosquitto_send_shared_packet(struct mosquitto *mosq, struct _mosquitto_packet *shared)
+{
+	struct _mosquitto_packet *packet = NULL;
+
+	assert(mosq);
+	assert(shared);
+
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->command = shared->command;
+	packet->mid = shared->mid;
+	packet->remaining_length = shared->remaining_length;
+	packet->remaining_count = shared->remaining_count;
+	packet->packet_length = shared->packet_length;
+	packet->payload = shared->payload;
+	packet->shared = shared;
+	shared->ref_count++;
+
+	return _mosquitto_packet_queue(mosq, packet);
+}
+
+/* Queue a PUBLISH whose payload is written straight from store rather than
+ * being copied into the packet. The packet holds a reference to store until
+ * it has been sent. */
+int _mosquitto_send_publish_store(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *store, int qos, bool retain, bool dup)
+{
+	struct _mosquitto_packet *packet = NULL;
+	const char *topic;
+	int rc;
+
+	assert(mosq);
+	assert(store);
+
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+	topic = _mosquitto_publish_topic(mosq, store->msg.topic);
+	if(!topic) return MOSQ_ERR_SUCCESS;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)store->msg.payloadlen);
+
+	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->mid = mid;
+	packet->command = PUBLISH | ((dup&0x1)<<3) | (qos<<1) | retain;
+	packet->remaining_length = 2+strlen(topic) + store->msg.payloadlen;
+	if(qos > 0) packet->remaining_length += 2; /* For message id */
+	packet->store = store;
+	rc = _mosquitto_packet_alloc(packet);
+	if(rc){
+		_mosquitto_free(packet);
+		return rc;
+	}
+	store->ref_count++;
+
+	_mosquitto_write_string(packet, topic, strlen(topic));
+	if(qos > 0){
+		_mosquitto_write_uint16(packet, mid);
+	}
+
 	return _mosquitto_packet_queue(mosq, packet);
 }
+#endif
@@ -34,6 +34,11 @@ POSSIBILITY OF SUCH DAMAGE.
 int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command);
 int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool dup);
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const uint8_t *payload, int qos, bool retain, bool dup);
+int _mosquitto_publish_packet_create(struct _mosquitto_packet **packet, uint16_t mid, const char *topic, uint32_t payloadlen, const uint8_t *payload, int qos, bool retain, bool dup);
+#ifdef WITH_BROKER
+int _mosquitto_send_shared_packet(struct mosquitto *mosq, struct _mosquitto_packet *shared);
+int _mosquitto_send_publish_store(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *store, int qos, bool retain, bool dup);
+#endif
 
 int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool clean_session);
 int _mosquitto_send_disconnect(struct mosquitto *mosq);
@@ -30,6 +30,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <string.h>
 #include <time.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
 
 #include <mosquitto.h>
 #include <memory_mosq.h>
@@ -45,6 +48,7 @@ int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
 {
 	uint8_t remaining_bytes[5], byte;
 	uint32_t remaining_length;
+	uint32_t alloc_length;
 	int i;
 
 	assert(packet);
@@ -64,7 +68,15 @@ int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
 	}while(remaining_length > 0 && packet->remaining_count < 5);
 	if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
 	packet->packet_length = packet->remaining_length + 1 + packet->remaining_count;
-	packet->payload = _mosquitto_malloc(sizeof(uint8_t)*packet->packet_length);
+	alloc_length = packet->packet_length;
+#ifdef WITH_BROKER
+	if(packet->store){
+		/* Only the headers live in the packet, the payload is sent from the store. */
+		packet->store_pos = packet->packet_length - packet->store->msg.payloadlen;
+		alloc_length = packet->store_pos;
+	}
+#endif
+	packet->payload = _mosquitto_malloc(sizeof(uint8_t)*alloc_length);
 	if(!packet->payload) return MOSQ_ERR_NOMEM;
 
 	packet->payload[0] = packet->command;
@@ -99,7 +111,7 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 				mosq->listener->client_count--;
 				assert(mosq->listener->client_count >= 0);
 			}
-			mosq->listener = NULL;
+			mqtt3_context_listener_set(mosq, NULL);
 #endif
 			_mosquitto_socket_close(mosq);
 		}
@@ -107,38 +119,57 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 }
 
 /* Convert ////some////over/slashed///topic/etc/etc//
- * into some/over/slashed/topic/etc/etc
+ * into /some/over/slashed/topic/etc/etc
+ * The topic is changed in place, as the result is never longer.
  */
 int _mosquitto_fix_sub_topic(char **subtopic)
 {
-	char *fixed = NULL;
-	char *token;
-	char *saveptr = NULL;
+	char *in, *out;
 
 	assert(subtopic);
 	assert(*subtopic);
 
-	/* size of fixed here is +1 for the terminating 0 and +1 for the spurious /
-	 * that gets appended. */
-	fixed = _mosquitto_calloc(strlen(*subtopic)+2, 1);
-	if(!fixed) return MOSQ_ERR_NOMEM;
-
-	if((*subtopic)[0] == '/'){
-		fixed[0] = '/';
+	in = *subtopic;
+	out = *subtopic;
+	if(in[0] == '/'){
+		out++;
+		while(in[0] == '/') in++;
 	}
-	token = strtok_r(*subtopic, "/", &saveptr);
-	while(token){
-		strcat(fixed, token);
-		strcat(fixed, "/");
-		token = strtok_r(NULL, "/", &saveptr);
+	while(in[0]){
+		if(in[0] == '/'){
+			while(in[0] == '/') in++;
+			if(in[0]){
+				out[0] = '/';
+				out++;
+			}
+		}else{
+			out[0] = in[0];
+			out++;
+			in++;
+		}
 	}
-
-	fixed[strlen(fixed)-1] = '\0';
-	_mosquitto_free(*subtopic);
-	*subtopic = fixed;
+	if(out == *subtopic+1 && (*subtopic)[0] == '/'){
+		/* Nothing but slashes. */
+		out = *subtopic;
+	}
+	out[0] = '\0';
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Milliseconds since the epoch, for measuring intervals shorter than time()
+ * can. */
+uint64_t _mosquitto_time_ms(void)
+{
+#ifndef WIN32
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+#else
+	return (uint64_t)time(NULL)*1000;
+#endif
+}
+
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq)
 {
 	assert(mosq);
@@ -167,3 +198,15 @@ int _mosquitto_topic_wildcard_len_check(const char *str)
 
 	return MOSQ_ERR_SUCCESS;
 }
+
+/* FNV-1a, for indexing strings. Returns 0 for NULL. */
+uint32_t _mosquitto_str_hash(const char *str)
+{
+	uint32_t h = 2166136261U;
+
+	if(!str) return 0;
+	for(; *str; str++){
+		h = (h ^ (uint8_t)(*str)) * 16777619U;
+	}
+	return h;
+}
@@ -36,5 +36,7 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq);
 int _mosquitto_fix_sub_topic(char **subtopic);
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq);
 int _mosquitto_topic_wildcard_len_check(const char *str);
+uint32_t _mosquitto_str_hash(const char *str);
+uint64_t _mosquitto_time_ms(void);
 
 #endif
@@ -0,0 +1,394 @@
+/*
+Copyright (c) 2012 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef WITH_AUTH_PLUGIN
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mqtt3.h>
+#include <memory_mosq.h>
+#include <send_mosq.h>
+
+#ifdef WITH_AUTH_PLUGIN
+
+/* The loaded plugin and the worker threads that make the password checks.
+ * The workers never allocate, free or log, because none of those are thread
+ * safe in the broker. They only move jobs from the queue to the done list. */
+struct _mosquitto_auth_plugin{
+	void *lib;
+	void *user_data;
+	bool initialised;
+	int (*plugin_version)(void);
+	int (*plugin_init)(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count);
+	int (*plugin_cleanup)(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count);
+	int (*unpwd_check)(void *user_data, const char *username, const char *password);
+	int (*acl_check)(void *user_data, const char *clientid, const char *username, const char *topic, int access);
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool stop;
+	/* Jobs waiting for a worker, oldest first. */
+	struct _mosquitto_auth_job *queue;
+	struct _mosquitto_auth_job *queue_last;
+	/* Finished jobs, newest first. */
+	struct _mosquitto_auth_job *done;
+	/* Written to when done stops being empty, to wake the main loop. */
+	int pipe_fds[2];
+};
+
+static void _auth_job_free(struct _mosquitto_auth_job *job)
+{
+	if(job->username) _mosquitto_free(job->username);
+	if(job->password) _mosquitto_free(job->password);
+	if(job->client_id) _mosquitto_free(job->client_id);
+	if(job->will){
+		if(job->will->topic) _mosquitto_free(job->will->topic);
+		if(job->will->payload) _mosquitto_free(job->will->payload);
+		_mosquitto_free(job->will);
+	}
+	_mosquitto_free(job);
+}
+
+static void *_auth_worker(void *obj)
+{
+	struct _mosquitto_auth_plugin *plugin = obj;
+	struct _mosquitto_auth_job *job;
+	char byte = 0;
+	bool wake;
+
+	pthread_mutex_lock(&plugin->mutex);
+	while(!plugin->stop){
+		job = plugin->queue;
+		if(!job){
+			pthread_cond_wait(&plugin->cond, &plugin->mutex);
+			continue;
+		}
+		plugin->queue = job->next;
+		if(!plugin->queue) plugin->queue_last = NULL;
+		pthread_mutex_unlock(&plugin->mutex);
+
+		job->rc = plugin->unpwd_check(plugin->user_data, job->username, job->password);
+
+		pthread_mutex_lock(&plugin->mutex);
+		wake = (plugin->done == NULL);
+		job->next = plugin->done;
+		plugin->done = job;
+		if(wake && write(plugin->pipe_fds[1], &byte, 1) != 1){
+			/* The pipe is full, so the main loop is going to wake anyway. */
+		}
+	}
+	pthread_mutex_unlock(&plugin->mutex);
+	return NULL;
+}
+
+static void *_auth_plugin_sym(struct _mosquitto_auth_plugin *plugin, const char *name)
+{
+	void *sym;
+
+	sym = dlsym(plugin->lib, name);
+	if(!sym){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to load auth plugin function %s().", name);
+	}
+	return sym;
+}
+
+static void _auth_plugin_free(mosquitto_db *db, struct _mosquitto_auth_plugin *plugin)
+{
+	struct _mosquitto_auth_job *job;
+	int i;
+
+	if(plugin->threads){
+		pthread_mutex_lock(&plugin->mutex);
+		plugin->stop = true;
+		pthread_cond_broadcast(&plugin->cond);
+		pthread_mutex_unlock(&plugin->mutex);
+		for(i=0; i<plugin->thread_count; i++){
+			pthread_join(plugin->threads[i], NULL);
+		}
+		_mosquitto_free(plugin->threads);
+		pthread_cond_destroy(&plugin->cond);
+		pthread_mutex_destroy(&plugin->mutex);
+	}
+	while(plugin->queue){
+		job = plugin->queue->next;
+		_auth_job_free(plugin->queue);
+		plugin->queue = job;
+	}
+	while(plugin->done){
+		job = plugin->done->next;
+		_auth_job_free(plugin->done);
+		plugin->done = job;
+	}
+	if(plugin->initialised){
+		plugin->plugin_cleanup(plugin->user_data, db->config->auth_options, db->config->auth_option_count);
+	}
+	if(plugin->lib) dlclose(plugin->lib);
+	if(plugin->pipe_fds[0] != -1) close(plugin->pipe_fds[0]);
+	if(plugin->pipe_fds[1] != -1) close(plugin->pipe_fds[1]);
+	_mosquitto_free(plugin);
+}
+
+int mqtt3_auth_plugin_init(mosquitto_db *db)
+{
+	struct _mosquitto_auth_plugin *plugin;
+	int version;
+	int rc;
+	int i;
+
+	if(!db || !db->config) return MOSQ_ERR_INVAL;
+	if(!db->config->auth_plugin) return MOSQ_ERR_SUCCESS;
+
+	if(db->config->auth_plugin_threads < 1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid auth_plugin_threads value (%d).", db->config->auth_plugin_threads);
+		return MOSQ_ERR_INVAL;
+	}
+
+	plugin = _mosquitto_calloc(1, sizeof(struct _mosquitto_auth_plugin));
+	if(!plugin){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	plugin->pipe_fds[0] = -1;
+	plugin->pipe_fds[1] = -1;
+
+	plugin->lib = dlopen(db->config->auth_plugin, RTLD_NOW);
+	if(!plugin->lib){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to load auth plugin \"%s\".", db->config->auth_plugin);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Reason: %s", dlerror());
+		_auth_plugin_free(db, plugin);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if(!(plugin->plugin_version = _auth_plugin_sym(plugin, "mosquitto_auth_plugin_version"))
+			|| !(plugin->plugin_init = _auth_plugin_sym(plugin, "mosquitto_auth_plugin_init"))
+			|| !(plugin->plugin_cleanup = _auth_plugin_sym(plugin, "mosquitto_auth_plugin_cleanup"))
+			|| !(plugin->unpwd_check = _auth_plugin_sym(plugin, "mosquitto_auth_unpwd_check"))
+			|| !(plugin->acl_check = _auth_plugin_sym(plugin, "mosquitto_auth_acl_check"))){
+
+		_auth_plugin_free(db, plugin);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	version = plugin->plugin_version();
+	if(version != MOSQ_AUTH_PLUGIN_VERSION){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incorrect auth plugin version (got %d, expected %d).",
+				version, MOSQ_AUTH_PLUGIN_VERSION);
+		_auth_plugin_free(db, plugin);
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	if(pipe(plugin->pipe_fds)
+			|| fcntl(plugin->pipe_fds[0], F_SETFL, O_NONBLOCK)
+			|| fcntl(plugin->pipe_fds[1], F_SETFL, O_NONBLOCK)){
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create auth plugin pipe.");
+		_auth_plugin_free(db, plugin);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	rc = plugin->plugin_init(&plugin->user_data, db->config->auth_options, db->config->auth_option_count);
+	if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Auth plugin initialisation returned %d.", rc);
+		_auth_plugin_free(db, plugin);
+		return rc;
+	}
+	plugin->initialised = true;
+
+	plugin->threads = _mosquitto_calloc(db->config->auth_plugin_threads, sizeof(pthread_t));
+	if(!plugin->threads){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		_auth_plugin_free(db, plugin);
+		return MOSQ_ERR_NOMEM;
+	}
+	pthread_mutex_init(&plugin->mutex, NULL);
+	pthread_cond_init(&plugin->cond, NULL);
+	for(i=0; i<db->config->auth_plugin_threads; i++){
+		if(pthread_create(&plugin->threads[i], NULL, _auth_worker, plugin)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start auth plugin thread.");
+			_auth_plugin_free(db, plugin);
+			return MOSQ_ERR_ERRNO;
+		}
+		plugin->thread_count++;
+	}
+
+	db->auth_plugin = plugin;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Loaded auth plugin %s.", db->config->auth_plugin);
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_auth_plugin_cleanup(mosquitto_db *db)
+{
+	if(!db || !db->auth_plugin) return;
+
+	_auth_plugin_free(db, db->auth_plugin);
+	db->auth_plugin = NULL;
+}
+
+/* Hand a password check to the workers. The client stays waiting until
+ * mqtt3_auth_plugin_process() finds the job done. */
+int mqtt3_auth_plugin_unpwd_check(mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
+{
+	struct _mosquitto_auth_plugin *plugin = db->auth_plugin;
+	struct _mosquitto_auth_job *job;
+
+	job = _mosquitto_calloc(1, sizeof(struct _mosquitto_auth_job));
+	if(!job) return MOSQ_ERR_NOMEM;
+	job->context = context;
+	job->start = time(NULL);
+	job->username = _mosquitto_strdup(username);
+	if(password){
+		job->password = _mosquitto_strdup(password);
+	}
+	if(!job->username || (password && !job->password)){
+		_auth_job_free(job);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	pthread_mutex_lock(&plugin->mutex);
+	if(plugin->queue_last){
+		plugin->queue_last->next = job;
+	}else{
+		plugin->queue = job;
+	}
+	plugin->queue_last = job;
+	pthread_cond_signal(&plugin->cond);
+	pthread_mutex_unlock(&plugin->mutex);
+
+	context->auth_job = job;
+	return MOSQ_ERR_AUTH_PENDING;
+}
+
+int mqtt3_auth_plugin_acl_check(mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	return db->auth_plugin->acl_check(db->auth_plugin->user_data, context->id, context->username, topic, access);
+}
+
+/* The client is going away, so its check is no longer wanted. A check that
+ * no worker has started yet is dropped, one that has been started is left to
+ * finish and then thrown away. */
+void mqtt3_auth_plugin_job_cancel(mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_auth_plugin *plugin;
+	struct _mosquitto_auth_job *job, *queued, *prev = NULL;
+
+	job = context->auth_job;
+	if(!job) return;
+	job->context = NULL;
+	context->auth_job = NULL;
+
+	if(!db || !db->auth_plugin) return;
+	plugin = db->auth_plugin;
+
+	pthread_mutex_lock(&plugin->mutex);
+	queued = plugin->queue;
+	while(queued && queued != job){
+		prev = queued;
+		queued = queued->next;
+	}
+	if(queued){
+		if(prev){
+			prev->next = job->next;
+		}else{
+			plugin->queue = job->next;
+		}
+		if(plugin->queue_last == job){
+			plugin->queue_last = prev;
+		}
+	}
+	pthread_mutex_unlock(&plugin->mutex);
+
+	if(queued){
+		_auth_job_free(job);
+	}
+}
+
+/* Fail the CONNECT of a client whose check has taken longer than
+ * auth_plugin_timeout, so that a plugin that has hung doesn't leave it
+ * waiting forever. */
+void mqtt3_auth_plugin_timeout_check(mosquitto_db *db, int context_index, time_t now)
+{
+	struct mosquitto *context = db->contexts[context_index];
+
+	if(!context->auth_job || !db->config->auth_plugin_timeout) return;
+	if(now - context->auth_job->start < db->config->auth_plugin_timeout) return;
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Auth plugin timed out checking password for %s.", context->auth_job->client_id);
+	_mosquitto_send_connack(context, 3);
+	mqtt3_context_disconnect(db, context_index);
+}
+
+/* The socket that becomes readable when there are finished checks. */
+int mqtt3_auth_plugin_sock(mosquitto_db *db)
+{
+	if(!db->auth_plugin) return INVALID_SOCKET;
+	return db->auth_plugin->pipe_fds[0];
+}
+
+/* Complete the CONNECT of every client whose check has finished. */
+void mqtt3_auth_plugin_process(mosquitto_db *db)
+{
+	struct _mosquitto_auth_plugin *plugin = db->auth_plugin;
+	struct _mosquitto_auth_job *job, *next, *done = NULL;
+	char buf[64];
+
+	if(!plugin) return;
+
+	while(read(plugin->pipe_fds[0], buf, sizeof(buf)) > 0){
+	}
+	pthread_mutex_lock(&plugin->mutex);
+	job = plugin->done;
+	plugin->done = NULL;
+	pthread_mutex_unlock(&plugin->mutex);
+
+	/* Oldest first. */
+	while(job){
+		next = job->next;
+		job->next = done;
+		done = job;
+		job = next;
+	}
+	while(done){
+		job = done;
+		done = done->next;
+		if(job->context){
+			job->context->auth_job = NULL;
+			mqtt3_handle_connect_auth(db, job);
+		}
+		_auth_job_free(job);
+	}
+}
+
+#endif
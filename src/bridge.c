@@ -110,6 +110,9 @@ int mqtt3_bridge_connect(mosquitto_db *db, struct mosquitto *context)
 	char *notification_topic;
 	int notification_topic_len;
 	uint8_t notification_payload[2];
+	struct _mosquitto_subhier *root;
+	const char *topic;
+	int offset;
 
 	if(!context || !context->bridge) return MOSQ_ERR_INVAL;
 
@@ -120,11 +123,16 @@ int mqtt3_bridge_connect(mosquitto_db *db, struct mosquitto *context)
 	context->keepalive = context->bridge->keepalive;
 	context->clean_session = context->bridge->clean_session;
 	context->in_packet.payload = NULL;
+	context->in_packet.shared = NULL;
+	context->in_packet.store = NULL;
+	context->in_packet.mapped_length = 0;
 	mqtt3_bridge_packet_cleanup(context);
 
 	for(i=0; i<context->bridge->topic_count; i++){
 		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
-			if(mqtt3_sub_add(context, context->bridge->topics[i].topic, context->bridge->topics[i].qos, &db->subs)) return 1;
+			topic = context->bridge->topics[i].topic;
+			root = mqtt3_sub_root(db, NULL, topic, &offset);
+			if(mqtt3_sub_add(context, &topic[offset], context->bridge->topics[i].qos, root, sa_check)) return 1;
 		}
 	}
 
@@ -166,6 +174,7 @@ void mqtt3_bridge_packet_cleanup(struct mosquitto *context)
 		context->out_packet = context->out_packet->next;
 		_mosquitto_free(packet);
 	}
+	mqtt3_db_out_packet_bytes(context, -(long)context->out_packet_bytes);
 
 	_mosquitto_packet_cleanup(&(context->in_packet));
 }
@@ -38,15 +38,20 @@ POSSIBILITY OF SUCH DAMAGE.
 
 static int _conf_parse_bool(char **token, const char *name, bool *value);
 static int _conf_parse_int(char **token, const char *name, int *value);
+static int _conf_parse_ulong(char **token, const char *name, unsigned long *value);
 static int _conf_parse_string(char **token, const char *name, char **value);
 
 static void _config_init_reload(mqtt3_config *config)
 {
+	int i;
+
 	/* Set defaults */
 	if(config->acl_file) _mosquitto_free(config->acl_file);
 	config->acl_file = NULL;
 	config->allow_anonymous = true;
 	config->autosave_interval = 1800;
+	config->autosave_on_changes = false;
+	config->autosave_delta_count = 0;
 	if(config->clientid_prefixes) _mosquitto_free(config->clientid_prefixes);
 	config->connection_messages = true;
 	config->clientid_prefixes = NULL;
@@ -58,6 +63,41 @@ static void _config_init_reload(mqtt3_config *config)
 	config->log_type = MOSQ_LOG_ERR | MOSQ_LOG_WARNING;
 #endif
 	config->log_timestamp = true;
+	config->max_queued_bytes = 0;
+	config->max_queued_bytes_total = 0;
+	config->max_user_queued_bytes = 0;
+	config->max_user_retained = 0;
+	config->max_user_subscriptions = 0;
+	config->max_inbound_rate = 0;
+	config->max_inbound_bytes_rate = 0;
+	config->max_user_inbound_rate = 0;
+	config->max_user_inbound_bytes_rate = 0;
+	config->overload_accept_lag = 0;
+	config->overload_pause_lag = 0;
+	config->overload_shed_lag = 0;
+	config->queue_drop_policy = dp_newest;
+	config->message_expiry = 0;
+	if(config->expiry_rules){
+		for(i=0; i<config->expiry_rule_count; i++){
+			if(config->expiry_rules[i].prefix) _mosquitto_free(config->expiry_rules[i].prefix);
+		}
+		_mosquitto_free(config->expiry_rules);
+	}
+	config->expiry_rules = NULL;
+	config->expiry_rule_count = 0;
+	config->payload_spill_size = 0;
+	if(config->payload_spill_dir) _mosquitto_free(config->payload_spill_dir);
+	config->payload_spill_dir = NULL;
+	config->queue_spill_time = 0;
+	config->persistence_compress_size = 0;
+	if(config->conflate_rules){
+		for(i=0; i<config->conflate_rule_count; i++){
+			if(config->conflate_rules[i].prefix) _mosquitto_free(config->conflate_rules[i].prefix);
+		}
+		_mosquitto_free(config->conflate_rules);
+	}
+	config->conflate_rules = NULL;
+	config->conflate_rule_count = 0;
 	if(config->password_file) _mosquitto_free(config->password_file);
 	config->password_file = NULL;
 	config->persistence = false;
@@ -65,9 +105,13 @@ static void _config_init_reload(mqtt3_config *config)
 	config->persistence_location = NULL;
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	config->persistence_file = NULL;
+	config->persistence_wal_sync_acks = false;
 	config->retry_interval = 20;
 	config->store_clean_interval = 10;
 	config->sys_interval = 10;
+#ifdef WITH_AUTH_PLUGIN
+	config->auth_plugin_timeout = 30;
+#endif
 #ifdef WITH_EXTERNAL_SECURITY_CHECKS
 	if(config->db_host) _mosquitto_free(config->db_host);
 	config->db_host = NULL;
@@ -94,14 +138,36 @@ void mqtt3_config_init(mqtt3_config *config)
 	config->default_listener.socks = NULL;
 	config->default_listener.sock_count = 0;
 	config->default_listener.client_count = 0;
+	config->default_listener.max_queued_bytes = 0;
+	config->default_listener.msg_bytes = 0;
+	config->default_listener.out_packet_bytes = 0;
+	config->default_listener.message_expiry = 0;
+	config->default_listener.max_packet_size = 0;
+	config->default_listener.max_subscriptions = 0;
+	config->default_listener.sub_count = 0;
+	config->default_listener.max_retained = 0;
+	config->default_listener.retained_count = 0;
+	config->default_listener.mount = NULL;
+	config->default_listener.max_inbound_rate = 0;
+	config->default_listener.max_inbound_bytes_rate = 0;
+	config->default_listener.max_outbound_bytes_rate = 0;
 	config->listeners = NULL;
 	config->listener_count = 0;
+	config->persistence_lazy_restore = false;
+	config->persistence_wal = false;
 	config->pid_file = NULL;
+	config->queue_spill_dir = NULL;
 	config->user = NULL;
 #ifdef WITH_BRIDGE
 	config->bridges = NULL;
 	config->bridge_count = 0;
 #endif
+#ifdef WITH_AUTH_PLUGIN
+	config->auth_plugin = NULL;
+	config->auth_options = NULL;
+	config->auth_option_count = 0;
+	config->auth_plugin_threads = 4;
+#endif
 }
 
 void mqtt3_config_cleanup(mqtt3_config *config)
@@ -115,6 +181,20 @@ void mqtt3_config_cleanup(mqtt3_config *config)
 	if(config->persistence_location) _mosquitto_free(config->persistence_location);
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	if(config->persistence_filepath) _mosquitto_free(config->persistence_filepath);
+	if(config->payload_spill_dir) _mosquitto_free(config->payload_spill_dir);
+	if(config->queue_spill_dir) _mosquitto_free(config->queue_spill_dir);
+	if(config->expiry_rules){
+		for(i=0; i<config->expiry_rule_count; i++){
+			if(config->expiry_rules[i].prefix) _mosquitto_free(config->expiry_rules[i].prefix);
+		}
+		_mosquitto_free(config->expiry_rules);
+	}
+	if(config->conflate_rules){
+		for(i=0; i<config->conflate_rule_count; i++){
+			if(config->conflate_rules[i].prefix) _mosquitto_free(config->conflate_rules[i].prefix);
+		}
+		_mosquitto_free(config->conflate_rules);
+	}
 	if(config->listeners){
 		for(i=0; i<config->listener_count; i++){
 			if(config->listeners[i].host) _mosquitto_free(config->listeners[i].host);
@@ -141,6 +221,16 @@ void mqtt3_config_cleanup(mqtt3_config *config)
 		_mosquitto_free(config->bridges);
 	}
 #endif
+#ifdef WITH_AUTH_PLUGIN
+	if(config->auth_plugin) _mosquitto_free(config->auth_plugin);
+	if(config->auth_options){
+		for(i=0; i<config->auth_option_count; i++){
+			if(config->auth_options[i].key) _mosquitto_free(config->auth_options[i].key);
+			if(config->auth_options[i].value) _mosquitto_free(config->auth_options[i].value);
+		}
+		_mosquitto_free(config->auth_options);
+	}
+#endif
 #ifdef WITH_EXTERNAL_SECURITY_CHECKS
 	if(config->db_host) _mosquitto_free(config->db_host);
 	if(config->db_name) _mosquitto_free(config->db_name);
@@ -231,7 +321,7 @@ int mqtt3_config_parse_args(mqtt3_config *config, int argc, char *argv[])
 			config->listeners[config->listener_count-1].host = NULL;
 		}
 		if(config->default_listener.mount_point){
-			config->listeners[config->listener_count-1].mount_point = config->default_listener.host;
+			config->listeners[config->listener_count-1].mount_point = config->default_listener.mount_point;
 		}else{
 			config->listeners[config->listener_count-1].mount_point = NULL;
 		}
@@ -240,6 +330,21 @@ int mqtt3_config_parse_args(mqtt3_config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
 		config->listeners[config->listener_count-1].client_count = 0;
+		config->listeners[config->listener_count-1].max_queued_bytes = config->default_listener.max_queued_bytes;
+		config->listeners[config->listener_count-1].msg_bytes = 0;
+		config->listeners[config->listener_count-1].out_packet_bytes = 0;
+		config->listeners[config->listener_count-1].message_expiry = config->default_listener.message_expiry;
+		config->listeners[config->listener_count-1].max_packet_size = config->default_listener.max_packet_size;
+		config->listeners[config->listener_count-1].max_subscriptions = config->default_listener.max_subscriptions;
+		config->listeners[config->listener_count-1].sub_count = 0;
+		config->listeners[config->listener_count-1].max_retained = config->default_listener.max_retained;
+		config->listeners[config->listener_count-1].retained_count = 0;
+		config->listeners[config->listener_count-1].mount = NULL;
+		config->listeners[config->listener_count-1].max_inbound_rate = config->default_listener.max_inbound_rate;
+		config->listeners[config->listener_count-1].max_inbound_bytes_rate = config->default_listener.max_inbound_bytes_rate;
+		memset(&config->listeners[config->listener_count-1].in_msgs, 0, sizeof(struct _mosquitto_bucket));
+		memset(&config->listeners[config->listener_count-1].in_bytes, 0, sizeof(struct _mosquitto_bucket));
+		config->listeners[config->listener_count-1].max_outbound_bytes_rate = config->default_listener.max_outbound_bytes_rate;
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -325,9 +430,72 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 #endif
 				}else if(!strcmp(token, "allow_anonymous")){
 					if(_conf_parse_bool(&token, "allow_anonymous", &config->allow_anonymous)) return MOSQ_ERR_INVAL;
+				}else if(!strncmp(token, "auth_opt_", 9)){
+#ifdef WITH_AUTH_PLUGIN
+					if(reload) continue; // Auth plugin not valid for reloading.
+					if(strlen(token) == 9){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid auth_opt_ option in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					config->auth_option_count++;
+					config->auth_options = _mosquitto_realloc(config->auth_options, sizeof(struct mosquitto_auth_opt)*config->auth_option_count);
+					if(!config->auth_options){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					config->auth_options[config->auth_option_count-1].key = _mosquitto_strdup(&token[9]);
+					config->auth_options[config->auth_option_count-1].value = NULL;
+					if(!config->auth_options[config->auth_option_count-1].key){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					/* The value is the rest of the line. */
+					token = strtok(NULL, "");
+					while(token && *token == ' ') token++;
+					if(!token || !strlen(token)){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty auth_opt_%s value in configuration.", config->auth_options[config->auth_option_count-1].key);
+						return MOSQ_ERR_INVAL;
+					}
+					config->auth_options[config->auth_option_count-1].value = _mosquitto_strdup(token);
+					if(!config->auth_options[config->auth_option_count-1].value){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin support not available.");
+#endif
+				}else if(!strcmp(token, "auth_plugin")){
+#ifdef WITH_AUTH_PLUGIN
+					if(reload) continue; // Auth plugin not valid for reloading.
+					if(_conf_parse_string(&token, "auth_plugin", &config->auth_plugin)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin support not available.");
+#endif
+				}else if(!strcmp(token, "auth_plugin_threads")){
+#ifdef WITH_AUTH_PLUGIN
+					if(reload) continue; // Auth plugin not valid for reloading.
+					if(_conf_parse_int(&token, "auth_plugin_threads", &config->auth_plugin_threads)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin support not available.");
+#endif
+				}else if(!strcmp(token, "auth_plugin_timeout")){
+#ifdef WITH_AUTH_PLUGIN
+					if(_conf_parse_int(&token, "auth_plugin_timeout", &config->auth_plugin_timeout)) return MOSQ_ERR_INVAL;
+					if(config->auth_plugin_timeout < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid auth_plugin_timeout value (%d).", config->auth_plugin_timeout);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin support not available.");
+#endif
 				}else if(!strcmp(token, "autosave_interval")){
 					if(_conf_parse_int(&token, "autosave_interval", &config->autosave_interval)) return MOSQ_ERR_INVAL;
 					if(config->autosave_interval < 0) config->autosave_interval = 0;
+				}else if(!strcmp(token, "autosave_delta_count")){
+					if(_conf_parse_int(&token, "autosave_delta_count", &config->autosave_delta_count)) return MOSQ_ERR_INVAL;
+					if(config->autosave_delta_count < 0) config->autosave_delta_count = 0;
+				}else if(!strcmp(token, "autosave_on_changes")){
+					if(_conf_parse_bool(&token, "autosave_on_changes", &config->autosave_on_changes)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "bind_address")){
 					if(reload) continue; // Listener not valid for reloading.
 					if(_conf_parse_string(&token, "default listener bind_address", &config->default_listener.host)) return MOSQ_ERR_INVAL;
@@ -402,6 +570,7 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 						cur_bridge->start_type = bst_automatic;
 						cur_bridge->idle_timeout = 60;
 						cur_bridge->threshold = 10;
+						cur_bridge->outbound_bytes_rate = 0;
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty connection value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -409,6 +578,31 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "conflate_topic")){
+					token = strtok(NULL, " ");
+					if(token){
+						config->conflate_rule_count++;
+						config->conflate_rules = _mosquitto_realloc(config->conflate_rules, sizeof(struct _mqtt3_conflate_rule)*config->conflate_rule_count);
+						if(!config->conflate_rules){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->conflate_rules[config->conflate_rule_count-1].interval = 0;
+						config->conflate_rules[config->conflate_rule_count-1].prefix = _mosquitto_strdup(token);
+						if(!config->conflate_rules[config->conflate_rule_count-1].prefix){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						token = strtok(NULL, " ");
+						if(token){
+							i = atoi(token);
+							if(i < 0) i = 0;
+							config->conflate_rules[config->conflate_rule_count-1].interval = i;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty conflate_topic value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "connection_messages")){
 					if(_conf_parse_bool(&token, token, &config->connection_messages)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "idle_timeout")){
@@ -461,6 +655,22 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 						config->listeners[config->listener_count-1].socks = NULL;
 						config->listeners[config->listener_count-1].sock_count = 0;
 						config->listeners[config->listener_count-1].client_count = 0;
+						config->listeners[config->listener_count-1].max_connections = -1;
+						config->listeners[config->listener_count-1].max_queued_bytes = 0;
+						config->listeners[config->listener_count-1].msg_bytes = 0;
+						config->listeners[config->listener_count-1].out_packet_bytes = 0;
+						config->listeners[config->listener_count-1].message_expiry = 0;
+						config->listeners[config->listener_count-1].max_packet_size = 0;
+						config->listeners[config->listener_count-1].max_subscriptions = 0;
+						config->listeners[config->listener_count-1].sub_count = 0;
+						config->listeners[config->listener_count-1].max_retained = 0;
+						config->listeners[config->listener_count-1].retained_count = 0;
+						config->listeners[config->listener_count-1].mount = NULL;
+						config->listeners[config->listener_count-1].max_inbound_rate = 0;
+						config->listeners[config->listener_count-1].max_inbound_bytes_rate = 0;
+						memset(&config->listeners[config->listener_count-1].in_msgs, 0, sizeof(struct _mosquitto_bucket));
+						memset(&config->listeners[config->listener_count-1].in_bytes, 0, sizeof(struct _mosquitto_bucket));
+						config->listeners[config->listener_count-1].max_outbound_bytes_rate = 0;
 						token = strtok(NULL, " ");
 						if(token){
 							config->listeners[config->listener_count-1].host = _mosquitto_strdup(token);
@@ -471,6 +681,15 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty listener value in configuration.");
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "listener_message_expiry")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_int(&token, "listener_message_expiry", &config->listeners[config->listener_count-1].message_expiry)) return MOSQ_ERR_INVAL;
+						if(config->listeners[config->listener_count-1].message_expiry < 0) config->listeners[config->listener_count-1].message_expiry = 0;
+					}else{
+						if(_conf_parse_int(&token, "listener_message_expiry", &config->default_listener.message_expiry)) return MOSQ_ERR_INVAL;
+						if(config->default_listener.message_expiry < 0) config->default_listener.message_expiry = 0;
+					}
 				}else if(!strcmp(token, "log_dest")){
 					token = strtok(NULL, " ");
 					if(token){
@@ -532,6 +751,10 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_connections value in configuration.");
 					}
+				}else if(!strcmp(token, "max_inbound_bytes_rate")){
+					if(_conf_parse_ulong(&token, "max_inbound_bytes_rate", &config->max_inbound_bytes_rate)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "max_inbound_rate")){
+					if(_conf_parse_ulong(&token, "max_inbound_rate", &config->max_inbound_rate)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "max_inflight_messages")){
 					token = strtok(NULL, " ");
 					if(token){
@@ -540,6 +763,63 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_inflight_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "max_listener_inbound_bytes_rate")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_ulong(&token, "max_listener_inbound_bytes_rate", &config->listeners[config->listener_count-1].max_inbound_bytes_rate)) return MOSQ_ERR_INVAL;
+					}else{
+						if(_conf_parse_ulong(&token, "max_listener_inbound_bytes_rate", &config->default_listener.max_inbound_bytes_rate)) return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "max_listener_inbound_rate")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_ulong(&token, "max_listener_inbound_rate", &config->listeners[config->listener_count-1].max_inbound_rate)) return MOSQ_ERR_INVAL;
+					}else{
+						if(_conf_parse_ulong(&token, "max_listener_inbound_rate", &config->default_listener.max_inbound_rate)) return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "max_listener_queued_bytes")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_ulong(&token, "max_listener_queued_bytes", &config->listeners[config->listener_count-1].max_queued_bytes)) return MOSQ_ERR_INVAL;
+					}else{
+						if(_conf_parse_ulong(&token, "max_listener_queued_bytes", &config->default_listener.max_queued_bytes)) return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "max_listener_retained")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_int(&token, "max_listener_retained", &config->listeners[config->listener_count-1].max_retained)) return MOSQ_ERR_INVAL;
+						if(config->listeners[config->listener_count-1].max_retained < 0) config->listeners[config->listener_count-1].max_retained = 0;
+					}else{
+						if(_conf_parse_int(&token, "max_listener_retained", &config->default_listener.max_retained)) return MOSQ_ERR_INVAL;
+						if(config->default_listener.max_retained < 0) config->default_listener.max_retained = 0;
+					}
+				}else if(!strcmp(token, "max_listener_subscriptions")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_int(&token, "max_listener_subscriptions", &config->listeners[config->listener_count-1].max_subscriptions)) return MOSQ_ERR_INVAL;
+						if(config->listeners[config->listener_count-1].max_subscriptions < 0) config->listeners[config->listener_count-1].max_subscriptions = 0;
+					}else{
+						if(_conf_parse_int(&token, "max_listener_subscriptions", &config->default_listener.max_subscriptions)) return MOSQ_ERR_INVAL;
+						if(config->default_listener.max_subscriptions < 0) config->default_listener.max_subscriptions = 0;
+					}
+				}else if(!strcmp(token, "max_outbound_bytes_rate")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_ulong(&token, "max_outbound_bytes_rate", &config->listeners[config->listener_count-1].max_outbound_bytes_rate)) return MOSQ_ERR_INVAL;
+					}else{
+						if(_conf_parse_ulong(&token, "max_outbound_bytes_rate", &config->default_listener.max_outbound_bytes_rate)) return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "max_packet_size")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count > 0){
+						if(_conf_parse_ulong(&token, "max_packet_size", &config->listeners[config->listener_count-1].max_packet_size)) return MOSQ_ERR_INVAL;
+					}else{
+						if(_conf_parse_ulong(&token, "max_packet_size", &config->default_listener.max_packet_size)) return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "max_queued_bytes")){
+					if(_conf_parse_ulong(&token, "max_queued_bytes", &config->max_queued_bytes)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "max_queued_bytes_total")){
+					if(_conf_parse_ulong(&token, "max_queued_bytes_total", &config->max_queued_bytes_total)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "max_queued_messages")){
 					token = strtok(NULL, " ");
 					if(token){
@@ -548,6 +828,42 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_queued_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "max_user_inbound_bytes_rate")){
+					if(_conf_parse_ulong(&token, "max_user_inbound_bytes_rate", &config->max_user_inbound_bytes_rate)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "max_user_inbound_rate")){
+					if(_conf_parse_ulong(&token, "max_user_inbound_rate", &config->max_user_inbound_rate)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "max_user_queued_bytes")){
+					if(_conf_parse_ulong(&token, "max_user_queued_bytes", &config->max_user_queued_bytes)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "max_user_retained")){
+					if(_conf_parse_int(&token, "max_user_retained", &config->max_user_retained)) return MOSQ_ERR_INVAL;
+					if(config->max_user_retained < 0) config->max_user_retained = 0;
+				}else if(!strcmp(token, "max_user_subscriptions")){
+					if(_conf_parse_int(&token, "max_user_subscriptions", &config->max_user_subscriptions)) return MOSQ_ERR_INVAL;
+					if(config->max_user_subscriptions < 0) config->max_user_subscriptions = 0;
+				}else if(!strcmp(token, "message_expiry")){
+					if(_conf_parse_int(&token, "message_expiry", &i)) return MOSQ_ERR_INVAL;
+					if(i < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid message_expiry value (%d).", i);
+						return MOSQ_ERR_INVAL;
+					}
+					token = strtok(NULL, " ");
+					if(token){
+						/* Expiry for a topic prefix. */
+						config->expiry_rule_count++;
+						config->expiry_rules = _mosquitto_realloc(config->expiry_rules, sizeof(struct _mqtt3_expiry_rule)*config->expiry_rule_count);
+						if(!config->expiry_rules){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->expiry_rules[config->expiry_rule_count-1].interval = i;
+						config->expiry_rules[config->expiry_rule_count-1].prefix = _mosquitto_strdup(token);
+						if(!config->expiry_rules[config->expiry_rule_count-1].prefix){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+					}else{
+						config->message_expiry = i;
+					}
 				}else if(!strcmp(token, "mount_point")){
 					if(reload) continue; // Listeners not valid for reloading.
 					if(config->listener_count == 0){
@@ -566,6 +882,35 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "outbound_bytes_rate")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_ulong(&token, "outbound_bytes_rate", &cur_bridge->outbound_bytes_rate)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "overload_accept_lag")){
+					if(_conf_parse_int(&token, "overload_accept_lag", &config->overload_accept_lag)) return MOSQ_ERR_INVAL;
+					if(config->overload_accept_lag < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid overload_accept_lag value (%d).", config->overload_accept_lag);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "overload_pause_lag")){
+					if(_conf_parse_int(&token, "overload_pause_lag", &config->overload_pause_lag)) return MOSQ_ERR_INVAL;
+					if(config->overload_pause_lag < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid overload_pause_lag value (%d).", config->overload_pause_lag);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "overload_shed_lag")){
+					if(_conf_parse_int(&token, "overload_shed_lag", &config->overload_shed_lag)) return MOSQ_ERR_INVAL;
+					if(config->overload_shed_lag < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid overload_shed_lag value (%d).", config->overload_shed_lag);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "password")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -601,12 +946,30 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 					if(_conf_parse_string(&token, "password_file", &config->password_file)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence") || !strcmp(token, "retained_persistence")){
 					if(_conf_parse_bool(&token, token, &config->persistence)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_compress_size")){
+#ifdef WITH_ZLIB
+					if(_conf_parse_ulong(&token, "persistence_compress_size", &config->persistence_compress_size)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistent database compression support not available.");
+#endif
 				}else if(!strcmp(token, "persistence_file")){
 					if(reload) continue; // FIXME
 					if(_conf_parse_string(&token, "persistence_file", &config->persistence_file)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "payload_spill_dir")){
+					if(_conf_parse_string(&token, "payload_spill_dir", &config->payload_spill_dir)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "payload_spill_size")){
+					if(_conf_parse_ulong(&token, "payload_spill_size", &config->payload_spill_size)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_lazy_restore")){
+					if(reload) continue; // Only used at startup.
+					if(_conf_parse_bool(&token, "persistence_lazy_restore", &config->persistence_lazy_restore)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(reload) continue; // FIXME
 					if(_conf_parse_string(&token, "persistence_location", &config->persistence_location)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_wal")){
+					if(reload) continue; // The log is only opened at startup.
+					if(_conf_parse_bool(&token, "persistence_wal", &config->persistence_wal)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_wal_sync_acks")){
+					if(_conf_parse_bool(&token, "persistence_wal_sync_acks", &config->persistence_wal_sync_acks)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "pid_file")){
 					if(reload) continue; // pid file not valid for reloading.
 					if(_conf_parse_string(&token, "pid_file", &config->pid_file)) return MOSQ_ERR_INVAL;
@@ -621,6 +984,32 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 						return MOSQ_ERR_INVAL;
 					}
 					config->default_listener.port = port_tmp;
+				}else if(!strcmp(token, "queue_drop_policy")){
+					token = strtok(NULL, " ");
+					if(token){
+						if(!strcmp(token, "newest")){
+							config->queue_drop_policy = dp_newest;
+						}else if(!strcmp(token, "oldest_qos0")){
+							config->queue_drop_policy = dp_oldest_qos0;
+						}else if(!strcmp(token, "disconnect")){
+							config->queue_drop_policy = dp_disconnect;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid queue_drop_policy value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty queue_drop_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "queue_spill_dir")){
+					if(reload) continue; // Spilled queues are found here.
+					if(_conf_parse_string(&token, "queue_spill_dir", &config->queue_spill_dir)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "queue_spill_time")){
+					if(_conf_parse_int(&token, "queue_spill_time", &config->queue_spill_time)) return MOSQ_ERR_INVAL;
+					if(config->queue_spill_time < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid queue_spill_time value (%d).", config->queue_spill_time);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "retry_interval")){
 					if(_conf_parse_int(&token, "retry_interval", &config->retry_interval)) return MOSQ_ERR_INVAL;
 					if(config->retry_interval < 1 || config->retry_interval > 3600){
@@ -798,8 +1187,7 @@ int mqtt3_config_read(mqtt3_config *config, bool reload)
 				}else if(!strcmp(token, "db_port")){
 					if(_conf_parse_int(&token, "db_port", &config->db_port)) return MOSQ_ERR_INVAL;
 #endif
-				}else if(!strcmp(token, "autosave_on_changes")
-						|| !strcmp(token, "connection_messages")
+				}else if(!strcmp(token, "connection_messages")
 						|| !strcmp(token, "trace_level")
 						|| !strcmp(token, "addresses")
 						|| !strcmp(token, "idle_timeout")
@@ -884,10 +1272,29 @@ static int _conf_parse_bool(char **token, const char *name, bool *value)
 }
 
 static int _conf_parse_int(char **token, const char *name, int *value)
+{
+	char *end;
+
+	*token = strtok(NULL, " ");
+	if(*token){
+		*value = (int)strtol(*token, &end, 10);
+		if(end == *token || *end){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid %s value (%s) in configuration.", name, *token);
+			return MOSQ_ERR_INVAL;
+		}
+	}else{
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty %s value in configuration.", name);
+		return MOSQ_ERR_INVAL;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _conf_parse_ulong(char **token, const char *name, unsigned long *value)
 {
 	*token = strtok(NULL, " ");
 	if(*token){
-		*value = atoi(*token);
+		*value = strtoul(*token, NULL, 10);
 	}else{
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty %s value in configuration.", name);
 		return MOSQ_ERR_INVAL;
@@ -28,6 +28,7 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <assert.h>
+#include <string.h>
 #ifndef WIN32
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -62,9 +63,24 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->username = NULL;
 	context->password = NULL;
 	context->listener = NULL;
+	context->quota_user = NULL;
+	context->sub_count = 0;
+	context->mount = NULL;
+	memset(&context->in_msgs, 0, sizeof(struct _mosquitto_bucket));
+	memset(&context->in_bytes, 0, sizeof(struct _mosquitto_bucket));
+	memset(&context->out_bytes, 0, sizeof(struct _mosquitto_bucket));
+	context->out_packet_bytes = 0;
+	context->overload_bytes = 0;
+	context->overload_paused = false;
 	context->acl_list = NULL;
+	context->acl_cache = NULL;
+	context->acl_generation = 0;
+	context->auth_job = NULL;
 
 	context->in_packet.payload = NULL;
+	context->in_packet.shared = NULL;
+	context->in_packet.store = NULL;
+	context->in_packet.mapped_length = 0;
 	_mosquitto_packet_cleanup(&context->in_packet);
 	context->out_packet = NULL;
 
@@ -88,6 +104,29 @@ struct mosquitto *mqtt3_context_init(int sock)
 	}
 	context->bridge = NULL;
 	context->msgs = NULL;
+	context->msgs_last = NULL;
+	context->msg_index = NULL;
+	context->msg_index_size = 0;
+	context->msg_index_count = 0;
+	context->msg_count = 0;
+	context->msg_count12 = 0;
+	context->msg_bytes = 0;
+	context->msgs_dropped = 0;
+	context->msgs_dropped_sys = 0;
+	context->queue_overflow = false;
+	context->db_dirty = false;
+	context->db_lazy_pos = 0;
+	context->db_lazy_len = 0;
+	context->db_spill_path = NULL;
+	context->db_spill_len = 0;
+	context->conflated = NULL;
+	context->conflated_size = 0;
+	context->conflated_count = 0;
+	context->conflate_held = false;
+	context->conflate_next = NULL;
+	context->conflate_listed = false;
+	context->write_next = NULL;
+	context->write_ready = false;
 #ifdef WITH_SSL
 	context->ssl = NULL;
 #endif
@@ -104,7 +143,6 @@ struct mosquitto *mqtt3_context_init(int sock)
 void mqtt3_context_cleanup(mosquitto_db *db, struct mosquitto *context, bool do_free)
 {
 	struct _mosquitto_packet *packet;
-	mosquitto_client_msg *msg, *next;
 	if(!context) return;
 
 	if(context->username){
@@ -115,16 +153,23 @@ void mqtt3_context_cleanup(mosquitto_db *db, struct mosquitto *context, bool do_
 		_mosquitto_free(context->password);
 		context->password = NULL;
 	}
+	mosquitto_acl_cache_cleanup(context);
+#ifdef WITH_AUTH_PLUGIN
+	mqtt3_auth_plugin_job_cancel(db, context);
+#endif
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_context_forget(context);
+#endif
 	if(context->sock != -1){
 		if(context->listener){
 			context->listener->client_count--;
 			assert(context->listener->client_count >= 0);
 		}
 		_mosquitto_socket_close(context);
-		context->listener = NULL;
+		mqtt3_context_listener_set(context, NULL);
 	}
 	if(context->clean_session && db){
-		mqtt3_subs_clean_session(context, &db->subs);
+		mqtt3_subs_clean_session(db, context);
 		mqtt3_db_messages_delete(context);
 	}
 	if(context->address){
@@ -142,22 +187,20 @@ void mqtt3_context_cleanup(mosquitto_db *db, struct mosquitto *context, bool do_
 		context->out_packet = context->out_packet->next;
 		_mosquitto_free(packet);
 	}
+	mqtt3_db_out_packet_bytes(context, -(long)context->out_packet_bytes);
 	if(context->will){
 		if(context->will->topic) _mosquitto_free(context->will->topic);
 		if(context->will->payload) _mosquitto_free(context->will->payload);
 		_mosquitto_free(context->will);
 	}
 	if(do_free || context->clean_session){
-		msg = context->msgs;
-		while(msg){
-			next = msg->next;
-			msg->store->ref_count--;
-			_mosquitto_free(msg);
-			msg = next;
-		}
-		context->msgs = NULL;
+		mqtt3_db_messages_delete(context);
 	}
 	if(do_free){
+		if(db){
+			mqtt3_quota_user_set(db, context, NULL);
+		}
+		mqtt3_db_write_unschedule(context);
 		_mosquitto_free(context);
 	}
 }
@@ -174,8 +217,30 @@ void mqtt3_context_disconnect(mosquitto_db *db, int context_index)
 	if(ctxt->listener){
 		ctxt->listener->client_count--;
 		assert(ctxt->listener->client_count >= 0);
-		ctxt->listener = NULL;
+		mqtt3_context_listener_set(ctxt, NULL);
 	}
+#ifdef WITH_AUTH_PLUGIN
+	mqtt3_auth_plugin_job_cancel(db, ctxt);
+#endif
 	_mosquitto_socket_close(ctxt);
 }
 
+/* Attach a context to a listener, or detach it if listener is NULL. The bytes
+ * queued for the context and its subscriptions count towards the listener
+ * max_listener_queued_bytes and max_listener_subscriptions limits only while
+ * it is attached. */
+void mqtt3_context_listener_set(struct mosquitto *context, struct _mqtt3_listener *listener)
+{
+	if(context->listener){
+		context->listener->msg_bytes -= context->msg_bytes;
+		context->listener->out_packet_bytes -= context->out_packet_bytes;
+		context->listener->sub_count -= context->sub_count;
+	}
+	context->listener = listener;
+	if(listener){
+		listener->msg_bytes += context->msg_bytes;
+		listener->out_packet_bytes += context->out_packet_bytes;
+		listener->sub_count += context->sub_count;
+	}
+}
+
@@ -64,6 +64,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include <config.h>
 
@@ -76,63 +79,148 @@ POSSIBILITY OF SUCH DAMAGE.
 static int max_inflight = 20;
 static int max_queued = 100;
 
+/* Contexts that have messages in a sendable state. Rather than call
+ * mqtt3_db_message_write() on every client on every pass through the main
+ * loop, a context is added to this list whenever one of its messages becomes
+ * sendable and the main loop only writes to those contexts. */
+static struct mosquitto *write_ready_head = NULL;
+static struct mosquitto *write_ready_tail = NULL;
+
+/* Payload bytes held in all client message lists, for max_queued_bytes_total. */
+static unsigned long queued_bytes_total = 0;
+/* Bytes of packets waiting in client out_packet lists, which also count
+ * against the byte limits. */
+static unsigned long out_packet_bytes_total = 0;
+static unsigned long msgs_dropped_total = 0;
+/* Set when _db_drop_slowest() has marked a client for disconnection. */
+static bool overflow_pending = false;
+
+/* Number of client messages that have an expiry time, so that
+ * mqtt3_db_message_expire() has nothing to do when expiry isn't in use. */
+static unsigned long expiring_msg_count = 0;
+static unsigned long msgs_expired_total = 0;
+
+/* Number of conflation entries held by all clients, and the clients that
+ * hold them. */
+static unsigned long conflated_count = 0;
+static struct mosquitto *conflate_head = NULL;
+static unsigned long msgs_conflated_total = 0;
+
 static int _mqtt3_db_cleanup(mosquitto_db *db);
 
-int mqtt3_db_open(mqtt3_config *config, mosquitto_db *db)
+static struct _mosquitto_subhier *_db_subhier_new(const char *topic)
 {
-	int rc = 0;
 	struct _mosquitto_subhier *child;
 
-	if(!config || !db) return MOSQ_ERR_INVAL;
-
-	db->last_db_id = 0;
-
-	db->context_count = 1;
-	db->contexts = _mosquitto_malloc(sizeof(struct mosquitto*)*db->context_count);
-	if(!db->contexts) return MOSQ_ERR_NOMEM;
-	db->contexts[0] = NULL;
-
-	db->subs.next = NULL;
-	db->subs.subs = NULL;
-	db->subs.topic = "";
-
 	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
 	if(!child){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+		return NULL;
 	}
 	child->next = NULL;
-	child->topic = _mosquitto_strdup("");
+	child->topic = _mosquitto_strdup(topic);
 	if(!child->topic){
+		_mosquitto_free(child);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+		return NULL;
 	}
 	child->subs = NULL;
 	child->children = NULL;
 	child->retained = NULL;
-	db->subs.children = child;
+	child->retained_user = NULL;
+	child->retained_listener = NULL;
+	return child;
+}
 
-	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
-	if(!child){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	child->next = NULL;
-	child->topic = _mosquitto_strdup("$SYS");
-	if(!child->topic){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+/* Set up the root of a subscription tree, which always has the "" and "$SYS"
+ * children. */
+static int _db_subs_root_init(struct _mosquitto_subhier *root)
+{
+	root->next = NULL;
+	root->subs = NULL;
+	root->topic = "";
+	root->retained = NULL;
+	root->retained_user = NULL;
+	root->retained_listener = NULL;
+
+	root->children = _db_subhier_new("");
+	if(!root->children) return MOSQ_ERR_NOMEM;
+	root->children->next = _db_subhier_new("$SYS");
+	if(!root->children->next) return MOSQ_ERR_NOMEM;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Give each distinct listener mount_point a subscription tree of its own. */
+static int _db_mounts_open(mqtt3_config *config, mosquitto_db *db)
+{
+	struct _mosquitto_mount *mount;
+	struct _mqtt3_listener *listener;
+	const char *c;
+	int i, len;
+
+	db->mounts = NULL;
+	for(i=0; i<config->listener_count; i++){
+		listener = &config->listeners[i];
+		listener->mount = NULL;
+		if(!listener->mount_point || !listener->mount_point[0]) continue;
+
+		len = strlen(listener->mount_point);
+		for(mount=db->mounts; mount; mount=mount->next){
+			if(!strcmp(mount->mount_point, listener->mount_point)) break;
+			if(!strncmp(mount->mount_point, listener->mount_point, mount->len < len ? mount->len : len)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: mount_point %s overlaps with mount_point %s.",
+						listener->mount_point, mount->mount_point);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		if(!mount){
+			mount = _mosquitto_calloc(1, sizeof(struct _mosquitto_mount));
+			if(!mount){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				return MOSQ_ERR_NOMEM;
+			}
+			mount->next = db->mounts;
+			db->mounts = mount;
+			mount->mount_point = listener->mount_point;
+			mount->len = len;
+			/* Count the levels as the subscription code tokenises them, so
+			 * that the levels after them in a topic can be found without
+			 * tokenising it again. */
+			if(mount->mount_point[0] == '/') mount->token_count++;
+			for(c=mount->mount_point; c[0]; c++){
+				if(c[0] != '/' && (c == mount->mount_point || c[-1] == '/')) mount->token_count++;
+			}
+			if(_db_subs_root_init(&mount->subs)) return MOSQ_ERR_NOMEM;
+		}
+		listener->mount = mount;
 	}
-	child->subs = NULL;
-	child->children = NULL;
-	child->retained = NULL;
-	db->subs.children->next = child;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_open(mqtt3_config *config, mosquitto_db *db)
+{
+	int rc = 0;
+
+	if(!config || !db) return MOSQ_ERR_INVAL;
+
+	db->last_db_id = 0;
+
+	db->context_count = 1;
+	db->contexts = _mosquitto_malloc(sizeof(struct mosquitto*)*db->context_count);
+	if(!db->contexts) return MOSQ_ERR_NOMEM;
+	db->contexts[0] = NULL;
+
+	if(_db_subs_root_init(&db->subs)) return MOSQ_ERR_NOMEM;
+	if(_db_mounts_open(config, db)) return 1;
 
 	db->unpwd = NULL;
 
 #ifdef WITH_PERSISTENCE
 	if(config->persistence && config->persistence_filepath){
 		if(mqtt3_db_restore(db)) return 1;
+		if(config->persistence_wal){
+			if(mqtt3_wal_open(db)) return 1;
+		}
 	}
 #endif
 
@@ -167,7 +255,18 @@ static void subhier_clean(struct _mosquitto_subhier *subhier)
 
 int mqtt3_db_close(mosquitto_db *db)
 {
+	struct _mosquitto_mount *mount;
+
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_lazy_close();
+#endif
 	subhier_clean(db->subs.children);
+	while(db->mounts){
+		mount = db->mounts;
+		db->mounts = mount->next;
+		subhier_clean(mount->subs.children);
+		_mosquitto_free(mount);
+	}
 	mqtt3_db_store_clean(db);
 
 	return MOSQ_ERR_SUCCESS;
@@ -223,18 +322,300 @@ static int _mqtt3_db_cleanup(mosquitto_db *db)
 	return rc;
 }
 
-int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
+/* Message id index.
+ *
+ * PUBACK, PUBREC, PUBREL and PUBCOMP only carry a message id, so each one
+ * used to require a walk of context->msgs to find the message it refers to.
+ * With a large number of messages in flight this became the dominant cost of
+ * handling QoS 1 and 2 traffic. Messages are now also linked into a small
+ * hash table keyed on (mid, direction), which grows as required. Messages
+ * with a mid of 0 (QoS 0) can never be acknowledged so aren't indexed.
+ * Entries are appended to the end of each bucket chain so that if a mid is
+ * duplicated the oldest message is still found first.
+ */
+#define MSG_INDEX_BUCKET(mid, dir, size) ((((unsigned int)(mid))*2 + (unsigned int)(dir)) & ((unsigned int)(size)-1))
+
+static void _db_msg_index_link(struct mosquitto *context, mosquitto_client_msg *msg)
 {
-	mosquitto_client_msg *tail, *last = NULL;
-	int msg_index = 0;
-	bool deleted = false;
+	mosquitto_client_msg **bucket;
 
-	if(!context) return MOSQ_ERR_INVAL;
+	bucket = &context->msg_index[MSG_INDEX_BUCKET(msg->mid, msg->direction, context->msg_index_size)];
+	while(*bucket){
+		bucket = &(*bucket)->mid_next;
+	}
+	msg->mid_next = NULL;
+	*bucket = msg;
+}
 
-	tail = context->msgs;
+static int _db_msg_index_resize(struct mosquitto *context, int size)
+{
+	mosquitto_client_msg **index;
+	mosquitto_client_msg *msg;
+
+	index = _mosquitto_calloc(size, sizeof(mosquitto_client_msg *));
+	if(!index) return MOSQ_ERR_NOMEM;
+
+	if(context->msg_index) _mosquitto_free(context->msg_index);
+	context->msg_index = index;
+	context->msg_index_size = size;
+
+	/* Rebuild in list order to preserve the ordering of duplicate mids. */
+	msg = context->msgs;
+	while(msg){
+		if(msg->mid){
+			_db_msg_index_link(context, msg);
+		}
+		msg = msg->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Must be called after msg has been added to context->msgs. */
+static void _db_msg_index_add(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+	if(!msg->mid) return;
+
+	context->msg_index_count++;
+	if(context->msg_index_count > context->msg_index_size){
+		if(!_db_msg_index_resize(context, context->msg_index_size ? context->msg_index_size*2 : 16)){
+			/* msg is already in the list so has been indexed by the resize. */
+			return;
+		}
+	}
+	/* If the index couldn't be allocated at all, lookups fall back to
+	 * searching the list. */
+	if(context->msg_index){
+		_db_msg_index_link(context, msg);
+	}
+}
+
+static void _db_msg_index_remove(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+	mosquitto_client_msg **bucket;
+
+	if(!msg->mid) return;
+
+	context->msg_index_count--;
+	if(!context->msg_index) return;
+
+	bucket = &context->msg_index[MSG_INDEX_BUCKET(msg->mid, msg->direction, context->msg_index_size)];
+	while(*bucket){
+		if(*bucket == msg){
+			*bucket = msg->mid_next;
+			msg->mid_next = NULL;
+			return;
+		}
+		bucket = &(*bucket)->mid_next;
+	}
+}
+
+static mosquitto_client_msg *_db_msg_index_find(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
+{
+	mosquitto_client_msg *msg;
+
+	if(context->msg_index){
+		msg = context->msg_index[MSG_INDEX_BUCKET(mid, dir, context->msg_index_size)];
+		while(msg){
+			if(msg->mid == mid && msg->direction == dir){
+				return msg;
+			}
+			msg = msg->mid_next;
+		}
+	}else{
+		msg = context->msgs;
+		while(msg){
+			if(msg->mid == mid && msg->direction == dir){
+				return msg;
+			}
+			msg = msg->next;
+		}
+	}
+	return NULL;
+}
+
+void mqtt3_db_write_schedule(struct mosquitto *context)
+{
+	if(!context || context->write_ready) return;
+
+	context->write_ready = true;
+	context->write_next = NULL;
+	if(write_ready_tail){
+		write_ready_tail->write_next = context;
+	}else{
+		write_ready_head = context;
+	}
+	write_ready_tail = context;
+}
+
+void mqtt3_db_write_unschedule(struct mosquitto *context)
+{
+	struct mosquitto *tail, *last = NULL;
+
+	if(!context || !context->write_ready) return;
+
+	tail = write_ready_head;
 	while(tail){
+		if(tail == context){
+			if(last){
+				last->write_next = tail->write_next;
+			}else{
+				write_ready_head = tail->write_next;
+			}
+			if(write_ready_tail == tail){
+				write_ready_tail = last;
+			}
+			break;
+		}
+		last = tail;
+		tail = tail->write_next;
+	}
+	context->write_next = NULL;
+	context->write_ready = false;
+}
+
+/* Remove and return the first context waiting to be written to, or NULL if
+ * there are none. */
+struct mosquitto *mqtt3_db_write_next(void)
+{
+	struct mosquitto *context;
+
+	context = write_ready_head;
+	if(context){
+		write_ready_head = context->write_next;
+		if(!write_ready_head){
+			write_ready_tail = NULL;
+		}
+		context->write_next = NULL;
+		context->write_ready = false;
+	}
+	return context;
+}
+
+static bool _db_state_sendable(enum mqtt3_msg_state state)
+{
+	switch(state){
+		case ms_publish:
+		case ms_publish_puback:
+		case ms_publish_pubrec:
+		case ms_resend_pubrec:
+		case ms_resend_pubrel:
+		case ms_resend_pubcomp:
+			return true;
+		default:
+			return false;
+	}
+}
+
+int mqtt3_db_message_append(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+	if(!context || !msg) return MOSQ_ERR_INVAL;
+
+	msg->next = NULL;
+	msg->prev = context->msgs_last;
+	msg->mid_next = NULL;
+	if(context->msgs_last){
+		context->msgs_last->next = msg;
+	}else{
+		context->msgs = msg;
+	}
+	context->msgs_last = msg;
+	context->msg_count++;
+	if(msg->qos > 0){
+		context->msg_count12++;
+	}
+	context->msg_bytes += msg->store->msg.payloadlen;
+	if(context->listener){
+		context->listener->msg_bytes += msg->store->msg.payloadlen;
+	}
+	if(context->quota_user){
+		context->quota_user->msg_bytes += msg->store->msg.payloadlen;
+	}
+	queued_bytes_total += msg->store->msg.payloadlen;
+	if(msg->expiry_time){
+		expiring_msg_count++;
+	}
+	_db_msg_index_add(context, msg);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Move msg and everything after it to the front of the context message list,
+ * keeping their order. */
+void mqtt3_db_messages_to_front(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+	mosquitto_client_msg *last;
+
+	assert(context);
+	assert(msg);
+
+	if(msg == context->msgs) return;
+
+	last = msg->prev;
+	last->next = NULL;
+	msg->prev = NULL;
+	context->msgs_last->next = context->msgs;
+	context->msgs->prev = context->msgs_last;
+	context->msgs = msg;
+	context->msgs_last = last;
+
+	/* Duplicate mids must still be found oldest first. */
+	if(context->msg_index){
+		_db_msg_index_resize(context, context->msg_index_size);
+	}
+}
+
+/* Unlink msg from the context message list and free it. */
+static void _db_message_remove(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_message_delete(context, msg);
+#endif
+	_db_msg_index_remove(context, msg);
+
+	if(msg->prev){
+		msg->prev->next = msg->next;
+	}else{
+		context->msgs = msg->next;
+	}
+	if(msg->next){
+		msg->next->prev = msg->prev;
+	}else{
+		context->msgs_last = msg->prev;
+	}
+	context->msg_count--;
+	if(msg->qos > 0){
+		context->msg_count12--;
+	}
+	context->msg_bytes -= msg->store->msg.payloadlen;
+	if(context->listener){
+		context->listener->msg_bytes -= msg->store->msg.payloadlen;
+	}
+	if(context->quota_user){
+		context->quota_user->msg_bytes -= msg->store->msg.payloadlen;
+	}
+	queued_bytes_total -= msg->store->msg.payloadlen;
+	if(msg->expiry_time){
+		expiring_msg_count--;
+	}
+	if(msg->conflated){
+		msg->conflated->msg = NULL;
+	}
+	/* FIXME - it would be nice to be able to remove the stored message here if ref_count==0 */
+	msg->store->ref_count--;
+	_mosquitto_free(msg);
+}
+
+/* Move queued messages that now fall inside the inflight window into a
+ * sendable state. This only needs to look at the first max_inflight messages. */
+static void _db_messages_promote(struct mosquitto *context)
+{
+	mosquitto_client_msg *tail;
+	int msg_index = 0;
+
+	tail = context->msgs;
+	while(tail && msg_index < max_inflight){
 		msg_index++;
-		if(tail->state == ms_queued && msg_index <= max_inflight){
+		if(tail->state == ms_queued){
 			tail->timestamp = time(NULL);
 			if(tail->direction == mosq_md_out){
 				switch(tail->qos){
@@ -248,50 +629,523 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 						tail->state = ms_publish_pubrec;
 						break;
 				}
+				mqtt3_db_write_schedule(context);
 			}else{
 				if(tail->qos == 2){
 					tail->state = ms_wait_pubrec;
 				}
 			}
 		}
-		if(tail->mid == mid && tail->direction == dir){
-			msg_index--;
-			/* FIXME - it would be nice to be able to remove the stored message here if ref_count==0 */
-			tail->store->ref_count--;
-			if(last){
-				last->next = tail->next;
-			}else{
-				context->msgs = tail->next;
+		tail = tail->next;
+	}
+}
+
+/* The connection of context has come back up, as when a bridge gets its
+ * CONNACK. Start sending what was queued while it was down. */
+void mqtt3_db_messages_resume(struct mosquitto *context)
+{
+	if(!context->msgs) return;
+
+	_db_messages_promote(context);
+	mqtt3_db_write_schedule(context);
+}
+
+/* The expiry time of a message queued for a client from stored. Only
+ * messages on their way to a client expire. A retained message is kept until
+ * it is replaced and is sent to new subscribers however old it is. */
+static time_t _db_msg_expiry(struct mosquitto_msg_store *stored, enum mosquitto_msg_direction dir, bool retain)
+{
+	if(dir != mosq_md_out || retain) return 0;
+	return stored->expiry_time;
+}
+
+/* Returns true if msg is an outgoing publish that has expired before being
+ * sent. Once any part of a QoS 1 or 2 flow has been sent it must be
+ * completed, so those messages never expire. */
+static bool _db_message_expired(mosquitto_client_msg *msg, time_t now)
+{
+	if(!msg->expiry_time || msg->expiry_time > now) return false;
+	if(msg->direction != mosq_md_out || msg->dup) return false;
+
+	switch(msg->state){
+		case ms_queued:
+		case ms_publish:
+		case ms_publish_puback:
+		case ms_publish_pubrec:
+			return true;
+		default:
+			return false;
+	}
+}
+
+int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
+{
+	mosquitto_client_msg *tail;
+
+	if(!context) return MOSQ_ERR_INVAL;
+
+	tail = _db_msg_index_find(context, mid, dir);
+	if(tail){
+		_db_message_remove(context, tail);
+	}
+
+	_db_messages_promote(context);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Conflation.
+ *
+ * For topics matching a conflate_topic prefix, a client has at most one
+ * unsent message per topic. A newer message replaces the stored message of
+ * the older one, which keeps its place in the queue, so a slow client only
+ * ever has the latest value waiting for it. If the rule has an interval, at
+ * most one message per topic is sent to each client in that time and the
+ * latest value is held back until the interval has passed.
+ */
+static int _db_conflate_rule(mosquitto_db *db, const char *topic)
+{
+	int i, rule = -1;
+	size_t len, best_len = 0;
+
+	for(i=0; i<db->config->conflate_rule_count; i++){
+		len = strlen(db->config->conflate_rules[i].prefix);
+		if(len >= best_len && !strncmp(topic, db->config->conflate_rules[i].prefix, len)){
+			rule = i;
+			best_len = len;
+		}
+	}
+	return rule;
+}
+
+/* Returns true if messages published to topic are subject to conflation. */
+bool mqtt3_db_conflate_topic(mosquitto_db *db, const char *topic)
+{
+	if(!db->config->conflate_rule_count) return false;
+	return _db_conflate_rule(db, topic) != -1;
+}
+
+/* The entries of each client are kept in a hash table keyed on topic, which
+ * grows in the same way as the mid index, so that finding the entry for a
+ * message doesn't depend on how many topics the client is following. Clients
+ * that have any entries are linked from conflate_head so that
+ * mqtt3_db_conflate_check() only visits those. */
+#define CONFLATE_BUCKET(hash, size) ((hash) & ((uint32_t)(size)-1))
+
+static int _db_conflate_resize(struct mosquitto *context, int size)
+{
+	struct _mosquitto_conflated **table, *conflated, *next;
+	int i;
+
+	table = _mosquitto_calloc(size, sizeof(struct _mosquitto_conflated *));
+	if(!table) return MOSQ_ERR_NOMEM;
+
+	for(i=0; i<context->conflated_size; i++){
+		conflated = context->conflated[i];
+		while(conflated){
+			next = conflated->next;
+			conflated->next = table[CONFLATE_BUCKET(conflated->hash, size)];
+			table[CONFLATE_BUCKET(conflated->hash, size)] = conflated;
+			conflated = next;
+		}
+	}
+	if(context->conflated){
+		_mosquitto_free(context->conflated);
+	}else{
+		context->conflate_next = conflate_head;
+		conflate_head = context;
+		context->conflate_listed = true;
+	}
+	context->conflated = table;
+	context->conflated_size = size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _db_conflate_unlist(struct mosquitto *context)
+{
+	struct mosquitto **prev;
+
+	if(!context->conflate_listed) return;
+
+	prev = &conflate_head;
+	while(*prev){
+		if(*prev == context){
+			*prev = context->conflate_next;
+			break;
+		}
+		prev = &(*prev)->conflate_next;
+	}
+	context->conflate_next = NULL;
+	context->conflate_listed = false;
+}
+
+static struct _mosquitto_conflated *_db_conflate_find(mosquitto_db *db, struct mosquitto *context, const char *topic)
+{
+	struct _mosquitto_conflated *conflated, **bucket;
+	uint32_t hash;
+	int rule;
+
+	rule = _db_conflate_rule(db, topic);
+	if(rule == -1) return NULL;
+
+	hash = _mosquitto_str_hash(topic);
+	if(context->conflated){
+		conflated = context->conflated[CONFLATE_BUCKET(hash, context->conflated_size)];
+		while(conflated){
+			if(conflated->hash == hash && !strcmp(conflated->topic, topic)){
+				return conflated;
 			}
-			_mosquitto_free(tail);
-			if(last){
-				tail = last->next;
-			}else{
-				tail = context->msgs;
+			conflated = conflated->next;
+		}
+	}
+
+	if(context->conflated_count >= context->conflated_size){
+		if(_db_conflate_resize(context, context->conflated_size ? context->conflated_size*2 : 16)){
+			return NULL;
+		}
+	}
+	conflated = _mosquitto_calloc(1, sizeof(struct _mosquitto_conflated));
+	if(!conflated) return NULL;
+	conflated->topic = _mosquitto_strdup(topic);
+	if(!conflated->topic){
+		_mosquitto_free(conflated);
+		return NULL;
+	}
+	conflated->hash = hash;
+	conflated->interval = db->config->conflate_rules[rule].interval;
+	bucket = &context->conflated[CONFLATE_BUCKET(hash, context->conflated_size)];
+	conflated->next = *bucket;
+	*bucket = conflated;
+	context->conflated_count++;
+	conflated_count++;
+
+	return conflated;
+}
+
+/* Replace the stored message of msg with stored if msg hasn't been sent yet.
+ * Returns true on success. */
+static bool _db_conflate_replace(struct mosquitto *context, mosquitto_client_msg *msg, int qos, bool retain, struct mosquitto_msg_store *stored)
+{
+	if(!msg || msg->qos != qos || msg->dup || msg->direction != mosq_md_out) return false;
+	switch(msg->state){
+		case ms_queued:
+		case ms_publish:
+		case ms_publish_puback:
+		case ms_publish_pubrec:
+			break;
+		default:
+			return false;
+	}
+
+	context->msg_bytes -= msg->store->msg.payloadlen;
+	context->msg_bytes += stored->msg.payloadlen;
+	if(context->listener){
+		context->listener->msg_bytes -= msg->store->msg.payloadlen;
+		context->listener->msg_bytes += stored->msg.payloadlen;
+	}
+	if(context->quota_user){
+		context->quota_user->msg_bytes -= msg->store->msg.payloadlen;
+		context->quota_user->msg_bytes += stored->msg.payloadlen;
+	}
+	queued_bytes_total -= msg->store->msg.payloadlen;
+	queued_bytes_total += stored->msg.payloadlen;
+	if(msg->expiry_time){
+		expiring_msg_count--;
+	}
+
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_message_delete(context, msg);
+#endif
+	msg->store->ref_count--;
+	msg->store = stored;
+	msg->store->ref_count++;
+	msg->retain = retain;
+	msg->expiry_time = _db_msg_expiry(stored, mosq_md_out, retain);
+	if(msg->expiry_time){
+		expiring_msg_count++;
+	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_message(context, msg);
+#endif
+	return true;
+}
+
+static void _db_conflate_free(struct mosquitto *context)
+{
+	struct _mosquitto_conflated *conflated, *next;
+	int i;
+
+	for(i=0; i<context->conflated_size; i++){
+		conflated = context->conflated[i];
+		while(conflated){
+			next = conflated->next;
+			if(conflated->msg){
+				conflated->msg->conflated = NULL;
 			}
-			deleted = true;
-		}else{
-			last = tail;
-			tail = tail->next;
+			_mosquitto_free(conflated->topic);
+			_mosquitto_free(conflated);
+			conflated_count--;
+			conflated = next;
 		}
-		if(msg_index > max_inflight && deleted){
-			return MOSQ_ERR_SUCCESS;
+	}
+	if(context->conflated) _mosquitto_free(context->conflated);
+	context->conflated = NULL;
+	context->conflated_size = 0;
+	context->conflated_count = 0;
+	context->conflate_held = false;
+	_db_conflate_unlist(context);
+}
+
+/* Reschedule clients that have had messages held back by a conflate_topic
+ * interval, and forget topics that have nothing queued and no interval
+ * still running. */
+void mqtt3_db_conflate_check(mosquitto_db *db)
+{
+	static time_t last_check = 0;
+	time_t now;
+	int i;
+	struct mosquitto *context, *context_next;
+	struct _mosquitto_conflated *conflated, **prev;
+
+	if(!conflated_count) return;
+
+	now = time(NULL);
+	if(now == last_check) return;
+	last_check = now;
+
+	for(context=conflate_head; context; context=context_next){
+		context_next = context->conflate_next;
+
+		if(context->conflate_held){
+			context->conflate_held = false;
+			mqtt3_db_write_schedule(context);
+		}
+
+		for(i=0; i<context->conflated_size; i++){
+			prev = &context->conflated[i];
+			while(*prev){
+				conflated = *prev;
+				if(!conflated->msg && conflated->next_send <= now){
+					*prev = conflated->next;
+					_mosquitto_free(conflated->topic);
+					_mosquitto_free(conflated);
+					context->conflated_count--;
+					conflated_count--;
+				}else{
+					prev = &conflated->next;
+				}
+			}
+		}
+		if(!context->conflated_count){
+			/* Also drops it from conflate_head. */
+			_db_conflate_free(context);
+		}
+	}
+}
+
+/* Account for len bytes being added to the out_packet list of context, or
+ * taken off it when len is negative. */
+void mqtt3_db_out_packet_bytes(struct mosquitto *context, long len)
+{
+	context->out_packet_bytes += len;
+	if(context->listener){
+		context->listener->out_packet_bytes += len;
+	}
+	if(context->quota_user){
+		context->quota_user->out_packet_bytes += len;
+	}
+	out_packet_bytes_total += len;
+}
+
+/* Bytes held for context, whether still in its message list or already
+ * written into its out_packet list. */
+static unsigned long _db_context_bytes(struct mosquitto *context)
+{
+	return context->msg_bytes + context->out_packet_bytes;
+}
+
+static bool _db_user_bytes_exceeded(mosquitto_db *db, struct mosquitto *context, uint32_t len)
+{
+	return context->quota_user && db->config->max_user_queued_bytes
+			&& context->quota_user->msg_bytes + context->quota_user->out_packet_bytes + len > db->config->max_user_queued_bytes;
+}
+
+static bool _db_listener_bytes_exceeded(struct mosquitto *context, uint32_t len)
+{
+	return context->listener && context->listener->max_queued_bytes
+			&& context->listener->msg_bytes + context->listener->out_packet_bytes + len > context->listener->max_queued_bytes;
+}
+
+/* Returns true if queueing another len bytes for context would take it, its
+ * user, its listener or the broker as a whole over a configured byte limit. */
+static bool _db_queue_bytes_exceeded(mosquitto_db *db, struct mosquitto *context, uint32_t len)
+{
+	if(db->config->max_queued_bytes && _db_context_bytes(context) + len > db->config->max_queued_bytes){
+		return true;
+	}
+	if(_db_user_bytes_exceeded(db, context, len)){
+		return true;
+	}
+	if(_db_listener_bytes_exceeded(context, len)){
+		return true;
+	}
+	if(db->config->max_queued_bytes_total
+			&& queued_bytes_total + out_packet_bytes_total + len > db->config->max_queued_bytes_total){
+		return true;
+	}
+	return false;
+}
+
+/* queue_drop_policy oldest_qos0: make room by discarding the oldest QoS 0
+ * messages waiting to be sent to context. */
+static void _db_drop_oldest_qos0(mosquitto_db *db, struct mosquitto *context, uint32_t len)
+{
+	mosquitto_client_msg *msg, *next;
+
+	msg = context->msgs;
+	while(msg && _db_queue_bytes_exceeded(db, context, len)){
+		next = msg->next;
+		if(msg->qos == 0 && msg->direction == mosq_md_out){
+			_db_message_remove(context, msg);
+			context->msgs_dropped++;
+			msgs_dropped_total++;
 		}
+		msg = next;
 	}
+}
+
+/* queue_drop_policy disconnect: out of the clients that share the limit that
+ * has been hit, discard the queue of the one with the most bytes queued and
+ * mark it to be disconnected. This is called while a message is being
+ * delivered to subscribers, when disconnecting and publishing the will could
+ * change the subscription tree that is being walked, so the disconnect itself
+ * is left to mqtt3_db_overflow_disconnect(). Returns true if that client was
+ * context itself. */
+static bool _db_drop_slowest(mosquitto_db *db, struct mosquitto *context, uint32_t len)
+{
+	struct mosquitto *slowest;
+	bool client_limit;
+	bool user_limit;
+	bool listener_limit;
+	int i, slowest_i = -1;
+
+	client_limit = db->config->max_queued_bytes && _db_context_bytes(context) + len > db->config->max_queued_bytes;
+	user_limit = _db_user_bytes_exceeded(db, context, len);
+	listener_limit = _db_listener_bytes_exceeded(context, len);
+
+	for(i=0; i<db->context_count; i++){
+		if(!db->contexts[i] || db->contexts[i]->queue_overflow) continue;
+		if(client_limit && db->contexts[i] != context) continue;
+		if(!client_limit && user_limit && db->contexts[i]->quota_user != context->quota_user) continue;
+		if(!client_limit && !user_limit && listener_limit && db->contexts[i]->listener != context->listener) continue;
+
+		if(slowest_i == -1 || _db_context_bytes(db->contexts[i]) > _db_context_bytes(db->contexts[slowest_i])){
+			slowest_i = i;
+		}
+	}
+	if(slowest_i == -1 || _db_context_bytes(db->contexts[slowest_i]) == 0) return false;
+
+	slowest = db->contexts[slowest_i];
+	_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s has too much data queued, discarding %d messages.", slowest->id, slowest->msg_count);
+	slowest->msgs_dropped += slowest->msg_count;
+	msgs_dropped_total += slowest->msg_count;
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client_delete(slowest, false);
+#endif
+	mqtt3_db_messages_delete(slowest);
+	if(slowest->sock != INVALID_SOCKET){
+		slowest->queue_overflow = true;
+		overflow_pending = true;
+	}
+	return slowest == context;
+}
+
+/* Disconnect the clients marked by _db_drop_slowest(). Called from the main
+ * loop, outside of any message delivery. */
+void mqtt3_db_overflow_disconnect(mosquitto_db *db)
+{
+	struct mosquitto *context;
+	int i;
+
+	if(!overflow_pending) return;
+	overflow_pending = false;
 
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || !context->queue_overflow) continue;
+
+		context->queue_overflow = false;
+		if(context->sock != INVALID_SOCKET){
+			mqtt3_context_disconnect(db, i);
+			/* Don't queue the will a second time if the client is also
+			 * disconnected for a later error. */
+			context->state = mosq_cs_disconnecting;
+		}
+	}
+}
+
+/* Check whether len more bytes can be sent to context without going over a
+ * byte limit, applying queue_drop_policy to make room if not. This is used
+ * both for messages going into the message list of context and for QoS 0
+ * messages written straight to its out_packet list. Returns MOSQ_ERR_SUCCESS
+ * if the message can be sent, or 2 if it has been dropped. */
+int mqtt3_db_queue_bytes_check(mosquitto_db *db, struct mosquitto *context, uint32_t len)
+{
+	if(!_db_queue_bytes_exceeded(db, context, len)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(_db_user_bytes_exceeded(db, context, len)){
+		mqtt3_quota_hit(mq_user_queued_bytes);
+	}
+	if(_db_listener_bytes_exceeded(context, len)){
+		mqtt3_quota_hit(mq_listener_queued_bytes);
+	}
+	switch(db->config->queue_drop_policy){
+		case dp_oldest_qos0:
+			_db_drop_oldest_qos0(db, context, len);
+			break;
+		case dp_disconnect:
+			if(_db_drop_slowest(db, context, len)){
+				/* context itself is being disconnected. */
+				context->msgs_dropped++;
+				msgs_dropped_total++;
+				return 2;
+			}
+			break;
+		case dp_newest:
+			break;
+	}
+	if(_db_queue_bytes_exceeded(db, context, len)){
+		context->msgs_dropped++;
+		msgs_dropped_total++;
+		return 2;
+	}
 	return MOSQ_ERR_SUCCESS;
 }
 
 int mqtt3_db_message_insert(mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored)
 {
-	mosquitto_client_msg *msg, *tail = NULL;
+	mosquitto_client_msg *msg;
+	struct _mosquitto_conflated *conflated = NULL;
 	enum mqtt3_msg_state state = ms_invalid;
-	int msg_count = 0;
+	time_t expiry_time;
 	int rc = 0;
 
 	assert(stored);
 	if(!context) return MOSQ_ERR_INVAL;
 
+	expiry_time = _db_msg_expiry(stored, dir, retain);
+	if(expiry_time && expiry_time <= time(NULL)){
+		return 2;
+	}
+
+	if(dir == mosq_md_out && context->queue_overflow){
+		/* About to be disconnected and its queue discarded. */
+		context->msgs_dropped++;
+		msgs_dropped_total++;
+		return 2;
+	}
+
 	if(context->sock == INVALID_SOCKET){
 		/* Client is not connected only queue messages with QoS>0. */
 		if(qos == 0){
@@ -304,19 +1158,17 @@ int mqtt3_db_message_insert(mosquitto_db *db, struct mosquitto *context, uint16_
 			}
 		}
 	}
-	if(context->msgs){
-		tail = context->msgs;
-		msg_count = 1;
-		while(tail && tail->next){
-			if(tail->qos > 0){
-				msg_count++;
-			}
-			tail = tail->next;
+
+	if(dir == mosq_md_out && db->config->conflate_rule_count){
+		conflated = _db_conflate_find(db, context, stored->msg.topic);
+		if(conflated && _db_conflate_replace(context, conflated->msg, qos, retain, stored)){
+			msgs_conflated_total++;
+			return MOSQ_ERR_SUCCESS;
 		}
 	}
 
 	if(context->sock != INVALID_SOCKET){
-		if(qos == 0 || max_inflight == 0 || msg_count < max_inflight){
+		if(qos == 0 || max_inflight == 0 || context->msg_count12 < max_inflight){
 			if(dir == mosq_md_out){
 				switch(qos){
 					case 0:
@@ -336,16 +1188,20 @@ int mqtt3_db_message_insert(mosquitto_db *db, struct mosquitto *context, uint16_
 					return 1;
 				}
 			}
-		}else if(max_queued == 0 || msg_count-max_inflight < max_queued){
+		}else if(max_queued == 0 || context->msg_count12-max_inflight < max_queued){
 			state = ms_queued;
 			rc = 2;
 		}else{
 			/* Dropping message due to full queue.
 		 	* FIXME - should this be logged? */
+			context->msgs_dropped++;
+			msgs_dropped_total++;
 			return 2;
 		}
 	}else{
-		if(msg_count >= max_queued){
+		if(context->msg_count >= max_queued){
+			context->msgs_dropped++;
+			msgs_dropped_total++;
 			return 2;
 		}else{
 			state = ms_queued;
@@ -353,29 +1209,41 @@ int mqtt3_db_message_insert(mosquitto_db *db, struct mosquitto *context, uint16_
 	}
 	assert(state != ms_invalid);
 
+	if(dir == mosq_md_out && mqtt3_db_queue_bytes_check(db, context, stored->msg.payloadlen)){
+		return 2;
+	}
+
 	msg = _mosquitto_malloc(sizeof(mosquitto_client_msg));
 	if(!msg) return MOSQ_ERR_NOMEM;
-	msg->next = NULL;
 	msg->store = stored;
 	msg->store->ref_count++;
 	msg->mid = mid;
 	msg->timestamp = time(NULL);
+	msg->expiry_time = expiry_time;
 	msg->direction = dir;
 	msg->state = state;
 	msg->dup = false;
 	msg->qos = qos;
 	msg->retain = retain;
-	if(tail){
-		tail->next = msg;
-	}else{
-		context->msgs = msg;
+	msg->conflated = conflated;
+	if(conflated){
+		/* Any older message for this topic is in flight and can't be
+		 * replaced any more. */
+		if(conflated->msg) conflated->msg->conflated = NULL;
+		conflated->msg = msg;
+	}
+	mqtt3_db_message_append(context, msg);
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_message(context, msg);
+#endif
+	if(_db_state_sendable(state)){
+		mqtt3_db_write_schedule(context);
 	}
 
 #ifdef WITH_BRIDGE
-	msg_count++; /* We've just added a message to the list */
 	if(context->bridge && context->bridge->start_type == bst_lazy
 			&& context->sock == INVALID_SOCKET
-			&& msg_count >= context->bridge->threshold){
+			&& context->msg_count >= context->bridge->threshold){
 
 		context->state = mosq_cs_new;
 		mqtt3_bridge_connect(db, context);
@@ -389,26 +1257,45 @@ int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosqui
 {
 	mosquitto_client_msg *tail;
 
-	tail = context->msgs;
-	while(tail){
-		if(tail->mid == mid && tail->direction == dir){
-			tail->state = state;
-			tail->timestamp = time(NULL);
-			return MOSQ_ERR_SUCCESS;
+	tail = _db_msg_index_find(context, mid, dir);
+	if(tail){
+		tail->state = state;
+		tail->timestamp = time(NULL);
+		if(_db_state_sendable(state)){
+			mqtt3_db_write_schedule(context);
 		}
-		tail = tail->next;
+		return MOSQ_ERR_SUCCESS;
 	}
 	return 1;
 }
 
 int mqtt3_db_messages_delete(struct mosquitto *context)
+{
+	if(!context) return MOSQ_ERR_INVAL;
+
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_lazy_drop(context);
+	mqtt3_db_spill_drop(context);
+#endif
+	mqtt3_db_messages_free(context);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Free the messages of context that are in memory, leaving any that are only
+ * on disk. */
+void mqtt3_db_messages_free(struct mosquitto *context)
 {
 	mosquitto_client_msg *tail, *next;
 
-	if(!context) return MOSQ_ERR_INVAL;
+	assert(context);
 
+	_db_conflate_free(context);
 	tail = context->msgs;
 	while(tail){
+		if(tail->expiry_time){
+			expiring_msg_count--;
+		}
 		/* FIXME - it would be nice to be able to remove the stored message here if rec_count==0 */
 		tail->store->ref_count--;
 		next = tail->next;
@@ -416,8 +1303,23 @@ int mqtt3_db_messages_delete(struct mosquitto *context)
 		tail = next;
 	}
 	context->msgs = NULL;
-
-	return MOSQ_ERR_SUCCESS;
+	context->msgs_last = NULL;
+	context->msg_count = 0;
+	context->msg_count12 = 0;
+	if(context->listener){
+		context->listener->msg_bytes -= context->msg_bytes;
+	}
+	if(context->quota_user){
+		context->quota_user->msg_bytes -= context->msg_bytes;
+	}
+	queued_bytes_total -= context->msg_bytes;
+	context->msg_bytes = 0;
+	if(context->msg_index){
+		_mosquitto_free(context->msg_index);
+		context->msg_index = NULL;
+	}
+	context->msg_index_size = 0;
+	context->msg_index_count = 0;
 }
 
 int mqtt3_db_messages_easy_queue(mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const uint8_t *payload, int retain)
@@ -436,7 +1338,7 @@ int mqtt3_db_messages_easy_queue(mosquitto_db *db, struct mosquitto *context, co
 	}
 	if(mqtt3_db_message_store(db, source_id, 0, topic, qos, payloadlen, payload, retain, &stored, 0)) return 1;
 
-	return mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
+	return mqtt3_db_messages_queue(db, context, source_id, topic, qos, retain, stored);
 }
 
 int mqtt3_db_message_store(mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const uint8_t *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id)
@@ -475,6 +1377,11 @@ int mqtt3_db_message_store(mosquitto_db *db, const char *source, uint16_t source
 		return MOSQ_ERR_NOMEM;
 	}
 	temp->msg.payloadlen = payloadlen;
+	temp->payload_map = NULL;
+	temp->payload_map_len = 0;
+	/* Restored messages are already on disk. */
+	temp->wal_logged = (store_id != 0);
+	temp->db_saved = (store_id != 0);
 	if(payloadlen){
 		temp->msg.payload = _mosquitto_malloc(sizeof(uint8_t)*payloadlen);
 		if(!temp->msg.payload){
@@ -502,13 +1409,107 @@ int mqtt3_db_message_store(mosquitto_db *db, const char *source, uint16_t source
 
 	if(!store_id){
 		temp->db_id = ++db->last_db_id;
+		temp->expiry_time = mqtt3_db_message_expiry(db, NULL, topic);
 	}else{
+		/* Restored messages carry their own expiry time, which the caller sets. */
 		temp->db_id = store_id;
+		temp->expiry_time = 0;
 	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Hand the file backed payload buffer of packet over to stored. The payload is
+ * the rest of the packet from its current read position. */
+void mqtt3_db_message_store_map(struct mosquitto_msg_store *stored, struct _mosquitto_packet *packet)
+{
+	assert(stored);
+	assert(packet);
+
+	stored->payload_map = packet->payload;
+	stored->payload_map_len = packet->mapped_length;
+	stored->msg.payload = &packet->payload[packet->pos];
+	stored->msg.payloadlen = packet->remaining_length - packet->pos;
+
+	packet->payload = NULL;
+	packet->mapped_length = 0;
+}
+
+/* Returns the time at which a message published to topic should expire, or 0
+ * if it should never expire. The longest matching message_expiry topic prefix
+ * takes precedence, then the expiry of the listener the message was published
+ * on, then the global message_expiry. $SYS messages never expire. */
+time_t mqtt3_db_message_expiry(mosquitto_db *db, struct _mqtt3_listener *listener, const char *topic)
+{
+	int i;
+	int interval = -1;
+	size_t len, best_len = 0;
+
+	assert(db);
+	assert(topic);
+
+	if(!strncmp(topic, "$SYS", 4)) return 0;
+
+	for(i=0; i<db->config->expiry_rule_count; i++){
+		len = strlen(db->config->expiry_rules[i].prefix);
+		if(len >= best_len && !strncmp(topic, db->config->expiry_rules[i].prefix, len)){
+			interval = db->config->expiry_rules[i].interval;
+			best_len = len;
+		}
+	}
+	if(interval == -1){
+		if(listener && listener->message_expiry){
+			interval = listener->message_expiry;
+		}else{
+			interval = db->config->message_expiry;
+		}
+	}
+	if(interval > 0){
+		return time(NULL) + interval;
+	}else{
+		return 0;
+	}
+}
+
+/* Discard any messages that have expired before they could be sent. Messages
+ * are also checked as they are written, so this is mainly to stop expired
+ * messages accumulating for clients that are offline or not reading. */
+void mqtt3_db_message_expire(mosquitto_db *db)
+{
+	static time_t last_check = 0;
+	time_t now;
+	int i;
+	struct mosquitto *context;
+	mosquitto_client_msg *msg, *next;
+	bool promote;
+
+	if(!expiring_msg_count) return;
+
+	now = time(NULL);
+	if(now == last_check) return;
+	last_check = now;
+
+	for(i=0; i<db->context_count && expiring_msg_count; i++){
+		context = db->contexts[i];
+		if(!context) continue;
+
+		promote = false;
+		msg = context->msgs;
+		while(msg){
+			next = msg->next;
+			if(_db_message_expired(msg, now)){
+				if(msg->state != ms_queued) promote = true;
+				_db_message_remove(context, msg);
+				msgs_expired_total++;
+			}
+			msg = next;
+		}
+		if(promote){
+			_db_messages_promote(context);
+		}
+	}
+}
+
 int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored)
 {
 	mosquitto_client_msg *tail;
@@ -516,13 +1517,10 @@ int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct
 	if(!context) return MOSQ_ERR_INVAL;
 
 	*stored = NULL;
-	tail = context->msgs;
-	while(tail){
-		if(tail->store->source_mid == mid && tail->direction == mosq_md_in){
-			*stored = tail->store;
-			return MOSQ_ERR_SUCCESS;
-		}
-		tail = tail->next;
+	tail = _db_msg_index_find(context, mid, mosq_md_in);
+	if(tail && tail->store->source_mid == mid){
+		*stored = tail->store;
+		return MOSQ_ERR_SUCCESS;
 	}
 
 	return 1;
@@ -530,13 +1528,19 @@ int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct
 
 int mqtt3_db_message_timeout_check(mosquitto_db *db, unsigned int timeout)
 {
+	static time_t last_check = 0;
 	int i;
-	time_t threshold = time(NULL) - timeout;
-	enum mqtt3_msg_state new_state = ms_invalid;
+	time_t now = time(NULL);
+	time_t threshold = now - timeout;
+	enum mqtt3_msg_state new_state;
 	struct mosquitto *context;
 	mosquitto_client_msg *msg;
 
-	
+	/* Timestamps only have a resolution of one second, so there is nothing
+	 * to gain from checking more often than that. */
+	if(now == last_check) return MOSQ_ERR_SUCCESS;
+	last_check = now;
+
 	for(i=0; i<db->context_count; i++){
 		context = db->contexts[i];
 		if(!context) continue;
@@ -544,6 +1548,7 @@ int mqtt3_db_message_timeout_check(mosquitto_db *db, unsigned int timeout)
 		msg = context->msgs;
 		while(msg){
 			if(msg->timestamp < threshold && msg->state != ms_queued){
+				new_state = ms_invalid;
 				switch(msg->state){
 					case ms_wait_puback:
 						new_state = ms_publish_puback;
@@ -564,6 +1569,7 @@ int mqtt3_db_message_timeout_check(mosquitto_db *db, unsigned int timeout)
 					msg->timestamp = time(NULL);
 					msg->state = new_state;
 					msg->dup = true;
+					mqtt3_db_write_schedule(context);
 				}
 			}
 			msg = msg->next;
@@ -575,7 +1581,7 @@ int mqtt3_db_message_timeout_check(mosquitto_db *db, unsigned int timeout)
 
 int mqtt3_db_message_release(mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
 {
-	mosquitto_client_msg *tail, *last = NULL;
+	mosquitto_client_msg *tail;
 	int qos;
 	int retain;
 	char *topic;
@@ -583,100 +1589,108 @@ int mqtt3_db_message_release(mosquitto_db *db, struct mosquitto *context, uint16
 
 	if(!context) return MOSQ_ERR_INVAL;
 
-	tail = context->msgs;
-	while(tail){
-		if(tail->mid == mid && tail->direction == dir){
-			qos = tail->store->msg.qos;
-			topic = tail->store->msg.topic;
-			retain = tail->retain;
-			source_id = tail->store->source_id;
-
-			if(!mqtt3_db_messages_queue(db, source_id, topic, qos, retain, tail->store)){
-				tail->store->ref_count--;
-				if(last){
-					last->next = tail->next;
-				}else{
-					context->msgs = tail->next;
-				}
-				_mosquitto_free(tail);
-				return MOSQ_ERR_SUCCESS;
-			}else{
-				return 1;
+	tail = _db_msg_index_find(context, mid, dir);
+	if(tail){
+		qos = tail->store->msg.qos;
+		topic = tail->store->msg.topic;
+		retain = tail->retain;
+		source_id = tail->store->source_id;
+
+		if(!mqtt3_db_messages_queue(db, context, source_id, topic, qos, retain, tail->store)){
+			/* Queueing can discard this client's messages if the
+			 * queue_drop_policy is disconnect, so look it up again. */
+			tail = _db_msg_index_find(context, mid, dir);
+			if(tail){
+				_db_message_remove(context, tail);
 			}
+			return MOSQ_ERR_SUCCESS;
+		}else{
+			return 1;
 		}
-		last = tail;
-		tail = tail->next;
 	}
 	return 1;
 }
 
+/* Send a PUBLISH for msg. Payloads held in a file backed buffer are written
+ * straight from the store rather than copied into every packet. */
+static int _db_send_publish(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+	struct mosquitto_msg_store *store = msg->store;
+
+	if(store->payload_map){
+		return _mosquitto_send_publish_store(context, msg->mid, store, msg->qos, msg->retain, msg->dup);
+	}
+	return _mosquitto_send_publish(context, msg->mid, store->msg.topic, store->msg.payloadlen, store->msg.payload, msg->qos, msg->retain, msg->dup);
+}
+
 int mqtt3_db_message_write(struct mosquitto *context)
 {
 	int rc;
-	mosquitto_client_msg *tail, *last = NULL;
+	mosquitto_client_msg *tail, *next;
 	uint16_t mid;
-	int retries;
-	int retain;
-	const char *topic;
-	int qos;
-	uint32_t payloadlen;
-	const uint8_t *payload;
+	time_t now;
+	bool promote = false;
 
 	if(!context || context->sock == -1
 			|| (context->state == mosq_cs_connected && !context->id)){
 		return MOSQ_ERR_INVAL;
 	}
 
+	now = time(NULL);
 	tail = context->msgs;
 	while(tail){
+		if(_db_message_expired(tail, now)){
+			next = tail->next;
+			if(tail->state != ms_queued) promote = true;
+			_db_message_remove(context, tail);
+			msgs_expired_total++;
+			tail = next;
+			continue;
+		}
+		if(tail->conflated && tail->state != ms_queued){
+			if(tail->conflated->next_send > now){
+				/* Held back by the conflate_topic interval. */
+				context->conflate_held = true;
+				tail = tail->next;
+				continue;
+			}
+			/* Once sent, the message can no longer be replaced. */
+			tail->conflated->next_send = now + tail->conflated->interval;
+			tail->conflated->msg = NULL;
+			tail->conflated = NULL;
+		}
 		if(tail->direction == mosq_md_out && tail->state != ms_queued){
 			mid = tail->mid;
-			retries = tail->dup;
-			retain = tail->retain;
-			topic = tail->store->msg.topic;
-			qos = tail->qos;
-			payloadlen = tail->store->msg.payloadlen;
-			payload = tail->store->msg.payload;
 
 			switch(tail->state){
 				case ms_publish:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					rc = _db_send_publish(context, tail);
 					if(!rc){
-						if(last){
-							last->next = tail->next;
-							tail->store->ref_count--;
-							_mosquitto_free(tail);
-							tail = last->next;
-						}else{
-							context->msgs = tail->next;
-							tail->store->ref_count--;
-							_mosquitto_free(tail);
-							tail = context->msgs;
-						}
+						next = tail->next;
+						_db_message_remove(context, tail);
+						tail = next;
 					}else{
 						return rc;
 					}
 					break;
 
 				case ms_publish_puback:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					rc = _db_send_publish(context, tail);
 					if(!rc){
 						tail->state = ms_wait_puback;
 					}else{
 						return rc;
 					}
-					last = tail;
 					tail = tail->next;
 					break;
 
 				case ms_publish_pubrec:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					rc = _db_send_publish(context, tail);
 					if(!rc){
 						tail->state = ms_wait_pubrec;
 					}else{
 						return rc;
 					}
-					last = tail;
 					tail = tail->next;
 					break;
 				
@@ -687,7 +1701,6 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					}else{
 						return rc;
 					}
-					last = tail;
 					tail = tail->next;
 					break;
 
@@ -698,7 +1711,6 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					}else{
 						return rc;
 					}
-					last = tail;
 					tail = tail->next;
 					break;
 
@@ -709,20 +1721,21 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					}else{
 						return rc;
 					}
-					last = tail;
 					tail = tail->next;
 					break;
 
 				default:
-					last = tail;
 					tail = tail->next;
 					break;
 			}
 		}else{
-			last = tail;
 			tail = tail->next;
 		}
 	}
+	if(promote){
+		/* Expired messages have made room in the inflight window. */
+		_db_messages_promote(context);
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -738,6 +1751,11 @@ void mqtt3_db_store_clean(mosquitto_db *db)
 		if(tail->ref_count == 0){
 			if(tail->source_id) _mosquitto_free(tail->source_id);
 			if(tail->msg.topic) _mosquitto_free(tail->msg.topic);
+#ifndef WIN32
+			if(tail->payload_map){
+				munmap(tail->payload_map, tail->payload_map_len);
+			}else
+#endif
 			if(tail->msg.payload) _mosquitto_free(tail->msg.payload);
 			if(last){
 				last->next = tail->next;
@@ -768,6 +1786,9 @@ void mqtt3_db_sys_update(mosquitto_db *db, int interval, time_t start_time)
 	time_t now = time(NULL);
 	time_t uptime;
 	char buf[100];
+	char *topic;
+	int topic_len;
+	int i;
 	int value;
 	int inactive;
 	int active;
@@ -785,12 +1806,32 @@ void mqtt3_db_sys_update(mosquitto_db *db, int interval, time_t start_time)
 #endif
 	static unsigned long msgs_received = -1;
 	static unsigned long msgs_sent = -1;
+	static unsigned long msgs_dropped = -1;
+	static unsigned long msgs_expired = -1;
+	static unsigned long msgs_conflated = -1;
 	static unsigned int msgsps_received = -1;
 	static unsigned int msgsps_sent = -1;
 	static unsigned long long bytes_received = -1;
 	static unsigned long long bytes_sent = -1;
 	static unsigned int bytesps_received = -1;
 	static unsigned int bytesps_sent = -1;
+	static unsigned long acl_cache_hits = -1;
+	static unsigned long acl_cache_misses = -1;
+	static unsigned long quota_hits[mq_count] = {-1, -1, -1, -1, -1, -1};
+	char quota_topic[100];
+	unsigned long value_ul2;
+	static int overload_stage = -1;
+	static int overload_lag = -1;
+	static unsigned long overload_deferred = -1;
+	static unsigned long overload_paused = -1;
+	static unsigned long overload_shed = -1;
+	int value2;
+	unsigned long value_ul3;
+#ifdef WITH_PERSISTENCE
+	static unsigned long backup_count = 0;
+	unsigned long backup_duration;
+	unsigned long long backup_bytes;
+#endif
 
 	if(interval && now - interval > last_update){
 		uptime = now - start_time;
@@ -856,6 +1897,46 @@ void mqtt3_db_sys_update(mosquitto_db *db, int interval, time_t start_time)
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/sent", 2, strlen(buf), (uint8_t *)buf, 1);
 		}
 
+		value_ul = msgs_dropped_total;
+		if(msgs_dropped != value_ul){
+			msgs_dropped = value_ul;
+			snprintf(buf, 100, "%lu", msgs_dropped);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/dropped", 2, strlen(buf), (uint8_t *)buf, 1);
+
+			/* Only clients whose count has changed are published. These
+			 * aren't retained, so that nothing is left behind for clients
+			 * that have gone, and client ids that can't be used as a single
+			 * topic level are skipped. */
+			for(i=0; i<db->context_count; i++){
+				if(!db->contexts[i] || !db->contexts[i]->id) continue;
+				if(db->contexts[i]->msgs_dropped == db->contexts[i]->msgs_dropped_sys) continue;
+
+				db->contexts[i]->msgs_dropped_sys = db->contexts[i]->msgs_dropped;
+				if(strpbrk(db->contexts[i]->id, "+#/")) continue;
+				topic_len = strlen("$SYS/broker/messages/dropped/") + strlen(db->contexts[i]->id) + 1;
+				topic = _mosquitto_malloc(topic_len);
+				if(!topic) break;
+				snprintf(topic, topic_len, "$SYS/broker/messages/dropped/%s", db->contexts[i]->id);
+				snprintf(buf, 100, "%lu", db->contexts[i]->msgs_dropped);
+				mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), (uint8_t *)buf, 0);
+				_mosquitto_free(topic);
+			}
+		}
+
+		value_ul = msgs_conflated_total;
+		if(msgs_conflated != value_ul){
+			msgs_conflated = value_ul;
+			snprintf(buf, 100, "%lu", msgs_conflated);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/conflated", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+
+		value_ul = msgs_expired_total;
+		if(msgs_expired != value_ul){
+			msgs_expired = value_ul;
+			snprintf(buf, 100, "%lu", msgs_expired);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/expired", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+
 		value_ull = (unsigned long long)mqtt3_net_bytes_total_received();
 		if(bytes_received != value_ull){
 			bytes_received = value_ull;
@@ -869,6 +1950,68 @@ void mqtt3_db_sys_update(mosquitto_db *db, int interval, time_t start_time)
 			snprintf(buf, 100, "%llu", bytes_sent);
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/sent", 2, strlen(buf), (uint8_t *)buf, 1);
 		}
+
+		mosquitto_acl_cache_stats(&value_ul, &value_ul2);
+		if(acl_cache_hits != value_ul || acl_cache_misses != value_ul2){
+			acl_cache_hits = value_ul;
+			acl_cache_misses = value_ul2;
+			snprintf(buf, 100, "%lu", acl_cache_hits);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl cache/hits", 2, strlen(buf), (uint8_t *)buf, 1);
+			snprintf(buf, 100, "%lu", acl_cache_misses);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl cache/misses", 2, strlen(buf), (uint8_t *)buf, 1);
+			if(acl_cache_hits + acl_cache_misses){
+				snprintf(buf, 100, "%.1f%%", 100.0*acl_cache_hits/(acl_cache_hits + acl_cache_misses));
+				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl cache/hit rate", 2, strlen(buf), (uint8_t *)buf, 1);
+			}
+		}
+
+		for(i=0; i<mq_count; i++){
+			value_ul = mqtt3_quota_hits(i);
+			if(quota_hits[i] != value_ul){
+				quota_hits[i] = value_ul;
+				snprintf(quota_topic, 100, "$SYS/broker/quota/%s", mqtt3_quota_name(i));
+				snprintf(buf, 100, "%lu", quota_hits[i]);
+				mqtt3_db_messages_easy_queue(db, NULL, quota_topic, 2, strlen(buf), (uint8_t *)buf, 1);
+			}
+		}
+
+		mqtt3_overload_stats(&value, &value2, &value_ul, &value_ul2, &value_ul3);
+		if(overload_stage != value){
+			overload_stage = value;
+			snprintf(buf, 100, "%d", overload_stage);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/overload/stage", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+		if(overload_lag != value2){
+			overload_lag = value2;
+			snprintf(buf, 100, "%d milliseconds", overload_lag);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/overload/lag", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+		if(overload_deferred != value_ul){
+			overload_deferred = value_ul;
+			snprintf(buf, 100, "%lu", overload_deferred);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/overload/accept deferred", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+		if(overload_paused != value_ul2){
+			overload_paused = value_ul2;
+			snprintf(buf, 100, "%lu", overload_paused);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/overload/publishers paused", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+		if(overload_shed != value_ul3){
+			overload_shed = value_ul3;
+			snprintf(buf, 100, "%lu", overload_shed);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/overload/messages shed", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+
+#ifdef WITH_PERSISTENCE
+		mqtt3_db_backup_stats(&value_ul, &backup_duration, &backup_bytes);
+		if(backup_count != value_ul){
+			backup_count = value_ul;
+			snprintf(buf, 100, "%lu milliseconds", backup_duration);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/persistence/save/duration", 2, strlen(buf), (uint8_t *)buf, 1);
+			snprintf(buf, 100, "%llu bytes", backup_bytes);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/persistence/save/size", 2, strlen(buf), (uint8_t *)buf, 1);
+		}
+#endif
 		
 		if(uptime){
 			value = msgs_received/uptime;
@@ -27,6 +27,8 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <config.h>
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
@@ -35,6 +37,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include <memory_mosq.h>
 #include <mqtt3.h>
@@ -76,9 +82,11 @@ error:
 	return 1;
 }
 
-static int _db_client_msg_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_client_msg_chunk_restore(mosquitto_db *db, FILE *db_fd, uint32_t length)
 {
 	dbid_t i64temp, store_id;
+	int64_t expiry;
+	uint32_t used;
 	uint16_t i16temp, slen, mid;
 	uint8_t qos, retain, direction, state, dup;
 	char *client_id = NULL;
@@ -118,6 +126,16 @@ static int _db_client_msg_chunk_restore(mosquitto_db *db, FILE *db_fd)
 	read_e(db_fd, &dup, sizeof(uint8_t));
 	printf("\tDup: %d\n", mid);
 
+	used = 2+slen + sizeof(dbid_t) + sizeof(uint16_t) + 5*sizeof(uint8_t);
+	if(length >= used + sizeof(int64_t)){
+		read_e(db_fd, &expiry, sizeof(int64_t));
+		printf("\tExpiry: %ld\n", (long )expiry);
+		used += sizeof(int64_t);
+	}
+	if(length > used){
+		fseek(db_fd, length-used, SEEK_CUR);
+	}
+
 	free(client_id);
 
 	return 0;
@@ -128,10 +146,75 @@ error:
 	return 1;
 }
 
-static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_string_print(FILE *db_fd, const char *name)
+{
+	uint16_t i16temp, slen;
+	char *str;
+
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	str = calloc(slen+1, sizeof(char));
+	if(!str){
+		fclose(db_fd);
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	read_e(db_fd, str, slen);
+	printf("\t%s: %s\n", name, str);
+	free(str);
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	return 1;
+}
+
+static int _db_client_msg_delete_chunk_restore(mosquitto_db *db, FILE *db_fd)
+{
+	uint16_t i16temp;
+	uint8_t direction;
+
+	if(_db_string_print(db_fd, "Client ID")) return 1;
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	printf("\tMID: %d\n", ntohs(i16temp));
+	read_e(db_fd, &direction, sizeof(uint8_t));
+	printf("\tDirection: %d\n", direction);
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	return 1;
+}
+
+static int _db_unsub_chunk_restore(mosquitto_db *db, FILE *db_fd)
+{
+	if(_db_string_print(db_fd, "Client ID")) return 1;
+	if(_db_string_print(db_fd, "Topic")) return 1;
+	return 0;
+}
+
+static int _db_client_delete_chunk_restore(mosquitto_db *db, FILE *db_fd)
+{
+	uint8_t session;
+
+	if(_db_string_print(db_fd, "Client ID")) return 1;
+	read_e(db_fd, &session, sizeof(uint8_t));
+	printf("\tSession: %d\n", session);
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	return 1;
+}
+
+static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fd, uint32_t length)
 {
 	dbid_t i64temp, store_id;
-	uint32_t i32temp, payloadlen;
+	int64_t expiry;
+	uint32_t i32temp, payloadlen, used;
 	uint16_t i16temp, slen, source_mid, mid;
 	uint8_t qos, retain, *payload = NULL;
 	char *source_id = NULL;
@@ -146,6 +229,7 @@ static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fd)
 
 	read_e(db_fd, &i16temp, sizeof(uint16_t));
 	slen = ntohs(i16temp);
+	used = sizeof(dbid_t) + 2+slen;
 	if(slen){
 		source_id = calloc(slen+1, sizeof(char));
 		if(!source_id){
@@ -172,6 +256,7 @@ static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fd)
 
 	read_e(db_fd, &i16temp, sizeof(uint16_t));
 	slen = ntohs(i16temp);
+	used += 2*sizeof(uint16_t) + 2+slen;
 	if(slen){
 		topic = calloc(slen+1, sizeof(char));
 		if(!topic){
@@ -232,6 +317,16 @@ static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fd)
 		free(payload);
 	}
 
+	used += 2*sizeof(uint8_t) + sizeof(uint32_t) + payloadlen;
+	if(length >= used + sizeof(int64_t)){
+		read_e(db_fd, &expiry, sizeof(int64_t));
+		printf("\tExpiry: %ld\n", (long )expiry);
+		used += sizeof(int64_t);
+	}
+	if(length > used){
+		fseek(db_fd, length-used, SEEK_CUR);
+	}
+
 	return rc;
 error:
 	fprintf(stderr, "Error: %s.", strerror(errno));
@@ -245,7 +340,7 @@ static int _db_retain_chunk_restore(mosquitto_db *db, FILE *db_fd)
 {
 	dbid_t i64temp, store_id;
 
-	if(fread(&i64temp, sizeof(dbid_t), 1, db_fd) != sizeof(dbid_t)){
+	if(fread(&i64temp, sizeof(dbid_t), 1, db_fd) != 1){
 		fprintf(stderr, "Error: %s.", strerror(errno));
 		fclose(db_fd);
 		return 1;
@@ -296,7 +391,1199 @@ error:
 	return 1;
 }
 
-int main(int argc, char *argv[])
+static char **strings = NULL;
+static uint32_t string_count = 0;
+
+static int _db_string_chunk_restore(FILE *db_fd, uint32_t length)
+{
+	char **tmp;
+	char *str;
+
+	str = calloc(length+1, sizeof(char));
+	if(!str){
+		fclose(db_fd);
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	if(length) read_e(db_fd, str, length);
+	tmp = realloc(strings, (string_count+1)*sizeof(char *));
+	if(!tmp){
+		fclose(db_fd);
+		free(str);
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	strings = tmp;
+	strings[string_count] = str;
+	string_count++;
+	printf("\tString %d: %s\n", string_count, str);
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	free(str);
+	return 1;
+}
+
+static int _db_varint_read(FILE *db_fd, uint32_t *used, uint64_t *value)
+{
+	uint8_t byte;
+	int shift = 0;
+
+	*value = 0;
+	do{
+		if(shift > 63) return 1;
+		read_e(db_fd, &byte, sizeof(uint8_t));
+		(*used)++;
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	}while(byte & 0x80);
+
+	return 0;
+error:
+	return 1;
+}
+
+static int _db_varint_print(FILE *db_fd, uint32_t *used, const char *name)
+{
+	uint64_t value;
+
+	if(_db_varint_read(db_fd, used, &value)){
+		fprintf(stderr, "Error: Corrupt persistent database.");
+		fclose(db_fd);
+		return 1;
+	}
+	printf("\t%s: %lu\n", name, (unsigned long)value);
+	return 0;
+}
+
+static int _db_string_ref_print(FILE *db_fd, uint32_t *used, const char *name)
+{
+	uint64_t id;
+
+	if(_db_varint_read(db_fd, used, &id) || id > string_count){
+		fprintf(stderr, "Error: Corrupt persistent database.");
+		fclose(db_fd);
+		return 1;
+	}
+	printf("\t%s: %s\n", name, id ? strings[id-1] : "");
+	return 0;
+}
+
+static int _db_packed_skip(FILE *db_fd, uint32_t length, uint32_t used)
+{
+	if(used > length){
+		fprintf(stderr, "Error: Corrupt persistent database.");
+		fclose(db_fd);
+		return 1;
+	}
+	if(length > used){
+		fseek(db_fd, length-used, SEEK_CUR);
+	}
+	return 0;
+}
+
+static int _db_msg_store_packed_chunk_restore(mosquitto_db *db, FILE *db_fd, uint32_t length)
+{
+	uint32_t used = 0;
+	uint8_t flags;
+
+	if(_db_varint_print(db_fd, &used, "Store ID")) return 1;
+	if(_db_string_ref_print(db_fd, &used, "Source ID")) return 1;
+	if(_db_varint_print(db_fd, &used, "Source MID")) return 1;
+	if(_db_varint_print(db_fd, &used, "MID")) return 1;
+	if(_db_string_ref_print(db_fd, &used, "Topic")) return 1;
+	read_e(db_fd, &flags, sizeof(uint8_t));
+	used++;
+	printf("\tQoS: %d\n", flags & DB_STORE_QOS_MASK);
+	printf("\tRetain: %d\n", (flags & DB_STORE_RETAIN) ? 1 : 0);
+	if(_db_varint_print(db_fd, &used, "Payload Length")) return 1;
+	if(flags & DB_STORE_EXPIRY){
+		if(_db_varint_print(db_fd, &used, "Expiry")) return 1;
+	}
+	if(flags & DB_STORE_COMPRESSED){
+		printf("\tCompressed Length: %d\n", length - used);
+	}
+	return _db_packed_skip(db_fd, length, used);
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	return 1;
+}
+
+static int _db_client_msg_packed_chunk_restore(mosquitto_db *db, FILE *db_fd, uint32_t length)
+{
+	uint32_t used = 0;
+	uint8_t flags, state;
+
+	if(_db_varint_print(db_fd, &used, "Store ID")) return 1;
+	if(_db_varint_print(db_fd, &used, "MID")) return 1;
+	read_e(db_fd, &flags, sizeof(uint8_t));
+	read_e(db_fd, &state, sizeof(uint8_t));
+	used += 2;
+	printf("\tQoS: %d\n", flags & DB_MSG_QOS_MASK);
+	printf("\tRetain: %d\n", (flags & DB_MSG_RETAIN) ? 1 : 0);
+	printf("\tDirection: %d\n", (flags & DB_MSG_DIRECTION) ? 1 : 0);
+	printf("\tState: %d\n", state);
+	printf("\tDup: %d\n", (flags & DB_MSG_DUP) ? 1 : 0);
+	if(_db_varint_print(db_fd, &used, "Expiry")) return 1;
+	return _db_packed_skip(db_fd, length, used);
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	return 1;
+}
+
+static int _db_client_packed_chunk_restore(mosquitto_db *db, FILE *db_fd, uint32_t length)
+{
+	uint32_t used = 0;
+
+	if(_db_string_ref_print(db_fd, &used, "Client ID")) return 1;
+	if(_db_varint_print(db_fd, &used, "Last MID")) return 1;
+	return _db_packed_skip(db_fd, length, used);
+}
+
+static int _db_sub_packed_chunk_restore(mosquitto_db *db, FILE *db_fd, uint32_t length)
+{
+	uint32_t used = 0;
+	uint8_t qos;
+
+	if(_db_string_ref_print(db_fd, &used, "Client ID")) return 1;
+	if(_db_string_ref_print(db_fd, &used, "Topic")) return 1;
+	read_e(db_fd, &qos, sizeof(uint8_t));
+	used++;
+	printf("\tQoS: %d\n", qos);
+	return _db_packed_skip(db_fd, length, used);
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(db_fd >= 0) fclose(db_fd);
+	return 1;
+}
+
+/* Compaction and conversion. The whole file is read into memory, then written
+ * out in the order the broker restores most quickly: stored messages by id,
+ * each client followed by its messages, then subscriptions by topic and
+ * retained messages. */
+
+#define DUMP_HEADER_SIZE (15 + 2*sizeof(uint32_t))
+
+struct dump_store{
+	dbid_t id;
+	char *source_id;
+	char *topic;
+	uint8_t *data;
+	uint32_t payloadlen;
+	uint32_t datalen;
+	int64_t expiry;
+	uint16_t source_mid;
+	uint16_t mid;
+	uint8_t qos;
+	uint8_t retain;
+	bool compressed;
+	bool used;
+};
+
+struct dump_msg{
+	dbid_t store_id;
+	int64_t expiry;
+	uint16_t mid;
+	uint8_t qos;
+	uint8_t retain;
+	uint8_t direction;
+	uint8_t state;
+	uint8_t dup;
+};
+
+struct dump_client{
+	char *id;
+	struct dump_msg *msgs;
+	int msg_count;
+	int msg_size;
+	uint16_t last_mid;
+};
+
+struct dump_sub{
+	char *client_id;
+	char *topic;
+	uint8_t qos;
+};
+
+struct dump_db{
+	/* The file being read. */
+	uint8_t *data;
+	size_t len;
+	size_t pos;
+	uint32_t version;
+	/* Every string allocated, so they can be freed together. */
+	char **pool;
+	int pool_count;
+	int pool_size;
+	/* The strings of the string chunks read so far. */
+	char **strings;
+	int string_count;
+	int string_size;
+	/* Contents. */
+	uint8_t shutdown;
+	dbid_t last_db_id;
+	bool have_delta;
+	uint32_t base_id;
+	bool have_checkpoint;
+	uint32_t checkpoint_id;
+	struct dump_store *stores;
+	int store_count;
+	int store_size;
+	struct dump_client *clients;
+	int client_count;
+	int client_size;
+	/* Open addressing index of clients by id, holding index+1. */
+	int *client_index;
+	int client_index_size;
+	struct dump_sub *subs;
+	int sub_count;
+	int sub_size;
+	dbid_t *retains;
+	int retain_count;
+	int retain_size;
+	/* Strings written to the output file so far, for version 4. */
+	char **dict;
+	uint32_t *dict_ids;
+	uint32_t dict_size;
+	uint32_t dict_count;
+};
+
+static int _compact_grow(void **array, int *size, int count, size_t item)
+{
+	void *tmp;
+	int new_size;
+
+	if(count < *size) return 0;
+	new_size = *size ? *size*2 : 64;
+	tmp = realloc(*array, new_size*item);
+	if(!tmp){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	*array = tmp;
+	*size = new_size;
+	return 0;
+}
+
+static unsigned int _compact_hash(const char *str)
+{
+	unsigned int hash = 5381;
+
+	while(*str){
+		hash = hash*33 + (uint8_t)(*str);
+		str++;
+	}
+	return hash;
+}
+
+static char *_compact_strndup(struct dump_db *d, const uint8_t *str, uint32_t len)
+{
+	char *s;
+
+	if(_compact_grow((void **)&d->pool, &d->pool_size, d->pool_count, sizeof(char *))) return NULL;
+	s = malloc(len+1);
+	if(!s){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return NULL;
+	}
+	memcpy(s, str, len);
+	s[len] = '\0';
+	d->pool[d->pool_count++] = s;
+	return s;
+}
+
+static int _compact_read(struct dump_db *d, void *buf, size_t len)
+{
+	if(d->len - d->pos < len) return 1;
+	memcpy(buf, &d->data[d->pos], len);
+	d->pos += len;
+	return 0;
+}
+
+static int _compact_read_varint(struct dump_db *d, uint64_t *value)
+{
+	uint8_t byte;
+	int shift = 0;
+
+	*value = 0;
+	do{
+		if(shift > 63 || d->pos >= d->len) return 1;
+		byte = d->data[d->pos++];
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	}while(byte & 0x80);
+	return 0;
+}
+
+static int _compact_read_string(struct dump_db *d, char **str)
+{
+	uint16_t i16temp, slen;
+
+	if(_compact_read(d, &i16temp, sizeof(uint16_t))) return 1;
+	slen = ntohs(i16temp);
+	if(d->len - d->pos < slen) return 1;
+	*str = _compact_strndup(d, &d->data[d->pos], slen);
+	if(!*str) return 1;
+	d->pos += slen;
+	return 0;
+}
+
+static int _compact_read_string_ref(struct dump_db *d, char **str)
+{
+	uint64_t id;
+
+	if(_compact_read_varint(d, &id) || id > (uint64_t)d->string_count) return 1;
+	*str = id ? d->strings[id-1] : "";
+	return 0;
+}
+
+static struct dump_client *_compact_client(struct dump_db *d, char *id, bool add)
+{
+	struct dump_client *client;
+	unsigned int slot;
+	int *index;
+	int i, size;
+
+	if(d->client_index_size){
+		slot = _compact_hash(id) & (d->client_index_size-1);
+		while(d->client_index[slot]){
+			client = &d->clients[d->client_index[slot]-1];
+			if(!strcmp(client->id, id)) return client;
+			slot = (slot+1) & (d->client_index_size-1);
+		}
+	}
+	if(!add) return NULL;
+
+	if(_compact_grow((void **)&d->clients, &d->client_size, d->client_count, sizeof(struct dump_client))) return NULL;
+	client = &d->clients[d->client_count];
+	memset(client, 0, sizeof(struct dump_client));
+	client->id = id;
+	d->client_count++;
+
+	if(d->client_count*2 > d->client_index_size){
+		size = d->client_index_size ? d->client_index_size*2 : 256;
+		index = calloc(size, sizeof(int));
+		if(!index){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return NULL;
+		}
+		free(d->client_index);
+		d->client_index = index;
+		d->client_index_size = size;
+		for(i=0; i<d->client_count-1; i++){
+			slot = _compact_hash(d->clients[i].id) & (size-1);
+			while(index[slot]) slot = (slot+1) & (size-1);
+			index[slot] = i+1;
+		}
+	}
+	slot = _compact_hash(id) & (d->client_index_size-1);
+	while(d->client_index[slot]) slot = (slot+1) & (d->client_index_size-1);
+	d->client_index[slot] = d->client_count;
+
+	return client;
+}
+
+static int _compact_store_read(struct dump_db *d, uint16_t chunk, uint32_t length)
+{
+	struct dump_store *store;
+	uint64_t value;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	uint8_t flags;
+	size_t end = d->pos + length;
+
+	if(_compact_grow((void **)&d->stores, &d->store_size, d->store_count, sizeof(struct dump_store))) return 1;
+	store = &d->stores[d->store_count];
+	memset(store, 0, sizeof(struct dump_store));
+
+	if(chunk == DB_CHUNK_MSG_STORE_PACKED){
+		if(_compact_read_varint(d, &value)) return 1;
+		store->id = value;
+		if(_compact_read_string_ref(d, &store->source_id)) return 1;
+		if(_compact_read_varint(d, &value)) return 1;
+		store->source_mid = value;
+		if(_compact_read_varint(d, &value)) return 1;
+		store->mid = value;
+		if(_compact_read_string_ref(d, &store->topic)) return 1;
+		if(_compact_read(d, &flags, sizeof(uint8_t))) return 1;
+		store->qos = flags & DB_STORE_QOS_MASK;
+		store->retain = (flags & DB_STORE_RETAIN) ? 1 : 0;
+		store->compressed = (flags & DB_STORE_COMPRESSED) ? true : false;
+		if(_compact_read_varint(d, &value)) return 1;
+		store->payloadlen = value;
+		if(flags & DB_STORE_EXPIRY){
+			if(_compact_read_varint(d, &value)) return 1;
+			store->expiry = value;
+		}
+		if(d->pos > end) return 1;
+		store->datalen = end - d->pos;
+	}else{
+		if(_compact_read(d, &store->id, sizeof(dbid_t))) return 1;
+		if(_compact_read_string(d, &store->source_id)) return 1;
+		if(_compact_read(d, &i16temp, sizeof(uint16_t))) return 1;
+		store->source_mid = ntohs(i16temp);
+		if(_compact_read(d, &i16temp, sizeof(uint16_t))) return 1;
+		store->mid = ntohs(i16temp);
+		if(_compact_read_string(d, &store->topic)) return 1;
+		if(_compact_read(d, &store->qos, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &store->retain, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &i32temp, sizeof(uint32_t))) return 1;
+		store->payloadlen = ntohl(i32temp);
+		store->datalen = store->payloadlen;
+	}
+	if(d->len - d->pos < store->datalen) return 1;
+	store->data = &d->data[d->pos];
+	d->pos += store->datalen;
+	if(d->pos > end) return 1;
+	if(chunk != DB_CHUNK_MSG_STORE_PACKED && end - d->pos >= sizeof(int64_t)){
+		if(_compact_read(d, &store->expiry, sizeof(int64_t))) return 1;
+	}
+	d->pos = end;
+	d->store_count++;
+	return 0;
+}
+
+static int _compact_client_msg_read(struct dump_db *d, uint16_t chunk, uint32_t length, struct dump_client *client)
+{
+	struct dump_msg *msg;
+	uint64_t value;
+	uint16_t i16temp;
+	uint8_t flags;
+	char *client_id;
+	size_t start = d->pos;
+
+	if(chunk == DB_CHUNK_CLIENT_MSG){
+		if(_compact_read_string(d, &client_id)) return 1;
+		client = _compact_client(d, client_id, true);
+	}
+	if(!client) return 1;
+	if(_compact_grow((void **)&client->msgs, &client->msg_size, client->msg_count, sizeof(struct dump_msg))) return 1;
+	msg = &client->msgs[client->msg_count];
+	memset(msg, 0, sizeof(struct dump_msg));
+
+	if(chunk == DB_CHUNK_CLIENT_MSG_PACKED){
+		if(_compact_read_varint(d, &value)) return 1;
+		msg->store_id = value;
+		if(_compact_read_varint(d, &value)) return 1;
+		msg->mid = value;
+		if(_compact_read(d, &flags, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &msg->state, sizeof(uint8_t))) return 1;
+		if(_compact_read_varint(d, &value)) return 1;
+		msg->expiry = value;
+		msg->qos = flags & DB_MSG_QOS_MASK;
+		msg->retain = (flags & DB_MSG_RETAIN) ? 1 : 0;
+		msg->direction = (flags & DB_MSG_DIRECTION) ? mosq_md_out : mosq_md_in;
+		msg->dup = (flags & DB_MSG_DUP) ? 1 : 0;
+	}else{
+		if(_compact_read(d, &msg->store_id, sizeof(dbid_t))) return 1;
+		if(_compact_read(d, &i16temp, sizeof(uint16_t))) return 1;
+		msg->mid = ntohs(i16temp);
+		if(_compact_read(d, &msg->qos, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &msg->retain, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &msg->direction, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &msg->state, sizeof(uint8_t))) return 1;
+		if(_compact_read(d, &msg->dup, sizeof(uint8_t))) return 1;
+		/* Version 2 databases have no expiry time. */
+		if(length >= d->pos - start + sizeof(int64_t)){
+			if(_compact_read(d, &msg->expiry, sizeof(int64_t))) return 1;
+		}
+	}
+	if(d->pos - start > length) return 1;
+	d->pos = start + length;
+	client->msg_count++;
+	return 0;
+}
+
+static int _compact_sub_read(struct dump_db *d, uint16_t chunk)
+{
+	struct dump_sub *sub;
+
+	if(_compact_grow((void **)&d->subs, &d->sub_size, d->sub_count, sizeof(struct dump_sub))) return 1;
+	sub = &d->subs[d->sub_count];
+	if(chunk == DB_CHUNK_SUB_PACKED){
+		if(_compact_read_string_ref(d, &sub->client_id)) return 1;
+		if(_compact_read_string_ref(d, &sub->topic)) return 1;
+	}else{
+		if(_compact_read_string(d, &sub->client_id)) return 1;
+		if(_compact_read_string(d, &sub->topic)) return 1;
+	}
+	if(_compact_read(d, &sub->qos, sizeof(uint8_t))) return 1;
+	d->sub_count++;
+	return 0;
+}
+
+static int _compact_file_read(struct dump_db *d)
+{
+	struct dump_client *client;
+	int client_idx = -1;
+	uint64_t value;
+	uint32_t i32temp, length;
+	uint16_t i16temp, chunk;
+	uint8_t i8temp;
+	char *str;
+	size_t start;
+
+	if(d->len < DUMP_HEADER_SIZE || memcmp(d->data, magic, 15)){
+		fprintf(stderr, "Error: Unrecognised file format.\n");
+		return 1;
+	}
+	memcpy(&i32temp, &d->data[15 + sizeof(uint32_t)], sizeof(uint32_t));
+	d->version = ntohl(i32temp);
+	if(d->version > MOSQ_DB_VERSION){
+		fprintf(stderr, "Error: Unsupported database version %d.\n", d->version);
+		return 1;
+	}
+	d->pos = DUMP_HEADER_SIZE;
+
+	while(d->len - d->pos >= sizeof(uint16_t)){
+		if(_compact_read(d, &i16temp, sizeof(uint16_t))) goto corrupt;
+		if(_compact_read(d, &i32temp, sizeof(uint32_t))) goto corrupt;
+		chunk = ntohs(i16temp);
+		length = ntohl(i32temp);
+		if(length > d->len - d->pos) goto corrupt;
+		start = d->pos;
+
+		switch(chunk){
+			case DB_CHUNK_CFG:
+				if(_compact_read(d, &d->shutdown, sizeof(uint8_t))) goto corrupt;
+				if(_compact_read(d, &i8temp, sizeof(uint8_t))) goto corrupt;
+				if(i8temp != sizeof(dbid_t)){
+					fprintf(stderr, "Error: Incompatible database configuration (dbid size is %d bytes, expected %d)\n",
+							i8temp, (int)sizeof(dbid_t));
+					return 1;
+				}
+				if(_compact_read(d, &d->last_db_id, sizeof(dbid_t))) goto corrupt;
+				break;
+
+			case DB_CHUNK_STRING:
+				if(_compact_grow((void **)&d->strings, &d->string_size, d->string_count, sizeof(char *))) return 1;
+				str = _compact_strndup(d, &d->data[d->pos], length);
+				if(!str) return 1;
+				d->strings[d->string_count++] = str;
+				d->pos += length;
+				break;
+
+			case DB_CHUNK_MSG_STORE:
+			case DB_CHUNK_MSG_STORE_PACKED:
+				if(_compact_store_read(d, chunk, length)) goto corrupt;
+				break;
+
+			case DB_CHUNK_CLIENT:
+				if(_compact_read_string(d, &str)) goto corrupt;
+				client = _compact_client(d, str, true);
+				if(!client) return 1;
+				client_idx = client - d->clients;
+				if(_compact_read(d, &i16temp, sizeof(uint16_t))) goto corrupt;
+				client->last_mid = ntohs(i16temp);
+				break;
+
+			case DB_CHUNK_CLIENT_PACKED:
+				if(_compact_read_string_ref(d, &str)) goto corrupt;
+				client = _compact_client(d, str, true);
+				if(!client) return 1;
+				client_idx = client - d->clients;
+				if(_compact_read_varint(d, &value)) goto corrupt;
+				client->last_mid = value;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG:
+			case DB_CHUNK_CLIENT_MSG_PACKED:
+				/* A packed message belongs to the client chunk before it. */
+				client = client_idx < 0 ? NULL : &d->clients[client_idx];
+				if(_compact_client_msg_read(d, chunk, length, client)) goto corrupt;
+				break;
+
+			case DB_CHUNK_SUB:
+			case DB_CHUNK_SUB_PACKED:
+				if(_compact_sub_read(d, chunk)) goto corrupt;
+				break;
+
+			case DB_CHUNK_RETAIN:
+				if(_compact_grow((void **)&d->retains, &d->retain_size, d->retain_count, sizeof(dbid_t))) return 1;
+				if(_compact_read(d, &d->retains[d->retain_count], sizeof(dbid_t))) goto corrupt;
+				d->retain_count++;
+				break;
+
+			case DB_CHUNK_CHECKPOINT:
+				if(_compact_read(d, &i32temp, sizeof(uint32_t))) goto corrupt;
+				d->checkpoint_id = ntohl(i32temp);
+				d->have_checkpoint = true;
+				break;
+
+			case DB_CHUNK_DELTA:
+				if(_compact_read(d, &i32temp, sizeof(uint32_t))) goto corrupt;
+				d->base_id = ntohl(i32temp);
+				d->have_delta = true;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG_DELETE:
+			case DB_CHUNK_UNSUB:
+			case DB_CHUNK_CLIENT_DELETE:
+				fprintf(stderr, "Error: This is a write ahead log or delta file, not a database file.\n");
+				return 1;
+
+			default:
+				fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.\n", chunk);
+				break;
+		}
+		if(d->pos - start > length) goto corrupt;
+		d->pos = start + length;
+		if(chunk != DB_CHUNK_CLIENT && chunk != DB_CHUNK_CLIENT_PACKED
+				&& chunk != DB_CHUNK_CLIENT_MSG && chunk != DB_CHUNK_CLIENT_MSG_PACKED){
+			client_idx = -1;
+		}
+	}
+	return 0;
+
+corrupt:
+	fprintf(stderr, "Error: Corrupt persistent database.\n");
+	return 1;
+}
+
+static int _compact_store_cmp(const void *a, const void *b)
+{
+	const struct dump_store *sa = a, *sb = b;
+
+	if(sa->id < sb->id) return -1;
+	return sa->id > sb->id;
+}
+
+static int _compact_sub_cmp(const void *a, const void *b)
+{
+	const struct dump_sub *sa = a, *sb = b;
+	int rc;
+
+	rc = strcmp(sa->topic, sb->topic);
+	if(rc) return rc;
+	return strcmp(sa->client_id, sb->client_id);
+}
+
+static int _compact_retain_cmp(const void *a, const void *b)
+{
+	const dbid_t *ra = a, *rb = b;
+
+	if(*ra < *rb) return -1;
+	return *ra > *rb;
+}
+
+static struct dump_store *_compact_store_find(struct dump_db *d, dbid_t id)
+{
+	struct dump_store key;
+
+	key.id = id;
+	return bsearch(&key, d->stores, d->store_count, sizeof(struct dump_store), _compact_store_cmp);
+}
+
+/* Mark the stored messages that something refers to, dropping references to
+ * stored messages that don't exist. If compact is false every stored message
+ * is kept. */
+static void _compact_refs_mark(struct dump_db *d, bool compact)
+{
+	struct dump_client *client;
+	struct dump_store *store;
+	int i, j, k, missing = 0;
+
+	qsort(d->stores, d->store_count, sizeof(struct dump_store), _compact_store_cmp);
+	for(i=0; i<d->store_count; i++){
+		d->stores[i].used = !compact;
+	}
+	for(i=0; i<d->client_count; i++){
+		client = &d->clients[i];
+		k = 0;
+		for(j=0; j<client->msg_count; j++){
+			store = _compact_store_find(d, client->msgs[j].store_id);
+			if(!store){
+				missing++;
+				continue;
+			}
+			store->used = true;
+			client->msgs[k++] = client->msgs[j];
+		}
+		client->msg_count = k;
+	}
+	k = 0;
+	for(i=0; i<d->retain_count; i++){
+		store = _compact_store_find(d, d->retains[i]);
+		if(!store){
+			missing++;
+			continue;
+		}
+		store->used = true;
+		d->retains[k++] = d->retains[i];
+	}
+	d->retain_count = k;
+	if(missing){
+		fprintf(stderr, "Warning: Dropped %d references to missing stored messages.\n", missing);
+	}
+}
+
+static int _compact_header_write(FILE *fptr, uint16_t chunk, uint32_t length)
+{
+	uint32_t i32temp;
+	uint16_t i16temp;
+
+	i16temp = htons(chunk);
+	write_e(fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(length);
+	write_e(fptr, &i32temp, sizeof(uint32_t));
+	return 0;
+error:
+	return 1;
+}
+
+static int _compact_varint_put(uint8_t *buf, uint64_t value)
+{
+	int len = 0;
+
+	while(value >= 0x80){
+		buf[len++] = (uint8_t)(value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = (uint8_t)value;
+	return len;
+}
+
+/* Find the number of str in the output file, writing a string chunk for it
+ * first if it hasn't been written yet. */
+static int _compact_string_ref(struct dump_db *d, FILE *fptr, char *str, uint32_t *id)
+{
+	char **dict;
+	uint32_t *ids;
+	uint32_t size, slot, i;
+
+	if(!str[0]){
+		*id = 0;
+		return 0;
+	}
+	if(d->dict_size){
+		slot = _compact_hash(str) & (d->dict_size-1);
+		while(d->dict[slot]){
+			if(!strcmp(d->dict[slot], str)){
+				*id = d->dict_ids[slot];
+				return 0;
+			}
+			slot = (slot+1) & (d->dict_size-1);
+		}
+	}
+
+	if((d->dict_count+1)*2 > d->dict_size){
+		size = d->dict_size ? d->dict_size*2 : 1024;
+		dict = calloc(size, sizeof(char *));
+		ids = calloc(size, sizeof(uint32_t));
+		if(!dict || !ids){
+			free(dict);
+			free(ids);
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		for(i=0; i<d->dict_size; i++){
+			if(!d->dict[i]) continue;
+			slot = _compact_hash(d->dict[i]) & (size-1);
+			while(dict[slot]) slot = (slot+1) & (size-1);
+			dict[slot] = d->dict[i];
+			ids[slot] = d->dict_ids[i];
+		}
+		free(d->dict);
+		free(d->dict_ids);
+		d->dict = dict;
+		d->dict_ids = ids;
+		d->dict_size = size;
+	}
+	if(_compact_header_write(fptr, DB_CHUNK_STRING, strlen(str))) return 1;
+	write_e(fptr, str, strlen(str));
+
+	d->dict_count++;
+	slot = _compact_hash(str) & (d->dict_size-1);
+	while(d->dict[slot]) slot = (slot+1) & (d->dict_size-1);
+	d->dict[slot] = str;
+	d->dict_ids[slot] = d->dict_count;
+	*id = d->dict_count;
+	return 0;
+error:
+	return 1;
+}
+
+static int _compact_plain_string_write(FILE *fptr, const char *str)
+{
+	uint16_t i16temp;
+
+	i16temp = htons(strlen(str));
+	write_e(fptr, &i16temp, sizeof(uint16_t));
+	write_e(fptr, str, strlen(str));
+	return 0;
+error:
+	return 1;
+}
+
+static int _compact_store_write(struct dump_db *d, FILE *fptr, struct dump_store *store, uint32_t version)
+{
+	uint8_t buf[64];
+	uint32_t source_ref, topic_ref, i32temp;
+	uint16_t i16temp;
+	int len = 0;
+
+	if(version >= 4){
+		if(_compact_string_ref(d, fptr, store->source_id, &source_ref)) return 1;
+		if(_compact_string_ref(d, fptr, store->topic, &topic_ref)) return 1;
+		len += _compact_varint_put(&buf[len], store->id);
+		len += _compact_varint_put(&buf[len], source_ref);
+		len += _compact_varint_put(&buf[len], store->source_mid);
+		len += _compact_varint_put(&buf[len], store->mid);
+		len += _compact_varint_put(&buf[len], topic_ref);
+		buf[len++] = (store->qos & DB_STORE_QOS_MASK)
+				| (store->retain ? DB_STORE_RETAIN : 0)
+				| (store->compressed ? DB_STORE_COMPRESSED : 0)
+				| (store->expiry > 0 ? DB_STORE_EXPIRY : 0);
+		len += _compact_varint_put(&buf[len], store->payloadlen);
+		if(store->expiry > 0){
+			len += _compact_varint_put(&buf[len], (uint64_t)store->expiry);
+		}
+		if(_compact_header_write(fptr, DB_CHUNK_MSG_STORE_PACKED, len + store->datalen)) return 1;
+		write_e(fptr, buf, len);
+	}else{
+		if(_compact_header_write(fptr, DB_CHUNK_MSG_STORE, sizeof(dbid_t)
+					+ 2+strlen(store->source_id) + 2*sizeof(uint16_t)
+					+ 2+strlen(store->topic) + 2*sizeof(uint8_t)
+					+ sizeof(uint32_t) + store->datalen)) return 1;
+		write_e(fptr, &store->id, sizeof(dbid_t));
+		if(_compact_plain_string_write(fptr, store->source_id)) return 1;
+		i16temp = htons(store->source_mid);
+		write_e(fptr, &i16temp, sizeof(uint16_t));
+		i16temp = htons(store->mid);
+		write_e(fptr, &i16temp, sizeof(uint16_t));
+		if(_compact_plain_string_write(fptr, store->topic)) return 1;
+		write_e(fptr, &store->qos, sizeof(uint8_t));
+		write_e(fptr, &store->retain, sizeof(uint8_t));
+		i32temp = htonl(store->payloadlen);
+		write_e(fptr, &i32temp, sizeof(uint32_t));
+	}
+	if(store->datalen){
+		write_e(fptr, store->data, store->datalen);
+	}
+	return 0;
+error:
+	return 1;
+}
+
+static int _compact_client_write(struct dump_db *d, FILE *fptr, struct dump_client *client, uint32_t version)
+{
+	struct dump_msg *msg;
+	uint8_t buf[64];
+	uint32_t id_ref, length;
+	uint16_t i16temp;
+	int i, len;
+
+	if(version >= 4){
+		if(_compact_string_ref(d, fptr, client->id, &id_ref)) return 1;
+		len = _compact_varint_put(buf, id_ref);
+		len += _compact_varint_put(&buf[len], client->last_mid);
+		if(_compact_header_write(fptr, DB_CHUNK_CLIENT_PACKED, len)) return 1;
+		write_e(fptr, buf, len);
+	}else{
+		if(_compact_header_write(fptr, DB_CHUNK_CLIENT, 2+strlen(client->id) + sizeof(uint16_t))) return 1;
+		if(_compact_plain_string_write(fptr, client->id)) return 1;
+		i16temp = htons(client->last_mid);
+		write_e(fptr, &i16temp, sizeof(uint16_t));
+	}
+
+	for(i=0; i<client->msg_count; i++){
+		msg = &client->msgs[i];
+		if(version >= 4){
+			len = _compact_varint_put(buf, msg->store_id);
+			len += _compact_varint_put(&buf[len], msg->mid);
+			buf[len++] = (msg->qos & DB_MSG_QOS_MASK)
+					| (msg->retain ? DB_MSG_RETAIN : 0)
+					| (msg->direction == mosq_md_out ? DB_MSG_DIRECTION : 0)
+					| (msg->dup ? DB_MSG_DUP : 0);
+			buf[len++] = msg->state;
+			len += _compact_varint_put(&buf[len], msg->expiry > 0 ? (uint64_t)msg->expiry : 0);
+			if(_compact_header_write(fptr, DB_CHUNK_CLIENT_MSG_PACKED, len)) return 1;
+			write_e(fptr, buf, len);
+		}else{
+			length = 2+strlen(client->id) + sizeof(dbid_t) + sizeof(uint16_t) + 5*sizeof(uint8_t);
+			/* Version 2 databases have no expiry time. */
+			if(version >= 3) length += sizeof(int64_t);
+			if(_compact_header_write(fptr, DB_CHUNK_CLIENT_MSG, length)) return 1;
+			if(_compact_plain_string_write(fptr, client->id)) return 1;
+			write_e(fptr, &msg->store_id, sizeof(dbid_t));
+			i16temp = htons(msg->mid);
+			write_e(fptr, &i16temp, sizeof(uint16_t));
+			write_e(fptr, &msg->qos, sizeof(uint8_t));
+			write_e(fptr, &msg->retain, sizeof(uint8_t));
+			write_e(fptr, &msg->direction, sizeof(uint8_t));
+			write_e(fptr, &msg->state, sizeof(uint8_t));
+			write_e(fptr, &msg->dup, sizeof(uint8_t));
+			if(version >= 3){
+				write_e(fptr, &msg->expiry, sizeof(int64_t));
+			}
+		}
+	}
+	return 0;
+error:
+	return 1;
+}
+
+static int _compact_sub_write(struct dump_db *d, FILE *fptr, struct dump_sub *sub, uint32_t version)
+{
+	uint8_t buf[32];
+	uint32_t client_ref, topic_ref;
+	int len;
+
+	if(version >= 4){
+		if(_compact_string_ref(d, fptr, sub->client_id, &client_ref)) return 1;
+		if(_compact_string_ref(d, fptr, sub->topic, &topic_ref)) return 1;
+		len = _compact_varint_put(buf, client_ref);
+		len += _compact_varint_put(&buf[len], topic_ref);
+		buf[len++] = sub->qos;
+		if(_compact_header_write(fptr, DB_CHUNK_SUB_PACKED, len)) return 1;
+		write_e(fptr, buf, len);
+	}else{
+		if(_compact_header_write(fptr, DB_CHUNK_SUB, 2+strlen(sub->client_id) + 2+strlen(sub->topic) + sizeof(uint8_t))) return 1;
+		if(_compact_plain_string_write(fptr, sub->client_id)) return 1;
+		if(_compact_plain_string_write(fptr, sub->topic)) return 1;
+		write_e(fptr, &sub->qos, sizeof(uint8_t));
+	}
+	return 0;
+error:
+	return 1;
+}
+
+static int _compact_file_write(struct dump_db *d, FILE *fptr, uint32_t version)
+{
+	uint32_t i32temp;
+	uint8_t i8temp;
+	int i;
+
+	write_e(fptr, magic, 15);
+	i32temp = 0;
+	write_e(fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(version);
+	write_e(fptr, &i32temp, sizeof(uint32_t));
+
+	if(_compact_header_write(fptr, DB_CHUNK_CFG, sizeof(dbid_t) + 2*sizeof(uint8_t))) return 1;
+	write_e(fptr, &d->shutdown, sizeof(uint8_t));
+	i8temp = sizeof(dbid_t);
+	write_e(fptr, &i8temp, sizeof(uint8_t));
+	write_e(fptr, &d->last_db_id, sizeof(dbid_t));
+
+	if(d->have_delta){
+		if(_compact_header_write(fptr, DB_CHUNK_DELTA, 2*sizeof(uint32_t))) return 1;
+		i32temp = htonl(d->base_id);
+		write_e(fptr, &i32temp, sizeof(uint32_t));
+		i32temp = 0;
+		write_e(fptr, &i32temp, sizeof(uint32_t));
+	}
+	if(d->have_checkpoint){
+		if(_compact_header_write(fptr, DB_CHUNK_CHECKPOINT, sizeof(uint32_t))) return 1;
+		i32temp = htonl(d->checkpoint_id);
+		write_e(fptr, &i32temp, sizeof(uint32_t));
+	}
+
+	for(i=0; i<d->store_count; i++){
+		if(d->stores[i].used){
+			if(_compact_store_write(d, fptr, &d->stores[i], version)) return 1;
+		}
+	}
+	for(i=0; i<d->client_count; i++){
+		if(_compact_client_write(d, fptr, &d->clients[i], version)) return 1;
+	}
+	qsort(d->subs, d->sub_count, sizeof(struct dump_sub), _compact_sub_cmp);
+	for(i=0; i<d->sub_count; i++){
+		if(_compact_sub_write(d, fptr, &d->subs[i], version)) return 1;
+	}
+	qsort(d->retains, d->retain_count, sizeof(dbid_t), _compact_retain_cmp);
+	for(i=0; i<d->retain_count; i++){
+		if(_compact_header_write(fptr, DB_CHUNK_RETAIN, sizeof(dbid_t))) return 1;
+		write_e(fptr, &d->retains[i], sizeof(dbid_t));
+	}
+	return 0;
+error:
+	return 1;
+}
+
+/* Compressed payloads can only be kept in a version 4 file. */
+static int _compact_payloads_uncompress(struct dump_db *d)
+{
+	struct dump_store *store;
+	int i;
+#ifdef WITH_ZLIB
+	uLongf len;
+	uint8_t *data;
+#endif
+
+	for(i=0; i<d->store_count; i++){
+		store = &d->stores[i];
+		if(!store->used || !store->compressed) continue;
+#ifdef WITH_ZLIB
+		if(_compact_grow((void **)&d->pool, &d->pool_size, d->pool_count, sizeof(char *))) return 1;
+		data = malloc(store->payloadlen);
+		if(!data){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		d->pool[d->pool_count++] = (char *)data;
+		len = store->payloadlen;
+		if(uncompress(data, &len, store->data, store->datalen) != Z_OK || len != store->payloadlen){
+			fprintf(stderr, "Error: Corrupt compressed message %ld.\n", (long)store->id);
+			return 1;
+		}
+		store->data = data;
+		store->datalen = store->payloadlen;
+		store->compressed = false;
+#else
+		fprintf(stderr, "Error: The database has compressed messages, but compression support is not available.\n");
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+/* Is there anything in the write ahead log or delta file of filename that the
+ * broker hasn't yet folded into the database? */
+static bool _compact_pending_changes(const char *filename)
+{
+	struct stat st;
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s.delta", filename);
+	if(!stat(path, &st) && st.st_size > 0) return true;
+	snprintf(path, sizeof(path), "%s.wal", filename);
+	if(!stat(path, &st) && st.st_size > (off_t)DUMP_HEADER_SIZE) return true;
+	return false;
+}
+
+static void _compact_free(struct dump_db *d)
+{
+	int i;
+
+	for(i=0; i<d->pool_count; i++){
+		free(d->pool[i]);
+	}
+	for(i=0; i<d->client_count; i++){
+		free(d->clients[i].msgs);
+	}
+	free(d->pool);
+	free(d->strings);
+	free(d->stores);
+	free(d->clients);
+	free(d->client_index);
+	free(d->subs);
+	free(d->retains);
+	free(d->dict);
+	free(d->dict_ids);
+	free(d->data);
+}
+
+/* Rewrite in_file to out_file, which may be the same file. If compact is set,
+ * stored messages that nothing refers to are dropped. version is the database
+ * version to write, or 0 to keep that of in_file. */
+static int _db_compact(const char *in_file, const char *out_file, bool compact, uint32_t version)
+{
+	struct dump_db d;
+	struct stat st;
+	FILE *fptr;
+	char *tmp_file = NULL;
+	int i, j, kept = 0, expiring = 0, rc = 1;
+
+	if(_compact_pending_changes(in_file)){
+		fprintf(stderr, "Error: %s has changes in its write ahead log or delta file. Stop the broker cleanly first.\n", in_file);
+		return 1;
+	}
+
+	memset(&d, 0, sizeof(struct dump_db));
+	fptr = fopen(in_file, "rb");
+	if(!fptr || fstat(fileno(fptr), &st)){
+		fprintf(stderr, "Error: Unable to open %s: %s.\n", in_file, strerror(errno));
+		if(fptr) fclose(fptr);
+		return 1;
+	}
+	d.len = st.st_size;
+	d.data = malloc(d.len ? d.len : 1);
+	if(!d.data){
+		fprintf(stderr, "Error: Out of memory.\n");
+		fclose(fptr);
+		return 1;
+	}
+	if(fread(d.data, 1, d.len, fptr) != d.len){
+		fprintf(stderr, "Error: Unable to read %s: %s.\n", in_file, strerror(errno));
+		fclose(fptr);
+		goto cleanup;
+	}
+	fclose(fptr);
+
+	if(_compact_file_read(&d)) goto cleanup;
+	if(!version) version = d.version;
+	if(version < 2 || version > MOSQ_DB_VERSION){
+		fprintf(stderr, "Error: Unable to write database version %d.\n", version);
+		goto cleanup;
+	}
+	_compact_refs_mark(&d, compact);
+	if(version < 4 && _compact_payloads_uncompress(&d)) goto cleanup;
+	if(version < 4){
+		expiring = 0;
+		for(i=0; i<d.store_count; i++){
+			if(d.stores[i].used && d.stores[i].expiry) expiring++;
+		}
+		if(expiring){
+			fprintf(stderr, "Warning: Version %d has no expiry times for stored messages, so %d stored messages will no longer expire.\n", version, expiring);
+		}
+	}
+	if(version < 3){
+		expiring = 0;
+		for(i=0; i<d.client_count; i++){
+			for(j=0; j<d.clients[i].msg_count; j++){
+				if(d.clients[i].msgs[j].expiry) expiring++;
+			}
+		}
+		if(expiring){
+			fprintf(stderr, "Warning: Version 2 has no expiry times, so %d messages will no longer expire.\n", expiring);
+		}
+	}
+
+	tmp_file = malloc(strlen(out_file) + strlen(".new") + 1);
+	if(!tmp_file){
+		fprintf(stderr, "Error: Out of memory.\n");
+		goto cleanup;
+	}
+	sprintf(tmp_file, "%s.new", out_file);
+	fptr = fopen(tmp_file, "wb");
+	if(!fptr){
+		fprintf(stderr, "Error: Unable to open %s: %s.\n", tmp_file, strerror(errno));
+		goto cleanup;
+	}
+	if(_compact_file_write(&d, fptr, version) || fflush(fptr) || fsync(fileno(fptr))){
+		fprintf(stderr, "Error: Unable to write %s: %s.\n", tmp_file, strerror(errno));
+		fclose(fptr);
+		remove(tmp_file);
+		goto cleanup;
+	}
+	fclose(fptr);
+	if(rename(tmp_file, out_file)){
+		fprintf(stderr, "Error: Unable to replace %s: %s.\n", out_file, strerror(errno));
+		remove(tmp_file);
+		goto cleanup;
+	}
+
+	for(i=0; i<d.store_count; i++){
+		if(d.stores[i].used) kept++;
+	}
+	if(!stat(out_file, &st)){
+		printf("Wrote %s: version %d, %d of %d stored messages, %d clients, %d subscriptions, %ld bytes (was %ld).\n",
+				out_file, version, kept, d.store_count, d.client_count, d.sub_count,
+				(long)st.st_size, (long)d.len);
+	}
+	rc = 0;
+cleanup:
+	free(tmp_file);
+	_compact_free(&d);
+	return rc;
+}
+
+static int _db_dump(const char *filename)
 {
 	FILE *fd;
 	char header[15];
@@ -309,12 +1596,8 @@ int main(int argc, char *argv[])
 	ssize_t rlen;
 	mosquitto_db db;
 
-	if(argc != 2){
-		fprintf(stderr, "Usage: db_dump <mosquitto db filename>\n");
-		return 1;
-	}
 	memset(&db, 0, sizeof(mosquitto_db));
-	fd = fopen(argv[1], "rb");
+	fd = fopen(filename, "rb");
 	if(!fd) return 0;
 	read_e(fd, &header, 15);
 	if(!memcmp(header, magic, 15)){
@@ -351,13 +1634,13 @@ int main(int argc, char *argv[])
 				case DB_CHUNK_MSG_STORE:
 					printf("DB_CHUNK_MSG_STORE:\n");
 					printf("\tLength: %d\n", length);
-					if(_db_msg_store_chunk_restore(&db, fd)) return 1;
+					if(_db_msg_store_chunk_restore(&db, fd, length)) return 1;
 					break;
 
 				case DB_CHUNK_CLIENT_MSG:
 					printf("DB_CHUNK_CLIENT_MSG:\n");
 					printf("\tLength: %d\n", length);
-					if(_db_client_msg_chunk_restore(&db, fd)) return 1;
+					if(_db_client_msg_chunk_restore(&db, fd, length)) return 1;
 					break;
 
 				case DB_CHUNK_RETAIN:
@@ -378,6 +1661,70 @@ int main(int argc, char *argv[])
 					if(_db_client_chunk_restore(&db, fd)) return 1;
 					break;
 
+				case DB_CHUNK_CLIENT_MSG_DELETE:
+					printf("DB_CHUNK_CLIENT_MSG_DELETE:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_client_msg_delete_chunk_restore(&db, fd)) return 1;
+					break;
+
+				case DB_CHUNK_UNSUB:
+					printf("DB_CHUNK_UNSUB:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_unsub_chunk_restore(&db, fd)) return 1;
+					break;
+
+				case DB_CHUNK_CLIENT_DELETE:
+					printf("DB_CHUNK_CLIENT_DELETE:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_client_delete_chunk_restore(&db, fd)) return 1;
+					break;
+
+				case DB_CHUNK_CHECKPOINT:
+					printf("DB_CHUNK_CHECKPOINT:\n");
+					printf("\tLength: %d\n", length);
+					read_e(fd, &i32temp, sizeof(uint32_t));
+					printf("\tCheckpoint: %d\n", ntohl(i32temp));
+					break;
+
+				case DB_CHUNK_DELTA:
+					printf("DB_CHUNK_DELTA:\n");
+					printf("\tLength: %d\n", length);
+					read_e(fd, &i32temp, sizeof(uint32_t));
+					printf("\tDatabase ID: %d\n", ntohl(i32temp));
+					read_e(fd, &i32temp, sizeof(uint32_t));
+					printf("\tDelta length: %d\n", ntohl(i32temp));
+					break;
+
+				case DB_CHUNK_STRING:
+					printf("DB_CHUNK_STRING:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_string_chunk_restore(fd, length)) return 1;
+					break;
+
+				case DB_CHUNK_MSG_STORE_PACKED:
+					printf("DB_CHUNK_MSG_STORE_PACKED:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_msg_store_packed_chunk_restore(&db, fd, length)) return 1;
+					break;
+
+				case DB_CHUNK_CLIENT_MSG_PACKED:
+					printf("DB_CHUNK_CLIENT_MSG_PACKED:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_client_msg_packed_chunk_restore(&db, fd, length)) return 1;
+					break;
+
+				case DB_CHUNK_SUB_PACKED:
+					printf("DB_CHUNK_SUB_PACKED:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_sub_packed_chunk_restore(&db, fd, length)) return 1;
+					break;
+
+				case DB_CHUNK_CLIENT_PACKED:
+					printf("DB_CHUNK_CLIENT_PACKED:\n");
+					printf("\tLength: %d\n", length);
+					if(_db_client_packed_chunk_restore(&db, fd, length)) return 1;
+					break;
+
 				default:
 					fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
 					fseek(fd, length, SEEK_CUR);
@@ -399,3 +1746,56 @@ error:
 	return 1;
 }
 
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: db_dump <mosquitto db filename>\n");
+	fprintf(stderr, "       db_dump [--compact] [--convert <version>] <mosquitto db filename> [<output filename>]\n\n");
+	fprintf(stderr, " --compact : rewrite the database without stored messages that nothing refers to.\n");
+	fprintf(stderr, " --convert : rewrite the database as the given version (2 to %d).\n", MOSQ_DB_VERSION);
+	fprintf(stderr, "The database is rewritten in place unless an output filename is given.\n");
+	fprintf(stderr, "Only rewrite the database of a broker that isn't running.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	bool rewrite = false, compact = false;
+	int version = 0;
+	int i;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "--compact")){
+			rewrite = true;
+			compact = true;
+		}else if(!strcmp(argv[i], "--convert")){
+			if(i == argc-1){
+				fprintf(stderr, "Error: --convert argument given but no version specified.\n\n");
+				print_usage();
+				return 1;
+			}
+			version = atoi(argv[i+1]);
+			if(version < 2 || version > MOSQ_DB_VERSION){
+				fprintf(stderr, "Error: Invalid database version %s.\n\n", argv[i+1]);
+				print_usage();
+				return 1;
+			}
+			rewrite = true;
+			i++;
+		}else{
+			break;
+		}
+	}
+
+	if(!rewrite){
+		if(argc != 2){
+			print_usage();
+			return 1;
+		}
+		return _db_dump(argv[1]);
+	}
+	if(argc - i < 1 || argc - i > 2){
+		print_usage();
+		return 1;
+	}
+	return _db_compact(argv[i], argc - i == 2 ? argv[i+1] : argv[i], compact, version);
+}
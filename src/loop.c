@@ -27,6 +27,9 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+/* For POLLRDHUP. */
+#define _GNU_SOURCE
+
 #include <config.h>
 
 #ifndef WIN32
@@ -52,8 +55,14 @@ extern bool flag_db_backup;
 extern bool flag_tree_print;
 extern int run;
 
+#ifndef POLLRDHUP
+/* Only a reset connection is noticed, not a close. */
+#  define POLLRDHUP 0
+#endif
+
 static void loop_handle_errors(mosquitto_db *db, struct pollfd *pollfds);
 static void loop_handle_reads_writes(mosquitto_db *db, struct pollfd *pollfds);
+static void loop_write_ready(mosquitto_db *db);
 
 int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count, int listener_max)
 {
@@ -61,7 +70,10 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 	time_t last_backup = time(NULL);
 	time_t last_store_clean = time(NULL);
 	time_t now;
+	uint64_t now_ms, poll_end = 0;
 	int fdcount;
+	int poll_timeout, wait;
+	int overload;
 #ifndef WIN32
 	sigset_t sigblock, origsig;
 #endif
@@ -70,6 +82,10 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 	unsigned int pollfd_count = 0;
 	int client_max = 0;
 	unsigned int sock_max = 0;
+	bool security_pending = false;
+#ifdef WITH_AUTH_PLUGIN
+	int auth_sock = mqtt3_auth_plugin_sock(db);
+#endif
 
 #ifndef WIN32
 	sigemptyset(&sigblock);
@@ -77,7 +93,12 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 #endif
 
 	while(run){
+#ifdef WITH_PERSISTENCE
+		/* Group commit of everything logged in the last pass. */
+		mqtt3_wal_sync();
+#endif
 		mqtt3_db_sys_update(db, db->config->sys_interval, start_time);
+		loop_write_ready(db);
 
 		client_max = -1;
 		for(i=0; i<db->context_count; i++){
@@ -91,6 +112,11 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 		}else{
 			sock_max = listener_max;
 		}
+#ifdef WITH_AUTH_PLUGIN
+		if(auth_sock != INVALID_SOCKET && (unsigned int)auth_sock > sock_max){
+			sock_max = auth_sock;
+		}
+#endif
 		if(sock_max+1 > pollfd_count){
 			pollfd_count = sock_max+1;
 			pollfds = _mosquitto_realloc(pollfds, sizeof(struct pollfd)*pollfd_count);
@@ -102,13 +128,36 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 
 		memset(pollfds, -1, sizeof(struct pollfd)*pollfd_count);
 
+		now = time(NULL);
+		now_ms = _mosquitto_time_ms();
+		/* The time spent since poll() last returned is how late the events
+		 * it returned have been handled. */
+		overload = mqtt3_overload_update(db, poll_end && now_ms > poll_end ? (int)(now_ms - poll_end) : 0, now_ms);
+
 		for(i=0; i<listensock_count; i++){
 			pollfds[listensock[i]].fd = listensock[i];
-			pollfds[listensock[i]].events = POLLIN;
+			/* New connections wait in the listen backlog until there is time
+			 * for them. */
+			pollfds[listensock[i]].events = mqtt3_overload_accept_deferred() ? 0 : POLLIN;
 			pollfds[listensock[i]].revents = 0;
 		}
+#ifdef WITH_AUTH_PLUGIN
+		if(auth_sock != INVALID_SOCKET){
+			pollfds[auth_sock].fd = auth_sock;
+			pollfds[auth_sock].events = POLLIN;
+			pollfds[auth_sock].revents = 0;
+		}
+#endif
 
-		now = time(NULL);
+		/* Don't wait while a reload is still being worked through, and keep
+		 * checking the load while overloaded. */
+		if(security_pending){
+			poll_timeout = 0;
+		}else if(overload){
+			poll_timeout = 100;
+		}else{
+			poll_timeout = 1000;
+		}
 		for(i=0; i<db->context_count; i++){
 			if(db->contexts[i]){
 				if(db->contexts[i]->sock != INVALID_SOCKET){
@@ -120,20 +169,50 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 						_mosquitto_check_keepalive(db->contexts[i]);
 					}
 #endif
+#ifdef WITH_AUTH_PLUGIN
+					mqtt3_auth_plugin_timeout_check(db, i, now);
+					if(db->contexts[i]->sock == INVALID_SOCKET) continue;
+#endif
+
+					/* Clients over their inbound rate are left unread, so
+					 * that TCP slows them down. Their PINGREQs aren't read
+					 * either, so their keepalive is held until they are let
+					 * go. */
+					wait = mqtt3_rate_inbound_wait(db, db->contexts[i], now_ms);
+					if(wait){
+						db->contexts[i]->last_msg_in = now;
+					}
 
-					/* Local bridges never time out in this fashion. */
-					if(!(db->contexts[i]->keepalive) || db->contexts[i]->bridge || now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
-						if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
-							if(db->contexts[i]->sock < pollfd_count){
-								pollfds[db->contexts[i]->sock].fd = db->contexts[i]->sock;
-								pollfds[db->contexts[i]->sock].events = POLLIN;
-								pollfds[db->contexts[i]->sock].revents = 0;
-								if(db->contexts[i]->out_packet){
+					/* Local bridges never time out in this fashion, nor do
+					 * clients that aren't being read because of overload. */
+					if(!(db->contexts[i]->keepalive) || db->contexts[i]->bridge || db->contexts[i]->overload_paused || now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
+						if(db->contexts[i]->sock < pollfd_count){
+							pollfds[db->contexts[i]->sock].fd = db->contexts[i]->sock;
+							pollfds[db->contexts[i]->sock].events = POLLIN;
+							pollfds[db->contexts[i]->sock].revents = 0;
+							if(wait){
+								pollfds[db->contexts[i]->sock].events = 0;
+								if(wait < poll_timeout) poll_timeout = wait;
+							}
+							if(db->contexts[i]->overload_paused){
+								pollfds[db->contexts[i]->sock].events = 0;
+							}
+#ifdef WITH_AUTH_PLUGIN
+							/* Nothing more is read until the CONNECT is done,
+							 * but the client going away is still noticed so
+							 * that its check can be cancelled. */
+							if(db->contexts[i]->auth_job){
+								pollfds[db->contexts[i]->sock].events = POLLRDHUP;
+							}
+#endif
+							if(db->contexts[i]->out_packet){
+								wait = mqtt3_rate_outbound_wait(db->contexts[i], now_ms);
+								if(!wait){
 									pollfds[db->contexts[i]->sock].events |= POLLOUT;
+								}else if(wait < poll_timeout){
+									poll_timeout = wait;
 								}
 							}
-						}else{
-							mqtt3_context_disconnect(db, i);
 						}
 					}else{
 						if(db->config->connection_messages == true){
@@ -168,18 +247,29 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 		}
 
 		mqtt3_db_message_timeout_check(db, db->config->retry_interval);
+		mqtt3_db_message_expire(db);
+		mqtt3_db_conflate_check(db);
+#ifdef WITH_PERSISTENCE
+		mqtt3_db_spill_check(db);
+#endif
 
 #ifndef WIN32
 		sigprocmask(SIG_SETMASK, &sigblock, &origsig);
-		fdcount = poll(pollfds, pollfd_count, 1000);
+		fdcount = poll(pollfds, pollfd_count, poll_timeout);
 		sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-		fdcount = WSAPoll(pollfds, pollfd_count, 1000);
+		fdcount = WSAPoll(pollfds, pollfd_count, poll_timeout);
 #endif
+		poll_end = _mosquitto_time_ms();
 		if(fdcount == -1){
 			loop_handle_errors(db, pollfds);
 		}else{
 			loop_handle_reads_writes(db, pollfds);
+#ifdef WITH_AUTH_PLUGIN
+			if(auth_sock != INVALID_SOCKET && pollfds[auth_sock].revents & POLLIN){
+				mqtt3_auth_plugin_process(db);
+			}
+#endif
 
 			for(i=0; i<listensock_count; i++){
 				if(pollfds[listensock[i]].revents & (POLLIN | POLLPRI)){
@@ -188,9 +278,17 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 				}
 			}
 		}
+		mqtt3_db_overflow_disconnect(db);
 #ifdef WITH_PERSISTENCE
+		mqtt3_db_backup_check(db, false);
 		if(db->config->persistence && db->config->autosave_interval){
-			if(last_backup + db->config->autosave_interval < now){
+			if(db->config->autosave_on_changes){
+				/* No more than one save a second, however busy. */
+				if(last_backup < now && mqtt3_db_changes() >= (unsigned long)db->config->autosave_interval){
+					mqtt3_db_backup(db, false, false);
+					last_backup = time(NULL);
+				}
+			}else if(last_backup + db->config->autosave_interval < now){
 				mqtt3_db_backup(db, false, false);
 				last_backup = time(NULL);
 			}
@@ -209,11 +307,10 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 		if(flag_reload){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Reloading config.");
 			mqtt3_config_read(db->config, true);
-			mosquitto_security_cleanup(db);
-			mosquitto_security_init(db);
-			mosquitto_security_apply(db);
+			mosquitto_security_reload(db);
 			flag_reload = false;
 		}
+		security_pending = mosquitto_security_apply(db);
 		if(flag_tree_print){
 			mqtt3_sub_tree_print(&db->subs, 0);
 			flag_tree_print = false;
@@ -224,6 +321,30 @@ int mosquitto_main_loop(mosquitto_db *db, int *listensock, int listensock_count,
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Send any messages that have become sendable since the last pass, for only
+ * those contexts that have been scheduled by the database functions.
+ */
+static void loop_write_ready(mosquitto_db *db)
+{
+	struct mosquitto *context;
+	int i;
+
+	while((context = mqtt3_db_write_next())){
+		if(context->sock == INVALID_SOCKET) continue;
+
+		if(mqtt3_db_message_write(context) != MOSQ_ERR_SUCCESS){
+			/* Write errors are rare, so finding the context index here
+			 * isn't a concern. */
+			for(i=0; i<db->context_count; i++){
+				if(db->contexts[i] == context){
+					mqtt3_context_disconnect(db, i);
+					break;
+				}
+			}
+		}
+	}
+}
+
 /* Error ocurred, probably an fd has been closed. 
  * Loop through and check them all.
  */
@@ -267,6 +388,17 @@ static void loop_handle_reads_writes(mosquitto_db *db, struct pollfd *pollfds)
 				}
 			}
 		}
+#ifdef WITH_AUTH_PLUGIN
+		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET && db->contexts[i]->auth_job){
+			if(pollfds[db->contexts[i]->sock].revents & (POLLRDHUP | POLLHUP | POLLERR)){
+				if(db->config->connection_messages == true){
+					_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s disconnected before its password was checked.", db->contexts[i]->auth_job->client_id);
+				}
+				mqtt3_context_disconnect(db, i);
+			}
+			continue;
+		}
+#endif
 		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
 			if(pollfds[db->contexts[i]->sock].revents & POLLIN){
 				if(_mosquitto_packet_read(db, i)){
@@ -208,6 +208,10 @@ int main(int argc, char *argv[])
 	mqtt3_log_init(config.log_type, config.log_dest);
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "mosquitto version %s (build date %s) starting", VERSION, TIMESTAMP);
 
+#ifdef WITH_AUTH_PLUGIN
+	rc = mqtt3_auth_plugin_init(&int_db);
+	if(rc) return rc;
+#endif
 	rc = mosquitto_security_init(&int_db);
 	if(rc) return rc;
 
@@ -284,9 +288,12 @@ int main(int argc, char *argv[])
 	mqtt3_log_close();
 
 #ifdef WITH_PERSISTENCE
+	/* Let any save running in the background finish. */
+	mqtt3_db_backup_check(&int_db, true);
 	if(config.persistence && config.autosave_interval){
 		mqtt3_db_backup(&int_db, true, true);
 	}
+	mqtt3_wal_close();
 #endif
 
 	for(i=0; i<int_db.context_count; i++){
@@ -297,6 +304,7 @@ int main(int argc, char *argv[])
 	_mosquitto_free(int_db.contexts);
 	int_db.contexts = NULL;
 	mqtt3_db_close(&int_db);
+	mqtt3_quota_cleanup(&int_db);
 
 	if(listensock){
 		for(i=0; i<listensock_count; i++){
@@ -312,6 +320,9 @@ int main(int argc, char *argv[])
 	}
 
 	mosquitto_security_cleanup(&int_db);
+#ifdef WITH_AUTH_PLUGIN
+	mqtt3_auth_plugin_cleanup(&int_db);
+#endif
 
 	if(config.pid_file){
 		remove(config.pid_file);
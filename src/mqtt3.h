@@ -36,13 +36,14 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_internal.h>
 #include <mosquitto.h>
+#include <mosquitto_plugin.h>
 
 #ifndef __GNUC__
 #define __attribute__(attrib)
 #endif
 
 /* Database macros */
-#define MOSQ_DB_VERSION 2
+#define MOSQ_DB_VERSION 4
 
 /* Log destinations */
 #define MQTT3_LOG_NONE 0x00
@@ -53,10 +54,6 @@ POSSIBILITY OF SUCH DAMAGE.
 #define MQTT3_LOG_TOPIC 0x10
 #define MQTT3_LOG_ALL 0xFF
 
-#define MOSQ_ACL_NONE 0x00
-#define MOSQ_ACL_READ 0x01
-#define MOSQ_ACL_WRITE 0x02
-
 typedef uint64_t dbid_t;
 
 enum mqtt3_msg_state {
@@ -74,6 +71,20 @@ enum mqtt3_msg_state {
 	ms_queued = 11
 };
 
+enum mqtt3_drop_policy {
+	dp_newest = 0,
+	dp_oldest_qos0 = 1,
+	dp_disconnect = 2
+};
+
+/* What the read ACLs say about the topics a subscription matches. */
+enum mqtt3_sub_acl {
+	sa_check = 0, /* Some may be allowed, so check each message. */
+	sa_allow = 1, /* All are allowed. */
+	sa_allow_below = 2, /* All are allowed, except the level a trailing # is attached to. */
+	sa_deny = 3 /* None are allowed. */
+};
+
 struct _mqtt3_listener {
 	int fd;
 	char *host;
@@ -83,6 +94,31 @@ struct _mqtt3_listener {
 	int *socks;
 	int sock_count;
 	int client_count;
+	unsigned long max_queued_bytes;
+	unsigned long msg_bytes;
+	unsigned long out_packet_bytes;
+	int message_expiry;
+	unsigned long max_packet_size;
+	int max_subscriptions;
+	int sub_count; /* Subscriptions of the clients attached to the listener. */
+	int max_retained;
+	int retained_count; /* Retained topics created through the listener. */
+	struct _mosquitto_mount *mount; /* Subscription tree for mount_point. */
+	unsigned long max_inbound_rate;
+	unsigned long max_inbound_bytes_rate;
+	struct _mosquitto_bucket in_msgs;
+	struct _mosquitto_bucket in_bytes;
+	unsigned long max_outbound_bytes_rate; /* For each client. */
+};
+
+struct _mqtt3_expiry_rule {
+	char *prefix;
+	int interval;
+};
+
+struct _mqtt3_conflate_rule {
+	char *prefix;
+	int interval;
 };
 
 typedef struct {
@@ -90,6 +126,8 @@ typedef struct {
 	char *acl_file;
 	bool allow_anonymous;
 	int autosave_interval;
+	bool autosave_on_changes;
+	int autosave_delta_count;
 	char *clientid_prefixes;
 	bool connection_messages;
 	bool daemon;
@@ -99,11 +137,37 @@ typedef struct {
 	int log_dest;
 	int log_type;
 	bool log_timestamp;
+	unsigned long max_queued_bytes;
+	unsigned long max_queued_bytes_total;
+	unsigned long max_user_queued_bytes;
+	int max_user_retained;
+	int max_user_subscriptions;
+	unsigned long max_inbound_rate;
+	unsigned long max_inbound_bytes_rate;
+	unsigned long max_user_inbound_rate;
+	unsigned long max_user_inbound_bytes_rate;
+	int overload_accept_lag;
+	int overload_pause_lag;
+	int overload_shed_lag;
+	enum mqtt3_drop_policy queue_drop_policy;
+	int message_expiry;
+	struct _mqtt3_expiry_rule *expiry_rules;
+	int expiry_rule_count;
+	struct _mqtt3_conflate_rule *conflate_rules;
+	int conflate_rule_count;
+	unsigned long payload_spill_size;
+	char *payload_spill_dir;
+	int queue_spill_time;
+	char *queue_spill_dir;
 	char *password_file;
 	bool persistence;
 	char *persistence_location;
+	unsigned long persistence_compress_size;
 	char *persistence_file;
 	char *persistence_filepath;
+	bool persistence_lazy_restore;
+	bool persistence_wal;
+	bool persistence_wal_sync_acks;
 	int retry_interval;
 	int store_clean_interval;
 	int sys_interval;
@@ -113,6 +177,13 @@ typedef struct {
 	struct _mqtt3_bridge *bridges;
 	int bridge_count;
 #endif
+#ifdef WITH_AUTH_PLUGIN
+	char *auth_plugin;
+	struct mosquitto_auth_opt *auth_options;
+	int auth_option_count;
+	int auth_plugin_threads;
+	int auth_plugin_timeout;
+#endif
 #ifdef WITH_EXTERNAL_SECURITY_CHECKS
 	char *db_host;
 	int db_port;
@@ -127,6 +198,9 @@ struct _mosquitto_subleaf {
 	struct _mosquitto_subleaf *next;
 	struct mosquitto *context;
 	int qos;
+	enum mqtt3_sub_acl acl;
+	/* The context's acl_generation when acl was decided. */
+	unsigned int acl_generation;
 };
 
 struct _mosquitto_subhier {
@@ -135,6 +209,29 @@ struct _mosquitto_subhier {
 	struct _mosquitto_subleaf *subs;
 	char *topic;
 	struct mosquitto_msg_store *retained;
+	/* Who created the retained message, for the retained topic limits. */
+	struct _mosquitto_quota_user *retained_user;
+	struct _mqtt3_listener *retained_listener;
+};
+
+/* The subscriptions of the clients of all listeners sharing a mount_point
+ * are kept in a tree of their own, with the mount_point removed from their
+ * topics. Retained messages stay in the main tree. Mount points may not be
+ * prefixes of each other, so that each topic belongs to at most one. */
+struct _mosquitto_mount {
+	struct _mosquitto_mount *next;
+	char *mount_point;
+	int len;
+	int token_count; /* Topic levels in mount_point, if it ends with '/'. */
+	struct _mosquitto_subhier subs;
+};
+
+/* Where the last subscription added by mqtt3_sub_add_bulk() went. */
+struct _mosquitto_sub_bulk {
+	struct _mosquitto_subhier *root;
+	char *topic;
+	struct _mosquitto_subhier *node;
+	struct _mosquitto_subleaf *tail;
 };
 
 struct mosquitto_msg_store{
@@ -143,25 +240,61 @@ struct mosquitto_msg_store{
 	int ref_count;
 	char *source_id;
 	uint16_t source_mid;
+	time_t expiry_time;
+	bool wal_logged; /* In the write ahead log or database file already. */
+	bool db_saved; /* In the database file or a delta already. */
+	uint8_t *payload_map; /* File backed buffer that msg.payload points into, if any. */
+	uint32_t payload_map_len;
 	struct mosquitto_message msg;
 };
 
+/* Per client state for a topic that is subject to conflation. */
+struct _mosquitto_conflated{
+	struct _mosquitto_conflated *next; /* Next entry in the hash bucket. */
+	char *topic;
+	uint32_t hash;
+	struct _mosquitto_client_msg *msg; /* Newest unsent message for topic, or NULL. */
+	time_t next_send;
+	int interval;
+};
+
 typedef struct _mosquitto_client_msg{
 	struct _mosquitto_client_msg *next;
+	struct _mosquitto_client_msg *prev;
+	struct _mosquitto_client_msg *mid_next; /* Next entry in the mid index bucket. */
+	struct _mosquitto_conflated *conflated;
 	struct mosquitto_msg_store *store;
 	uint16_t mid;
 	int qos;
 	bool retain;
 	time_t timestamp;
+	time_t expiry_time;
 	enum mosquitto_msg_direction direction;
 	enum mqtt3_msg_state state;
 	bool dup;
 } mosquitto_client_msg;
 
+enum mqtt3_pw_type {
+	pw_plain = 0,
+	pw_pbkdf2_sha512 = 1, /* $7$iterations$salt$hash, base64 salt and hash. */
+	pw_invalid = 2 /* A hash that can't be used, so never matches. */
+};
+
 struct _mosquitto_unpwd{
 	struct _mosquitto_unpwd *next;
+	struct _mosquitto_unpwd *hash_next;
 	char *username;
 	char *password;
+	enum mqtt3_pw_type type;
+	int iterations;
+	unsigned char *salt;
+	int salt_len;
+	unsigned char *hash;
+	int hash_len;
+	/* While a reload is applied, the password of a connected client that has
+	 * been checked against this entry and the result. */
+	char *reload_password;
+	int reload_rc;
 };
 
 struct _mosquitto_acl{
@@ -171,23 +304,97 @@ struct _mosquitto_acl{
 	int access;
 };
 
+/* A level of a compiled ACL tree. The ACLs of a user and all pattern ACLs are
+ * merged into one tree, so that a topic can be checked in a single walk. */
+struct _mosquitto_acl_node{
+	struct _mosquitto_acl_node *next;
+	struct _mosquitto_acl_node *children;
+	struct _mosquitto_acl_node *plus;
+	struct _mosquitto_acl_node *client_id; /* %c in a pattern */
+	struct _mosquitto_acl_node *username; /* %u in a pattern */
+	struct _mosquitto_acl_node *slash; /* Root only, for topics starting with / */
+	char *topic;
+	int topic_len;
+	int access; /* Access to topics ending at this level. */
+	int hash_access; /* Access to topics below this level, from a trailing # */
+};
+
 struct _mosquitto_acl_user{
 	struct _mosquitto_acl_user *next;
+	struct _mosquitto_acl_user *hash_next;
 	char *username;
 	struct _mosquitto_acl *acl;
+	struct _mosquitto_acl_node *tree;
+	/* While a reload is applied, the new user with the same ACLs, if any. */
+	struct _mosquitto_acl_user *unchanged;
+};
+
+/* A username/password check waiting for, or finished by, the auth plugin
+ * worker threads. The workers only touch username, password and rc. */
+struct _mosquitto_auth_job{
+	struct _mosquitto_auth_job *next;
+	struct mosquitto *context; /* NULL if the client has gone away. */
+	time_t start;
+	char *username;
+	char *password;
+	int rc;
+	/* The rest of the CONNECT, for when the check completes. */
+	char *client_id;
+	struct mosquitto_message *will;
+	bool clean_session;
+};
+
+/* What the clients of one user hold in the broker, for the max_user_* limits.
+ * Shared by every client that connected with the username. */
+struct _mosquitto_quota_user{
+	struct _mosquitto_quota_user *next;
+	char *username;
+	int ref_count; /* Clients and retained topics belonging to the user. */
+	int sub_count;
+	int retained_count;
+	unsigned long msg_bytes;
+	unsigned long out_packet_bytes;
+	struct _mosquitto_bucket in_msgs;
+	struct _mosquitto_bucket in_bytes;
+};
+
+/* The limits counted in $SYS/broker/quota/. */
+enum mqtt3_quota {
+	mq_user_subscriptions = 0,
+	mq_user_retained = 1,
+	mq_user_queued_bytes = 2,
+	mq_listener_subscriptions = 3,
+	mq_listener_retained = 4,
+	mq_listener_queued_bytes = 5,
+	mq_count = 6
 };
 
 typedef struct _mosquitto_db{
 	dbid_t last_db_id;
 	struct _mosquitto_subhier subs;
+	struct _mosquitto_mount *mounts;
 	struct _mosquitto_unpwd *unpwd;
+	/* unpwd and acl_list indexed by username. */
+	struct _mosquitto_unpwd **unpwd_hash;
+	int unpwd_hash_size;
+	int unpwd_count;
 	struct _mosquitto_acl_user *acl_list;
+	struct _mosquitto_acl_user **acl_user_hash;
+	int acl_user_hash_size;
+	int acl_user_count;
 	struct _mosquitto_acl *acl_patterns;
+	struct _mosquitto_acl_node *acl_pattern_tree;
 	struct mosquitto **contexts;
 	int context_count;
 	struct mosquitto_msg_store *msg_store;
 	int msg_store_count;
+	struct _mosquitto_quota_user **quota_user_hash;
+	int quota_user_hash_size;
+	int quota_user_count;
 	mqtt3_config *config;
+#ifdef WITH_AUTH_PLUGIN
+	struct _mosquitto_auth_plugin *auth_plugin;
+#endif
 } mosquitto_db;
 
 enum mqtt3_bridge_direction{
@@ -225,6 +432,7 @@ struct _mqtt3_bridge{
 	enum mosquitto_bridge_start_type start_type;
 	int idle_timeout;
 	int threshold;
+	unsigned long outbound_bytes_rate;
 };
 
 #include <net_mosq.h>
@@ -260,6 +468,7 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
  * ============================================================ */
 int mqtt3_socket_accept(struct _mosquitto_db *db, int listensock);
 int mqtt3_socket_listen(struct _mqtt3_listener *listener);
+int mqtt3_net_payload_spill(mosquitto_db *db, struct _mosquitto_packet *packet);
 
 uint64_t mqtt3_net_bytes_total_received(void);
 uint64_t mqtt3_net_bytes_total_sent(void);
@@ -272,6 +481,7 @@ unsigned long mqtt3_net_msgs_total_sent(void);
 int mqtt3_packet_handle(mosquitto_db *db, int context_index);
 int mqtt3_handle_connack(mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_connect(mosquitto_db *db, int context_index);
+int mqtt3_handle_connect_auth(mosquitto_db *db, struct _mosquitto_auth_job *job);
 int mqtt3_handle_disconnect(mosquitto_db *db, int context_index);
 int mqtt3_handle_publish(mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_subscribe(mosquitto_db *db, struct mosquitto *context);
@@ -284,11 +494,34 @@ int mqtt3_db_open(mqtt3_config *config, mosquitto_db *db);
 int mqtt3_db_close(mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int mqtt3_db_backup(mosquitto_db *db, bool cleanup, bool shutdown);
+void mqtt3_db_backup_check(mosquitto_db *db, bool wait);
+void mqtt3_db_backup_stats(unsigned long *count, unsigned long *duration, unsigned long long *bytes);
+unsigned long mqtt3_db_changes(void);
 int mqtt3_db_restore(mosquitto_db *db);
+int mqtt3_db_lazy_load(mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_lazy_drop(struct mosquitto *context);
+void mqtt3_db_lazy_close(void);
+void mqtt3_db_spill_check(mosquitto_db *db);
+int mqtt3_db_spill_load(mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_spill_drop(struct mosquitto *context);
+int mqtt3_wal_open(mosquitto_db *db);
+void mqtt3_wal_close(void);
+void mqtt3_wal_sync(void);
+int mqtt3_wal_ack(mosquitto_db *db, struct mosquitto *context, uint8_t command, uint16_t mid);
+void mqtt3_wal_context_forget(struct mosquitto *context);
+void mqtt3_wal_client(struct mosquitto *context);
+void mqtt3_wal_client_delete(struct mosquitto *context, bool session);
+void mqtt3_wal_message(struct mosquitto *context, mosquitto_client_msg *msg);
+void mqtt3_wal_message_delete(struct mosquitto *context, mosquitto_client_msg *msg);
+void mqtt3_wal_sub(struct mosquitto *context, const char *topic, int qos);
+void mqtt3_wal_unsub(struct mosquitto *context, const char *topic);
+void mqtt3_wal_retain(struct mosquitto_msg_store *stored);
 #endif
 int mqtt3_db_client_count(mosquitto_db *db, int *count, int *inactive_count);
 void mqtt3_db_limits_set(int inflight, int queued);
 /* Return the number of in-flight messages in count. */
+int mqtt3_db_message_append(struct mosquitto *context, mosquitto_client_msg *msg);
+void mqtt3_db_messages_to_front(struct mosquitto *context, mosquitto_client_msg *msg);
 int mqtt3_db_message_count(int *count);
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
 int mqtt3_db_message_insert(mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored);
@@ -296,12 +529,26 @@ int mqtt3_db_message_release(mosquitto_db *db, struct mosquitto *context, uint16
 int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mqtt3_msg_state state);
 int mqtt3_db_message_write(struct mosquitto *context);
 int mqtt3_db_messages_delete(struct mosquitto *context);
+void mqtt3_db_messages_free(struct mosquitto *context);
 int mqtt3_db_messages_easy_queue(mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const uint8_t *payload, int retain);
-int mqtt3_db_messages_queue(mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
+int mqtt3_db_messages_queue(mosquitto_db *db, struct mosquitto *context, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
+int mqtt3_db_messages_queue_qos0(mosquitto_db *db, const char *source_id, struct _mqtt3_listener *listener, const char *topic, uint32_t payloadlen, const uint8_t *payload);
 int mqtt3_db_message_store(mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const uint8_t *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id);
+void mqtt3_db_message_store_map(struct mosquitto_msg_store *stored, struct _mosquitto_packet *packet);
 int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored);
 /* Check all messages waiting on a client reply and resend if timeout has been exceeded. */
 int mqtt3_db_message_timeout_check(mosquitto_db *db, unsigned int timeout);
+time_t mqtt3_db_message_expiry(mosquitto_db *db, struct _mqtt3_listener *listener, const char *topic);
+void mqtt3_db_message_expire(mosquitto_db *db);
+void mqtt3_db_conflate_check(mosquitto_db *db);
+void mqtt3_db_overflow_disconnect(mosquitto_db *db);
+int mqtt3_db_queue_bytes_check(mosquitto_db *db, struct mosquitto *context, uint32_t len);
+void mqtt3_db_out_packet_bytes(struct mosquitto *context, long len);
+bool mqtt3_db_conflate_topic(mosquitto_db *db, const char *topic);
+void mqtt3_db_write_schedule(struct mosquitto *context);
+void mqtt3_db_messages_resume(struct mosquitto *context);
+void mqtt3_db_write_unschedule(struct mosquitto *context);
+struct mosquitto *mqtt3_db_write_next(void);
 int mqtt3_retain_queue(mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
 void mqtt3_db_store_clean(mosquitto_db *db);
 void mqtt3_db_sys_update(mosquitto_db *db, int interval, time_t start_time);
@@ -310,11 +557,15 @@ void mqtt3_db_vacuum(void);
 /* ============================================================
  * Subscription functions
  * ============================================================ */
-int mqtt3_sub_add(struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
+int mqtt3_sub_add(struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root, enum mqtt3_sub_acl acl);
 int mqtt3_sub_remove(struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
+int mqtt3_sub_add_bulk(struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root, struct _mosquitto_sub_bulk *bulk);
+void mqtt3_sub_bulk_clean(struct _mosquitto_sub_bulk *bulk);
 int mqtt3_sub_search(struct _mosquitto_db *db, struct _mosquitto_subhier *root, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level);
-int mqtt3_subs_clean_session(struct mosquitto *context, struct _mosquitto_subhier *root);
+int mqtt3_subs_clean_session(mosquitto_db *db, struct mosquitto *context);
+struct _mosquitto_subhier *mqtt3_sub_root(mosquitto_db *db, struct _mosquitto_mount *mount, const char *sub, int *offset);
+bool mqtt3_sub_exists(struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
 
 /* ============================================================
  * Context functions
@@ -322,6 +573,38 @@ int mqtt3_subs_clean_session(struct mosquitto *context, struct _mosquitto_subhie
 struct mosquitto *mqtt3_context_init(int sock);
 void mqtt3_context_cleanup(mosquitto_db *db, struct mosquitto *context, bool do_free);
 void mqtt3_context_disconnect(mosquitto_db *db, int context_index);
+void mqtt3_context_listener_set(struct mosquitto *context, struct _mqtt3_listener *listener);
+
+/* ============================================================
+ * Quota functions
+ * ============================================================ */
+int mqtt3_quota_user_set(mosquitto_db *db, struct mosquitto *context, const char *username);
+void mqtt3_quota_cleanup(mosquitto_db *db);
+void mqtt3_quota_sub_count(struct mosquitto *context, int delta);
+bool mqtt3_quota_sub_refused(mosquitto_db *db, struct mosquitto *context, const char *sub);
+bool mqtt3_quota_retained_refused(mosquitto_db *db, struct mosquitto *context);
+void mqtt3_quota_retained_set(struct _mosquitto_subhier *node, struct mosquitto *context);
+void mqtt3_quota_retained_clear(mosquitto_db *db, struct _mosquitto_subhier *node);
+void mqtt3_quota_hit(enum mqtt3_quota quota);
+unsigned long mqtt3_quota_hits(enum mqtt3_quota quota);
+const char *mqtt3_quota_name(enum mqtt3_quota quota);
+
+/* ============================================================
+ * Rate limit functions
+ * ============================================================ */
+int mqtt3_rate_inbound_wait(mosquitto_db *db, struct mosquitto *context, uint64_t now);
+void mqtt3_rate_inbound_take(mosquitto_db *db, struct mosquitto *context, uint32_t bytes);
+int mqtt3_rate_outbound_wait(struct mosquitto *context, uint64_t now);
+uint32_t mqtt3_rate_outbound_allowed(struct mosquitto *context, uint32_t len);
+void mqtt3_rate_outbound_take(struct mosquitto *context, uint32_t bytes);
+
+/* ============================================================
+ * Overload functions
+ * ============================================================ */
+int mqtt3_overload_update(mosquitto_db *db, int busy, uint64_t now);
+bool mqtt3_overload_accept_deferred(void);
+bool mqtt3_overload_shed(struct mosquitto *context);
+void mqtt3_overload_stats(int *stage, int *lag, unsigned long *deferred, unsigned long *paused, unsigned long *shed);
 
 /* ============================================================
  * Logging functions
@@ -344,20 +627,40 @@ void mqtt3_bridge_packet_cleanup(struct mosquitto *context);
  * ============================================================ */
 int mosquitto_security_init(mosquitto_db *db);
 void mosquitto_security_cleanup(mosquitto_db *db);
+int mosquitto_security_reload(mosquitto_db *db);
+bool mosquitto_security_apply(mosquitto_db *db);
 #ifdef WITH_EXTERNAL_SECURITY_CHECKS
 int mosquitto_unpwd_init(struct _mosquitto_db *db);
 int mosquitto_acl_init(struct _mosquitto_db *db);
 #else
 int mqtt3_aclfile_parse(struct _mosquitto_db *db);
 int mqtt3_pwfile_parse(struct _mosquitto_db *db);
-int mosquitto_security_apply(struct _mosquitto_db *db);
 #endif
 
 int mosquitto_acl_check(struct _mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
 void mosquitto_acl_cleanup(struct _mosquitto_db *db);
-int mosquitto_unpwd_check(struct _mosquitto_db *db, const char *username, const char *password);
+void mosquitto_acl_cache_cleanup(struct mosquitto *context);
+void mosquitto_acl_context_changed(struct mosquitto *context);
+struct _mosquitto_acl_user *mosquitto_acl_user_find(struct _mosquitto_db *db, const char *username);
+enum mqtt3_sub_acl mosquitto_acl_check_sub(struct _mosquitto_db *db, struct mosquitto *context, const char *sub);
+void mosquitto_acl_cache_stats(unsigned long *hits, unsigned long *misses);
+int mosquitto_unpwd_check(struct _mosquitto_db *db, struct mosquitto *context, const char *username, const char *password);
 int mosquitto_unpwd_cleanup(struct _mosquitto_db *db);
 
+/* ============================================================
+ * Auth plugin functions
+ * ============================================================ */
+#ifdef WITH_AUTH_PLUGIN
+int mqtt3_auth_plugin_init(mosquitto_db *db);
+void mqtt3_auth_plugin_cleanup(mosquitto_db *db);
+int mqtt3_auth_plugin_unpwd_check(mosquitto_db *db, struct mosquitto *context, const char *username, const char *password);
+int mqtt3_auth_plugin_acl_check(mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+void mqtt3_auth_plugin_job_cancel(mosquitto_db *db, struct mosquitto *context);
+void mqtt3_auth_plugin_timeout_check(mosquitto_db *db, int context_index, time_t now);
+int mqtt3_auth_plugin_sock(mosquitto_db *db);
+void mqtt3_auth_plugin_process(mosquitto_db *db);
+#endif
+
 /* ============================================================
  * Window service related functions
  * ============================================================ */
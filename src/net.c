@@ -32,6 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef WIN32
 #include <netdb.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -42,6 +43,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef WITH_WRAP
 #include <tcpd.h>
@@ -247,6 +249,59 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 	}
 }
 
+/* Give packet a file backed buffer for its remaining_length bytes, so that
+ * large payloads are kept out of the heap. The file is unlinked straight
+ * away, so it disappears once the mapping is released. On failure the packet
+ * is left alone and the caller should fall back to malloc.
+ */
+int mqtt3_net_payload_spill(mosquitto_db *db, struct _mosquitto_packet *packet)
+{
+#ifndef WIN32
+	char *path;
+	const char *dir;
+	int len;
+	int fd;
+	void *map;
+
+	assert(db);
+	assert(packet);
+
+	dir = db->config->payload_spill_dir?db->config->payload_spill_dir:"/tmp";
+	len = strlen(dir) + strlen("/mosquitto-XXXXXX") + 1;
+	path = _mosquitto_malloc(len);
+	if(!path){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	snprintf(path, len, "%s/mosquitto-XXXXXX", dir);
+	fd = mkstemp(path);
+	if(fd == -1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to create spill file in %s: %s.", dir, strerror(errno));
+		_mosquitto_free(path);
+		return MOSQ_ERR_ERRNO;
+	}
+	unlink(path);
+	_mosquitto_free(path);
+
+	if(ftruncate(fd, packet->remaining_length)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to size spill file: %s.", strerror(errno));
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+	map = mmap(NULL, packet->remaining_length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to map spill file: %s.", strerror(errno));
+		return MOSQ_ERR_ERRNO;
+	}
+	packet->payload = map;
+	packet->mapped_length = packet->remaining_length;
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
 uint64_t mqtt3_net_bytes_total_received(void)
 {
 	return bytes_received;
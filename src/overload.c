@@ -0,0 +1,198 @@
+/*
+Copyright (c) 2012 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <mqtt3.h>
+
+/* The main loop reports how long each pass spent working rather than waiting
+ * in poll(). The longest pass in each window is the lag that clients saw, and
+ * is smoothed over windows so that a single slow pass doesn't trigger
+ * anything. As the lag grows past each of the configured thresholds the
+ * broker stops accepting new connections, then stops reading from the
+ * heaviest publishers one at a time, then drops QoS 0 messages for the
+ * clients with the most queued. No client is disconnected. A stage ends once
+ * the lag is back under three quarters of its threshold. */
+
+#define OVERLOAD_WINDOW 250
+
+static uint64_t window_start = 0;
+static int window_max = 0;
+static int lag = 0;
+static int stage = 0;
+static bool accept_deferred = false;
+static bool pausing = false;
+static bool shedding = false;
+/* Clients with at least this much queued have QoS 0 messages shed. */
+static unsigned long shed_backlog = 0;
+
+static unsigned long accept_deferred_count = 0;
+static unsigned long publishers_paused = 0;
+static unsigned long messages_shed = 0;
+
+static bool _overload_stage_check(bool active, int threshold)
+{
+	if(!threshold) return false;
+	if(active){
+		return lag*4 >= threshold*3;
+	}else{
+		return lag >= threshold;
+	}
+}
+
+static unsigned long _overload_backlog(struct mosquitto *context)
+{
+	return context->out_packet_bytes + context->msg_bytes;
+}
+
+/* Stop reading from the client that has published the most since the last
+ * window, other than bridges and those already paused. */
+static void _overload_pause_heaviest(mosquitto_db *db)
+{
+	struct mosquitto *heaviest = NULL;
+	int i;
+
+	for(i=0; i<db->context_count; i++){
+		if(!db->contexts[i] || db->contexts[i]->bridge || db->contexts[i]->overload_paused) continue;
+		if(db->contexts[i]->overload_bytes && (!heaviest || db->contexts[i]->overload_bytes > heaviest->overload_bytes)){
+			heaviest = db->contexts[i];
+		}
+	}
+	if(heaviest){
+		heaviest->overload_paused = true;
+		publishers_paused++;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Overloaded, pausing reads from client %s.", heaviest->id);
+	}
+}
+
+static void _overload_window_end(mosquitto_db *db)
+{
+	unsigned long backlog, max_backlog = 0;
+	int i;
+
+	lag = (lag + window_max)/2;
+	window_max = 0;
+
+	if(accept_deferred != _overload_stage_check(accept_deferred, db->config->overload_accept_lag)){
+		accept_deferred = !accept_deferred;
+		if(accept_deferred){
+			accept_deferred_count++;
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Overloaded, deferring new connections (lag %d ms).", lag);
+		}
+	}
+
+	if(pausing != _overload_stage_check(pausing, db->config->overload_pause_lag)){
+		pausing = !pausing;
+		if(!pausing){
+			for(i=0; i<db->context_count; i++){
+				if(db->contexts[i]) db->contexts[i]->overload_paused = false;
+			}
+		}
+	}
+	if(pausing){
+		_overload_pause_heaviest(db);
+	}
+
+	shedding = _overload_stage_check(shedding, db->config->overload_shed_lag);
+	if(shedding){
+		for(i=0; i<db->context_count; i++){
+			if(!db->contexts[i] || db->contexts[i]->bridge) continue;
+			backlog = _overload_backlog(db->contexts[i]);
+			if(backlog > max_backlog) max_backlog = backlog;
+		}
+		/* Anyone within a factor of two of the worst. */
+		shed_backlog = max_backlog/2;
+	}
+
+	if(shedding){
+		stage = 3;
+	}else if(pausing){
+		stage = 2;
+	}else if(accept_deferred){
+		stage = 1;
+	}else{
+		stage = 0;
+	}
+
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i]) db->contexts[i]->overload_bytes = 0;
+	}
+}
+
+/* Called once a pass of the main loop with busy, the milliseconds the last
+ * pass spent outside poll(). Returns the current stage, 0 if the broker is
+ * not overloaded. */
+int mqtt3_overload_update(mosquitto_db *db, int busy, uint64_t now)
+{
+	if(!db->config->overload_accept_lag && !db->config->overload_pause_lag && !db->config->overload_shed_lag){
+		if(stage){
+			/* Disabled on reload while active. */
+			lag = 0;
+			_overload_window_end(db);
+		}
+		return 0;
+	}
+
+	if(busy > window_max) window_max = busy;
+	if(now < window_start || now - window_start >= OVERLOAD_WINDOW){
+		if(window_start) _overload_window_end(db);
+		window_start = now;
+	}
+	return stage;
+}
+
+bool mqtt3_overload_accept_deferred(void)
+{
+	return accept_deferred;
+}
+
+/* Returns true if a QoS 0 message for context should be dropped rather than
+ * queued. */
+bool mqtt3_overload_shed(struct mosquitto *context)
+{
+	unsigned long backlog;
+
+	if(!shedding || !shed_backlog || context->bridge) return false;
+
+	backlog = _overload_backlog(context);
+	if(backlog >= shed_backlog){
+		messages_shed++;
+		return true;
+	}
+	return false;
+}
+
+void mqtt3_overload_stats(int *cur_stage, int *cur_lag, unsigned long *deferred, unsigned long *paused, unsigned long *shed)
+{
+	*cur_stage = stage;
+	*cur_lag = lag;
+	*deferred = accept_deferred_count;
+	*paused = publishers_paused;
+	*shed = messages_shed;
+}
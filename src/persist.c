@@ -40,104 +40,353 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include <memory_mosq.h>
 #include <mqtt3.h>
+#include <mqtt3_protocol.h>
 #include <persist.h>
+#include <send_mosq.h>
+#include <util_mosq.h>
 
-static int _db_restore_sub(mosquitto_db *db, const char *client_id, const char *sub, int qos);
+/* A PUBACK or PUBREC that is waiting for the write ahead log to be synced. */
+struct _wal_ack{
+	struct _wal_ack *next;
+	struct mosquitto *context;
+	uint8_t command;
+	uint16_t mid;
+};
+
+static FILE *wal_fptr = NULL;
+static char *wal_filepath = NULL;
+static bool wal_dirty = false;
+static struct _wal_ack *wal_acks = NULL;
+static struct _wal_ack *wal_acks_last = NULL;
+/* The most recent checkpoint id seen or written. */
+static uint32_t wal_checkpoint_id = 0;
+/* The checkpoint in the database file that was restored. */
+static uint32_t db_checkpoint_id = 0;
+/* Offset in the log just after the checkpoint of the save in progress. */
+static long wal_checkpoint_pos = 0;
+
+/* A retained message that has changed since the last save. */
+struct _db_retain_change{
+	struct _db_retain_change *next;
+	struct mosquitto_msg_store *stored;
+};
+
+/* A persistent session that has been thrown away since the last save. */
+struct _db_client_deleted{
+	struct _db_client_deleted *next;
+	char *id;
+};
+
+#define DB_FILE_BASE 0
+#define DB_FILE_DELTA 1
+#define DB_FILE_WAL 2
+
+/* Changes since the last save, for autosave_on_changes. */
+static unsigned long db_changes = 0;
+/* Delta saves. Sessions with changes have db_dirty set. */
+static bool db_delta_tracking = false;
+static bool db_full_needed = true;
+static uint32_t db_base_id = 0;
+static int db_delta_count = 0;
+static struct _db_retain_change *db_retain_changes = NULL;
+static struct _db_retain_change *db_retain_changes_last = NULL;
+static struct _db_client_deleted *db_clients_deleted = NULL;
+static int db_delta_list_count = 0;
+
+/* The fields of a stored message chunk of either kind. The strings aren't
+ * terminated and, like the payload, may point into a mapped file. */
+struct _db_store_fields{
+	dbid_t db_id;
+	const char *source_id;
+	uint16_t source_len;
+	uint16_t source_mid;
+	uint16_t mid;
+	const char *topic;
+	uint16_t topic_len;
+	uint8_t flags;
+	uint32_t payloadlen;
+	const uint8_t *data;
+	uint32_t datalen;
+	int64_t expiry;
+};
+
+/* The fields of a client message chunk of either kind. */
+struct _db_msg_fields{
+	dbid_t store_id;
+	int64_t expiry;
+	uint16_t mid;
+	uint8_t qos;
+	uint8_t retain;
+	uint8_t direction;
+	uint8_t state;
+	uint8_t dup;
+};
+
+/* A string written to the file being saved, and its number. */
+struct _db_dict_entry{
+	const char *str;
+	uint16_t len;
+	uint32_t id;
+};
+
+/* Strings written by the full save in progress, open addressed. */
+static struct _db_dict_entry *db_dict = NULL;
+static unsigned int db_dict_size = 0;
+static unsigned int db_dict_count = 0;
+static uint32_t db_dict_last = 0;
+#ifdef WITH_ZLIB
+static unsigned long db_compress_size = 0;
+static uint8_t *db_compress_buf = NULL;
+static uLong db_compress_buf_len = 0;
+#endif
 
-static struct mosquitto *_db_find_or_add_context(mosquitto_db *db, const char *client_id, uint16_t last_mid)
+static int _db_client_delete_chunk_write(FILE *db_fptr, const char *client_id, uint8_t session);
+static int _db_lazy_stores_write(FILE *db_fptr);
+static int _db_lazy_messages_write(FILE *db_fptr, struct mosquitto *context, bool packed);
+static int _db_spill_chunks_write(FILE *db_fptr, struct mosquitto *context, uint16_t type);
+static void _db_spill_removals_run(void);
+
+#ifndef WIN32
+static pid_t backup_pid = 0;
+static uint64_t backup_start = 0;
+/* The child doing a background save reports how long it took and how much it
+ * wrote on this. */
+static int backup_pipe = -1;
+#endif
+static bool backup_full = false;
+static unsigned long backup_count = 0;
+static unsigned long backup_duration = 0;
+static unsigned long long backup_bytes = 0;
+
+#define DB_BACKUP_BUFFER_SIZE 1048576
+#define DB_INDEX_MIN_SIZE 1024
+/* Past this many retained message changes and deleted sessions a full save is
+ * made instead of a delta, rather than holding on to them all. */
+#define DB_DELTA_MAX_LIST 10000
+
+static void _wal_checkpoint_begin(uint32_t *id);
+static void _wal_checkpoint_end(void);
+
+static int _db_fsync(FILE *fptr)
 {
-	struct mosquitto *context;
-	struct mosquitto **tmp_contexts;
-	int i;
+#ifndef WIN32
+	return fsync(fileno(fptr));
+#else
+	return _commit(_fileno(fptr));
+#endif
+}
 
-	context = NULL;
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && !strcmp(db->contexts[i]->id, client_id)){
-			context = db->contexts[i];
-			break;
-		}
+static unsigned int _db_string_hash(const char *str, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for(i=0; i<len; i++){
+		hash = (hash ^ (uint8_t)str[i]) * 16777619U;
 	}
-	if(!context){
-		context = mqtt3_context_init(-1);
-		context->clean_session = false;
+	return hash;
+}
 
-		for(i=0; i<db->context_count; i++){
-			if(!db->contexts[i]){
-				db->contexts[i] = context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = context;
-			}else{
-				return NULL;
-			}
-		}
-		context->id = _mosquitto_strdup(client_id);
+static unsigned int _db_index_size(unsigned int count)
+{
+	unsigned int size = DB_INDEX_MIN_SIZE;
+
+	while(size < count*2){
+		size *= 2;
 	}
-	if(last_mid){
-		context->last_mid = last_mid;
+	return size;
+}
+
+/* Packed chunks.
+ *
+ * Full saves write the packed chunks of version 4. Each string is written in
+ * a string chunk the first time it is used and after that is referred to by
+ * number, and integers are written as varints. Client messages follow the
+ * chunk of their client, so they don't repeat the client id. That also means
+ * they don't refer to any strings, and can be copied into another file as they
+ * are. Payloads of at least persistence_compress_size bytes are compressed if
+ * that makes them smaller. Deltas, the write ahead log and spill files are
+ * added to a little at a time, so they stay with the plain chunks.
+ */
+#define DB_VARINT_MAX 10
+
+static int _db_varint_put(uint8_t *buf, uint64_t value)
+{
+	int len = 0;
+
+	while(value >= 0x80){
+		buf[len++] = (uint8_t)(value & 0x7F) | 0x80;
+		value >>= 7;
 	}
-	return context;
+	buf[len++] = (uint8_t)value;
+	return len;
 }
 
-static int mqtt3_db_client_messages_write(mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+static void _db_dict_free(void)
 {
-	uint32_t length;
-	dbid_t i64temp;
-	uint16_t i16temp, slen;
-	uint8_t i8temp;
-	mosquitto_client_msg *cmsg;
+	if(db_dict) _mosquitto_free(db_dict);
+	db_dict = NULL;
+	db_dict_size = 0;
+	db_dict_count = 0;
+	db_dict_last = 0;
+#ifdef WITH_ZLIB
+	if(db_compress_buf) _mosquitto_free(db_compress_buf);
+	db_compress_buf = NULL;
+	db_compress_buf_len = 0;
+#endif
+}
 
-	assert(db);
-	assert(db_fptr);
-	assert(context);
+static void _db_dict_add(const char *str, uint16_t len, uint32_t id)
+{
+	struct _db_dict_entry *dict;
+	unsigned int size, i, j;
+
+	if((db_dict_count+1)*2 > db_dict_size){
+		size = _db_index_size(db_dict_count+1);
+		dict = _mosquitto_calloc(size, sizeof(struct _db_dict_entry));
+		/* Not remembering the string only costs space. */
+		if(!dict) return;
+		for(i=0; i<db_dict_size; i++){
+			if(db_dict[i].str){
+				j = _db_string_hash(db_dict[i].str, db_dict[i].len) & (size-1);
+				while(dict[j].str){
+					j = (j+1) & (size-1);
+				}
+				dict[j] = db_dict[i];
+			}
+		}
+		if(db_dict) _mosquitto_free(db_dict);
+		db_dict = dict;
+		db_dict_size = size;
+	}
+	i = _db_string_hash(str, len) & (db_dict_size-1);
+	while(db_dict[i].str){
+		i = (i+1) & (db_dict_size-1);
+	}
+	db_dict[i].str = str;
+	db_dict[i].len = len;
+	db_dict[i].id = id;
+	db_dict_count++;
+}
 
-	cmsg = context->msgs;
-	while(cmsg){
-		slen = strlen(context->id);
+/* Get the number of a string, writing it to the file first if it is new. str
+ * must stay where it is until the save is over, unless keep is false, in
+ * which case it is written again if it is used again. */
+static int _db_string_ref(FILE *db_fptr, const char *str, uint16_t len, bool keep, uint32_t *id)
+{
+	uint32_t i32temp;
+	uint16_t i16temp;
+	unsigned int i;
 
-		length = htonl(sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + 2+slen);
+	if(!len){
+		*id = 0;
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(db_dict){
+		i = _db_string_hash(str, len) & (db_dict_size-1);
+		while(db_dict[i].str){
+			if(db_dict[i].len == len && !memcmp(db_dict[i].str, str, len)){
+				*id = db_dict[i].id;
+				return MOSQ_ERR_SUCCESS;
+			}
+			i = (i+1) & (db_dict_size-1);
+		}
+	}
 
-		i16temp = htons(DB_CHUNK_CLIENT_MSG);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
+	i16temp = htons(DB_CHUNK_STRING);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(len);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	write_e(db_fptr, str, len);
 
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, context->id, slen);
+	*id = ++db_dict_last;
+	if(keep){
+		_db_dict_add(str, len, *id);
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
 
-		i64temp = cmsg->store->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
+#ifdef WITH_ZLIB
+/* Compress the payload if it is big enough and that makes it smaller. */
+static void _db_payload_compress(struct _db_store_fields *sf)
+{
+	uLong len;
+	uint8_t *buf;
 
-		i16temp = htons(cmsg->mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	if(!db_compress_size || sf->datalen < db_compress_size) return;
 
-		i8temp = (uint8_t )cmsg->qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	len = compressBound(sf->datalen);
+	if(len > db_compress_buf_len){
+		buf = _mosquitto_realloc(db_compress_buf, len);
+		if(!buf) return;
+		db_compress_buf = buf;
+		db_compress_buf_len = len;
+	}
+	if(compress2(db_compress_buf, &len, sf->data, sf->datalen, Z_BEST_SPEED) != Z_OK) return;
+	if(len >= sf->datalen) return;
 
-		i8temp = (uint8_t )cmsg->retain;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	sf->data = db_compress_buf;
+	sf->datalen = len;
+	sf->flags |= DB_STORE_COMPRESSED;
+}
+#endif
 
-		i8temp = (uint8_t )cmsg->direction;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+static int _db_store_packed_chunk_write(FILE *db_fptr, struct _db_store_fields *sf)
+{
+	uint8_t buf[7*DB_VARINT_MAX + 1];
+	uint32_t source_ref, topic_ref, i32temp;
+	uint16_t i16temp;
+	int len = 0;
 
-		i8temp = (uint8_t )cmsg->state;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	if(_db_string_ref(db_fptr, sf->source_id, sf->source_len, true, &source_ref)) return 1;
+	if(_db_string_ref(db_fptr, sf->topic, sf->topic_len, true, &topic_ref)) return 1;
+#ifdef WITH_ZLIB
+	if(!(sf->flags & DB_STORE_COMPRESSED)){
+		_db_payload_compress(sf);
+	}
+#endif
 
-		i8temp = (uint8_t )cmsg->dup;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	len += _db_varint_put(&buf[len], sf->db_id);
+	len += _db_varint_put(&buf[len], source_ref);
+	len += _db_varint_put(&buf[len], sf->source_mid);
+	len += _db_varint_put(&buf[len], sf->mid);
+	len += _db_varint_put(&buf[len], topic_ref);
+	if(sf->expiry > 0){
+		sf->flags |= DB_STORE_EXPIRY;
+	}else{
+		sf->flags &= ~DB_STORE_EXPIRY;
+	}
+	buf[len++] = sf->flags;
+	len += _db_varint_put(&buf[len], sf->payloadlen);
+	if(sf->flags & DB_STORE_EXPIRY){
+		len += _db_varint_put(&buf[len], (uint64_t)sf->expiry);
+	}
 
-		cmsg = cmsg->next;
+	i16temp = htons(DB_CHUNK_MSG_STORE_PACKED);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(len + sf->datalen);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	write_e(db_fptr, buf, len);
+	if(sf->datalen){
+		write_e(db_fptr, sf->data, sf->datalen);
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -146,65 +395,87 @@ error:
 	return 1;
 }
 
+static int _db_msg_store_packed_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
+{
+	struct _db_store_fields sf;
+
+	sf.db_id = stored->db_id;
+	sf.source_id = stored->source_id;
+	sf.source_len = strlen(stored->source_id);
+	sf.source_mid = stored->source_mid;
+	sf.mid = stored->msg.mid;
+	sf.topic = stored->msg.topic;
+	sf.topic_len = strlen(stored->msg.topic);
+	sf.flags = (stored->msg.qos & DB_STORE_QOS_MASK) | (stored->msg.retain ? DB_STORE_RETAIN : 0);
+	sf.payloadlen = stored->msg.payloadlen;
+	sf.data = stored->msg.payload;
+	sf.datalen = stored->msg.payloadlen;
+	sf.expiry = stored->expiry_time;
+
+	return _db_store_packed_chunk_write(db_fptr, &sf);
+}
 
-static int mqtt3_db_message_store_write(mosquitto_db *db, FILE *db_fptr)
+static int _db_client_msg_packed_chunk_write(FILE *db_fptr, struct _db_msg_fields *mf)
 {
-	uint32_t length;
-	dbid_t i64temp;
+	uint8_t buf[3*DB_VARINT_MAX + 2];
 	uint32_t i32temp;
-	uint16_t i16temp, slen;
-	uint8_t i8temp;
-	struct mosquitto_msg_store *stored;
-
-	assert(db);
-	assert(db_fptr);
-
-	stored = db->msg_store;
-	while(stored){
-		length = htonl(sizeof(dbid_t) + 2+strlen(stored->source_id) +
-				sizeof(uint16_t) + sizeof(uint16_t) +
-				2+strlen(stored->msg.topic) + sizeof(uint32_t) +
-				stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t));
-
-		i16temp = htons(DB_CHUNK_MSG_STORE);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
-
-		i64temp = stored->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
-
-		slen = strlen(stored->source_id);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		if(slen){
-			write_e(db_fptr, stored->source_id, slen);
-		}
-
-		i16temp = htons(stored->source_mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	uint16_t i16temp;
+	int len = 0;
+
+	len += _db_varint_put(&buf[len], mf->store_id);
+	len += _db_varint_put(&buf[len], mf->mid);
+	buf[len++] = (mf->qos & DB_MSG_QOS_MASK)
+			| (mf->retain ? DB_MSG_RETAIN : 0)
+			| (mf->direction == mosq_md_out ? DB_MSG_DIRECTION : 0)
+			| (mf->dup ? DB_MSG_DUP : 0);
+	buf[len++] = mf->state;
+	len += _db_varint_put(&buf[len], mf->expiry > 0 ? (uint64_t)mf->expiry : 0);
+
+	i16temp = htons(DB_CHUNK_CLIENT_MSG_PACKED);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(len);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	write_e(db_fptr, buf, len);
 
-		i16temp = htons(stored->msg.mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
 
-		slen = strlen(stored->msg.topic);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, stored->msg.topic, slen);
+static int _db_client_msg_packed_write(FILE *db_fptr, mosquitto_client_msg *cmsg)
+{
+	struct _db_msg_fields mf;
+
+	mf.store_id = cmsg->store->db_id;
+	mf.expiry = cmsg->expiry_time;
+	mf.mid = cmsg->mid;
+	mf.qos = cmsg->qos;
+	mf.retain = cmsg->retain;
+	mf.direction = cmsg->direction;
+	mf.state = cmsg->state;
+	mf.dup = cmsg->dup;
+
+	return _db_client_msg_packed_chunk_write(db_fptr, &mf);
+}
 
-		i8temp = (uint8_t )stored->msg.qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+static int _db_client_packed_chunk_write(FILE *db_fptr, struct mosquitto *context)
+{
+	uint8_t buf[2*DB_VARINT_MAX];
+	uint32_t id_ref, i32temp;
+	uint16_t i16temp;
+	int len = 0;
 
-		i8temp = (uint8_t )stored->msg.retain;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	if(_db_string_ref(db_fptr, context->id, strlen(context->id), true, &id_ref)) return 1;
 
-		i32temp = htonl(stored->msg.payloadlen);
-		write_e(db_fptr, &i32temp, sizeof(uint32_t));
-		if(stored->msg.payloadlen){
-			write_e(db_fptr, stored->msg.payload, stored->msg.payloadlen);
-		}
+	len += _db_varint_put(&buf[len], id_ref);
+	len += _db_varint_put(&buf[len], context->last_mid);
 
-		stored = stored->next;
-	}
+	i16temp = htons(DB_CHUNK_CLIENT_PACKED);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(len);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	write_e(db_fptr, buf, len);
 
 	return MOSQ_ERR_SUCCESS;
 error:
@@ -212,35 +483,24 @@ error:
 	return 1;
 }
 
-static int mqtt3_db_client_write(mosquitto_db *db, FILE *db_fptr)
+static int _db_sub_packed_chunk_write(FILE *db_fptr, const char *client_id, uint32_t topic_ref, uint8_t qos)
 {
-	int i;
-	struct mosquitto *context;
-	uint16_t i16temp, slen;
-	uint32_t length;
-
-	assert(db);
-	assert(db_fptr);
-
-	for(i=0; i<db->context_count; i++){
-		context = db->contexts[i];
-		if(context && context->clean_session == false){
-			length = htonl(2+strlen(context->id) + sizeof(uint16_t));
+	uint8_t buf[2*DB_VARINT_MAX + 1];
+	uint32_t id_ref, i32temp;
+	uint16_t i16temp;
+	int len = 0;
 
-			i16temp = htons(DB_CHUNK_CLIENT);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
+	if(_db_string_ref(db_fptr, client_id, strlen(client_id), true, &id_ref)) return 1;
 
-			slen = strlen(context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, context->id, slen);
-			i16temp = htons(context->last_mid);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	len += _db_varint_put(&buf[len], id_ref);
+	len += _db_varint_put(&buf[len], topic_ref);
+	buf[len++] = qos;
 
-			if(mqtt3_db_client_messages_write(db, db_fptr, context)) return 1;
-		}
-	}
+	i16temp = htons(DB_CHUNK_SUB_PACKED);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(len);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	write_e(db_fptr, buf, len);
 
 	return MOSQ_ERR_SUCCESS;
 error:
@@ -248,543 +508,3303 @@ error:
 	return 1;
 }
 
-static int _db_subs_retain_write(mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
+static int _db_client_msg_chunk_write(FILE *db_fptr, struct mosquitto *context, mosquitto_client_msg *cmsg)
 {
-	struct _mosquitto_subhier *subhier;
-	struct _mosquitto_subleaf *sub;
-	char *thistopic;
 	uint32_t length;
-	uint16_t i16temp;
 	dbid_t i64temp;
-	int slen;
+	int64_t expiry;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
 
-	slen = strlen(topic) + strlen(node->topic) + 2;
-	thistopic = _mosquitto_malloc(sizeof(char)*slen);
-	if(!thistopic) return MOSQ_ERR_NOMEM;
-	if(strlen(topic)){
-		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
-	}else{
-		snprintf(thistopic, slen, "%s", node->topic);
-	}
+	slen = strlen(context->id);
 
-	sub = node->subs;
-	while(sub){
-		if(sub->context->clean_session == false){
-			length = htonl(2+strlen(sub->context->id) + 2+strlen(thistopic) + sizeof(uint8_t));
+	length = htonl(sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
+			sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
+			sizeof(uint8_t) + 2+slen + sizeof(int64_t));
 
-			i16temp = htons(DB_CHUNK_SUB);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
+	i16temp = htons(DB_CHUNK_CLIENT_MSG);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
 
-			slen = strlen(sub->context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, sub->context->id, slen);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, context->id, slen);
 
-			slen = strlen(thistopic);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, thistopic, slen);
+	i64temp = cmsg->store->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
 
-			write_e(db_fptr, &sub->qos, sizeof(uint8_t));
-		}
-		sub = sub->next;
-	}
-	if(node->retained){
-		length = htonl(sizeof(dbid_t));
+	i16temp = htons(cmsg->mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
 
-		i16temp = htons(DB_CHUNK_RETAIN);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
+	i8temp = (uint8_t )cmsg->qos;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
 
-		i64temp = node->retained->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
-	}
+	i8temp = (uint8_t )cmsg->retain;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->direction;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->state;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->dup;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	expiry = (int64_t)cmsg->expiry_time;
+	write_e(db_fptr, &expiry, sizeof(int64_t));
 
-	subhier = node->children;
-	while(subhier){
-		_db_subs_retain_write(db, db_fptr, subhier, thistopic);
-		subhier = subhier->next;
-	}
-	_mosquitto_free(thistopic);
 	return MOSQ_ERR_SUCCESS;
 error:
 	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
 	return 1;
 }
 
-static int mqtt3_db_subs_retain_write(mosquitto_db *db, FILE *db_fptr)
+/* Write the messages of context, which must follow its client chunk if packed
+ * is true. */
+static int mqtt3_db_client_messages_write(mosquitto_db *db, FILE *db_fptr, struct mosquitto *context, bool packed)
 {
-	struct _mosquitto_subhier *subhier;
+	mosquitto_client_msg *cmsg;
 
-	subhier = db->subs.children;
-	while(subhier){
-		_db_subs_retain_write(db, db_fptr, subhier, "");
-		subhier = subhier->next;
+	assert(db);
+	assert(db_fptr);
+	assert(context);
+
+	/* Messages still on disk are older than any in memory. */
+	if(_db_lazy_messages_write(db_fptr, context, packed)) return 1;
+	if(_db_spill_chunks_write(db_fptr, context, DB_CHUNK_CLIENT_MSG)) return 1;
+	cmsg = context->msgs;
+	while(cmsg){
+		if(packed){
+			if(_db_client_msg_packed_write(db_fptr, cmsg)) return 1;
+		}else{
+			if(_db_client_msg_chunk_write(db_fptr, context, cmsg)) return 1;
+		}
+		cmsg = cmsg->next;
 	}
-	
+
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt3_db_backup(mosquitto_db *db, bool cleanup, bool shutdown)
+static int _db_msg_store_chunk_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
 {
-	int rc = 0;
-	FILE *db_fptr = NULL;
-	uint32_t db_version = htonl(MOSQ_DB_VERSION);
-	uint32_t crc = htonl(0);
+	uint32_t length;
 	dbid_t i64temp;
+	int64_t expiry;
 	uint32_t i32temp;
-	uint16_t i16temp;
+	uint16_t i16temp, slen;
 	uint8_t i8temp;
 
-	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
-	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-	if(cleanup){
-		mqtt3_db_store_clean(db);
-	}
+	length = htonl(sizeof(dbid_t) + 2+strlen(stored->source_id) +
+			sizeof(uint16_t) + sizeof(uint16_t) +
+			2+strlen(stored->msg.topic) + sizeof(uint32_t) +
+			stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t) +
+			sizeof(int64_t));
 
-	db_fptr = fopen(db->config->persistence_filepath, "wb");
-	if(db_fptr == NULL){
-		goto error;
+	i16temp = htons(DB_CHUNK_MSG_STORE);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	slen = strlen(stored->source_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	if(slen){
+		write_e(db_fptr, stored->source_id, slen);
 	}
 
-	/* Header */
-	write_e(db_fptr, magic, 15);
-	write_e(db_fptr, &crc, sizeof(uint32_t));
-	write_e(db_fptr, &db_version, sizeof(uint32_t));
+	i16temp = htons(stored->source_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
 
-	/* DB config */
-	i16temp = htons(DB_CHUNK_CFG);
+	i16temp = htons(stored->msg.mid);
 	write_e(db_fptr, &i16temp, sizeof(uint16_t));
-	/* chunk length */
-	i32temp = htonl(sizeof(dbid_t) + sizeof(uint8_t) + sizeof(uint8_t));
-	write_e(db_fptr, &i32temp, sizeof(uint32_t));
-	/* db written at broker shutdown or not */
-	i8temp = shutdown;
+
+	slen = strlen(stored->msg.topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, stored->msg.topic, slen);
+
+	i8temp = (uint8_t )stored->msg.qos;
 	write_e(db_fptr, &i8temp, sizeof(uint8_t));
-	i8temp = sizeof(dbid_t);
+
+	i8temp = (uint8_t )stored->msg.retain;
 	write_e(db_fptr, &i8temp, sizeof(uint8_t));
-	/* last db mid */
-	i64temp = db->last_db_id;
-	write_e(db_fptr, &i64temp, sizeof(dbid_t));
 
-	if(mqtt3_db_message_store_write(db, db_fptr)){
-		goto error;
+	i32temp = htonl(stored->msg.payloadlen);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	if(stored->msg.payloadlen){
+		write_e(db_fptr, stored->msg.payload, stored->msg.payloadlen);
 	}
 
-	mqtt3_db_client_write(db, db_fptr);
-	mqtt3_db_subs_retain_write(db, db_fptr);
+	expiry = (int64_t)stored->expiry_time;
+	write_e(db_fptr, &expiry, sizeof(int64_t));
 
-	fclose(db_fptr);
-	return rc;
+	return MOSQ_ERR_SUCCESS;
 error:
 	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(db_fptr) fclose(db_fptr);
 	return 1;
 }
 
-static int _db_client_msg_restore(mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+static int mqtt3_db_message_store_write(mosquitto_db *db, FILE *db_fptr)
 {
-	mosquitto_client_msg *cmsg, *tail;
-	struct mosquitto_msg_store *store;
-	struct mosquitto *context;
+	struct mosquitto_msg_store *stored;
 
-	cmsg = _mosquitto_calloc(1, sizeof(mosquitto_client_msg));
-	if(!cmsg){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	assert(db);
+	assert(db_fptr);
+
+	stored = db->msg_store;
+	while(stored){
+		if(_db_msg_store_packed_write(db_fptr, stored)) return 1;
+		stored = stored->next;
+	}
+
+	return _db_lazy_stores_write(db_fptr);
+}
+
+static int _db_client_chunk_write(FILE *db_fptr, struct mosquitto *context)
+{
+	uint16_t i16temp, slen;
+	uint32_t length;
+
+	length = htonl(2+strlen(context->id) + sizeof(uint16_t));
+
+	i16temp = htons(DB_CHUNK_CLIENT);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	slen = strlen(context->id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, context->id, slen);
+	i16temp = htons(context->last_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int mqtt3_db_client_write(mosquitto_db *db, FILE *db_fptr)
+{
+	int i;
+	struct mosquitto *context;
+
+	assert(db);
+	assert(db_fptr);
+
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(context && context->clean_session == false){
+			/* Spilled messages carry their own stored messages. */
+			if(_db_spill_chunks_write(db_fptr, context, DB_CHUNK_MSG_STORE)) return 1;
+			if(_db_client_packed_chunk_write(db_fptr, context)) return 1;
+			if(mqtt3_db_client_messages_write(db, db_fptr, context, true)) return 1;
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_sub_chunk_write(FILE *db_fptr, const char *client_id, const char *topic, uint8_t qos)
+{
+	uint32_t length;
+	uint16_t i16temp;
+	int slen;
+
+	length = htonl(2+strlen(client_id) + 2+strlen(topic) + sizeof(uint8_t));
+
+	i16temp = htons(DB_CHUNK_SUB);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	slen = strlen(client_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, client_id, slen);
+
+	slen = strlen(topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, topic, slen);
+
+	write_e(db_fptr, &qos, sizeof(uint8_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_retain_chunk_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
+{
+	uint32_t length;
+	uint16_t i16temp;
+	dbid_t i64temp;
+
+	length = htonl(sizeof(dbid_t));
+
+	i16temp = htons(DB_CHUNK_RETAIN);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+/* Write the subscriptions and retained messages below node. For a delta, only
+ * the subscriptions of sessions that have changed are written. The top level
+ * of a mount tree is joined straight on to its mount_point, which is the
+ * first prefix_len characters of topic. */
+static int _db_subs_retain_write(mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic, int prefix_len, bool delta)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subleaf *sub;
+	char *thistopic;
+	int slen;
+	uint32_t topic_ref;
+	bool have_ref = false;
+
+	slen = strlen(topic) + strlen(node->topic) + 2;
+	thistopic = _mosquitto_malloc(sizeof(char)*slen);
+	if(!thistopic) return MOSQ_ERR_NOMEM;
+	if(strlen(topic) > prefix_len){
+		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
+	}else{
+		snprintf(thistopic, slen, "%s%s", topic, node->topic);
+	}
+
+	sub = node->subs;
+	while(sub){
+		if(sub->context->clean_session == false){
+			if(!delta){
+				if(!have_ref){
+					/* thistopic is about to be freed, so mustn't be kept. */
+					if(_db_string_ref(db_fptr, thistopic, strlen(thistopic), false, &topic_ref)) goto error;
+					have_ref = true;
+				}
+				if(_db_sub_packed_chunk_write(db_fptr, sub->context->id, topic_ref, sub->qos)) goto error;
+			}else if(sub->context->db_dirty){
+				if(_db_sub_chunk_write(db_fptr, sub->context->id, thistopic, sub->qos)) goto error;
+			}
+		}
+		sub = sub->next;
+	}
+	if(node->retained && !delta){
+		if(_db_retain_chunk_write(db_fptr, node->retained)) goto error;
+	}
+
+	subhier = node->children;
+	while(subhier){
+		if(_db_subs_retain_write(db, db_fptr, subhier, thistopic, prefix_len, delta)) goto error;
+		subhier = subhier->next;
+	}
+	_mosquitto_free(thistopic);
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_free(thistopic);
+	return 1;
+}
+
+static int mqtt3_db_subs_retain_write(mosquitto_db *db, FILE *db_fptr, bool delta)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_mount *mount;
+
+	subhier = db->subs.children;
+	while(subhier){
+		if(_db_subs_retain_write(db, db_fptr, subhier, "", 0, delta)) return 1;
+		subhier = subhier->next;
+	}
+	for(mount=db->mounts; mount; mount=mount->next){
+		for(subhier=mount->subs.children; subhier; subhier=subhier->next){
+			if(_db_subs_retain_write(db, db_fptr, subhier, mount->mount_point, mount->len, delta)) return 1;
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_checkpoint_chunk_write(FILE *db_fptr, uint32_t id)
+{
+	uint32_t i32temp;
+	uint16_t i16temp;
+
+	i16temp = htons(DB_CHUNK_CHECKPOINT);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(sizeof(uint32_t));
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(id);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _db_delta_chunk_write(FILE *db_fptr, uint32_t id, uint32_t length)
+{
+	uint32_t i32temp;
+	uint16_t i16temp;
+
+	i16temp = htons(DB_CHUNK_DELTA);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(2*sizeof(uint32_t));
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(id);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(length);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+/* A stored message that a delta refers to must be in the delta unless an
+ * earlier save already has it. */
+static int _db_delta_store_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
+{
+	if(stored->db_saved) return MOSQ_ERR_SUCCESS;
+	if(db_fptr && _db_msg_store_chunk_write(db_fptr, stored)) return 1;
+	stored->db_saved = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Write everything that has changed since the last save: deleted sessions,
+ * then the whole of each changed session, then changed retained messages.
+ * Restoring a session starts by deleting what an earlier save had for it. If
+ * db_fptr is NULL nothing is written, but everything is marked as saved just as
+ * it would be if it had been. */
+static int _db_delta_changes_write(mosquitto_db *db, FILE *db_fptr)
+{
+	struct _db_client_deleted *deleted;
+	struct _db_retain_change *change;
+	struct mosquitto *context;
+	mosquitto_client_msg *msg;
+	int i;
+
+	for(deleted=db_clients_deleted; deleted; deleted=deleted->next){
+		if(db_fptr && _db_client_delete_chunk_write(db_fptr, deleted->id, 1)) return 1;
+	}
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || !context->db_dirty || context->clean_session) continue;
+
+		for(msg=context->msgs; msg; msg=msg->next){
+			if(_db_delta_store_write(db_fptr, msg->store)) return 1;
+		}
+		if(db_fptr){
+			if(_db_spill_chunks_write(db_fptr, context, DB_CHUNK_MSG_STORE)) return 1;
+			if(_db_client_delete_chunk_write(db_fptr, context->id, 1)) return 1;
+			if(_db_client_chunk_write(db_fptr, context)) return 1;
+			if(mqtt3_db_client_messages_write(db, db_fptr, context, false)) return 1;
+		}
+	}
+	if(db_fptr && mqtt3_db_subs_retain_write(db, db_fptr, true)) return 1;
+	for(change=db_retain_changes; change; change=change->next){
+		if(_db_delta_store_write(db_fptr, change->stored)) return 1;
+		if(db_fptr && _db_retain_chunk_write(db_fptr, change->stored)) return 1;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Forget about everything that has changed, because it has just been saved. */
+static void _db_changes_reset(mosquitto_db *db)
+{
+	struct _db_client_deleted *deleted;
+	struct _db_retain_change *change;
+	int i;
+
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i]){
+			db->contexts[i]->db_dirty = false;
+		}
+	}
+	while(db_clients_deleted){
+		deleted = db_clients_deleted->next;
+		_mosquitto_free(db_clients_deleted->id);
+		_mosquitto_free(db_clients_deleted);
+		db_clients_deleted = deleted;
+	}
+	while(db_retain_changes){
+		change = db_retain_changes->next;
+		db_retain_changes->stored->ref_count--;
+		_mosquitto_free(db_retain_changes);
+		db_retain_changes = change;
+	}
+	db_retain_changes_last = NULL;
+	db_delta_list_count = 0;
+	db_changes = 0;
+}
+
+/* What a save is to write. */
+struct _db_backup_job{
+	const char *filepath;
+	char *tmp_filepath;
+	char *delta_filepath;
+	bool full;
+	bool shutdown;
+	uint32_t base_id;
+	uint32_t checkpoint;
+};
+
+/* Write the whole database to a temporary file and then move it over
+ * filepath, so that a save that fails part way through never replaces a good
+ * file. The writes go through a large buffer rather than one system call per
+ * field. Any delta file belongs to the old database, so it is removed. If
+ * checkpoint is not 0 it is recorded in the file, to show which part of the
+ * write ahead log the file already includes. Returns 0 on success or an errno
+ * value on failure. */
+static int _db_backup_write(mosquitto_db *db, struct _db_backup_job *job, uint64_t *bytes)
+{
+	FILE *db_fptr = NULL;
+	uint32_t db_version = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = htonl(0);
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	uint8_t i8temp;
+	int err;
+
+	db_fptr = fopen(job->tmp_filepath, "wb");
+	if(db_fptr == NULL){
+		goto error;
+	}
+	setvbuf(db_fptr, NULL, _IOFBF, DB_BACKUP_BUFFER_SIZE);
+	_db_dict_free();
+#ifdef WITH_ZLIB
+	db_compress_size = db->config->persistence_compress_size;
+#endif
+
+	/* Header */
+	write_e(db_fptr, magic, 15);
+	write_e(db_fptr, &crc, sizeof(uint32_t));
+	write_e(db_fptr, &db_version, sizeof(uint32_t));
+
+	/* DB config */
+	i16temp = htons(DB_CHUNK_CFG);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	/* chunk length */
+	i32temp = htonl(sizeof(dbid_t) + sizeof(uint8_t) + sizeof(uint8_t));
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	/* db written at broker shutdown or not */
+	i8temp = job->shutdown;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i8temp = sizeof(dbid_t);
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	/* last db mid */
+	i64temp = db->last_db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	if(_db_delta_chunk_write(db_fptr, job->base_id, 0)){
+		goto error;
+	}
+	if(job->checkpoint && _db_checkpoint_chunk_write(db_fptr, job->checkpoint)){
+		goto error;
+	}
+
+	if(mqtt3_db_message_store_write(db, db_fptr)){
+		goto error;
+	}
+
+	if(mqtt3_db_client_write(db, db_fptr)){
+		goto error;
+	}
+	if(mqtt3_db_subs_retain_write(db, db_fptr, false)){
+		goto error;
+	}
+	_db_dict_free();
+
+	/* The file must be on disk before it replaces the old one. */
+	if(fflush(db_fptr) || _db_fsync(db_fptr)){
+		goto error;
+	}
+	*bytes = ftell(db_fptr);
+	if(fclose(db_fptr)){
+		db_fptr = NULL;
+		goto error;
+	}
+	db_fptr = NULL;
+#ifdef WIN32
+	/* rename() won't replace an existing file on Windows. */
+	remove(job->filepath);
+#endif
+	if(rename(job->tmp_filepath, job->filepath)){
+		goto error;
+	}
+	remove(job->delta_filepath);
+	return 0;
+error:
+	err = errno ? errno : EIO;
+	_db_dict_free();
+	if(db_fptr) fclose(db_fptr);
+	remove(job->tmp_filepath);
+	return err;
+}
+
+/* Append the changes since the last save to the delta file. The length in the
+ * delta chunk is only filled in once the changes are on disk, so a delta that
+ * was only partly written is recognised and ignored when restoring. Returns 0
+ * on success or an errno value on failure. */
+static int _db_delta_write(mosquitto_db *db, struct _db_backup_job *job, uint64_t *bytes)
+{
+	FILE *db_fptr = NULL;
+	uint32_t db_version = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = htonl(0);
+	uint32_t i32temp;
+	long start, end;
+	int err;
+
+	db_fptr = fopen(job->delta_filepath, "r+b");
+	if(db_fptr == NULL){
+		db_fptr = fopen(job->delta_filepath, "w+b");
+	}
+	if(db_fptr == NULL){
+		goto error;
+	}
+	setvbuf(db_fptr, NULL, _IOFBF, DB_BACKUP_BUFFER_SIZE);
+	if(fseek(db_fptr, 0, SEEK_END)) goto error;
+	if(ftell(db_fptr) == 0){
+		write_e(db_fptr, magic, 15);
+		write_e(db_fptr, &crc, sizeof(uint32_t));
+		write_e(db_fptr, &db_version, sizeof(uint32_t));
+	}
+
+	start = ftell(db_fptr);
+	if(_db_delta_chunk_write(db_fptr, job->base_id, 0)){
+		goto error;
+	}
+	if(job->checkpoint && _db_checkpoint_chunk_write(db_fptr, job->checkpoint)){
+		goto error;
+	}
+	if(_db_delta_changes_write(db, db_fptr)){
+		goto error;
+	}
+	if(fflush(db_fptr) || _db_fsync(db_fptr)){
+		goto error;
+	}
+
+	end = ftell(db_fptr);
+	/* Skip the chunk header and id to get to the length. */
+	if(fseek(db_fptr, start + 2+4+4, SEEK_SET)) goto error;
+	i32temp = htonl(end - start - (2+4+8));
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	if(fflush(db_fptr) || _db_fsync(db_fptr)){
+		goto error;
+	}
+	*bytes = end - start;
+	if(fclose(db_fptr)){
+		db_fptr = NULL;
+		goto error;
+	}
+	return 0;
+error:
+	err = errno ? errno : EIO;
+	if(db_fptr) fclose(db_fptr);
+	return err;
+}
+
+/* Record the result of a save that took duration milliseconds. */
+static int _db_backup_done(mosquitto_db *db, int err, unsigned long duration, unsigned long long bytes)
+{
+	if(err){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to save in-memory database to %s: %s.", db->config->persistence_filepath, strerror(err));
+		/* Whatever the save would have held now has to go in a full save. */
+		db_full_needed = true;
+		return 1;
+	}
+
+	if(backup_full){
+		db_full_needed = false;
+		db_delta_count = 0;
+	}else{
+		db_delta_count++;
+	}
+	backup_count++;
+	backup_duration = duration;
+	backup_bytes = bytes;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Saved %s to %s (%llu bytes in %lu ms).",
+			backup_full?"in-memory database":"changes", db->config->persistence_filepath, backup_bytes, backup_duration);
+
+	if(wal_fptr){
+		_wal_checkpoint_end();
+	}else if(wal_filepath){
+		/* The log was disabled after an error, so what it holds is out of
+		 * date and must not be replayed on top of this save. */
+		remove(wal_filepath);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Check whether a save running in the background has finished, waiting for it
+ * if wait is true. */
+void mqtt3_db_backup_check(mosquitto_db *db, bool wait)
+{
+#ifndef WIN32
+	pid_t pid;
+	int status;
+	int err;
+	uint64_t report[2];
+
+	if(!backup_pid) return;
+
+	pid = waitpid(backup_pid, &status, wait?0:WNOHANG);
+	if(pid == 0) return;
+
+	backup_pid = 0;
+	_db_spill_removals_run();
+	if(pid < 0){
+		err = errno;
+	}else if(WIFEXITED(status)){
+		err = WEXITSTATUS(status);
+	}else{
+		err = EINTR;
+	}
+	/* Only the child knows when it actually finished. */
+	if(read(backup_pipe, report, sizeof(report)) != sizeof(report)){
+		report[0] = _mosquitto_time_ms() - backup_start;
+		report[1] = 0;
+	}
+	close(backup_pipe);
+	backup_pipe = -1;
+	_db_backup_done(db, err, (unsigned long)report[0], (unsigned long long)report[1]);
+#endif
+}
+
+void mqtt3_db_backup_stats(unsigned long *count, unsigned long *duration, unsigned long long *bytes)
+{
+	*count = backup_count;
+	*duration = backup_duration;
+	*bytes = backup_bytes;
+}
+
+unsigned long mqtt3_db_changes(void)
+{
+	return db_changes;
+}
+
+/* Should this save write everything, rather than a delta? */
+static bool _db_backup_full_wanted(mosquitto_db *db, bool shutdown)
+{
+	struct stat base_st, delta_st;
+	char *delta_filepath;
+	int len;
+	bool full = false;
+
+	if(!db->config->autosave_delta_count){
+		db_delta_tracking = false;
+		return true;
+	}
+	if(!db_delta_tracking){
+		/* Changes haven't been tracked up to now. */
+		db_delta_tracking = true;
+		return true;
+	}
+	if(shutdown || db_full_needed || db_delta_count >= db->config->autosave_delta_count){
+		return true;
+	}
+
+	/* Once the deltas are bigger than the database they replace, it is time
+	 * to combine them. */
+	len = strlen(db->config->persistence_filepath) + strlen(".delta") + 1;
+	delta_filepath = _mosquitto_malloc(len);
+	if(!delta_filepath) return true;
+	snprintf(delta_filepath, len, "%s.delta", db->config->persistence_filepath);
+	if(!stat(db->config->persistence_filepath, &base_st) && !stat(delta_filepath, &delta_st)){
+		full = delta_st.st_size > base_st.st_size;
+	}
+	_mosquitto_free(delta_filepath);
+
+	return full;
+}
+
+/* Everything a save is about to write is now as good as saved. */
+static void _db_backup_mark(mosquitto_db *db, bool full)
+{
+	struct mosquitto_msg_store *stored;
+
+	if(full){
+		for(stored=db->msg_store; stored; stored=stored->next){
+			stored->db_saved = true;
+		}
+	}else{
+		_db_delta_changes_write(db, NULL);
+		if(wal_fptr){
+			/* Messages in the part of the log that is about to be dropped
+			 * must be logged again if they aren't in the delta. */
+			for(stored=db->msg_store; stored; stored=stored->next){
+				stored->wal_logged = stored->db_saved;
+			}
+		}
+	}
+	_db_changes_reset(db);
+}
+
+static int _db_backup_run(mosquitto_db *db, struct _db_backup_job *job, uint64_t *bytes)
+{
+	if(job->full){
+		return _db_backup_write(db, job, bytes);
+	}else{
+		return _db_delta_write(db, job, bytes);
+	}
+}
+
+/* Save the database, or if autosave_delta_count allows it just what has
+ * changed since the last save. Unless the broker is shutting down this is done
+ * by a child process working from a copy on write snapshot of the broker's
+ * memory, so that the broker can carry on serving clients while a large
+ * database is written. mqtt3_db_backup_check() picks up the result. */
+int mqtt3_db_backup(mosquitto_db *db, bool cleanup, bool shutdown)
+{
+	struct _db_backup_job job;
+	uint64_t start;
+	uint64_t report[2];
+	int len;
+	int err;
+#ifndef WIN32
+	pid_t pid;
+	int fds[2];
+#endif
+
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+#ifndef WIN32
+	if(backup_pid){
+		if(!shutdown){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Not saving in-memory database, a save is already in progress.");
+			return MOSQ_ERR_SUCCESS;
+		}
+		mqtt3_db_backup_check(db, true);
+	}
+#endif
+	memset(&job, 0, sizeof(struct _db_backup_job));
+	job.filepath = db->config->persistence_filepath;
+	job.shutdown = shutdown;
+	job.full = _db_backup_full_wanted(db, shutdown);
+	if(!job.full && !db_changes){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Not saving in-memory database, nothing has changed.");
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(job.full){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", job.filepath);
+	}else{
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving changes to in-memory database to %s.", job.filepath);
+	}
+	if(cleanup){
+		mqtt3_db_store_clean(db);
+	}
+
+	len = strlen(job.filepath) + strlen(".delta") + 1;
+	job.tmp_filepath = _mosquitto_malloc(len);
+	job.delta_filepath = _mosquitto_malloc(len);
+	if(!job.tmp_filepath || !job.delta_filepath){
+		if(job.tmp_filepath) _mosquitto_free(job.tmp_filepath);
+		if(job.delta_filepath) _mosquitto_free(job.delta_filepath);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	snprintf(job.tmp_filepath, len, "%s.new", job.filepath);
+	snprintf(job.delta_filepath, len, "%s.delta", job.filepath);
+
+	if(job.full){
+		db_base_id++;
+	}
+	job.base_id = db_base_id;
+	if(wal_fptr){
+		_wal_checkpoint_begin(&job.checkpoint);
+	}
+	backup_full = job.full;
+
+	start = _mosquitto_time_ms();
+#ifndef WIN32
+	if(!shutdown){
+		if(!pipe(fds)){
+			pid = fork();
+			if(pid == 0){
+				close(fds[0]);
+				err = _db_backup_run(db, &job, &report[1]);
+				report[0] = _mosquitto_time_ms() - start;
+				if(write(fds[1], report, sizeof(report)) != sizeof(report)){
+					/* The broker will use its own estimate. */
+				}
+				_exit(err);
+			}else if(pid > 0){
+				close(fds[1]);
+				_mosquitto_free(job.tmp_filepath);
+				_mosquitto_free(job.delta_filepath);
+				backup_pid = pid;
+				backup_start = start;
+				backup_pipe = fds[0];
+				_db_backup_mark(db, job.full);
+				return MOSQ_ERR_SUCCESS;
+			}
+			close(fds[0]);
+			close(fds[1]);
+		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to save in-memory database in the background: %s.", strerror(errno));
+	}
+#endif
+	report[1] = 0;
+	err = _db_backup_run(db, &job, &report[1]);
+	_mosquitto_free(job.tmp_filepath);
+	_mosquitto_free(job.delta_filepath);
+	_db_backup_mark(db, job.full);
+	return _db_backup_done(db, err, (unsigned long)(_mosquitto_time_ms() - start), (unsigned long long)report[1]);
+}
+
+/* Restore.
+ *
+ * Each file is mapped into memory and restored in a single pass over its
+ * chunks. Strings are copied out to two buffers that are reused for every
+ * chunk, and payloads are copied straight from the mapping into the message
+ * store. Stored messages are found by id and sessions by client id through
+ * hash indexes that only exist while restoring; they are built from the
+ * lists the first time they are needed and thrown away afterwards. The
+ * subscriptions in the database file come grouped by topic, so they are
+ * appended to the tree without searching it for each one.
+ */
+#define DB_STR_ID 0
+#define DB_STR_TOPIC 1
+
+/* A string from a string chunk. */
+struct _db_string{
+	const char *str;
+	uint16_t len;
+};
+
+struct _db_reader{
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	bool mapped;
+	char *str[2];
+	/* The string chunks seen so far, pointing into data. */
+	struct _db_string *strings;
+	uint32_t string_count;
+	uint32_t string_size;
+	/* For uncompressing payloads. */
+	uint8_t *buf;
+	uint32_t buf_len;
+};
+
+/* Store ids, open addressed. */
+static struct mosquitto_msg_store **db_store_index = NULL;
+static unsigned int db_store_index_size = 0;
+/* Client ids, open addressed. Each entry is a db->contexts slot plus one, so
+ * that 0 is free. The slot may since have been emptied or reused by another
+ * client, so the id is always checked. */
+static int *db_context_index = NULL;
+static unsigned int db_context_index_size = 0;
+static unsigned int db_context_index_count = 0;
+/* There are no free slots in db->contexts below this. */
+static int db_context_free = 0;
+static struct _mosquitto_sub_bulk db_sub_bulk = {NULL, NULL, NULL, NULL};
+/* For the report at the end of the restore. */
+static unsigned long db_restore_stores = 0;
+static unsigned long db_restore_msgs = 0;
+static unsigned long db_restore_subs = 0;
+static unsigned long long db_restore_bytes = 0;
+/* Only true while restoring, when the indexes above can be used. */
+static bool db_restoring = false;
+
+/* Lazy restore.
+ *
+ * With persistence_lazy_restore, the queued messages of each client in the
+ * database file are left where they are until the client reconnects. The
+ * file stays mapped, each client records where its run of messages is, and
+ * each stored message in the file is indexed by id with its offset and the
+ * number of messages still on disk that refer to it. A stored message is only
+ * read from the file when a message that refers to it is restored, and is
+ * then held in memory until the last such message has been restored. Saves
+ * copy what is still on disk straight from the mapping.
+ */
+struct _db_lazy_store{
+	dbid_t db_id;
+	size_t pos;
+	uint32_t refs;
+	struct mosquitto_msg_store *stored;
+};
+
+static bool db_lazy = false;
+static struct _db_reader db_lazy_reader;
+/* Store ids, open addressed. A db_id of 0 is free. */
+static struct _db_lazy_store *db_lazy_stores = NULL;
+static unsigned int db_lazy_stores_size = 0;
+static unsigned int db_lazy_stores_count = 0;
+static unsigned long db_lazy_sessions = 0;
+static unsigned long db_lazy_msgs = 0;
+
+#define map_read_e(r, b, c) if(_db_read(r, b, c)){ goto error; }
+
+/* Returns -1 if filepath can't be opened, as when it doesn't exist. */
+static int _db_reader_open(struct _db_reader *r, const char *filepath)
+{
+	FILE *fptr;
+	struct stat st;
+	int i;
+
+	memset(r, 0, sizeof(struct _db_reader));
+	fptr = fopen(filepath, "rb");
+	if(!fptr) return -1;
+	if(fstat(fileno(fptr), &st)){
+		fclose(fptr);
+		return 1;
+	}
+	for(i=0; i<2; i++){
+		/* Big enough for any string, which has a 16 bit length. */
+		r->str[i] = _mosquitto_malloc(UINT16_MAX+1);
+		if(!r->str[i]){
+			fclose(fptr);
+			errno = ENOMEM;
+			return 1;
+		}
+	}
+	r->len = st.st_size;
+	if(r->len){
+#ifndef WIN32
+		r->data = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+		if(r->data == MAP_FAILED){
+			r->data = NULL;
+			fclose(fptr);
+			return 1;
+		}
+		r->mapped = true;
+		madvise((void *)r->data, r->len, MADV_SEQUENTIAL);
+#else
+		r->data = _mosquitto_malloc(r->len);
+		if(!r->data){
+			fclose(fptr);
+			errno = ENOMEM;
+			return 1;
+		}
+		if(fread((void *)r->data, 1, r->len, fptr) != r->len){
+			fclose(fptr);
+			return 1;
+		}
+#endif
+	}
+	fclose(fptr);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _db_reader_close(struct _db_reader *r)
+{
+	int i;
+
+	if(r->data){
+#ifndef WIN32
+		if(r->mapped){
+			munmap((void *)r->data, r->len);
+		}
+#else
+		_mosquitto_free((void *)r->data);
+#endif
+	}
+	for(i=0; i<2; i++){
+		if(r->str[i]) _mosquitto_free(r->str[i]);
+	}
+	if(r->strings) _mosquitto_free(r->strings);
+	if(r->buf) _mosquitto_free(r->buf);
+	memset(r, 0, sizeof(struct _db_reader));
+}
+
+static int _db_read(struct _db_reader *r, void *buf, size_t len)
+{
+	if(r->len - r->pos < len) return 1;
+	memcpy(buf, &r->data[r->pos], len);
+	r->pos += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static const uint8_t *_db_read_ptr(struct _db_reader *r, size_t len)
+{
+	const uint8_t *ptr;
+
+	if(r->len - r->pos < len) return NULL;
+	ptr = &r->data[r->pos];
+	r->pos += len;
+	return ptr;
+}
+
+/* Read a string with a 16 bit length into buffer which of r. */
+static int _db_read_string(struct _db_reader *r, int which, char **str, uint16_t *slen)
+{
+	uint16_t i16temp;
+
+	if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+	*slen = ntohs(i16temp);
+	if(_db_read(r, r->str[which], *slen)) return 1;
+	r->str[which][*slen] = '\0';
+	*str = r->str[which];
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_skip(struct _db_reader *r, size_t len)
+{
+	if(r->len - r->pos < len) return 1;
+	r->pos += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Read a varint that must be no more than max. */
+static int _db_read_varint(struct _db_reader *r, uint64_t max, uint64_t *value)
+{
+	uint8_t byte;
+	int shift = 0;
+
+	*value = 0;
+	do{
+		if(shift > 63 || r->pos >= r->len) return 1;
+		byte = r->data[r->pos++];
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	}while(byte & 0x80);
+
+	return *value > max;
+}
+
+/* Note the string chunk of the given length at the position of r. */
+static int _db_string_add(struct _db_reader *r, uint32_t length)
+{
+	struct _db_string *strings;
+	uint32_t size;
+
+	if(length > UINT16_MAX || length > r->len - r->pos) return 1;
+	if(r->string_count == r->string_size){
+		size = r->string_size ? r->string_size*2 : DB_INDEX_MIN_SIZE;
+		strings = _mosquitto_realloc(r->strings, size*sizeof(struct _db_string));
+		if(!strings) return 1;
+		r->strings = strings;
+		r->string_size = size;
+	}
+	r->strings[r->string_count].str = (const char *)&r->data[r->pos];
+	r->strings[r->string_count].len = length;
+	r->string_count++;
+	r->pos += length;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Read the number of a string and look it up, leaving it where it is. */
+static int _db_string_get(struct _db_reader *r, const char **str, uint16_t *slen)
+{
+	uint64_t id;
+
+	if(_db_read_varint(r, r->string_count, &id)) return 1;
+	if(id){
+		*str = r->strings[id-1].str;
+		*slen = r->strings[id-1].len;
+	}else{
+		*str = "";
+		*slen = 0;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Copy a string into buffer which of r. */
+static char *_db_string_copy(struct _db_reader *r, int which, const char *str, uint16_t slen)
+{
+	memcpy(r->str[which], str, slen);
+	r->str[which][slen] = '\0';
+	return r->str[which];
+}
+
+/* Like _db_read_string(), for a packed chunk. */
+static int _db_read_string_ref(struct _db_reader *r, int which, char **str, uint16_t *slen)
+{
+	const char *ref;
+
+	if(_db_string_get(r, &ref, slen)) return 1;
+	*str = _db_string_copy(r, which, ref, *slen);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Read a stored message chunk of either kind, with length bytes after its
+ * header, leaving its strings and payload where they are. */
+static int _db_store_fields_read(struct _db_reader *r, uint16_t chunk, uint32_t length, struct _db_store_fields *sf)
+{
+	uint64_t value;
+	uint32_t i32temp, used;
+	uint16_t i16temp;
+	uint8_t qos, retain;
+	size_t start = r->pos;
+
+	sf->expiry = 0;
+	if(chunk == DB_CHUNK_MSG_STORE_PACKED){
+		if(_db_read_varint(r, UINT64_MAX, &value)) return 1;
+		sf->db_id = value;
+		if(_db_string_get(r, &sf->source_id, &sf->source_len)) return 1;
+		if(_db_read_varint(r, UINT16_MAX, &value)) return 1;
+		sf->source_mid = value;
+		if(_db_read_varint(r, UINT16_MAX, &value)) return 1;
+		sf->mid = value;
+		if(_db_string_get(r, &sf->topic, &sf->topic_len)) return 1;
+		if(_db_read(r, &sf->flags, sizeof(uint8_t))) return 1;
+		if(_db_read_varint(r, UINT32_MAX, &value)) return 1;
+		sf->payloadlen = value;
+		if(sf->flags & DB_STORE_EXPIRY){
+			if(_db_read_varint(r, INT64_MAX, &value)) return 1;
+			sf->expiry = value;
+		}
+		if(r->pos - start > length) return 1;
+		sf->datalen = length - (r->pos - start);
+	}else{
+		if(_db_read(r, &sf->db_id, sizeof(dbid_t))) return 1;
+		if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+		sf->source_len = ntohs(i16temp);
+		sf->source_id = (const char *)_db_read_ptr(r, sf->source_len);
+		if(!sf->source_id) return 1;
+		if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+		sf->source_mid = ntohs(i16temp);
+		if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+		sf->mid = ntohs(i16temp);
+		if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+		sf->topic_len = ntohs(i16temp);
+		sf->topic = (const char *)_db_read_ptr(r, sf->topic_len);
+		if(!sf->topic) return 1;
+		if(_db_read(r, &qos, sizeof(uint8_t))) return 1;
+		if(_db_read(r, &retain, sizeof(uint8_t))) return 1;
+		sf->flags = (qos & DB_STORE_QOS_MASK) | (retain ? DB_STORE_RETAIN : 0);
+		if(_db_read(r, &i32temp, sizeof(uint32_t))) return 1;
+		sf->payloadlen = ntohl(i32temp);
+		sf->datalen = sf->payloadlen;
+	}
+	sf->data = _db_read_ptr(r, sf->datalen);
+	if(!sf->data) return 1;
+
+	if(chunk != DB_CHUNK_MSG_STORE_PACKED){
+		/* Older databases have no expiry time. */
+		used = r->pos - start;
+		if(length >= used + sizeof(int64_t)){
+			if(_db_read(r, &sf->expiry, sizeof(int64_t))) return 1;
+		}
+		/* Skip anything added by later versions. */
+		used = r->pos - start;
+		if(used > length) return 1;
+		return _db_skip(r, length - used);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static unsigned int _db_id_hash(dbid_t id)
+{
+	return (unsigned int)((id * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/* If replace is false and a store with the same id is already indexed, that
+ * one is kept. */
+static void _db_store_index_link(struct mosquitto_msg_store *stored, bool replace)
+{
+	unsigned int i;
+
+	i = _db_id_hash(stored->db_id) & (db_store_index_size-1);
+	while(db_store_index[i]){
+		if(db_store_index[i]->db_id == stored->db_id){
+			if(replace) db_store_index[i] = stored;
+			return;
+		}
+		i = (i+1) & (db_store_index_size-1);
+	}
+	db_store_index[i] = stored;
+}
+
+/* Index everything in db->msg_store. Newer stores are at the head of the list
+ * and take precedence over older ones with the same id. */
+static int _db_store_index_build(mosquitto_db *db)
+{
+	struct mosquitto_msg_store **index;
+	struct mosquitto_msg_store *stored;
+	unsigned int size;
+
+	size = _db_index_size(db->msg_store_count+1);
+	index = _mosquitto_calloc(size, sizeof(struct mosquitto_msg_store *));
+	if(!index) return MOSQ_ERR_NOMEM;
+	if(db_store_index) _mosquitto_free(db_store_index);
+	db_store_index = index;
+	db_store_index_size = size;
+
+	for(stored=db->msg_store; stored; stored=stored->next){
+		_db_store_index_link(stored, false);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Must be called after stored has been added to db->msg_store. */
+static void _db_store_index_add(mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	if(!db_store_index) return;
+
+	if(db->msg_store_count*2 > db_store_index_size){
+		/* Picks up stored as well. If there is no memory for the index,
+		 * lookups fall back to searching the list. */
+		_db_store_index_build(db);
+	}else{
+		_db_store_index_link(stored, true);
+	}
+}
+
+static struct mosquitto_msg_store *_db_lazy_store_load(mosquitto_db *db, dbid_t store_id);
+
+/* Once restoring is over, the only stored messages that are looked up are
+ * those that lazily restored messages refer to. */
+static struct mosquitto_msg_store *_db_store_find(mosquitto_db *db, dbid_t store_id)
+{
+	struct mosquitto_msg_store *stored;
+	unsigned int i;
+
+	/* A client message often follows the message it refers to. */
+	if(db->msg_store && db->msg_store->db_id == store_id){
+		return db->msg_store;
+	}
+	if(!db_restoring){
+		return _db_lazy_store_load(db, store_id);
+	}
+
+	if(!db_store_index){
+		_db_store_index_build(db);
+	}
+	if(db_store_index){
+		i = _db_id_hash(store_id) & (db_store_index_size-1);
+		while(db_store_index[i]){
+			if(db_store_index[i]->db_id == store_id){
+				return db_store_index[i];
+			}
+			i = (i+1) & (db_store_index_size-1);
+		}
+	}else{
+		for(stored=db->msg_store; stored; stored=stored->next){
+			if(stored->db_id == store_id){
+				return stored;
+			}
+		}
+	}
+	return _db_lazy_store_load(db, store_id);
+}
+
+static void _db_context_index_link(mosquitto_db *db, int slot)
+{
+	unsigned int i;
+
+	i = _db_string_hash(db->contexts[slot]->id, strlen(db->contexts[slot]->id)) & (db_context_index_size-1);
+	while(db_context_index[i]){
+		i = (i+1) & (db_context_index_size-1);
+	}
+	db_context_index[i] = slot+1;
+	db_context_index_count++;
+}
+
+static int _db_context_index_build(mosquitto_db *db)
+{
+	int *index;
+	unsigned int size;
+	int i;
+
+	size = _db_index_size(db->context_count+1);
+	index = _mosquitto_calloc(size, sizeof(int));
+	if(!index) return MOSQ_ERR_NOMEM;
+	if(db_context_index) _mosquitto_free(db_context_index);
+	db_context_index = index;
+	db_context_index_size = size;
+	db_context_index_count = 0;
+
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] && db->contexts[i]->id){
+			_db_context_index_link(db, i);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Returns the slot in db->contexts of client_id, or -1. */
+static int _db_find_context_slot(mosquitto_db *db, const char *client_id)
+{
+	struct mosquitto *context;
+	unsigned int i;
+	int slot;
+
+	if(!db_context_index){
+		_db_context_index_build(db);
+	}
+	if(db_context_index){
+		i = _db_string_hash(client_id, strlen(client_id)) & (db_context_index_size-1);
+		while(db_context_index[i]){
+			slot = db_context_index[i]-1;
+			context = db->contexts[slot];
+			if(context && context->id && !strcmp(context->id, client_id)){
+				return slot;
+			}
+			i = (i+1) & (db_context_index_size-1);
+		}
+		return -1;
+	}
+
+	for(slot=0; slot<db->context_count; slot++){
+		if(db->contexts[slot] && db->contexts[slot]->id && !strcmp(db->contexts[slot]->id, client_id)){
+			return slot;
+		}
+	}
+	return -1;
+}
+
+static struct mosquitto *_db_find_context(mosquitto_db *db, const char *client_id)
+{
+	int slot;
+
+	slot = _db_find_context_slot(db, client_id);
+	if(slot < 0) return NULL;
+	return db->contexts[slot];
+}
+
+static struct mosquitto *_db_find_or_add_context(mosquitto_db *db, const char *client_id, uint16_t last_mid)
+{
+	struct mosquitto *context;
+	struct mosquitto **tmp_contexts;
+	int i;
+
+	context = _db_find_context(db, client_id);
+	if(!context){
+		context = mqtt3_context_init(-1);
+		if(!context) return NULL;
+		context->clean_session = false;
+		context->id = _mosquitto_strdup(client_id);
+		if(!context->id){
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
+		}
+
+		for(i=db_context_free; i<db->context_count; i++){
+			if(!db->contexts[i]){
+				db->contexts[i] = context;
+				break;
+			}
+		}
+		if(i==db->context_count){
+			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
+			if(tmp_contexts){
+				db->contexts = tmp_contexts;
+				db->contexts[db->context_count] = context;
+				db->context_count++;
+			}else{
+				mqtt3_context_cleanup(db, context, true);
+				return NULL;
+			}
+		}
+		db_context_free = i+1;
+
+		if(db_context_index){
+			if(db_context_index_count*2 >= db_context_index_size){
+				_db_context_index_build(db);
+			}else{
+				_db_context_index_link(db, i);
+			}
+		}
+	}
+	if(last_mid){
+		context->last_mid = last_mid;
+	}
+	return context;
+}
+
+static void _db_restore_index_free(void)
+{
+	if(db_store_index) _mosquitto_free(db_store_index);
+	db_store_index = NULL;
+	db_store_index_size = 0;
+	if(db_context_index) _mosquitto_free(db_context_index);
+	db_context_index = NULL;
+	db_context_index_size = 0;
+	db_context_index_count = 0;
+	db_context_free = 0;
+	mqtt3_sub_bulk_clean(&db_sub_bulk);
+}
+
+static int _db_client_msg_restore(mosquitto_db *db, struct mosquitto *context, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id, time_t expiry_time)
+{
+	mosquitto_client_msg *cmsg;
+	struct mosquitto_msg_store *store;
+
+	store = _db_store_find(db, store_id);
+	if(!store){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+
+	cmsg = _mosquitto_calloc(1, sizeof(mosquitto_client_msg));
+	if(!cmsg){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	cmsg->store = store;
+	cmsg->store->ref_count++;
+	cmsg->mid = mid;
+	cmsg->qos = qos;
+	cmsg->retain = retain;
+	cmsg->direction = direction;
+	cmsg->state = state;
+	cmsg->dup = dup;
+	cmsg->expiry_time = expiry_time;
+
+	mqtt3_db_message_append(context, cmsg);
+	db_restore_msgs++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_client_chunk_restore(mosquitto_db *db, struct _db_reader *r, uint16_t chunk, struct mosquitto **context)
+{
+	uint64_t value;
+	uint16_t i16temp, slen, last_mid;
+	char *client_id;
+
+	if(chunk == DB_CHUNK_CLIENT_PACKED){
+		if(_db_read_string_ref(r, DB_STR_ID, &client_id, &slen)) goto error;
+		if(_db_read_varint(r, UINT16_MAX, &value)) goto error;
+		last_mid = value;
+	}else{
+		if(_db_read_string(r, DB_STR_ID, &client_id, &slen)) goto error;
+		map_read_e(r, &i16temp, sizeof(uint16_t));
+		last_mid = ntohs(i16temp);
+	}
+	if(!slen){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+		return 1;
+	}
+
+	*context = _db_find_or_add_context(db, client_id, last_mid);
+	if(!(*context)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return 1;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* Read a client message chunk of either kind, with length bytes after its
+ * header. client_id is set to the client that the message names, or to NULL
+ * for a packed message. */
+static int _db_client_msg_fields_read(struct _db_reader *r, uint16_t chunk, uint32_t length, char **client_id, struct _db_msg_fields *mf)
+{
+	uint64_t value;
+	uint32_t used;
+	uint16_t i16temp, slen;
+	uint8_t flags;
+	size_t start = r->pos;
+
+	mf->expiry = 0;
+	if(chunk == DB_CHUNK_CLIENT_MSG_PACKED){
+		*client_id = NULL;
+		if(_db_read_varint(r, UINT64_MAX, &value)) return 1;
+		mf->store_id = value;
+		if(_db_read_varint(r, UINT16_MAX, &value)) return 1;
+		mf->mid = value;
+		if(_db_read(r, &flags, sizeof(uint8_t))) return 1;
+		if(_db_read(r, &mf->state, sizeof(uint8_t))) return 1;
+		if(_db_read_varint(r, INT64_MAX, &value)) return 1;
+		mf->expiry = value;
+		mf->qos = flags & DB_MSG_QOS_MASK;
+		mf->retain = (flags & DB_MSG_RETAIN) ? 1 : 0;
+		mf->direction = (flags & DB_MSG_DIRECTION) ? mosq_md_out : mosq_md_in;
+		mf->dup = (flags & DB_MSG_DUP) ? 1 : 0;
+	}else{
+		if(_db_read_string(r, DB_STR_ID, client_id, &slen)) return 1;
+		if(!slen) return 1;
+		if(_db_read(r, &mf->store_id, sizeof(dbid_t))) return 1;
+		if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+		mf->mid = ntohs(i16temp);
+		if(_db_read(r, &mf->qos, sizeof(uint8_t))) return 1;
+		if(_db_read(r, &mf->retain, sizeof(uint8_t))) return 1;
+		if(_db_read(r, &mf->direction, sizeof(uint8_t))) return 1;
+		if(_db_read(r, &mf->state, sizeof(uint8_t))) return 1;
+		if(_db_read(r, &mf->dup, sizeof(uint8_t))) return 1;
+		/* Version 2 databases have no expiry time. */
+		used = r->pos - start;
+		if(length >= used + sizeof(int64_t)){
+			if(_db_read(r, &mf->expiry, sizeof(int64_t))) return 1;
+		}
+	}
+	/* Skip anything added by later versions. */
+	used = r->pos - start;
+	if(used > length) return 1;
+	return _db_skip(r, length - used);
+}
+
+/* Restore a message for context, or if it is NULL for the client the chunk
+ * names. A packed message belongs to the client chunk before it, which must be
+ * context. */
+static int _db_client_msg_chunk_restore(mosquitto_db *db, struct _db_reader *r, uint16_t chunk, uint32_t length, struct mosquitto *context)
+{
+	struct _db_msg_fields mf;
+	char *client_id;
+
+	if(_db_client_msg_fields_read(r, chunk, length, &client_id, &mf)) goto error;
+	if(!client_id && !context) goto error;
+
+	if(mf.expiry && mf.direction == mosq_md_out && !mf.dup && (time_t)mf.expiry <= time(NULL)){
+		/* Don't bring back messages that expired while we were down. */
+		switch(mf.state){
+			case ms_queued:
+			case ms_publish:
+			case ms_publish_puback:
+			case ms_publish_pubrec:
+				return MOSQ_ERR_SUCCESS;
+			default:
+				break;
+		}
+	}
+
+	if(!context){
+		context = _db_find_or_add_context(db, client_id, 0);
+		if(!context){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+			return 1;
+		}
+	}
+	return _db_client_msg_restore(db, context, mf.mid, mf.qos, mf.retain, mf.direction, mf.state, mf.dup, mf.store_id, (time_t)mf.expiry);
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+#ifdef WITH_ZLIB
+static const uint8_t *_db_payload_uncompress(struct _db_reader *r, struct _db_store_fields *sf)
+{
+	uLongf len = sf->payloadlen;
+	uint8_t *buf;
+
+	if(sf->payloadlen > r->buf_len){
+		buf = _mosquitto_realloc(r->buf, sf->payloadlen);
+		if(!buf) return NULL;
+		r->buf = buf;
+		r->buf_len = sf->payloadlen;
+	}
+	if(uncompress(r->buf, &len, sf->data, sf->datalen) != Z_OK || len != sf->payloadlen){
+		return NULL;
+	}
+	return r->buf;
+}
+#endif
+
+static int _db_msg_store_chunk_restore(mosquitto_db *db, struct _db_reader *r, uint16_t chunk, uint32_t length)
+{
+	struct _db_store_fields sf;
+	const uint8_t *payload;
+	char *source_id = NULL;
+	char *topic;
+	int rc = 0;
+	struct mosquitto_msg_store *stored = NULL;
+
+	if(_db_store_fields_read(r, chunk, length, &sf)) goto error;
+	if(!sf.topic_len){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid msg_store chunk when restoring persistent database.");
+		return 1;
+	}
+	if(sf.source_len){
+		source_id = _db_string_copy(r, DB_STR_ID, sf.source_id, sf.source_len);
+	}
+	topic = _db_string_copy(r, DB_STR_TOPIC, sf.topic, sf.topic_len);
+
+	payload = sf.data;
+	if(sf.flags & DB_STORE_COMPRESSED){
+#ifdef WITH_ZLIB
+		payload = _db_payload_uncompress(r, &sf);
+		if(!payload) goto error;
+#else
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database has compressed messages, but compression support is not available.");
+		return 1;
+#endif
+	}else if(sf.datalen != sf.payloadlen){
+		goto error;
+	}
+	if(!sf.payloadlen) payload = NULL;
+
+	rc = mqtt3_db_message_store(db, source_id, sf.source_mid, topic, sf.flags & DB_STORE_QOS_MASK, sf.payloadlen, payload,
+			(sf.flags & DB_STORE_RETAIN) ? 1 : 0, &stored, sf.db_id);
+	if(rc) return rc;
+	stored->expiry_time = (time_t)sf.expiry;
+	_db_store_index_add(db, stored);
+	db_restore_stores++;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_retain_chunk_restore(mosquitto_db *db, struct _db_reader *r)
+{
+	dbid_t i64temp;
+	struct mosquitto_msg_store *store;
+
+	map_read_e(r, &i64temp, sizeof(dbid_t));
+	store = _db_store_find(db, i64temp);
+	if(store){
+		mqtt3_db_messages_queue(db, NULL, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* Subscriptions in the database file are known to be unique, so can be added
+ * in bulk. Elsewhere they may repeat one that is already there. */
+static int _db_sub_chunk_restore(mosquitto_db *db, struct _db_reader *r, uint16_t chunk, bool bulk)
+{
+	uint16_t slen;
+	uint8_t qos;
+	char *client_id;
+	char *topic;
+	struct mosquitto *context;
+	struct _mosquitto_subhier *root;
+	int offset;
+	int rc;
+
+	if(chunk == DB_CHUNK_SUB_PACKED){
+		if(_db_read_string_ref(r, DB_STR_ID, &client_id, &slen)) goto error;
+		if(_db_read_string_ref(r, DB_STR_TOPIC, &topic, &slen)) goto error;
+	}else{
+		if(_db_read_string(r, DB_STR_ID, &client_id, &slen)) goto error;
+		if(_db_read_string(r, DB_STR_TOPIC, &topic, &slen)) goto error;
+	}
+	map_read_e(r, &qos, sizeof(uint8_t));
+
+	context = _db_find_or_add_context(db, client_id, 0);
+	if(!context) return 1;
+	root = mqtt3_sub_root(db, NULL, topic, &offset);
+	if(bulk){
+		rc = mqtt3_sub_add_bulk(context, &topic[offset], qos, root, &db_sub_bulk);
+	}else{
+		rc = mqtt3_sub_add(context, &topic[offset], qos, root, sa_check);
+	}
+	if(rc) return 1;
+	db_restore_subs++;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_client_msg_delete_chunk_restore(mosquitto_db *db, struct _db_reader *r)
+{
+	uint16_t i16temp, slen, mid;
+	uint8_t direction;
+	char *client_id;
+	struct mosquitto *context;
+
+	if(_db_read_string(r, DB_STR_ID, &client_id, &slen)) goto error;
+	map_read_e(r, &i16temp, sizeof(uint16_t));
+	mid = ntohs(i16temp);
+	map_read_e(r, &direction, sizeof(uint8_t));
+
+	context = _db_find_context(db, client_id);
+	if(context){
+		/* The message may still be on disk. */
+		if(mqtt3_db_lazy_load(db, context)) return 1;
+		mqtt3_db_message_delete(context, mid, direction);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_unsub_chunk_restore(mosquitto_db *db, struct _db_reader *r)
+{
+	uint16_t slen;
+	char *client_id;
+	char *topic;
+	struct mosquitto *context;
+	struct _mosquitto_subhier *root;
+	int offset;
+
+	if(_db_read_string(r, DB_STR_ID, &client_id, &slen)) goto error;
+	if(_db_read_string(r, DB_STR_TOPIC, &topic, &slen)) goto error;
+
+	context = _db_find_context(db, client_id);
+	if(context){
+		mqtt3_sub_bulk_clean(&db_sub_bulk);
+		root = mqtt3_sub_root(db, NULL, topic, &offset);
+		mqtt3_sub_remove(context, &topic[offset], root);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_client_delete_chunk_restore(mosquitto_db *db, struct _db_reader *r)
+{
+	uint16_t slen;
+	uint8_t session;
+	char *client_id;
+	int slot;
+
+	if(_db_read_string(r, DB_STR_ID, &client_id, &slen)) goto error;
+	map_read_e(r, &session, sizeof(uint8_t));
+
+	slot = _db_find_context_slot(db, client_id);
+	if(slot >= 0){
+		if(session){
+			/* The whole session has gone, as if it had been clean. */
+			mqtt3_sub_bulk_clean(&db_sub_bulk);
+			db->contexts[slot]->clean_session = true;
+			mqtt3_context_cleanup(db, db->contexts[slot], true);
+			db->contexts[slot] = NULL;
+			if(slot < db_context_free){
+				db_context_free = slot;
+			}
+		}else{
+			mqtt3_db_messages_delete(db->contexts[slot]);
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static struct _db_lazy_store *_db_lazy_store_entry(dbid_t store_id)
+{
+	unsigned int i;
+
+	if(!db_lazy_stores) return NULL;
+
+	i = _db_id_hash(store_id) & (db_lazy_stores_size-1);
+	while(db_lazy_stores[i].db_id){
+		if(db_lazy_stores[i].db_id == store_id){
+			return &db_lazy_stores[i];
+		}
+		i = (i+1) & (db_lazy_stores_size-1);
+	}
+	return NULL;
+}
+
+/* Record that the stored message store_id is in the chunk at pos. */
+static int _db_lazy_store_add(dbid_t store_id, size_t pos)
+{
+	struct _db_lazy_store *stores, *entry;
+	unsigned int size, i, j;
+
+	if(!store_id) return 1;
+	if((db_lazy_stores_count+1)*2 > db_lazy_stores_size){
+		size = _db_index_size(db_lazy_stores_count+1);
+		stores = _mosquitto_calloc(size, sizeof(struct _db_lazy_store));
+		if(!stores){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		for(i=0; i<db_lazy_stores_size; i++){
+			if(db_lazy_stores[i].db_id){
+				j = _db_id_hash(db_lazy_stores[i].db_id) & (size-1);
+				while(stores[j].db_id){
+					j = (j+1) & (size-1);
+				}
+				stores[j] = db_lazy_stores[i];
+			}
+		}
+		if(db_lazy_stores) _mosquitto_free(db_lazy_stores);
+		db_lazy_stores = stores;
+		db_lazy_stores_size = size;
+	}
+
+	entry = _db_lazy_store_entry(store_id);
+	if(!entry){
+		i = _db_id_hash(store_id) & (db_lazy_stores_size-1);
+		while(db_lazy_stores[i].db_id){
+			i = (i+1) & (db_lazy_stores_size-1);
+		}
+		entry = &db_lazy_stores[i];
+		entry->db_id = store_id;
+		db_lazy_stores_count++;
+	}
+	/* A later chunk with the same id replaces an earlier one. */
+	entry->pos = pos;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Read the stored message store_id from the mapped database file. It is held
+ * in memory while messages still on disk refer to it. */
+static struct mosquitto_msg_store *_db_lazy_store_load(mosquitto_db *db, dbid_t store_id)
+{
+	struct _db_lazy_store *entry;
+	struct mosquitto_msg_store *stored;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	size_t pos;
+	int rc;
+
+	entry = _db_lazy_store_entry(store_id);
+	if(!entry || !db_lazy_reader.data) return NULL;
+	if(entry->stored) return entry->stored;
+
+	pos = db_lazy_reader.pos;
+	db_lazy_reader.pos = entry->pos;
+	if(_db_read(&db_lazy_reader, &i16temp, sizeof(uint16_t))
+			|| _db_read(&db_lazy_reader, &i32temp, sizeof(uint32_t))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+		rc = 1;
+	}else{
+		rc = _db_msg_store_chunk_restore(db, &db_lazy_reader, ntohs(i16temp), ntohl(i32temp));
+	}
+	db_lazy_reader.pos = pos;
+	if(rc) return NULL;
+
+	stored = db->msg_store;
+	if(entry->refs){
+		stored->ref_count++;
+		entry->stored = stored;
+	}
+	return stored;
+}
+
+/* Read the header and store id of the client message chunk at the position
+ * of r, leaving r at the start of the next chunk. */
+static int _db_lazy_chunk_read(struct _db_reader *r, dbid_t *store_id)
+{
+	struct _db_msg_fields mf;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	char *client_id;
+
+	if(_db_read(r, &i16temp, sizeof(uint16_t))) return 1;
+	if(_db_read(r, &i32temp, sizeof(uint32_t))) return 1;
+	if(_db_client_msg_fields_read(r, ntohs(i16temp), ntohl(i32temp), &client_id, &mf)) return 1;
+	*store_id = mf.store_id;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* The messages at pos are no longer on disk only, so release their hold on
+ * the messages they refer to. */
+static void _db_lazy_release(size_t pos, size_t len)
+{
+	struct _db_lazy_store *entry;
+	dbid_t store_id;
+	size_t saved;
+
+	if(!db_lazy_reader.data) return;
+
+	saved = db_lazy_reader.pos;
+	db_lazy_reader.pos = pos;
+	while(db_lazy_reader.pos < pos + len){
+		if(_db_lazy_chunk_read(&db_lazy_reader, &store_id)) break;
+		entry = _db_lazy_store_entry(store_id);
+		if(entry && entry->refs){
+			entry->refs--;
+			if(!entry->refs && entry->stored){
+				entry->stored->ref_count--;
+				entry->stored = NULL;
+			}
+		}
+		if(db_lazy_msgs) db_lazy_msgs--;
+	}
+	db_lazy_reader.pos = saved;
+}
+
+static void _db_lazy_free(void)
+{
+	unsigned int i;
+
+	for(i=0; i<db_lazy_stores_size; i++){
+		if(db_lazy_stores[i].stored){
+			db_lazy_stores[i].stored->ref_count--;
+		}
+	}
+	if(db_lazy_stores) _mosquitto_free(db_lazy_stores);
+	db_lazy_stores = NULL;
+	db_lazy_stores_size = 0;
+	db_lazy_stores_count = 0;
+	db_lazy_sessions = 0;
+	db_lazy_msgs = 0;
+	_db_reader_close(&db_lazy_reader);
+}
+
+/* Nothing of context is left on disk only. Once that is true of every client
+ * the database file is no longer needed. */
+static void _db_lazy_session_done(struct mosquitto *context)
+{
+	_db_lazy_release(context->db_lazy_pos, context->db_lazy_len);
+	context->db_lazy_pos = 0;
+	context->db_lazy_len = 0;
+	if(db_lazy_sessions) db_lazy_sessions--;
+	if(!db_lazy_sessions && !db_restoring){
+		_db_lazy_free();
+	}
+}
+
+/* Leave a client message chunk on disk for context, if it follows on from
+ * those already left there. r is just past the chunk header, which starts at
+ * start. Returns 0 if the message was left on disk, 1 if it should be restored
+ * now and -1 on error. */
+static int _db_lazy_client_msg_note(struct _db_reader *r, size_t start, uint16_t chunk, uint32_t length, struct mosquitto *context)
+{
+	struct _db_lazy_store *entry;
+	struct _db_msg_fields mf;
+	char *client_id;
+	size_t pos;
+
+	/* Messages already in memory are newer. */
+	if(context->msgs) return 1;
+	if(context->db_lazy_len && context->db_lazy_pos + context->db_lazy_len != start) return 1;
+
+	pos = r->pos;
+	if(_db_client_msg_fields_read(r, chunk, length, &client_id, &mf)) return -1;
+	if(client_id && strcmp(client_id, context->id)){
+		r->pos = pos;
+		return 1;
+	}
+	entry = _db_lazy_store_entry(mf.store_id);
+	if(!entry){
+		r->pos = pos;
+		return 1;
+	}
+
+	entry->refs++;
+	if(!context->db_lazy_len){
+		context->db_lazy_pos = start;
+		db_lazy_sessions++;
+	}
+	context->db_lazy_len = r->pos - context->db_lazy_pos;
+	db_lazy_msgs++;
+	return 0;
+}
+
+/* Restore the messages of context that are still on disk, in front of any it
+ * has gained since. */
+int mqtt3_db_lazy_load(mosquitto_db *db, struct mosquitto *context)
+{
+	mosquitto_client_msg *last;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	size_t pos, end;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	assert(db);
+	assert(context);
+
+	if(!context->db_lazy_len) return MOSQ_ERR_SUCCESS;
+
+	if(db_lazy_reader.data){
+		last = context->msgs_last;
+		pos = db_lazy_reader.pos;
+		db_lazy_reader.pos = context->db_lazy_pos;
+		end = context->db_lazy_pos + context->db_lazy_len;
+		while(db_lazy_reader.pos < end){
+			if(_db_read(&db_lazy_reader, &i16temp, sizeof(uint16_t))
+					|| _db_read(&db_lazy_reader, &i32temp, sizeof(uint32_t))){
+				rc = 1;
+				break;
+			}
+			rc = _db_client_msg_chunk_restore(db, &db_lazy_reader, ntohs(i16temp), ntohl(i32temp), context);
+			if(rc) break;
+		}
+		db_lazy_reader.pos = pos;
+		if(last && last->next){
+			mqtt3_db_messages_to_front(context, last->next);
+		}
+	}
+	_db_lazy_session_done(context);
+
+	return rc;
+}
+
+/* The messages of context are being thrown away. */
+void mqtt3_db_lazy_drop(struct mosquitto *context)
+{
+	if(context->db_lazy_len){
+		_db_lazy_session_done(context);
+	}
+}
+
+void mqtt3_db_lazy_close(void)
+{
+	_db_lazy_free();
+}
+
+/* Write the stored messages that are still on disk only, as packed chunks
+ * using the strings of the file being written. */
+static int _db_lazy_stores_write(FILE *db_fptr)
+{
+	struct _db_lazy_store *entry;
+	struct _db_store_fields sf;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	unsigned int i;
+	size_t pos;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(!db_lazy_reader.data) return MOSQ_ERR_SUCCESS;
+
+	pos = db_lazy_reader.pos;
+	for(i=0; i<db_lazy_stores_size; i++){
+		entry = &db_lazy_stores[i];
+		if(!entry->db_id || !entry->refs || entry->stored) continue;
+
+		db_lazy_reader.pos = entry->pos;
+		if(_db_read(&db_lazy_reader, &i16temp, sizeof(uint16_t))
+				|| _db_read(&db_lazy_reader, &i32temp, sizeof(uint32_t))
+				|| _db_store_fields_read(&db_lazy_reader, ntohs(i16temp), ntohl(i32temp), &sf)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+			rc = 1;
+			break;
+		}
+		rc = _db_store_packed_chunk_write(db_fptr, &sf);
+		if(rc) break;
+	}
+	db_lazy_reader.pos = pos;
+
+	return rc;
+}
+
+/* Copy the messages of context that are still on disk only. Messages from an
+ * older database are packed on the way if packed is set. */
+static int _db_lazy_messages_write(FILE *db_fptr, struct mosquitto *context, bool packed)
+{
+	struct _db_msg_fields mf;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	char *client_id;
+	size_t pos, end;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(!context->db_lazy_len || !db_lazy_reader.data) return MOSQ_ERR_SUCCESS;
+
+	memcpy(&i16temp, &db_lazy_reader.data[context->db_lazy_pos], sizeof(uint16_t));
+	if(!packed || ntohs(i16temp) == DB_CHUNK_CLIENT_MSG_PACKED){
+		write_e(db_fptr, &db_lazy_reader.data[context->db_lazy_pos], context->db_lazy_len);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	pos = db_lazy_reader.pos;
+	db_lazy_reader.pos = context->db_lazy_pos;
+	end = context->db_lazy_pos + context->db_lazy_len;
+	while(db_lazy_reader.pos < end){
+		if(_db_read(&db_lazy_reader, &i16temp, sizeof(uint16_t))
+				|| _db_read(&db_lazy_reader, &i32temp, sizeof(uint32_t))
+				|| _db_client_msg_fields_read(&db_lazy_reader, ntohs(i16temp), ntohl(i32temp), &client_id, &mf)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+			rc = 1;
+			break;
+		}
+		rc = _db_client_msg_packed_chunk_write(db_fptr, &mf);
+		if(rc) break;
+	}
+	db_lazy_reader.pos = pos;
+
+	return rc;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+/* Restore the chunks from the current position of r to its end. r is a file
+ * of the given DB_FILE_* type. A write ahead log or delta file may end with a
+ * chunk or delta that was only partly written when the broker stopped, so for
+ * those anything that runs past the end of the file is ignored and good is set
+ * to the offset at which it starts. */
+static int _db_chunks_restore(mosquitto_db *db, struct _db_reader *r, int type, long *good, int *count)
+{
+	dbid_t i64temp;
+	uint64_t value;
+	uint32_t i32temp, length, delta_length;
+	uint16_t i16temp, chunk;
+	uint8_t i8temp;
+	size_t pos;
+	bool wal = (type != DB_FILE_BASE);
+	bool lazy = (db_lazy && type == DB_FILE_BASE);
+	bool torn = false;
+	struct mosquitto *context = NULL;
+	int rc;
+
+	pos = r->pos;
+	while(r->len - r->pos >= sizeof(uint16_t)){
+		map_read_e(r, &i16temp, sizeof(uint16_t));
+		chunk = ntohs(i16temp);
+		if(_db_read(r, &i32temp, sizeof(uint32_t))){
+			if(wal) break;
+			goto error;
+		}
+		length = ntohl(i32temp);
+		if(wal && length > r->len - r->pos){
+			break;
+		}
+		switch(chunk){
+			case DB_CHUNK_CFG:
+				map_read_e(r, &i8temp, sizeof(uint8_t)); // shutdown
+				map_read_e(r, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
+				if(i8temp != sizeof(dbid_t)){
+					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %d)",
+							i8temp, sizeof(dbid_t));
+					return 1;
+				}
+				map_read_e(r, &i64temp, sizeof(dbid_t));
+				db->last_db_id = i64temp;
+				break;
+
+			case DB_CHUNK_STRING:
+				if(_db_string_add(r, length)) goto error;
+				break;
+
+			case DB_CHUNK_MSG_STORE:
+			case DB_CHUNK_MSG_STORE_PACKED:
+				if(lazy){
+					/* Only read when something refers to it. */
+					if(chunk == DB_CHUNK_MSG_STORE_PACKED){
+						if(_db_read_varint(r, UINT64_MAX, &value)) goto error;
+						i64temp = value;
+					}else{
+						map_read_e(r, &i64temp, sizeof(dbid_t));
+					}
+					if(_db_lazy_store_add(i64temp, pos)) return 1;
+					if(i64temp > db->last_db_id){
+						db->last_db_id = i64temp;
+					}
+					if(r->pos - pos > sizeof(uint16_t) + sizeof(uint32_t) + length) goto error;
+					if(_db_skip(r, pos + sizeof(uint16_t) + sizeof(uint32_t) + length - r->pos)) goto error;
+					break;
+				}
+				if(_db_msg_store_chunk_restore(db, r, chunk, length)) return 1;
+				if(db->msg_store->db_id > db->last_db_id){
+					/* Stored after the last snapshot. */
+					db->last_db_id = db->msg_store->db_id;
+				}
+				break;
+
+			case DB_CHUNK_CLIENT_MSG:
+			case DB_CHUNK_CLIENT_MSG_PACKED:
+				if(lazy && context){
+					/* A client's messages follow its client chunk. */
+					rc = _db_lazy_client_msg_note(r, pos, chunk, length, context);
+					if(rc < 0) goto error;
+					if(rc == 0) break;
+				}
+				if(_db_client_msg_chunk_restore(db, r, chunk, length,
+							chunk == DB_CHUNK_CLIENT_MSG_PACKED ? context : NULL)) return 1;
+				break;
+
+			case DB_CHUNK_RETAIN:
+				if(_db_retain_chunk_restore(db, r)) return 1;
+				break;
+
+			case DB_CHUNK_SUB:
+			case DB_CHUNK_SUB_PACKED:
+				if(_db_sub_chunk_restore(db, r, chunk, type == DB_FILE_BASE)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT:
+			case DB_CHUNK_CLIENT_PACKED:
+				if(_db_client_chunk_restore(db, r, chunk, &context)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG_DELETE:
+				if(_db_client_msg_delete_chunk_restore(db, r)) return 1;
+				break;
+
+			case DB_CHUNK_UNSUB:
+				if(_db_unsub_chunk_restore(db, r)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_DELETE:
+				if(_db_client_delete_chunk_restore(db, r)) return 1;
+				break;
+
+			case DB_CHUNK_CHECKPOINT:
+				map_read_e(r, &i32temp, sizeof(uint32_t));
+				if(type != DB_FILE_WAL){
+					db_checkpoint_id = ntohl(i32temp);
+				}
+				if(ntohl(i32temp) > wal_checkpoint_id){
+					wal_checkpoint_id = ntohl(i32temp);
+				}
+				break;
+
+			case DB_CHUNK_DELTA:
+				map_read_e(r, &i32temp, sizeof(uint32_t));
+				map_read_e(r, &delta_length, sizeof(uint32_t));
+				delta_length = ntohl(delta_length);
+				if(type == DB_FILE_BASE){
+					db_base_id = ntohl(i32temp);
+				}else if(type == DB_FILE_DELTA){
+					if(!delta_length || delta_length > r->len - r->pos){
+						torn = true;
+					}else if(ntohl(i32temp) != db_base_id){
+						/* Left over from before the last full save. */
+						r->pos += delta_length;
+					}
+				}
+				break;
+
+			default:
+				_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+				if(_db_skip(r, length)) goto error;
+				break;
+		}
+		if(torn) break;
+		if(chunk != DB_CHUNK_CLIENT && chunk != DB_CHUNK_CLIENT_MSG
+				&& chunk != DB_CHUNK_CLIENT_PACKED && chunk != DB_CHUNK_CLIENT_MSG_PACKED){
+			context = NULL;
+		}
+		if(count) (*count)++;
+		pos = r->pos;
+	}
+	if(good) *good = pos;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* Check the header of r and move past it. Returns 0 if it is good, 1 if it
+ * isn't a database file at all and 2 if it is from a newer version. */
+static int _db_header_read(struct _db_reader *r)
+{
+	uint32_t i32temp;
+
+	if(r->len < 15 + 2*sizeof(uint32_t) || memcmp(r->data, magic, 15)){
+		return 1;
+	}
+	/* Skip the crc. */
+	r->pos = 15 + sizeof(uint32_t);
+	map_read_e(r, &i32temp, sizeof(uint32_t));
+	/* IMPORTANT - this is where compatibility checks are made.
+	 * Is your DB change still compatible with previous versions?
+	 */
+	if(ntohl(i32temp) > MOSQ_DB_VERSION){
+		return 2;
+	}
+	return 0;
+error:
+	return 1;
+}
+
+static char *_db_delta_filepath(mosquitto_db *db)
+{
+	char *filepath;
+	int len;
+
+	len = strlen(db->config->persistence_filepath) + strlen(".delta") + 1;
+	filepath = _mosquitto_malloc(len);
+	if(!filepath){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return NULL;
+	}
+	snprintf(filepath, len, "%s.delta", db->config->persistence_filepath);
+	return filepath;
+}
+
+static void _db_delta_filepath_remove(mosquitto_db *db)
+{
+	char *filepath;
+
+	filepath = _db_delta_filepath(db);
+	if(filepath){
+		remove(filepath);
+		_mosquitto_free(filepath);
+	}
+}
+
+/* Apply the deltas that belong to the database file just restored, then cut
+ * off any delta that was only partly written. */
+static int _db_delta_restore(mosquitto_db *db)
+{
+	struct _db_reader r;
+	char *filepath;
+	long good = 0;
+	int count = 0;
+	int rc;
+
+	filepath = _db_delta_filepath(db);
+	if(!filepath) return MOSQ_ERR_NOMEM;
+
+	rc = _db_reader_open(&r, filepath);
+	if(rc){
+		if(rc > 0){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read %s: %s.", filepath, strerror(errno));
+		}
+		_db_reader_close(&r);
+		_mosquitto_free(filepath);
+		return rc > 0 ? 1 : MOSQ_ERR_SUCCESS;
+	}
+	rc = _db_header_read(&r);
+	if(rc == 2){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version in %s (need version %d).", filepath, MOSQ_DB_VERSION);
+		_db_reader_close(&r);
+		_mosquitto_free(filepath);
+		return 1;
+	}else if(rc == 0){
+		if(_db_chunks_restore(db, &r, DB_FILE_DELTA, &good, &count)){
+			_db_reader_close(&r);
+			_mosquitto_free(filepath);
+			return 1;
+		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Restored %d changes from %s.", count, filepath);
+		db_restore_bytes += good;
+	}
+	/* Otherwise not even the header was written. */
+	_db_reader_close(&r);
+
+	if(good){
+		if(truncate(filepath, good)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to truncate %s: %s.", filepath, strerror(errno));
+			_mosquitto_free(filepath);
+			return 1;
+		}
+	}else{
+		remove(filepath);
+	}
+	_mosquitto_free(filepath);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_restore(mosquitto_db *db)
+{
+	struct _db_reader base, *r;
+	uint64_t start;
+	unsigned long duration;
+	int rc;
+
+	assert(db);
+	assert(db->config);
+	assert(db->config->persistence_filepath);
+
+	start = _mosquitto_time_ms();
+	db_restore_stores = 0;
+	db_restore_msgs = 0;
+	db_restore_subs = 0;
+	db_restore_bytes = 0;
+	db_delta_tracking = (db->config->autosave_delta_count > 0);
+	db_lazy = db->config->persistence_lazy_restore;
+	/* With a lazy restore the file is kept open for as long as any client
+	 * still has messages in it. */
+	r = db_lazy ? &db_lazy_reader : &base;
+
+	rc = _db_reader_open(r, db->config->persistence_filepath);
+	if(rc < 0){
+		/* Any deltas are for a database that no longer exists. */
+		_db_reader_close(r);
+		_db_delta_filepath_remove(db);
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read %s: %s.", db->config->persistence_filepath, strerror(errno));
+		_db_reader_close(r);
+		return 1;
+	}
+	db_restoring = true;
+
+	rc = _db_header_read(r);
+	if(rc == 2){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version (need version %d).", MOSQ_DB_VERSION);
+		rc = 1;
+	}else if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
+	}else{
+		rc = _db_chunks_restore(db, r, DB_FILE_BASE, NULL, NULL);
+		db_restore_bytes += r->len;
+	}
+	if(!db_lazy){
+		_db_reader_close(r);
+	}
+	mqtt3_sub_bulk_clean(&db_sub_bulk);
+
+	if(!rc){
+		/* Deltas can follow on from the database just restored. */
+		db_full_needed = false;
+		rc = _db_delta_restore(db);
+	}
+	_db_restore_index_free();
+	_db_changes_reset(db);
+	db_restoring = false;
+	/* The write ahead log may still refer to stored messages in the file. */
+	if(rc || (!db_lazy_sessions && !db->config->persistence_wal)){
+		_db_lazy_free();
+	}
+
+	if(!rc){
+		duration = (unsigned long)(_mosquitto_time_ms() - start);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Restored %lu messages, %lu queued messages and %lu subscriptions (%llu bytes) in %lu ms, %lu messages/s.",
+				db_restore_stores, db_restore_msgs, db_restore_subs, db_restore_bytes, duration,
+				(unsigned long)((db_restore_stores + db_restore_msgs)*1000/(duration ? duration : 1)));
+		if(db_lazy_sessions){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Left %lu queued messages for %lu clients on disk until they reconnect.",
+					db_lazy_msgs, db_lazy_sessions);
+		}
+	}
+	return rc;
+}
+
+/* Write ahead log.
+ *
+ * Changes to persistent client sessions and retained messages are appended
+ * to <persistence_filepath>.wal as they happen. The log uses the chunk format
+ * of the database file, plus chunks for changes that remove something. It is
+ * written through a large stdio buffer and flushed and synced once per pass
+ * of the main loop, so that the sync is shared by everything that happened in
+ * that pass. If persistence_wal_sync_acks is set, PUBACK and PUBREC are held
+ * back until that sync is done. On restore the log is replayed on top of the
+ * database file. Each save of the database records a checkpoint in both the
+ * log and the database file. Once the save is complete the log is cut back to
+ * the checkpoint, and when restoring, the log is only replayed from the
+ * checkpoint that the database file holds.
+ */
+static int _db_client_msg_delete_chunk_write(FILE *db_fptr, const char *client_id, uint16_t mid, uint8_t direction)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	slen = strlen(client_id);
+	length = htonl(2+slen + sizeof(uint16_t) + sizeof(uint8_t));
+
+	i16temp = htons(DB_CHUNK_CLIENT_MSG_DELETE);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, client_id, slen);
+
+	i16temp = htons(mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &direction, sizeof(uint8_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _db_unsub_chunk_write(FILE *db_fptr, const char *client_id, const char *topic)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	length = htonl(2+strlen(client_id) + 2+strlen(topic));
+
+	i16temp = htons(DB_CHUNK_UNSUB);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	slen = strlen(client_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, client_id, slen);
+
+	slen = strlen(topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, topic, slen);
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _db_client_delete_chunk_write(FILE *db_fptr, const char *client_id, uint8_t session)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	slen = strlen(client_id);
+	length = htonl(2+slen + sizeof(uint8_t));
+
+	i16temp = htons(DB_CHUNK_CLIENT_DELETE);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, client_id, slen);
+	write_e(db_fptr, &session, sizeof(uint8_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _wal_header_write(FILE *fptr)
+{
+	uint32_t db_version = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = htonl(0);
+
+	write_e(fptr, magic, 15);
+	write_e(fptr, &crc, sizeof(uint32_t));
+	write_e(fptr, &db_version, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+/* Appending has failed, so stop logging rather than leave a log with holes
+ * in it. Changes are still saved by the next database save. */
+static void _wal_error(void)
+{
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write to %s: %s. Write ahead log disabled.", wal_filepath, strerror(errno));
+	fclose(wal_fptr);
+	wal_fptr = NULL;
+	wal_dirty = false;
+}
+
+/* Note a change to the session of context, for delta saves and
+ * autosave_on_changes. Returns true if the change needs logging as well. */
+static bool _db_session_changed(struct mosquitto *context)
+{
+	if(!context || !context->id || context->clean_session) return false;
+
+	db_changes++;
+	context->db_dirty = true;
+	return wal_fptr != NULL;
+}
+
+/* Log stored if it isn't already in the log or the database file. */
+static int _wal_store(struct mosquitto_msg_store *stored)
+{
+	if(stored->wal_logged) return MOSQ_ERR_SUCCESS;
+	if(_db_msg_store_chunk_write(wal_fptr, stored)) return 1;
+	stored->wal_logged = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _wal_ack_send(struct mosquitto *context, uint8_t command, uint16_t mid)
+{
+	if(context->sock == INVALID_SOCKET) return;
+
+	/* Errors will be picked up by the next read or write on the socket. */
+	if(command == PUBACK){
+		_mosquitto_send_puback(context, mid);
+	}else{
+		_mosquitto_send_pubrec(context, mid);
+	}
+}
+
+static void _wal_acks_release(void)
+{
+	struct _wal_ack *ack, *next;
+
+	ack = wal_acks;
+	wal_acks = NULL;
+	wal_acks_last = NULL;
+	while(ack){
+		next = ack->next;
+		_wal_ack_send(ack->context, ack->command, ack->mid);
+		_mosquitto_free(ack);
+		ack = next;
+	}
+}
+
+/* Move r to just after the checkpoint id, if the log holds it. Everything
+ * before it is already in the database file. */
+static void _wal_checkpoint_find(struct _db_reader *r, uint32_t id)
+{
+	uint32_t i32temp, length;
+	uint16_t i16temp;
+	size_t start, found = 0;
+
+	start = r->pos;
+	while(!_db_read(r, &i16temp, sizeof(uint16_t))
+			&& !_db_read(r, &i32temp, sizeof(uint32_t))){
+
+		length = ntohl(i32temp);
+		if(ntohs(i16temp) == DB_CHUNK_CHECKPOINT && length == sizeof(uint32_t)){
+			if(_db_read(r, &i32temp, sizeof(uint32_t))) break;
+			if(ntohl(i32temp) == id){
+				found = r->pos;
+				break;
+			}
+		}else if(_db_skip(r, length)){
+			break;
+		}
+	}
+	r->pos = found?found:start;
+}
+
+/* Replay any existing log, then open it for appending. */
+int mqtt3_wal_open(mosquitto_db *db)
+{
+	struct _db_reader r;
+	long good = 0;
+	int count = 0;
+	int len;
+	int rc;
+
+	assert(db);
+	assert(db->config);
+	assert(db->config->persistence_filepath);
+
+	len = strlen(db->config->persistence_filepath) + strlen(".wal") + 1;
+	wal_filepath = _mosquitto_malloc(len);
+	if(!wal_filepath){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
 	}
+	snprintf(wal_filepath, len, "%s.wal", db->config->persistence_filepath);
 
-	cmsg->store = NULL;
-	cmsg->mid = mid;
-	cmsg->qos = qos;
-	cmsg->retain = retain;
-	cmsg->direction = direction;
-	cmsg->state = state;
-	cmsg->dup = dup;
-
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			cmsg->store = store;
-			cmsg->store->ref_count++;
-			break;
+	rc = _db_reader_open(&r, wal_filepath);
+	if(rc > 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read %s: %s.", wal_filepath, strerror(errno));
+		_db_reader_close(&r);
+		return 1;
+	}else if(rc == 0){
+		rc = _db_header_read(&r);
+		if(rc == 2){
+			_db_reader_close(&r);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported write ahead log format version (need version %d).", MOSQ_DB_VERSION);
+			return 1;
+		}else if(rc == 0){
+			if(db_checkpoint_id){
+				_wal_checkpoint_find(&r, db_checkpoint_id);
+			}
+			db_restoring = true;
+			rc = _db_chunks_restore(db, &r, DB_FILE_WAL, &good, &count);
+			db_restoring = false;
+			_db_restore_index_free();
+			if(rc){
+				_db_reader_close(&r);
+				return 1;
+			}
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Restored %d changes from %s.", count, wal_filepath);
+			if(count){
+				/* The replayed changes are in neither the database file
+				 * nor its deltas. */
+				db_full_needed = true;
+			}
+			_db_changes_reset(db);
 		}
-		store = store->next;
+		/* Otherwise the broker stopped before the header was complete, so
+		 * there is nothing to restore. */
 	}
-	if(!cmsg->store){
-		_mosquitto_free(cmsg);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
-		return 1;
+	_db_reader_close(&r);
+	if(!db_lazy_sessions){
+		_db_lazy_free();
 	}
-	context = _db_find_or_add_context(db, client_id, 0);
-	if(!context){
-		_mosquitto_free(cmsg);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+
+	if(good){
+		/* Drop anything after the last complete chunk. */
+		if(truncate(wal_filepath, good)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to truncate %s: %s.", wal_filepath, strerror(errno));
+			return 1;
+		}
+		wal_fptr = fopen(wal_filepath, "ab");
+	}else{
+		wal_fptr = fopen(wal_filepath, "wb");
+	}
+	if(!wal_fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open %s: %s.", wal_filepath, strerror(errno));
 		return 1;
 	}
-	if(context->msgs){
-		tail = context->msgs;
-		while(tail->next){
-			tail = tail->next;
+	setvbuf(wal_fptr, NULL, _IOFBF, 65536);
+	if(!good){
+		if(_wal_header_write(wal_fptr) || fflush(wal_fptr) || _db_fsync(wal_fptr)){
+			_wal_error();
+			return 1;
 		}
-		tail->next = cmsg;
-	}else{
-		context->msgs = cmsg;
 	}
-	cmsg->next = NULL;
 
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int _db_client_chunk_restore(mosquitto_db *db, FILE *db_fptr)
+void mqtt3_wal_close(void)
 {
-	uint16_t i16temp, slen, last_mid;
-	char *client_id = NULL;
-	int rc = 0;
-	struct mosquitto *context;
+	if(wal_fptr){
+		mqtt3_wal_sync();
+	}
+	if(wal_fptr){
+		fclose(wal_fptr);
+		wal_fptr = NULL;
+	}
+	if(wal_filepath){
+		_mosquitto_free(wal_filepath);
+		wal_filepath = NULL;
+	}
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(!slen){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
-		return 1;
+/* Group commit. Make everything logged since the last call durable, then
+ * send the acknowledgements that were waiting for it. */
+void mqtt3_wal_sync(void)
+{
+	if(wal_fptr && wal_dirty){
+		if(fflush(wal_fptr) || _db_fsync(wal_fptr)){
+			_wal_error();
+		}
+		wal_dirty = false;
 	}
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	if(wal_acks){
+		_wal_acks_release();
 	}
-	read_e(db_fptr, client_id, slen);
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	last_mid = ntohs(i16temp);
+/* A save is starting. Mark the point in the log that it will include and make
+ * sure the mark is on disk before the save can be. */
+static void _wal_checkpoint_begin(uint32_t *id)
+{
+	wal_checkpoint_id++;
+	if(_db_checkpoint_chunk_write(wal_fptr, wal_checkpoint_id)
+			|| fflush(wal_fptr) || _db_fsync(wal_fptr)){
 
-	context = _db_find_or_add_context(db, client_id, last_mid);
-	if(!context) rc = 1;
+		_wal_error();
+		return;
+	}
+	wal_dirty = false;
+	wal_checkpoint_pos = ftell(wal_fptr);
+	*id = wal_checkpoint_id;
+}
 
-	_mosquitto_free(client_id);
+/* The save that started at the last checkpoint is on disk, so everything in
+ * the log up to the checkpoint is redundant. Copy what has been logged since
+ * to a new log and move it into place. If the broker stops part way through,
+ * either log is valid: on restore the old one is only replayed from the
+ * checkpoint onwards. */
+static void _wal_checkpoint_end(void)
+{
+	FILE *src = NULL, *dst = NULL;
+	char *tmp_filepath = NULL;
+	char buf[4096];
+	size_t len;
+
+	if(fflush(wal_fptr)){
+		_wal_error();
+		return;
+	}
+	len = strlen(wal_filepath) + strlen(".new") + 1;
+	tmp_filepath = _mosquitto_malloc(len);
+	if(!tmp_filepath){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return;
+	}
+	snprintf(tmp_filepath, len, "%s.new", wal_filepath);
+
+	src = fopen(wal_filepath, "rb");
+	if(!src || fseek(src, wal_checkpoint_pos, SEEK_SET)) goto error;
+	dst = fopen(tmp_filepath, "wb");
+	if(!dst || _wal_header_write(dst)) goto error;
+	while((len = fread(buf, 1, sizeof(buf), src)) > 0){
+		if(fwrite(buf, 1, len, dst) != len) goto error;
+	}
+	if(ferror(src) || fflush(dst) || _db_fsync(dst)) goto error;
+	fclose(src);
+	src = NULL;
+	if(fclose(dst)){
+		dst = NULL;
+		goto error;
+	}
+	dst = NULL;
 
-	return rc;
+	fclose(wal_fptr);
+	wal_fptr = NULL;
+#ifdef WIN32
+	remove(wal_filepath);
+#endif
+	if(rename(tmp_filepath, wal_filepath)){
+		/* The old log is still valid, so carry on appending to it. */
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to replace %s: %s.", wal_filepath, strerror(errno));
+		remove(tmp_filepath);
+	}
+	_mosquitto_free(tmp_filepath);
+	wal_fptr = fopen(wal_filepath, "ab");
+	if(!wal_fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open %s: %s. Write ahead log disabled.", wal_filepath, strerror(errno));
+		return;
+	}
+	setvbuf(wal_fptr, NULL, _IOFBF, 65536);
+	return;
 error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(db_fptr) fclose(db_fptr);
-	if(client_id) _mosquitto_free(client_id);
-	return 1;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to compact %s: %s.", wal_filepath, strerror(errno));
+	if(src) fclose(src);
+	if(dst) fclose(dst);
+	remove(tmp_filepath);
+	_mosquitto_free(tmp_filepath);
 }
 
-static int _db_client_msg_chunk_restore(mosquitto_db *db, FILE *db_fptr)
+/* Send a PUBACK or PUBREC, or hold it back until the next sync if it
+ * acknowledges a change that hasn't been synced yet. */
+int mqtt3_wal_ack(mosquitto_db *db, struct mosquitto *context, uint8_t command, uint16_t mid)
 {
-	dbid_t i64temp, store_id;
-	uint16_t i16temp, slen, mid;
-	uint8_t qos, retain, direction, state, dup;
-	char *client_id = NULL;
-	int rc;
+	struct _wal_ack *ack;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(!slen){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
-		return 1;
+	if(!wal_fptr || !wal_dirty || !db->config->persistence_wal_sync_acks){
+		if(command == PUBACK){
+			return _mosquitto_send_puback(context, mid);
+		}else{
+			return _mosquitto_send_pubrec(context, mid);
+		}
 	}
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
+
+	ack = _mosquitto_malloc(sizeof(struct _wal_ack));
+	if(!ack){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
-	read_e(db_fptr, client_id, slen);
+	ack->next = NULL;
+	ack->context = context;
+	ack->command = command;
+	ack->mid = mid;
+	if(wal_acks_last){
+		wal_acks_last->next = ack;
+	}else{
+		wal_acks = ack;
+	}
+	wal_acks_last = ack;
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
-	store_id = i64temp;
+	return MOSQ_ERR_SUCCESS;
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	mid = ntohs(i16temp);
+/* Forget any held back acknowledgements for a context that is going away. */
+void mqtt3_wal_context_forget(struct mosquitto *context)
+{
+	struct _wal_ack *ack, *prev = NULL, *next;
+
+	ack = wal_acks;
+	while(ack){
+		next = ack->next;
+		if(ack->context == context){
+			if(prev){
+				prev->next = next;
+			}else{
+				wal_acks = next;
+			}
+			if(wal_acks_last == ack){
+				wal_acks_last = prev;
+			}
+			_mosquitto_free(ack);
+		}else{
+			prev = ack;
+		}
+		ack = next;
+	}
+}
 
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	read_e(db_fptr, &direction, sizeof(uint8_t));
-	read_e(db_fptr, &state, sizeof(uint8_t));
-	read_e(db_fptr, &dup, sizeof(uint8_t));
+void mqtt3_wal_client(struct mosquitto *context)
+{
+	if(!_db_session_changed(context)) return;
 
-	rc = _db_client_msg_restore(db, client_id, mid, qos, retain, direction, state, dup, store_id);
-	_mosquitto_free(client_id);
+	if(_db_client_chunk_write(wal_fptr, context)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
+}
 
-	return rc;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(db_fptr) fclose(db_fptr);
-	if(client_id) _mosquitto_free(client_id);
-	return 1;
+/* The queued messages of context have been discarded, along with the rest of
+ * its session if session is true. */
+void mqtt3_wal_client_delete(struct mosquitto *context, bool session)
+{
+	struct _db_client_deleted *deleted;
+
+	if(session && db_delta_tracking && !db_full_needed && context && context->id && !context->clean_session){
+		if(db_delta_list_count < DB_DELTA_MAX_LIST){
+			deleted = _mosquitto_malloc(sizeof(struct _db_client_deleted));
+			if(deleted){
+				deleted->id = _mosquitto_strdup(context->id);
+				if(!deleted->id){
+					_mosquitto_free(deleted);
+					deleted = NULL;
+				}
+			}
+			if(deleted){
+				deleted->next = db_clients_deleted;
+				db_clients_deleted = deleted;
+				db_delta_list_count++;
+			}else{
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				db_full_needed = true;
+			}
+		}else{
+			db_full_needed = true;
+		}
+	}
+	if(!_db_session_changed(context)) return;
+
+	if(_db_client_delete_chunk_write(wal_fptr, context->id, session)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
 }
 
-static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fptr)
+void mqtt3_wal_message(struct mosquitto *context, mosquitto_client_msg *msg)
 {
-	dbid_t i64temp, store_id;
-	uint32_t i32temp, payloadlen;
-	uint16_t i16temp, slen, source_mid, mid;
-	uint8_t qos, retain, *payload = NULL;
-	char *source_id = NULL;
-	char *topic = NULL;
-	int rc = 0;
-	struct mosquitto_msg_store *stored = NULL;
+	if(!_db_session_changed(context)) return;
+
+	if(_wal_store(msg->store) || _db_client_msg_chunk_write(wal_fptr, context, msg)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
+}
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
-	store_id = i64temp;
+void mqtt3_wal_message_delete(struct mosquitto *context, mosquitto_client_msg *msg)
+{
+	if(!_db_session_changed(context)) return;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(slen){
-		source_id = _mosquitto_calloc(slen+1, sizeof(char));
-		if(!source_id){
-			fclose(db_fptr);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		if(fread(source_id, 1, slen, db_fptr) != slen){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			return 1;
+	if(_db_client_msg_delete_chunk_write(wal_fptr, context->id, msg->mid, msg->direction)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_sub(struct mosquitto *context, const char *topic, int qos)
+{
+	if(!_db_session_changed(context)) return;
+
+	if(_db_sub_chunk_write(wal_fptr, context->id, topic, qos)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_unsub(struct mosquitto *context, const char *topic)
+{
+	if(!_db_session_changed(context)) return;
+
+	if(_db_unsub_chunk_write(wal_fptr, context->id, topic)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+/* stored has become the retained message for its topic, or cleared it if it
+ * has no payload. */
+void mqtt3_wal_retain(struct mosquitto_msg_store *stored)
+{
+	struct _db_retain_change *change;
+
+	/* The broker regenerates these itself. */
+	if(!strncmp(stored->msg.topic, "$SYS", 4)) return;
+
+	db_changes++;
+	if(db_delta_tracking && !db_full_needed){
+		if(db_delta_list_count < DB_DELTA_MAX_LIST){
+			change = _mosquitto_malloc(sizeof(struct _db_retain_change));
+			if(change){
+				change->next = NULL;
+				change->stored = stored;
+				stored->ref_count++;
+				if(db_retain_changes_last){
+					db_retain_changes_last->next = change;
+				}else{
+					db_retain_changes = change;
+				}
+				db_retain_changes_last = change;
+				db_delta_list_count++;
+			}else{
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				db_full_needed = true;
+			}
+		}else{
+			db_full_needed = true;
 		}
 	}
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	source_mid = ntohs(i16temp);
+	if(!wal_fptr) return;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	mid = ntohs(i16temp);
+	if(_wal_store(stored) || _db_retain_chunk_write(wal_fptr, stored)){
+		_wal_error();
+		return;
+	}
+	wal_dirty = true;
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(slen){
-		topic = _mosquitto_calloc(slen+1, sizeof(char));
-		if(!topic){
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
+
+/* Queue spilling.
+ *
+ * With queue_spill_time set, the queued messages of a persistent client that
+ * has not been heard from for that long are written to a file of its own and
+ * freed. For each message the file holds its stored message chunk followed by
+ * its client message chunk, in the format of the database file, and any later
+ * spill is appended. When the client reconnects the file is read back, in
+ * front of anything queued since, and removed. Saves copy the chunks from the
+ * file. A background save may be reading a spill file, so nothing is spilled
+ * while one is running and files are only removed once it has finished.
+ */
+struct _db_spill_removal{
+	struct _db_spill_removal *next;
+	char *path;
+};
+
+static struct _db_spill_removal *db_spill_removals = NULL;
+static time_t db_spill_next_check = 0;
+
+static bool _db_backup_running(void)
+{
+#ifndef WIN32
+	return backup_pid != 0;
+#else
+	return false;
+#endif
+}
+
+static char *_db_spill_path(mosquitto_db *db, struct mosquitto *context)
+{
+	const char *hex = "0123456789abcdef";
+	const char *dir;
+	char *path;
+	int len, dlen, pos, i;
+
+	dir = db->config->queue_spill_dir;
+	if(!dir) dir = db->config->persistence_location;
+	if(!dir) dir = "";
+	dlen = strlen(dir);
+
+	len = dlen + 1 + 2*strlen(context->id) + strlen(".queue") + 1;
+	path = _mosquitto_malloc(len);
+	if(!path){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return NULL;
+	}
+	pos = snprintf(path, len, "%s%s", dir, (dlen && dir[dlen-1] != '/')?"/":"");
+	/* Client ids can hold characters that aren't allowed in file names. */
+	for(i=0; context->id[i]; i++){
+		path[pos++] = hex[((uint8_t)context->id[i])>>4];
+		path[pos++] = hex[((uint8_t)context->id[i])&0x0F];
+	}
+	snprintf(&path[pos], len-pos, ".queue");
+	return path;
+}
+
+static void _db_spill_removals_run(void)
+{
+	struct _db_spill_removal *next;
+
+	while(db_spill_removals){
+		next = db_spill_removals->next;
+		remove(db_spill_removals->path);
+		_mosquitto_free(db_spill_removals->path);
+		_mosquitto_free(db_spill_removals);
+		db_spill_removals = next;
+	}
+}
+
+/* The spill file of context is no longer needed. */
+static void _db_spill_forget(struct mosquitto *context)
+{
+	struct _db_spill_removal *removal;
+
+	if(_db_backup_running()){
+		removal = _mosquitto_malloc(sizeof(struct _db_spill_removal));
+		if(removal){
+			removal->path = context->db_spill_path;
+			removal->next = db_spill_removals;
+			db_spill_removals = removal;
+		}else{
+			/* Left behind, to be replaced by the next spill. */
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		if(fread(topic, 1, slen, db_fptr) != slen){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			return 1;
+			_mosquitto_free(context->db_spill_path);
 		}
 	}else{
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid msg_store chunk when restoring persistent database.");
-		fclose(db_fptr);
-		_mosquitto_free(source_id);
+		remove(context->db_spill_path);
+		_mosquitto_free(context->db_spill_path);
+	}
+	context->db_spill_path = NULL;
+	context->db_spill_len = 0;
+}
+
+/* Open the spill file of context, checking that it is as long as expected. */
+static int _db_spill_open(struct mosquitto *context, struct _db_reader *r)
+{
+	if(_db_reader_open(r, context->db_spill_path)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read %s: %s.", context->db_spill_path, strerror(errno));
+		_db_reader_close(r);
 		return 1;
 	}
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	
-	read_e(db_fptr, &i32temp, sizeof(uint32_t));
-	payloadlen = ntohl(i32temp);
-
-	if(payloadlen){
-		payload = _mosquitto_malloc(payloadlen);
-		if(!payload){
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
+	if(r->len < context->db_spill_len || _db_header_read(r)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s is incomplete.", context->db_spill_path);
+		_db_reader_close(r);
+		return 1;
+	}
+	/* Anything after is left over from a spill that failed. */
+	r->len = context->db_spill_len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Copy the chunks of the given type from the spill file of context. */
+static int _db_spill_chunks_write(FILE *db_fptr, struct mosquitto *context, uint16_t type)
+{
+	struct _db_reader r;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	size_t start;
+	int rc;
+
+	if(!context->db_spill_path) return MOSQ_ERR_SUCCESS;
+
+	rc = _db_spill_open(context, &r);
+	if(rc) return rc;
+
+	while(r.len - r.pos >= sizeof(uint16_t) + sizeof(uint32_t)){
+		start = r.pos;
+		if(_db_read(&r, &i16temp, sizeof(uint16_t))
+				|| _db_read(&r, &i32temp, sizeof(uint32_t))
+				|| _db_skip(&r, ntohl(i32temp))){
+			rc = 1;
+			break;
 		}
-		if(fread(payload, 1, payloadlen, db_fptr) != payloadlen){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			_mosquitto_free(payload);
-			return 1;
+		if(ntohs(i16temp) == type){
+			write_e(db_fptr, &r.data[start], r.pos - start);
 		}
 	}
-
-	rc = mqtt3_db_message_store(db, source_id, source_mid, topic, qos, payloadlen, payload, retain, &stored, store_id);
-	_mosquitto_free(source_id);
-	_mosquitto_free(topic);
-	_mosquitto_free(payload);
+	_db_reader_close(&r);
 
 	return rc;
 error:
 	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(db_fptr) fclose(db_fptr);
-	if(source_id) _mosquitto_free(source_id);
-	if(topic) _mosquitto_free(topic);
+	_db_reader_close(&r);
 	return 1;
 }
 
-static int _db_retain_chunk_restore(mosquitto_db *db, FILE *db_fptr)
+/* Write the queued messages of context to its spill file and free them. */
+static int _db_spill(mosquitto_db *db, struct mosquitto *context)
 {
-	dbid_t i64temp, store_id;
-	struct mosquitto_msg_store *store;
+	mosquitto_client_msg *msg;
+	FILE *fptr;
+	long len;
+	int count = 0;
 
-	if(fread(&i64temp, 1, sizeof(dbid_t), db_fptr) != sizeof(dbid_t)){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-		fclose(db_fptr);
-		return 1;
-	}
-	store_id = i64temp;
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
-			break;
-		}
-		store = store->next;
-	}
-	return MOSQ_ERR_SUCCESS;
-}
+	/* Anything still in the database file is older, so must go first. */
+	if(mqtt3_db_lazy_load(db, context)) return 1;
+	if(!context->msgs) return MOSQ_ERR_SUCCESS;
 
-static int _db_sub_chunk_restore(mosquitto_db *db, FILE *db_fptr)
-{
-	uint16_t i16temp, slen;
-	uint8_t qos;
-	char *client_id;
-	char *topic;
-	int rc = 0;
+	if(!context->db_spill_path){
+		context->db_spill_path = _db_spill_path(db, context);
+		if(!context->db_spill_path) return MOSQ_ERR_NOMEM;
+	}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	fptr = fopen(context->db_spill_path, context->db_spill_len ? "r+b" : "wb");
+	if(!fptr) goto error;
+	setvbuf(fptr, NULL, _IOFBF, 65536);
+	if(context->db_spill_len){
+		if(fseek(fptr, context->db_spill_len, SEEK_SET)) goto error;
+	}else{
+		if(_wal_header_write(fptr)) goto error;
 	}
-	read_e(db_fptr, client_id, slen);
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	topic = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!topic){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		_mosquitto_free(client_id);
-		return MOSQ_ERR_NOMEM;
+	for(msg=context->msgs; msg; msg=msg->next){
+		if(_db_msg_store_chunk_write(fptr, msg->store)) goto error;
+		if(_db_client_msg_chunk_write(fptr, context, msg)) goto error;
+		count++;
 	}
-	read_e(db_fptr, topic, slen);
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	if(_db_restore_sub(db, client_id, topic, qos)){
-		rc = 1;
+	if(fflush(fptr)) goto error;
+	len = ftell(fptr);
+	if(fclose(fptr)){
+		fptr = NULL;
+		goto error;
 	}
-	_mosquitto_free(client_id);
-	_mosquitto_free(topic);
 
-	return rc;
+	context->db_spill_len = len;
+	mqtt3_db_messages_free(context);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Spilled %d queued messages for %s to disk.", count, context->id);
+
+	return MOSQ_ERR_SUCCESS;
 error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(db_fptr) fclose(db_fptr);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to spill queued messages to %s: %s.", context->db_spill_path, strerror(errno));
+	if(fptr) fclose(fptr);
+	if(!context->db_spill_len){
+		remove(context->db_spill_path);
+		_mosquitto_free(context->db_spill_path);
+		context->db_spill_path = NULL;
+	}
 	return 1;
 }
 
-int mqtt3_db_restore(mosquitto_db *db)
+void mqtt3_db_spill_check(mosquitto_db *db)
 {
-	FILE *fptr;
-	char header[15];
-	int rc = 0;
-	uint32_t crc, db_version;
-	dbid_t i64temp;
-	uint32_t i32temp, length;
-	uint16_t i16temp, chunk;
-	uint8_t i8temp;
-	ssize_t rlen;
+	struct mosquitto *context;
+	time_t now;
+	int i;
 
 	assert(db);
-	assert(db->config);
-	assert(db->config->persistence_filepath);
 
-	fptr = fopen(db->config->persistence_filepath, "rb");
-	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
-	read_e(fptr, &header, 15);
-	if(!memcmp(header, magic, 15)){
-		// Restore DB as normal
-		read_e(fptr, &crc, sizeof(uint32_t));
-		read_e(fptr, &i32temp, sizeof(uint32_t));
-		db_version = ntohl(i32temp);
-		/* IMPORTANT - this is where compatibility checks are made.
-		 * Is your DB change still compatible with previous versions?
-		 */
-		if(db_version > MOSQ_DB_VERSION && db_version != 0){
-			fclose(fptr);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
-			return 1;
-		}
+	if(!db->config->queue_spill_time) return;
+	now = time(NULL);
+	if(now < db_spill_next_check || _db_backup_running()) return;
+	db_spill_next_check = now + 1;
 
-		while(rlen = fread(&i16temp, 1, sizeof(uint16_t), fptr), rlen == sizeof(uint16_t)){
-			chunk = ntohs(i16temp);
-			read_e(fptr, &i32temp, sizeof(uint32_t));
-			length = ntohl(i32temp);
-			switch(chunk){
-				case DB_CHUNK_CFG:
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // shutdown
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
-					if(i8temp != sizeof(dbid_t)){
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %d)",
-								i8temp, sizeof(dbid_t));
-						fclose(fptr);
-						return 1;
-					}
-					read_e(fptr, &i64temp, sizeof(dbid_t));
-					db->last_db_id = i64temp;
-					break;
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || !context->msgs || context->sock != INVALID_SOCKET) continue;
+		if(context->clean_session || context->bridge) continue;
+		if(now - context->last_msg_in < db->config->queue_spill_time) continue;
 
-				case DB_CHUNK_MSG_STORE:
-					if(_db_msg_store_chunk_restore(db, fptr)) return 1;
-					break;
+		if(_db_spill(db, context)){
+			/* Don't keep trying while the disk is full. */
+			db_spill_next_check = now + db->config->queue_spill_time;
+			break;
+		}
+	}
+}
 
-				case DB_CHUNK_CLIENT_MSG:
-					if(_db_client_msg_chunk_restore(db, fptr)) return 1;
-					break;
+/* Read back the spilled messages of context, in front of any it has gained
+ * since. */
+int mqtt3_db_spill_load(mosquitto_db *db, struct mosquitto *context)
+{
+	struct _db_reader r;
+	mosquitto_client_msg *last;
+	uint32_t i32temp, length;
+	uint16_t i16temp;
+	int rc;
 
-				case DB_CHUNK_RETAIN:
-					if(_db_retain_chunk_restore(db, fptr)) return 1;
-					break;
+	assert(db);
+	assert(context);
 
-				case DB_CHUNK_SUB:
-					if(_db_sub_chunk_restore(db, fptr)) return 1;
-					break;
+	if(!context->db_spill_path) return MOSQ_ERR_SUCCESS;
 
-				case DB_CHUNK_CLIENT:
-					if(_db_client_chunk_restore(db, fptr)) return 1;
+	rc = _db_spill_open(context, &r);
+	if(!rc){
+		last = context->msgs_last;
+		while(r.len - r.pos >= sizeof(uint16_t) + sizeof(uint32_t)){
+			if(_db_read(&r, &i16temp, sizeof(uint16_t))
+					|| _db_read(&r, &i32temp, sizeof(uint32_t))){
+				rc = 1;
+				break;
+			}
+			length = ntohl(i32temp);
+			switch(ntohs(i16temp)){
+				case DB_CHUNK_MSG_STORE:
+					rc = _db_msg_store_chunk_restore(db, &r, DB_CHUNK_MSG_STORE, length);
+					/* It may not be in the database file yet. */
+					if(!rc) db->msg_store->db_saved = false;
+					break;
+				case DB_CHUNK_CLIENT_MSG:
+					rc = _db_client_msg_chunk_restore(db, &r, DB_CHUNK_CLIENT_MSG, length, context);
 					break;
-
 				default:
-					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fptr, length, SEEK_CUR);
+					rc = _db_skip(&r, length);
 					break;
 			}
+			if(rc) break;
+		}
+		_db_reader_close(&r);
+		if(last && last->next){
+			mqtt3_db_messages_to_front(context, last->next);
 		}
-		if(rlen < 0) goto error;
-	}else{
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
-		rc = 1;
 	}
-
-	fclose(fptr);
+	_db_spill_forget(context);
 
 	return rc;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(fptr) fclose(fptr);
-	return 1;
 }
 
-static int _db_restore_sub(mosquitto_db *db, const char *client_id, const char *sub, int qos)
+/* The messages of context are being thrown away. */
+void mqtt3_db_spill_drop(struct mosquitto *context)
 {
-	struct mosquitto *context;
-
-	assert(db);
-	assert(client_id);
-	assert(sub);
-
-	context = _db_find_or_add_context(db, client_id, 0);
-	if(!context) return 1;
-	return mqtt3_sub_add(context, sub, qos, &db->subs);
+	if(context->db_spill_path){
+		_db_spill_forget(context);
+	}
 }
 
 #endif
@@ -38,6 +38,41 @@ const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* Only found in the write ahead log. */
+#define DB_CHUNK_CLIENT_MSG_DELETE 7
+#define DB_CHUNK_UNSUB 8
+#define DB_CHUNK_CLIENT_DELETE 9
+/* Marks the point in the write ahead log that a database save includes. Found
+ * in both. */
+#define DB_CHUNK_CHECKPOINT 10
+/* Starts each set of changes in a delta file, giving the id of the database
+ * file they apply to and their length. The database file records its own id
+ * with a length of 0. */
+#define DB_CHUNK_DELTA 11
+/* Version 4 database files. A string that later chunks in the same file refer
+ * to by number, counting from 1 in the order they appear. Number 0 is the
+ * empty string. */
+#define DB_CHUNK_STRING 12
+/* Packed versions of the chunks above. Integers are varints, 7 bits to a byte
+ * with the top bit set on all but the last, and strings are numbers from
+ * string chunks. A packed client message belongs to the client of the client
+ * chunk before it, so it doesn't name the client. */
+#define DB_CHUNK_MSG_STORE_PACKED 13
+#define DB_CHUNK_CLIENT_MSG_PACKED 14
+#define DB_CHUNK_SUB_PACKED 15
+#define DB_CHUNK_CLIENT_PACKED 16
+/* Flags of a packed stored message. */
+#define DB_STORE_QOS_MASK 0x03
+#define DB_STORE_RETAIN 0x04
+/* The payload is compressed with zlib. */
+#define DB_STORE_COMPRESSED 0x08
+/* An expiry time follows the payload length. */
+#define DB_STORE_EXPIRY 0x10
+/* Flags of a packed client message. */
+#define DB_MSG_QOS_MASK 0x03
+#define DB_MSG_RETAIN 0x04
+#define DB_MSG_DIRECTION 0x08
+#define DB_MSG_DUP 0x10
 /* End DB read/write */
 
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
@@ -0,0 +1,287 @@
+/*
+Copyright (c) 2012 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mqtt3.h>
+#include <memory_mosq.h>
+#include <util_mosq.h>
+
+/* Number of times each limit has been reached, for $SYS/broker/quota/. */
+static unsigned long quota_hits[mq_count];
+
+static const char *quota_names[mq_count] = {
+	"max_user_subscriptions",
+	"max_user_retained",
+	"max_user_queued_bytes",
+	"max_listener_subscriptions",
+	"max_listener_retained",
+	"max_listener_queued_bytes"
+};
+
+static struct _mosquitto_quota_user **_quota_user_slot(mosquitto_db *db, const char *username)
+{
+	struct _mosquitto_quota_user **slot;
+
+	slot = &db->quota_user_hash[_mosquitto_str_hash(username) & (db->quota_user_hash_size-1)];
+	while(*slot && strcmp((*slot)->username, username)){
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+/* Double the size of the user hash, which must stay a power of two. */
+static int _quota_user_hash_grow(mosquitto_db *db)
+{
+	struct _mosquitto_quota_user **hash, **old_hash, *user, *next;
+	int i, old_size, size;
+
+	old_hash = db->quota_user_hash;
+	old_size = db->quota_user_hash_size;
+	size = old_size ? old_size*2 : 64;
+
+	hash = _mosquitto_calloc(size, sizeof(struct _mosquitto_quota_user *));
+	if(!hash) return MOSQ_ERR_NOMEM;
+
+	db->quota_user_hash = hash;
+	db->quota_user_hash_size = size;
+	for(i=0; i<old_size; i++){
+		user = old_hash[i];
+		while(user){
+			next = user->next;
+			user->next = hash[_mosquitto_str_hash(user->username) & (size-1)];
+			hash[_mosquitto_str_hash(user->username) & (size-1)] = user;
+			user = next;
+		}
+	}
+	if(old_hash) _mosquitto_free(old_hash);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct _mosquitto_quota_user *_quota_user_get(mosquitto_db *db, const char *username)
+{
+	struct _mosquitto_quota_user **slot, *user;
+
+	if(db->quota_user_hash_size){
+		slot = _quota_user_slot(db, username);
+		if(*slot) return *slot;
+	}
+	if(db->quota_user_count >= db->quota_user_hash_size){
+		if(_quota_user_hash_grow(db)) return NULL;
+	}
+
+	user = _mosquitto_calloc(1, sizeof(struct _mosquitto_quota_user));
+	if(!user) return NULL;
+	user->username = _mosquitto_strdup(username);
+	if(!user->username){
+		_mosquitto_free(user);
+		return NULL;
+	}
+	slot = _quota_user_slot(db, username);
+	*slot = user;
+	db->quota_user_count++;
+	return user;
+}
+
+static void _quota_user_release(mosquitto_db *db, struct _mosquitto_quota_user *user)
+{
+	struct _mosquitto_quota_user **slot;
+
+	user->ref_count--;
+	if(user->ref_count > 0) return;
+
+	slot = _quota_user_slot(db, user->username);
+	assert(*slot == user);
+	*slot = user->next;
+	db->quota_user_count--;
+	_mosquitto_free(user->username);
+	_mosquitto_free(user);
+}
+
+/* Make the subscriptions and queued messages of context count towards the
+ * limits of username, moving them from any user it was counted against
+ * before. Clients without a username are only subject to the listener
+ * limits. */
+int mqtt3_quota_user_set(mosquitto_db *db, struct mosquitto *context, const char *username)
+{
+	struct _mosquitto_quota_user *user = NULL;
+
+	assert(db);
+	assert(context);
+
+	if(username){
+		if(context->quota_user && !strcmp(context->quota_user->username, username)){
+			return MOSQ_ERR_SUCCESS;
+		}
+		user = _quota_user_get(db, username);
+		if(!user){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		user->ref_count++;
+		user->sub_count += context->sub_count;
+		user->msg_bytes += context->msg_bytes;
+		user->out_packet_bytes += context->out_packet_bytes;
+	}
+	if(context->quota_user){
+		context->quota_user->sub_count -= context->sub_count;
+		context->quota_user->msg_bytes -= context->msg_bytes;
+		context->quota_user->out_packet_bytes -= context->out_packet_bytes;
+		_quota_user_release(db, context->quota_user);
+	}
+	context->quota_user = user;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Free the users left over once all clients and the subscription tree have
+ * gone. */
+void mqtt3_quota_cleanup(mosquitto_db *db)
+{
+	struct _mosquitto_quota_user *user, *next;
+	int i;
+
+	for(i=0; i<db->quota_user_hash_size; i++){
+		user = db->quota_user_hash[i];
+		while(user){
+			next = user->next;
+			_mosquitto_free(user->username);
+			_mosquitto_free(user);
+			user = next;
+		}
+	}
+	if(db->quota_user_hash) _mosquitto_free(db->quota_user_hash);
+	db->quota_user_hash = NULL;
+	db->quota_user_hash_size = 0;
+	db->quota_user_count = 0;
+}
+
+/* Called whenever a subscription of context is added (delta 1) or removed
+ * (delta -1). */
+void mqtt3_quota_sub_count(struct mosquitto *context, int delta)
+{
+	context->sub_count += delta;
+	if(context->quota_user){
+		context->quota_user->sub_count += delta;
+	}
+	if(context->listener){
+		context->listener->sub_count += delta;
+	}
+}
+
+/* Returns true if context may not add a subscription to sub because its user
+ * or listener is at its subscription limit. Changing the QoS of an existing
+ * subscription is always allowed. */
+bool mqtt3_quota_sub_refused(mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	bool user_limit, listener_limit;
+	struct _mosquitto_subhier *root;
+	int offset;
+
+	user_limit = context->quota_user && db->config->max_user_subscriptions
+			&& context->quota_user->sub_count >= db->config->max_user_subscriptions;
+	listener_limit = context->listener && context->listener->max_subscriptions
+			&& context->listener->sub_count >= context->listener->max_subscriptions;
+
+	if(!user_limit && !listener_limit) return false;
+	root = mqtt3_sub_root(db, context->listener?context->listener->mount:NULL, sub, &offset);
+	if(mqtt3_sub_exists(context, &sub[offset], root)) return false;
+
+	if(user_limit) mqtt3_quota_hit(mq_user_subscriptions);
+	if(listener_limit) mqtt3_quota_hit(mq_listener_subscriptions);
+	return true;
+}
+
+/* Returns true if a message from context may not be retained on a topic that
+ * has no retained message yet. context may be NULL for messages that the
+ * broker publishes itself. */
+bool mqtt3_quota_retained_refused(mosquitto_db *db, struct mosquitto *context)
+{
+	bool user_limit, listener_limit;
+
+	if(!context) return false;
+
+	user_limit = context->quota_user && db->config->max_user_retained
+			&& context->quota_user->retained_count >= db->config->max_user_retained;
+	listener_limit = context->listener && context->listener->max_retained
+			&& context->listener->retained_count >= context->listener->max_retained;
+
+	if(user_limit) mqtt3_quota_hit(mq_user_retained);
+	if(listener_limit) mqtt3_quota_hit(mq_listener_retained);
+	return user_limit || listener_limit;
+}
+
+/* Count the retained message just set on node against the user and listener
+ * of context. */
+void mqtt3_quota_retained_set(struct _mosquitto_subhier *node, struct mosquitto *context)
+{
+	if(!context || node->retained_user || node->retained_listener) return;
+
+	if(context->quota_user){
+		node->retained_user = context->quota_user;
+		node->retained_user->ref_count++;
+		node->retained_user->retained_count++;
+	}
+	if(context->listener){
+		node->retained_listener = context->listener;
+		node->retained_listener->retained_count++;
+	}
+}
+
+/* The retained message of node has been removed. */
+void mqtt3_quota_retained_clear(mosquitto_db *db, struct _mosquitto_subhier *node)
+{
+	if(node->retained_user){
+		node->retained_user->retained_count--;
+		_quota_user_release(db, node->retained_user);
+		node->retained_user = NULL;
+	}
+	if(node->retained_listener){
+		node->retained_listener->retained_count--;
+		node->retained_listener = NULL;
+	}
+}
+
+void mqtt3_quota_hit(enum mqtt3_quota quota)
+{
+	quota_hits[quota]++;
+}
+
+unsigned long mqtt3_quota_hits(enum mqtt3_quota quota)
+{
+	return quota_hits[quota];
+}
+
+const char *mqtt3_quota_name(enum mqtt3_quota quota)
+{
+	return quota_names[quota];
+}
@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2012 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <mqtt3.h>
+#include <util_mosq.h>
+
+/* Each limit is a token bucket that fills at its rate per second and holds
+ * at most one second's worth, so that short bursts are allowed. Packets are
+ * taken from the bucket once they have been read, which can leave it
+ * overdrawn. Nothing more is read from the client until it has refilled,
+ * which pushes back on the client through TCP rather than dropping
+ * anything. */
+
+static void _bucket_fill(struct _mosquitto_bucket *bucket, unsigned long rate, uint64_t now)
+{
+	int64_t max = (int64_t)rate*1000;
+
+	if(!bucket->updated || now < bucket->updated){
+		bucket->tokens = max;
+	}else{
+		bucket->tokens += (int64_t)rate*(int64_t)(now - bucket->updated);
+		if(bucket->tokens > max) bucket->tokens = max;
+	}
+	bucket->updated = now;
+}
+
+/* Returns the milliseconds until bucket holds at least need tokens, up to a
+ * second. 0 means it can be used now. */
+static int _bucket_wait(struct _mosquitto_bucket *bucket, unsigned long rate, int64_t need, uint64_t now)
+{
+	int64_t wait;
+
+	if(!rate) return 0;
+	_bucket_fill(bucket, rate, now);
+	if(bucket->tokens >= need) return 0;
+
+	wait = (need - bucket->tokens + rate - 1)/rate;
+	return wait < 1000 ? (int)wait : 1000;
+}
+
+static void _bucket_take(struct _mosquitto_bucket *bucket, unsigned long rate, uint32_t count, uint64_t now)
+{
+	if(!rate) return;
+	_bucket_fill(bucket, rate, now);
+	bucket->tokens -= (int64_t)count*1000;
+}
+
+/* Returns how many milliseconds to wait before reading from context again
+ * because it, its user or its listener is over its inbound rate. 0 means it
+ * may be read now. Bridges carry the messages of many clients, so aren't
+ * limited. */
+int mqtt3_rate_inbound_wait(mosquitto_db *db, struct mosquitto *context, uint64_t now)
+{
+	struct _mosquitto_quota_user *user = context->quota_user;
+	struct _mqtt3_listener *listener = context->listener;
+	int wait, w;
+
+	if(context->bridge) return 0;
+
+	wait = _bucket_wait(&context->in_msgs, db->config->max_inbound_rate, 0, now);
+	w = _bucket_wait(&context->in_bytes, db->config->max_inbound_bytes_rate, 0, now);
+	if(w > wait) wait = w;
+	if(user){
+		w = _bucket_wait(&user->in_msgs, db->config->max_user_inbound_rate, 0, now);
+		if(w > wait) wait = w;
+		w = _bucket_wait(&user->in_bytes, db->config->max_user_inbound_bytes_rate, 0, now);
+		if(w > wait) wait = w;
+	}
+	if(listener){
+		w = _bucket_wait(&listener->in_msgs, listener->max_inbound_rate, 0, now);
+		if(w > wait) wait = w;
+		w = _bucket_wait(&listener->in_bytes, listener->max_inbound_bytes_rate, 0, now);
+		if(w > wait) wait = w;
+	}
+	return wait;
+}
+
+/* Count a PUBLISH of bytes bytes received from context against the inbound
+ * rates that apply to it. */
+void mqtt3_rate_inbound_take(mosquitto_db *db, struct mosquitto *context, uint32_t bytes)
+{
+	struct _mosquitto_quota_user *user = context->quota_user;
+	struct _mqtt3_listener *listener = context->listener;
+	uint64_t now;
+
+	if(context->bridge) return;
+	if(!db->config->max_inbound_rate && !db->config->max_inbound_bytes_rate
+			&& !(user && (db->config->max_user_inbound_rate || db->config->max_user_inbound_bytes_rate))
+			&& !(listener && (listener->max_inbound_rate || listener->max_inbound_bytes_rate))){
+
+		return;
+	}
+
+	now = _mosquitto_time_ms();
+	_bucket_take(&context->in_msgs, db->config->max_inbound_rate, 1, now);
+	_bucket_take(&context->in_bytes, db->config->max_inbound_bytes_rate, bytes, now);
+	if(user){
+		_bucket_take(&user->in_msgs, db->config->max_user_inbound_rate, 1, now);
+		_bucket_take(&user->in_bytes, db->config->max_user_inbound_bytes_rate, bytes, now);
+	}
+	if(listener){
+		_bucket_take(&listener->in_msgs, listener->max_inbound_rate, 1, now);
+		_bucket_take(&listener->in_bytes, listener->max_inbound_bytes_rate, bytes, now);
+	}
+}
+
+/* Bridges and the clients of some listeners are sent data no faster than a
+ * set number of bytes a second, for links that are slow or charged by the
+ * byte. */
+static unsigned long _rate_outbound_limit(struct mosquitto *context)
+{
+	if(context->bridge) return context->bridge->outbound_bytes_rate;
+	if(context->listener) return context->listener->max_outbound_bytes_rate;
+	return 0;
+}
+
+/* Returns how many milliseconds to wait before at least one byte may be
+ * written to context. */
+int mqtt3_rate_outbound_wait(struct mosquitto *context, uint64_t now)
+{
+	return _bucket_wait(&context->out_bytes, _rate_outbound_limit(context), 1000, now);
+}
+
+/* Returns how many of the next len bytes may be written to context now. */
+uint32_t mqtt3_rate_outbound_allowed(struct mosquitto *context, uint32_t len)
+{
+	unsigned long rate = _rate_outbound_limit(context);
+
+	if(!rate) return len;
+
+	_bucket_fill(&context->out_bytes, rate, _mosquitto_time_ms());
+	if(context->out_bytes.tokens < 1000) return 0;
+	if(context->out_bytes.tokens/1000 < len) return (uint32_t)(context->out_bytes.tokens/1000);
+	return len;
+}
+
+/* Count bytes written to context, straight after
+ * mqtt3_rate_outbound_allowed(). */
+void mqtt3_rate_outbound_take(struct mosquitto *context, uint32_t bytes)
+{
+	if(_rate_outbound_limit(context)){
+		context->out_bytes.tokens -= (int64_t)bytes*1000;
+	}
+}
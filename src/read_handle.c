@@ -88,26 +88,37 @@ int mqtt3_handle_publish(mosquitto_db *db, struct mosquitto *context)
 {
 	char *topic;
 	uint8_t *payload = NULL;
-	uint32_t payloadlen;
+	uint32_t payloadlen, len;
 	uint8_t dup, qos, retain;
 	uint16_t mid = 0;
 	int rc = 0;
 	uint8_t header = context->in_packet.command;
 	int res = 0;
 	struct mosquitto_msg_store *stored = NULL;
-	int len;
-	char *topic_mount;
+	struct _mosquitto_mount *mount = NULL;
+	char *unmounted;
 
 	dup = (header & 0x08)>>3;
 	qos = (header & 0x06)>>1;
 	retain = (header & 0x01);
 
-	if(_mosquitto_read_string(&context->in_packet, &topic)) return 1;
-	if(_mosquitto_fix_sub_topic(&topic)) return 1;
-	if(!strlen(topic)){
+	/* Whatever happens to the message, it has used up some of the inbound
+	 * rate of the client, and counts towards it being a heavy publisher. */
+	len = 1 + context->in_packet.remaining_count + context->in_packet.remaining_length;
+	mqtt3_rate_inbound_take(db, context, len);
+	context->overload_bytes += len;
+
+	/* The topic is read straight in after the mount_point of the listener. */
+	if(context->listener) mount = context->listener->mount;
+	if(_mosquitto_read_string_prefix(&context->in_packet,
+				mount?mount->mount_point:NULL, mount?mount->len:0, &topic)) return 1;
+	unmounted = mount?&topic[mount->len]:topic;
+	_mosquitto_fix_sub_topic(&unmounted);
+	if(!strlen(unmounted)){
+		_mosquitto_free(topic);
 		return 1;
 	}
-	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS){
+	if(_mosquitto_topic_wildcard_len_check(unmounted) != MOSQ_ERR_SUCCESS){
 		/* Invalid publish topic, just swallow it. */
 		_mosquitto_free(topic);
 		return MOSQ_ERR_SUCCESS;
@@ -121,20 +132,9 @@ int mqtt3_handle_publish(mosquitto_db *db, struct mosquitto *context)
 	}
 
 	payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
-	if(context->listener && context->listener->mount_point){
-		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
-		topic_mount = _mosquitto_calloc(len, sizeof(char));
-		if(!topic_mount){
-			_mosquitto_free(topic);
-			return MOSQ_ERR_NOMEM;
-		}
-		snprintf(topic_mount, len, "%s%s", context->listener->mount_point, topic);
-		_mosquitto_free(topic);
-		topic = topic_mount;
-	}
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-	if(payloadlen){
+	if(payloadlen && !context->in_packet.mapped_length){
 		payload = _mosquitto_calloc(payloadlen+1, sizeof(uint8_t));
 		if(_mosquitto_read_bytes(&context->in_packet, payload, payloadlen)){
 			_mosquitto_free(topic);
@@ -154,26 +154,46 @@ int mqtt3_handle_publish(mosquitto_db *db, struct mosquitto *context)
 		return rc;
 	}
 
+	if(qos == 0 && !retain && !context->in_packet.mapped_length
+			&& !mqtt3_db_conflate_topic(db, topic)){
+		/* Nothing to keep, so skip the message store where possible. */
+		rc = mqtt3_db_messages_queue_qos0(db, context->id, context->listener, topic, payloadlen, payload);
+		_mosquitto_free(topic);
+		if(payload) _mosquitto_free(payload);
+		return rc;
+	}
+
 	if(qos > 0){
 		mqtt3_db_message_store_find(context, mid, &stored);
 	}
 	if(!stored){
 		dup = 0;
-		if(mqtt3_db_message_store(db, context->id, mid, topic, qos, payloadlen, payload, retain, &stored, 0)){
+		if(mqtt3_db_message_store(db, context->id, mid, topic, qos, payload?payloadlen:0, payload, retain, &stored, 0)){
 			_mosquitto_free(topic);
 			if(payload) _mosquitto_free(payload);
 			return 1;
 		}
+		if(context->in_packet.mapped_length){
+			/* Large payload that was spilled to file, keep it there. */
+			mqtt3_db_message_store_map(stored, &context->in_packet);
+		}
+		if(context->listener && context->listener->message_expiry){
+			stored->expiry_time = mqtt3_db_message_expiry(db, context->listener, topic);
+		}
 	}else{
 		dup = 1;
 	}
 	switch(qos){
 		case 0:
-			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
+			if(mqtt3_db_messages_queue(db, context, context->id, topic, qos, retain, stored)) rc = 1;
 			break;
 		case 1:
-			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
+			if(mqtt3_db_messages_queue(db, context, context->id, topic, qos, retain, stored)) rc = 1;
+#ifdef WITH_PERSISTENCE
+			if(mqtt3_wal_ack(db, context, PUBACK, mid)) rc = 1;
+#else
 			if(_mosquitto_send_puback(context, mid)) rc = 1;
+#endif
 			break;
 		case 2:
 			if(!dup){
@@ -182,7 +202,11 @@ int mqtt3_handle_publish(mosquitto_db *db, struct mosquitto *context)
 				res = 0;
 			}
 			if(!res){
+#ifdef WITH_PERSISTENCE
+				if(mqtt3_wal_ack(db, context, PUBREC, mid)) rc = 1;
+#else
 				if(_mosquitto_send_pubrec(context, mid)) rc = 1;
+#endif
 			}else if(res == 1){
 				rc = 1;
 			}
@@ -85,6 +85,8 @@ int mqtt3_handle_connack(mosquitto_db *db, struct mosquitto *context)
 				}
 			}
 			context->state = mosq_cs_connected;
+			/* Send anything that was queued while the connection was down. */
+			mqtt3_db_messages_resume(context);
 			return MOSQ_ERR_SUCCESS;
 		case 1:
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Connection Refused: unacceptable protocol version");
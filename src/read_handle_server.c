@@ -38,6 +38,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <send_mosq.h>
 #include <util_mosq.h>
 
+static int _connect_finish(mosquitto_db *db, struct mosquitto *context, char *client_id, struct mosquitto_message *will_struct, uint8_t clean_session);
+
 int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 {
 	char *protocol_name;
@@ -49,9 +51,7 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 	uint8_t will, will_retain, will_qos, clean_session;
 	uint8_t username_flag, password_flag;
 	char *username, *password = NULL;
-	int i;
 	int rc;
-	struct _mosquitto_acl_user *acl_tail;
 	struct mosquitto *context;
 
 	context = db->contexts[context_index];
@@ -134,7 +134,15 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 			mqtt3_context_disconnect(db, context_index);
 			return MOSQ_ERR_NOMEM;
 		}
-		if(_mosquitto_read_string(&context->in_packet, &will_topic)){
+		/* The will is published from within the mount_point, like any other
+		 * message from the client. */
+		if(context->listener && context->listener->mount){
+			rc = _mosquitto_read_string_prefix(&context->in_packet, context->listener->mount->mount_point,
+					context->listener->mount->len, &will_topic);
+		}else{
+			rc = _mosquitto_read_string(&context->in_packet, &will_topic);
+		}
+		if(rc){
 			_mosquitto_free(client_id);
 			mqtt3_context_disconnect(db, context_index);
 			return 1;
@@ -144,6 +152,16 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 			mqtt3_context_disconnect(db, context_index);
 			return 1;
 		}
+		will_struct->topic = will_topic;
+		if(will_message){
+			will_struct->payload = (uint8_t *)will_message;
+			will_struct->payloadlen = strlen(will_message);
+		}else{
+			will_struct->payload = NULL;
+			will_struct->payloadlen = 0;
+		}
+		will_struct->qos = will_qos;
+		will_struct->retain = will_retain;
 	}
 
 	if(username_flag){
@@ -160,10 +178,17 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 					password_flag = 0;
 				}
 			}
-			rc = mosquitto_unpwd_check(db, username, password);
+			rc = mosquitto_unpwd_check(db, context, username, password);
 			context->username = username;
 			context->password = password;
-			if(rc == MOSQ_ERR_AUTH){
+			if(rc == MOSQ_ERR_AUTH_PENDING){
+				/* The auth plugin carries on from here when it has an
+				 * answer, see mqtt3_handle_connect_auth(). */
+				context->auth_job->client_id = client_id;
+				context->auth_job->will = will_struct;
+				context->auth_job->clean_session = clean_session;
+				return MOSQ_ERR_SUCCESS;
+			}else if(rc == MOSQ_ERR_AUTH){
 				_mosquitto_send_connack(context, 2);
 				mqtt3_context_disconnect(db, context_index);
 				_mosquitto_free(client_id);
@@ -188,6 +213,56 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 		return MOSQ_ERR_SUCCESS;
 	}
 
+	return _connect_finish(db, context, client_id, will_struct, clean_session);
+}
+
+/* Carry on with a CONNECT once the auth plugin has checked the password. */
+int mqtt3_handle_connect_auth(mosquitto_db *db, struct _mosquitto_auth_job *job)
+{
+	struct mosquitto *context = job->context;
+	char *client_id;
+	struct mosquitto_message *will_struct;
+	int i;
+
+	/* Disconnected while waiting, the job frees the CONNECT state. */
+	if(context->sock == INVALID_SOCKET) return MOSQ_ERR_SUCCESS;
+
+	client_id = job->client_id;
+	will_struct = job->will;
+	job->client_id = NULL;
+	job->will = NULL;
+
+	if(job->rc == MOSQ_ERR_SUCCESS){
+		return _connect_finish(db, context, client_id, will_struct, job->clean_session);
+	}
+
+	if(job->rc == MOSQ_ERR_AUTH){
+		_mosquitto_send_connack(context, 2);
+	}else{
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Auth plugin unable to check password for %s (%d).", client_id, job->rc);
+		_mosquitto_send_connack(context, 3);
+	}
+	_mosquitto_free(client_id);
+	if(will_struct){
+		if(will_struct->topic) _mosquitto_free(will_struct->topic);
+		if(will_struct->payload) _mosquitto_free(will_struct->payload);
+		_mosquitto_free(will_struct);
+	}
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] == context){
+			mqtt3_context_disconnect(db, i);
+			break;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* The part of a CONNECT after the client has passed the security checks. */
+static int _connect_finish(mosquitto_db *db, struct mosquitto *context, char *client_id, struct mosquitto_message *will_struct, uint8_t clean_session)
+{
+	int i;
+	struct _mosquitto_mount *mount;
+
 	/* Find if this client already has an entry. This must be done *after* any security checks. */
 	for(i=0; i<db->context_count; i++){
 		if(db->contexts[i] && db->contexts[i]->id && !strcmp(db->contexts[i]->id, client_id)){
@@ -201,18 +276,38 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Client %s already connected, closing old connection.", client_id);
 				}
 			}
+#ifdef WITH_PERSISTENCE
+			if(clean_session){
+				/* The old session is about to be thrown away. */
+				mqtt3_wal_client_delete(db->contexts[i], true);
+			}
+#endif
 			db->contexts[i]->clean_session = clean_session;
 			mqtt3_context_cleanup(db, db->contexts[i], false);
 			db->contexts[i]->state = mosq_cs_connected;
 			db->contexts[i]->address = _mosquitto_strdup(context->address);
+			db->contexts[i]->username = context->username;
+			context->username = NULL;
+			db->contexts[i]->password = context->password;
+			context->password = NULL;
 			db->contexts[i]->sock = context->sock;
-			db->contexts[i]->listener = context->listener;
+			mqtt3_context_listener_set(db->contexts[i], context->listener);
 			db->contexts[i]->last_msg_in = time(NULL);
 			db->contexts[i]->last_msg_out = time(NULL);
 			db->contexts[i]->keepalive = context->keepalive;
 			context->sock = -1;
 			context->state = mosq_cs_disconnecting;
 			context = db->contexts[i];
+#ifdef WITH_PERSISTENCE
+			/* Spilled messages are older than those queued since, and
+			 * those still in the database file are older again. */
+			if(mqtt3_db_spill_load(db, context)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore spilled messages for %s.", client_id);
+			}
+			if(mqtt3_db_lazy_load(db, context)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore queued messages for %s.", client_id);
+			}
+#endif
 			if(context->msgs){
 				/* Messages received when the client was disconnected are put
 				 * in the ms_queued state. If we don't change them to the
@@ -236,6 +331,9 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 							break;
 					}
 				}
+				/* Messages that were in flight when the client disconnected
+				 * are also waiting to be sent. */
+				mqtt3_db_write_schedule(context);
 			}
 			break;
 		}
@@ -243,41 +341,25 @@ int mqtt3_handle_connect(mosquitto_db *db, int context_index)
 
 	context->id = client_id;
 	context->clean_session = clean_session;
+	/* New subscriptions go in the tree of the listener mount_point. If the
+	 * session has none left in any other tree, only that one needs cleaning
+	 * when the session ends. */
+	mount = context->listener?context->listener->mount:NULL;
+	if(!context->sub_count){
+		context->mount = mount;
+	}else if(context->mount != mount){
+		context->mount = NULL;
+	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client(context);
+#endif
 
 	context->will = will_struct;
-	if(context->will){
-		context->will->topic = will_topic;
-		if(will_message){
-			context->will->payload = (uint8_t *)will_message;
-			context->will->payloadlen = strlen(will_message);
-		}else{
-			context->will->payload = NULL;
-			context->will->payloadlen = 0;
-		}
-		context->will->qos = will_qos;
-		context->will->retain = will_retain;
-	}
 
 	/* Associate user with its ACL, assuming we have ACLs loaded. */
-	if(db->acl_list){
-		acl_tail = db->acl_list;
-		while(acl_tail){
-			if(context->username){
-				if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}else{
-				if(acl_tail->username == NULL){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}
-			acl_tail = acl_tail->next;
-		}
-	}else{
-		context->acl_list = NULL;
-	}
+	context->acl_list = mosquitto_acl_user_find(db, context->username);
+	mosquitto_acl_context_changed(context);
+	if(mqtt3_quota_user_set(db, context, context->username)) return MOSQ_ERR_NOMEM;
 
 	if(db->config->connection_messages == true){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New client connected from %s as %s.", context->address, client_id);
@@ -315,18 +397,23 @@ int mqtt3_handle_subscribe(mosquitto_db *db, struct mosquitto *context)
 	uint8_t qos;
 	uint8_t *payload = NULL, *tmp_payload;
 	uint32_t payloadlen = 0;
-	int len;
-	char *sub_mount;
+	struct _mosquitto_mount *mount = NULL;
+	struct _mosquitto_subhier *root;
+	char *unmounted;
+	int offset;
+	enum mqtt3_sub_acl sub_acl;
 
 	if(!context) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received SUBSCRIBE from %s", context->id);
 	/* FIXME - plenty of potential for memory leaks here */
 
 	if(_mosquitto_read_uint16(&context->in_packet, &mid)) return 1;
+	if(context->listener) mount = context->listener->mount;
 
 	while(context->in_packet.pos < context->in_packet.remaining_length){
 		sub = NULL;
-		if(_mosquitto_read_string(&context->in_packet, &sub)){
+		if(_mosquitto_read_string_prefix(&context->in_packet,
+					mount?mount->mount_point:NULL, mount?mount->len:0, &sub)){
 			if(payload) _mosquitto_free(payload);
 			return 1;
 		}
@@ -344,50 +431,39 @@ int mqtt3_handle_subscribe(mosquitto_db *db, struct mosquitto *context)
 				if(payload) _mosquitto_free(payload);
 				return 1;
 			}
-			if(_mosquitto_fix_sub_topic(&sub)){
-				_mosquitto_free(sub);
-				if(payload) _mosquitto_free(payload);
-				return 1;
-			}
-			if(!strlen(sub)){
+			unmounted = mount?&sub[mount->len]:sub;
+			_mosquitto_fix_sub_topic(&unmounted);
+			if(!strlen(unmounted)){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Empty subscription string from %s, disconnecting.",
 					context->address);
 				_mosquitto_free(sub);
 				if(payload) _mosquitto_free(payload);
 				return 1;
 			}
-			if(context->listener && context->listener->mount_point){
-				len = strlen(context->listener->mount_point) + strlen(sub) + 1;
-				sub_mount = _mosquitto_calloc(len, sizeof(char));
-				if(!sub_mount){
-					_mosquitto_free(sub);
-					if(payload) _mosquitto_free(payload);
-					return MOSQ_ERR_NOMEM;
-				}
-				snprintf(sub_mount, len, "%s%s", context->listener->mount_point, sub);
-				_mosquitto_free(sub);
-				sub = sub_mount;
-
-			}
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s (QoS %d)", sub, qos);
-			/* FIXME - need to deny access to retained messages. */
-#if 0
-			/* Check for topic access */
-			rc2 = mqtt3_acl_check(db, context, sub, MOSQ_ACL_READ);
-			if(rc2 == MOSQ_ERR_SUCCESS){
-				mqtt3_sub_add(context, sub, qos, &db->subs);
-				if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
-			}else if(rc2 != MOSQ_ERR_ACL_DENIED){
-				rc = 1;
-			}
-#else
-			rc2 = mqtt3_sub_add(context, sub, qos, &db->subs);
-			if(rc2 == MOSQ_ERR_SUCCESS){
-				if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
-			}else if(rc2 != -1){
-				rc = rc2;
-			}
+			/* A subscription that can never be sent anything, or that would
+			 * take the client over a subscription limit, isn't added. The
+			 * client still gets its QoS in the SUBACK, as there is no way
+			 * of refusing a subscription. */
+			sub_acl = mosquitto_acl_check_sub(db, context, sub);
+			if(sub_acl == sa_deny){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Denied subscription to %s from %s.", sub, context->id);
+			}else if(mqtt3_quota_sub_refused(db, context, sub)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Refused subscription to %s from %s, over its subscription limit.", sub, context->id);
+			}else{
+				root = mqtt3_sub_root(db, mount, sub, &offset);
+				rc2 = mqtt3_sub_add(context, &sub[offset], qos, root, sub_acl);
+#ifdef WITH_PERSISTENCE
+				if(rc2 == MOSQ_ERR_SUCCESS || rc2 == -1){
+					mqtt3_wal_sub(context, sub, qos);
+				}
 #endif
+				if(rc2 == MOSQ_ERR_SUCCESS){
+					if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
+				}else if(rc2 != -1){
+					rc = rc2;
+				}
+			}
 			_mosquitto_free(sub);
 
 			tmp_payload = _mosquitto_realloc(payload, payloadlen + 1);
@@ -413,21 +489,33 @@ int mqtt3_handle_unsubscribe(mosquitto_db *db, struct mosquitto *context)
 {
 	uint16_t mid;
 	char *sub;
+	struct _mosquitto_mount *mount = NULL;
+	struct _mosquitto_subhier *root;
+	char *unmounted;
+	int offset;
 
 	if(!context) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received UNSUBSCRIBE from %s", context->id);
 
 	if(_mosquitto_read_uint16(&context->in_packet, &mid)) return 1;
+	if(context->listener) mount = context->listener->mount;
 
 	while(context->in_packet.pos < context->in_packet.remaining_length){
 		sub = NULL;
-		if(_mosquitto_read_string(&context->in_packet, &sub)){
+		if(_mosquitto_read_string_prefix(&context->in_packet,
+					mount?mount->mount_point:NULL, mount?mount->len:0, &sub)){
 			return 1;
 		}
 
 		if(sub){
+			unmounted = mount?&sub[mount->len]:sub;
+			_mosquitto_fix_sub_topic(&unmounted);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
-			mqtt3_sub_remove(context, sub, &db->subs);
+			root = mqtt3_sub_root(db, mount, sub, &offset);
+			mqtt3_sub_remove(context, &sub[offset], root);
+#ifdef WITH_PERSISTENCE
+			mqtt3_wal_unsub(context, sub);
+#endif
 			_mosquitto_free(sub);
 		}
 	}
@@ -32,13 +32,99 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <string.h>
 
+#ifdef WITH_PASSWORD_HASHES
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#endif
+
 #include <memory_mosq.h>
 #include <mqtt3.h>
+#include <util_mosq.h>
+
+/* Number of topics each client remembers ACL decisions for. Must be a power
+ * of two. */
+#define ACL_CACHE_SIZE 16
+
+struct _mosquitto_acl_cache_entry{
+	char *topic;
+	int topic_size; /* Allocated, so it can be reused for another topic. */
+	uint32_t hash;
+	int known; /* Access modes that have been checked for this topic. */
+	int allowed; /* Those of them that were allowed. */
+};
+
+/* The ACL decisions of a client, for the ACLs that were loaded when
+ * generation was current and the acl_list the client had then. */
+struct _mosquitto_acl_cache{
+	struct _mosquitto_acl_user *acl_list;
+	unsigned int generation;
+	struct _mosquitto_acl_cache_entry entries[ACL_CACHE_SIZE];
+};
+
+/* Changed whenever the ACLs are loaded or freed, which throws away the
+ * decisions every client has cached. */
+static unsigned int acl_generation = 0;
+static unsigned long acl_cache_hits = 0;
+static unsigned long acl_cache_misses = 0;
+/* Source of the acl_generation of each client. */
+static unsigned int acl_context_generation = 0;
+
+#ifndef WITH_EXTERNAL_SECURITY_CHECKS
+/* Number of lines of the password and acl files, users to compile or clients
+ * to check that a reload gets through in each pass of the main loop. */
+#define SECURITY_RELOAD_BATCH 1000
+
+enum mosquitto_reload_state{
+	rs_none = 0,
+	rs_pwfile = 1,
+	rs_aclfile = 2,
+	rs_compile = 3,
+	rs_apply = 4
+};
+
+/* A reload is done a batch at a time from the main loop. The files are loaded
+ * into reload_new, which replaces the current data in one go once it is
+ * complete. The data it replaces is kept in reload_old until every client has
+ * been moved over to the new data, so clients that haven't been reached yet
+ * carry on as before. */
+static enum mosquitto_reload_state reload_state = rs_none;
+static mosquitto_db reload_new;
+static mosquitto_db reload_old;
+static FILE *reload_file = NULL;
+static char *reload_acl_user = NULL; /* The last "user" line of the acl file. */
+static struct _mosquitto_acl_user *reload_compile_pos = NULL;
+static int reload_pos = 0;
+/* The pattern ACLs or whether there are ACLs at all changed, so every client
+ * needs its ACLs redoing. */
+static bool reload_acl_all = false;
+/* There were no passwords before, so every client needs checking. */
+static bool reload_pwd_all = false;
+
+static void _reload_discard(void);
+#endif
+
+#ifdef WITH_PASSWORD_HASHES
+/* Number of password checks that are remembered, so that clients
+ * reconnecting with the same credentials don't need the key derivation
+ * function running again. Must be a power of two. */
+#define AUTH_CACHE_SIZE 1024
+
+/* A digest of a username, the password file entry it was checked against and
+ * the password that matched it, so a changed entry no longer matches. */
+struct _mosquitto_auth_cache_entry{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	bool used;
+};
+
+static struct _mosquitto_auth_cache_entry auth_cache[AUTH_CACHE_SIZE];
+#endif
 
 int mosquitto_security_init(mosquitto_db *db)
 {
 	int rc;
 
+	acl_generation++;
+
 #ifdef WITH_EXTERNAL_SECURITY_CHECKS
 	rc = mosquitto_unpwd_init(db);
 	if(rc){
@@ -52,6 +138,11 @@ int mosquitto_security_init(mosquitto_db *db)
 		return rc;
 	}
 #else
+#ifdef WITH_AUTH_PLUGIN
+	/* The plugin replaces the password and acl files. */
+	if(db->auth_plugin) return MOSQ_ERR_SUCCESS;
+#endif
+
 	/* Load username/password data if required. */
 	if(db->config->password_file){
 		rc = mqtt3_pwfile_parse(db);
@@ -75,15 +166,112 @@ int mosquitto_security_init(mosquitto_db *db)
 
 void mosquitto_security_cleanup(mosquitto_db *db)
 {
+	acl_generation++;
 	mosquitto_acl_cleanup(db);
 	mosquitto_unpwd_cleanup(db);
+#ifndef WITH_EXTERNAL_SECURITY_CHECKS
+	if(reload_state == rs_apply){
+		mosquitto_acl_cleanup(&reload_old);
+		mosquitto_unpwd_cleanup(&reload_old);
+		reload_state = rs_none;
+	}else if(reload_state != rs_none){
+		_reload_discard();
+	}
+#endif
+}
+
+static void _acl_cache_clear(struct _mosquitto_acl_cache *cache)
+{
+	int i;
+
+	for(i=0; i<ACL_CACHE_SIZE; i++){
+		if(cache->entries[i].topic){
+			_mosquitto_free(cache->entries[i].topic);
+		}
+	}
+	memset(cache, 0, sizeof(struct _mosquitto_acl_cache));
+}
+
+void mosquitto_acl_cache_cleanup(struct mosquitto *context)
+{
+	if(!context || !context->acl_cache) return;
+
+	_acl_cache_clear(context->acl_cache);
+	_mosquitto_free(context->acl_cache);
+	context->acl_cache = NULL;
+}
+
+void mosquitto_acl_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+	if(hits) *hits = acl_cache_hits;
+	if(misses) *misses = acl_cache_misses;
+}
+
+/* Called when the ACLs that apply to context may have changed, so that
+ * decisions made about its subscriptions before are no longer used. */
+void mosquitto_acl_context_changed(struct mosquitto *context)
+{
+	acl_context_generation++;
+	if(acl_context_generation == 0) acl_context_generation++;
+	context->acl_generation = acl_context_generation;
+}
+
+/* Find the ACLs of username, or of anonymous clients if username is NULL. */
+struct _mosquitto_acl_user *mosquitto_acl_user_find(struct _mosquitto_db *db, const char *username)
+{
+	struct _mosquitto_acl_user *acl_user;
+
+	if(!db || !db->acl_user_hash) return NULL;
+
+	acl_user = db->acl_user_hash[_mosquitto_str_hash(username) & (db->acl_user_hash_size-1)];
+	while(acl_user){
+		if(username && acl_user->username){
+			if(!strcmp(acl_user->username, username)) return acl_user;
+		}else if(!username && !acl_user->username){
+			return acl_user;
+		}
+		acl_user = acl_user->hash_next;
+	}
+	return NULL;
 }
 
 #ifndef WITH_EXTERNAL_SECURITY_CHECKS
 
+static int _acl_user_hash_add(struct _mosquitto_db *db, struct _mosquitto_acl_user *acl_user)
+{
+	struct _mosquitto_acl_user **buckets, *tail, *next;
+	int size;
+	int i, b;
+
+	if(db->acl_user_count >= db->acl_user_hash_size){
+		/* Keep the chains short. */
+		size = db->acl_user_hash_size ? db->acl_user_hash_size*2 : 64;
+		buckets = _mosquitto_calloc(size, sizeof(struct _mosquitto_acl_user *));
+		if(!buckets) return MOSQ_ERR_NOMEM;
+		for(i=0; i<db->acl_user_hash_size; i++){
+			tail = db->acl_user_hash[i];
+			while(tail){
+				next = tail->hash_next;
+				b = _mosquitto_str_hash(tail->username) & (size-1);
+				tail->hash_next = buckets[b];
+				buckets[b] = tail;
+				tail = next;
+			}
+		}
+		if(db->acl_user_hash) _mosquitto_free(db->acl_user_hash);
+		db->acl_user_hash = buckets;
+		db->acl_user_hash_size = size;
+	}
+	b = _mosquitto_str_hash(acl_user->username) & (db->acl_user_hash_size-1);
+	acl_user->hash_next = db->acl_user_hash[b];
+	db->acl_user_hash[b] = acl_user;
+	db->acl_user_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
 int _add_acl(struct _mosquitto_db *db, const char *user, const char *topic, int access)
 {
-	struct _mosquitto_acl_user *acl_user=NULL, *user_tail;
+	struct _mosquitto_acl_user *acl_user=NULL;
 	struct _mosquitto_acl *acl, *acl_root=NULL, *acl_tail=NULL;
 	char *local_topic;
 	char *token = NULL;
@@ -96,21 +284,7 @@ int _add_acl(struct _mosquitto_db *db, const char *user, const char *topic, int
 		return MOSQ_ERR_NOMEM;
 	}
 
-	if(db->acl_list){
-		user_tail = db->acl_list;
-		while(user_tail){
-			if(user == NULL){
-				if(user_tail->username == NULL){
-					acl_user = user_tail;
-					break;
-				}
-			}else if(user_tail->username && !strcmp(user_tail->username, user)){
-				acl_user = user_tail;
-				break;
-			}
-			user_tail = user_tail->next;
-		}
-	}
+	acl_user = mosquitto_acl_user_find(db, user);
 	if(!acl_user){
 		acl_user = _mosquitto_malloc(sizeof(struct _mosquitto_acl_user));
 		if(!acl_user){
@@ -130,6 +304,8 @@ int _add_acl(struct _mosquitto_db *db, const char *user, const char *topic, int
 		}
 		acl_user->next = NULL;
 		acl_user->acl = NULL;
+		acl_user->tree = NULL;
+		acl_user->unchanged = NULL;
 	}
 
 	/* Tokenise topic */
@@ -188,16 +364,12 @@ int _add_acl(struct _mosquitto_db *db, const char *user, const char *topic, int
 	}
 
 	if(new_user){
-		/* Add to end of list */
-		if(db->acl_list){
-			user_tail = db->acl_list;
-			while(user_tail->next){
-				user_tail = user_tail->next;
-			}
-			user_tail->next = acl_user;
-		}else{
-			db->acl_list = acl_user;
+		if(_acl_user_hash_add(db, acl_user)){
+			_mosquitto_free(local_topic);
+			return MOSQ_ERR_NOMEM;
 		}
+		acl_user->next = db->acl_list;
+		db->acl_list = acl_user;
 	}
 
 	_mosquitto_free(local_topic);
@@ -276,258 +448,551 @@ int _add_acl_pattern(struct _mosquitto_db *db, const char *topic, int access)
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mosquitto_acl_check(struct _mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+static struct _mosquitto_acl_node *_acl_node_new(const char *topic)
 {
-	char *local_topic;
-	char *token;
-	struct _mosquitto_acl *acl_root, *acl_tail;
+	struct _mosquitto_acl_node *node;
+
+	node = _mosquitto_calloc(1, sizeof(struct _mosquitto_acl_node));
+	if(!node) return NULL;
+	if(topic){
+		node->topic = _mosquitto_strdup(topic);
+		if(!node->topic){
+			_mosquitto_free(node);
+			return NULL;
+		}
+		node->topic_len = strlen(topic);
+	}
+	return node;
+}
 
-	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
-	if(!db->acl_list) return MOSQ_ERR_SUCCESS;
-	if(!context->acl_list && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+static void _acl_tree_free(struct _mosquitto_acl_node *node)
+{
+	struct _mosquitto_acl_node *child;
 
-	if(context->acl_list){
-		acl_root = context->acl_list->acl;
+	if(!node) return;
+
+	while(node->children){
+		child = node->children->next;
+		_acl_tree_free(node->children);
+		node->children = child;
+	}
+	_acl_tree_free(node->plus);
+	_acl_tree_free(node->client_id);
+	_acl_tree_free(node->username);
+	_acl_tree_free(node->slash);
+	if(node->topic) _mosquitto_free(node->topic);
+	_mosquitto_free(node);
+}
+
+/* Find or add the level below node that matches the ACL level topic. %c and %u
+ * are only special in patterns. */
+static struct _mosquitto_acl_node *_acl_tree_child(struct _mosquitto_acl_node *node, const char *topic, bool pattern)
+{
+	struct _mosquitto_acl_node **child;
+
+	if(!strcmp(topic, "+")){
+		child = &node->plus;
+	}else if(pattern && !strcmp(topic, "%c")){
+		child = &node->client_id;
+	}else if(pattern && !strcmp(topic, "%u")){
+		child = &node->username;
 	}else{
-		acl_root = NULL;
+		child = &node->children;
+		while(*child){
+			if(!strcmp((*child)->topic, topic)) return *child;
+			child = &(*child)->next;
+		}
 	}
+	if(!*child){
+		*child = _acl_node_new(topic);
+	}
+	return *child;
+}
 
-	/* Loop through all ACLs for this client. */
-	while(acl_root){
-		local_topic = _mosquitto_strdup(topic);
-		if(!local_topic) return MOSQ_ERR_NOMEM;
+/* Merge the ACL starting at acl, as built by _add_acl(), into tree. */
+static int _acl_tree_add(struct _mosquitto_acl_node *tree, struct _mosquitto_acl *acl, bool pattern)
+{
+	struct _mosquitto_acl_node *node = tree;
 
-		acl_tail = acl_root;
+	if(!strcmp(acl->topic, "/")){
+		if(!tree->slash){
+			tree->slash = _acl_node_new(NULL);
+			if(!tree->slash) return MOSQ_ERR_NOMEM;
+		}
+		node = tree->slash;
+		acl = acl->child;
+	}
+	while(acl){
+		if(!acl->child && !strcmp(acl->topic, "#")){
+			node->hash_access |= acl->access;
+			return MOSQ_ERR_SUCCESS;
+		}
+		node = _acl_tree_child(node, acl->topic, pattern);
+		if(!node) return MOSQ_ERR_NOMEM;
+		if(!acl->child){
+			node->access |= acl->access;
+		}
+		acl = acl->child;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
 
-		if(local_topic[0] == '/'){
-			if(strcmp(acl_tail->topic, "/")){
-				acl_root = acl_root->next;
-				continue;
-			}
-			acl_tail = acl_tail->child;
+/* Build the tree of patterns, for clients without a user of their own. */
+static int _acl_compile_patterns(struct _mosquitto_db *db)
+{
+	struct _mosquitto_acl *acl;
+	int rc;
+
+	db->acl_pattern_tree = _acl_node_new(NULL);
+	if(!db->acl_pattern_tree) return MOSQ_ERR_NOMEM;
+	for(acl = db->acl_patterns; acl; acl = acl->next){
+		rc = _acl_tree_add(db->acl_pattern_tree, acl, true);
+		if(rc) return rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Build the tree of a user, holding its own ACLs and the patterns. */
+static int _acl_compile_user(struct _mosquitto_db *db, struct _mosquitto_acl_user *acl_user)
+{
+	struct _mosquitto_acl *acl;
+	int rc;
+
+	acl_user->tree = _acl_node_new(NULL);
+	if(!acl_user->tree) return MOSQ_ERR_NOMEM;
+	for(acl = acl_user->acl; acl; acl = acl->next){
+		rc = _acl_tree_add(acl_user->tree, acl, false);
+		if(rc) return rc;
+	}
+	for(acl = db->acl_patterns; acl; acl = acl->next){
+		rc = _acl_tree_add(acl_user->tree, acl, true);
+		if(rc) return rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Does the rest of a topic, starting at pos, match below node with the
+ * access asked for? Empty levels are skipped, as strtok() used to. */
+static bool _acl_tree_match(struct _mosquitto_acl_node *node, const char *pos, struct mosquitto *context, int access, bool root)
+{
+	struct _mosquitto_acl_node *child;
+	const char *next;
+	int len;
+
+	while(*pos == '/') pos++;
+	if(!*pos){
+		return !root && (node->access & access);
+	}
+	if(node->hash_access & access) return true;
+
+	next = pos;
+	while(*next && *next != '/') next++;
+	len = next - pos;
+
+	for(child = node->children; child; child = child->next){
+		if(child->topic_len == len && !memcmp(child->topic, pos, len)){
+			if(_acl_tree_match(child, next, context, access, false)) return true;
+			break;
 		}
+	}
+	if(node->plus && _acl_tree_match(node->plus, next, context, access, false)){
+		return true;
+	}
+	if(node->client_id && context->id
+			&& !strncmp(context->id, pos, len) && context->id[len] == '\0'
+			&& _acl_tree_match(node->client_id, next, context, access, false)){
+		return true;
+	}
+	if(node->username && context->username
+			&& !strncmp(context->username, pos, len) && context->username[len] == '\0'
+			&& _acl_tree_match(node->username, next, context, access, false)){
+		return true;
+	}
+	return false;
+}
 
-		token = strtok(local_topic, "/");
-		/* Loop through the topic looking for matches to this ACL. */
-		while(token){
-			if(acl_tail){
-				if(!strcmp(acl_tail->topic, "#") && acl_tail->child == NULL){
-					/* We have a match */
-					if(access & acl_tail->access){
-						/* And access is allowed. */
-						_mosquitto_free(local_topic);
-						return MOSQ_ERR_SUCCESS;
-					}else{
-						break;
-					}
-				}else if(!strcmp(acl_tail->topic, token) || !strcmp(acl_tail->topic, "+")){
-					token = strtok(NULL, "/");
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else{
-					break;
-				}
-				acl_tail = acl_tail->child;
+static int _acl_tree_check(struct _mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_acl_node *tree;
+
+	if(context->acl_list){
+		tree = context->acl_list->tree;
+	}else{
+		tree = db->acl_pattern_tree;
+	}
+	if(!tree) return MOSQ_ERR_ACL_DENIED;
+
+	/* ACLs starting with / only match topics starting with /, and the other
+	 * way round. */
+	if(topic[0] == '/'){
+		tree = tree->slash;
+		if(!tree) return MOSQ_ERR_ACL_DENIED;
+		topic++;
+	}
+	if(_acl_tree_match(tree, topic, context, access, true)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return MOSQ_ERR_ACL_DENIED;
+}
+
+/* Find the cache entry for topic, throwing away whatever the context had
+ * cached if the ACLs have changed since. Returns NULL if the cache can't be
+ * allocated. */
+static struct _mosquitto_acl_cache_entry *_acl_cache_entry(struct mosquitto *context, const char *topic, uint32_t *hash)
+{
+	struct _mosquitto_acl_cache *cache;
+
+	if(!context->acl_cache){
+		context->acl_cache = _mosquitto_calloc(1, sizeof(struct _mosquitto_acl_cache));
+		if(!context->acl_cache) return NULL;
+		context->acl_cache->acl_list = context->acl_list;
+		context->acl_cache->generation = acl_generation;
+	}
+	cache = context->acl_cache;
+	if(cache->generation != acl_generation || cache->acl_list != context->acl_list){
+		_acl_cache_clear(cache);
+		cache->acl_list = context->acl_list;
+		cache->generation = acl_generation;
+	}
+
+	*hash = _mosquitto_str_hash(topic);
+	return &cache->entries[*hash & (ACL_CACHE_SIZE-1)];
+}
+
+int mosquitto_acl_check(struct _mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_acl_cache_entry *entry;
+	uint32_t hash;
+	int len;
+	int rc;
+
+	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
+#ifdef WITH_AUTH_PLUGIN
+	if(!db->auth_plugin){
+#endif
+		if(!db->acl_list) return MOSQ_ERR_SUCCESS;
+		if(!context->acl_list && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+#ifdef WITH_AUTH_PLUGIN
+	}
+#endif
+
+	entry = _acl_cache_entry(context, topic, &hash);
+	if(entry && entry->topic && entry->hash == hash && !strcmp(entry->topic, topic)){
+		if((entry->known & access) == access){
+			acl_cache_hits++;
+			if((entry->allowed & access) == access){
+				return MOSQ_ERR_SUCCESS;
 			}else{
-				break;
+				return MOSQ_ERR_ACL_DENIED;
 			}
 		}
-		_mosquitto_free(local_topic);
+	}else if(entry){
+		len = strlen(topic) + 1;
+		if(len > entry->topic_size){
+			if(entry->topic) _mosquitto_free(entry->topic);
+			entry->topic = _mosquitto_malloc(len);
+			entry->topic_size = entry->topic ? len : 0;
+		}
+		if(entry->topic){
+			memcpy(entry->topic, topic, len);
+		}
+		entry->hash = hash;
+		entry->known = 0;
+		entry->allowed = 0;
+	}
+	acl_cache_misses++;
 
-		acl_root = acl_root->next;
+#ifdef WITH_AUTH_PLUGIN
+	if(db->auth_plugin){
+		rc = mqtt3_auth_plugin_acl_check(db, context, topic, access);
+	}else{
+		rc = _acl_tree_check(db, context, topic, access);
 	}
+#else
+	rc = _acl_tree_check(db, context, topic, access);
+#endif
+	if(entry && entry->topic){
+		entry->known |= access;
+		if(rc == MOSQ_ERR_SUCCESS){
+			entry->allowed |= access;
+		}
+	}
+	return rc;
+}
 
-	acl_root = db->acl_patterns;
-	/* Loop through all pattern ACLs. */
-	while(acl_root){
-		local_topic = _mosquitto_strdup(topic);
-		if(!local_topic) return MOSQ_ERR_NOMEM;
+/* Is the level of a topic or subscription from pos to end equal to str? */
+static bool _acl_level_is(const char *pos, const char *end, const char *str)
+{
+	return str && !strncmp(str, pos, end-pos) && str[end-pos] == '\0';
+}
 
-		acl_tail = acl_root;
+/* Are all topics that match the subscription from pos to end allowed by the
+ * tree below node? This is allowed to say no when it isn't sure. A trailing #
+ * is taken to match only the levels below the one it is attached to. */
+static bool _acl_sub_allowed(struct _mosquitto_acl_node *node, const char *pos, const char *end, struct mosquitto *context, bool root)
+{
+	struct _mosquitto_acl_node *child;
+	const char *next;
 
-		if(local_topic[0] == '/'){
-			if(strcmp(acl_tail->topic, "/")){
-				acl_root = acl_root->next;
-				continue;
-			}
-			acl_tail = acl_tail->child;
+	while(pos < end && *pos == '/') pos++;
+	if(pos == end){
+		return !root && (node->access & MOSQ_ACL_READ);
+	}
+	if(node->hash_access & MOSQ_ACL_READ) return true;
+
+	next = pos;
+	while(next < end && *next != '/') next++;
+
+	if(_acl_level_is(pos, next, "#")){
+		return next == end && node->plus
+				&& (node->plus->access & node->plus->hash_access & MOSQ_ACL_READ);
+	}else if(_acl_level_is(pos, next, "+")){
+		return node->plus && _acl_sub_allowed(node->plus, next, end, context, false);
+	}
+
+	for(child = node->children; child; child = child->next){
+		if(child->topic_len == next-pos && !memcmp(child->topic, pos, next-pos)){
+			if(_acl_sub_allowed(child, next, end, context, false)) return true;
+			break;
 		}
+	}
+	if(node->plus && _acl_sub_allowed(node->plus, next, end, context, false)){
+		return true;
+	}
+	if(node->client_id && _acl_level_is(pos, next, context->id)
+			&& _acl_sub_allowed(node->client_id, next, end, context, false)){
+		return true;
+	}
+	if(node->username && _acl_level_is(pos, next, context->username)
+			&& _acl_sub_allowed(node->username, next, end, context, false)){
+		return true;
+	}
+	return false;
+}
 
-		token = strtok(local_topic, "/");
-		/* Loop through the topic looking for matches to this ACL. */
-		while(token){
-			if(acl_tail){
-				if(!strcmp(acl_tail->topic, "#") && acl_tail->child == NULL){
-					/* We have a match */
-					if(access & acl_tail->access){
-						/* And access is allowed. */
-						_mosquitto_free(local_topic);
-						return MOSQ_ERR_SUCCESS;
-					}else{
-						break;
-					}
-				}else if(!strcmp(acl_tail->topic, "%c")){
-					if(!context->id || strcmp(token, context->id)){
-						/* No access */
-						break;
-					}
-					token = strtok(NULL, "/");
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else if(!strcmp(acl_tail->topic, "%u")){
-					if(!context->username || strcmp(token, context->username)){
-						/* No access */
-						break;
-					}
-					token = strtok(NULL, "/");
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else if(!strcmp(acl_tail->topic, token) || !strcmp(acl_tail->topic, "+")){
-					token = strtok(NULL, "/");
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else{
-					break;
-				}
-				acl_tail = acl_tail->child;
-			}else{
-				break;
-			}
+/* Does anything below node allow reading? */
+static bool _acl_tree_readable(struct _mosquitto_acl_node *node)
+{
+	struct _mosquitto_acl_node *child;
+
+	if(!node) return false;
+	if((node->access | node->hash_access) & MOSQ_ACL_READ) return true;
+	for(child = node->children; child; child = child->next){
+		if(_acl_tree_readable(child)) return true;
+	}
+	return _acl_tree_readable(node->plus)
+			|| _acl_tree_readable(node->client_id)
+			|| _acl_tree_readable(node->username);
+}
+
+/* Could any topic that matches the subscription at pos be allowed by the tree
+ * below node? This is allowed to say yes when it isn't sure. */
+static bool _acl_sub_readable(struct _mosquitto_acl_node *node, const char *pos, struct mosquitto *context, bool root)
+{
+	struct _mosquitto_acl_node *child;
+	const char *next;
+	bool plus;
+
+	while(*pos == '/') pos++;
+	if(!*pos){
+		return !root && (node->access & MOSQ_ACL_READ);
+	}
+	if(node->hash_access & MOSQ_ACL_READ) return true;
+
+	next = pos;
+	while(*next && *next != '/') next++;
+
+	if(_acl_level_is(pos, next, "#")){
+		if(*next) return true;
+		if(!root && (node->access & MOSQ_ACL_READ)) return true;
+		for(child = node->children; child; child = child->next){
+			if(_acl_tree_readable(child)) return true;
 		}
-		_mosquitto_free(local_topic);
+		return _acl_tree_readable(node->plus)
+				|| _acl_tree_readable(node->client_id)
+				|| _acl_tree_readable(node->username);
+	}
 
-		acl_root = acl_root->next;
+	plus = _acl_level_is(pos, next, "+");
+	for(child = node->children; child; child = child->next){
+		if(plus || (child->topic_len == next-pos && !memcmp(child->topic, pos, next-pos))){
+			if(_acl_sub_readable(child, next, context, false)) return true;
+		}
+	}
+	if(node->plus && _acl_sub_readable(node->plus, next, context, false)){
+		return true;
+	}
+	if(node->client_id && context->id && (plus || _acl_level_is(pos, next, context->id))
+			&& _acl_sub_readable(node->client_id, next, context, false)){
+		return true;
+	}
+	if(node->username && context->username && (plus || _acl_level_is(pos, next, context->username))
+			&& _acl_sub_readable(node->username, next, context, false)){
+		return true;
 	}
+	return false;
+}
 
-	return MOSQ_ERR_ACL_DENIED;
+/* Decide whether the messages sent to context through the subscription sub
+ * need their topic checking against the ACLs, by looking at every topic sub
+ * could match at once. */
+enum mqtt3_sub_acl mosquitto_acl_check_sub(struct _mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	struct _mosquitto_acl_node *tree;
+	const char *end;
+	int len;
+	bool slash = false;
+
+	if(!db || !context || !sub) return sa_check;
+#ifdef WITH_AUTH_PLUGIN
+	/* Only the plugin knows which topics it allows. */
+	if(db->auth_plugin) return sa_check;
+#endif
+	if(!db->acl_list) return sa_allow;
+	if(!context->acl_list && !db->acl_patterns) return sa_deny;
+
+	if(context->acl_list){
+		tree = context->acl_list->tree;
+	}else{
+		tree = db->acl_pattern_tree;
+	}
+	if(!tree) return sa_deny;
+
+	if(sub[0] == '/'){
+		tree = tree->slash;
+		if(!tree) return sa_deny;
+		sub++;
+		slash = true;
+	}else if(sub[0] == '+'){
+		/* Also matches topics starting with /, which are in another part of
+		 * the tree. */
+		return sa_check;
+	}
+
+	if(!_acl_sub_readable(tree, sub, context, true)){
+		return sa_deny;
+	}
+
+	len = strlen(sub);
+	end = sub + len;
+	if(len >= 1 && sub[len-1] == '#' && (len == 1 || sub[len-2] == '/')){
+		if(!_acl_sub_allowed(tree, sub, end, context, true)){
+			return sa_check;
+		}
+		/* The level that # is attached to matches as well. At the top of
+		 * the tree that is nothing, or the topic "/" which is never
+		 * allowed. */
+		if(len == 1){
+			return slash ? sa_allow_below : sa_allow;
+		}else if(_acl_sub_allowed(tree, sub, end-2, context, true)){
+			return sa_allow;
+		}
+		return sa_allow_below;
+	}else if(_acl_sub_allowed(tree, sub, end, context, true)){
+		return sa_allow;
+	}
+	return sa_check;
 }
 
-int mqtt3_aclfile_parse(struct _mosquitto_db *db)
+/* Parse a line of the acl file. user is the current "user" line, which is
+ * updated by the line. */
+static int _aclfile_line(struct _mosquitto_db *db, char *buf, char **user)
 {
-	FILE *aclfile;
-	char buf[1024];
 	char *token;
-	char *user = NULL;
 	char *topic;
 	char *access_s;
 	int access;
-	int rc;
 	int slen;
 	int topic_pattern;
 
-	if(!db || !db->config) return MOSQ_ERR_INVAL;
-	if(!db->config->acl_file) return MOSQ_ERR_SUCCESS;
-
-	aclfile = fopen(db->config->acl_file, "rt");
-	if(!aclfile) return 1;
-
 	// topic [read|write] <topic> 
 	// user <user>
 
-	while(fgets(buf, 1024, aclfile)){
+	slen = strlen(buf);
+	while(slen > 0 && (buf[slen-1] == 10 || buf[slen-1] == 13)){
+		buf[slen-1] = '\0';
 		slen = strlen(buf);
-		while(slen > 0 && (buf[slen-1] == 10 || buf[slen-1] == 13)){
-			buf[slen-1] = '\0';
-			slen = strlen(buf);
-		}
-		token = strtok(buf, " ");
-		if(token){
-			if(!strcmp(token, "topic") || !strcmp(token, "pattern")){
-				if(!strcmp(token, "topic")){
-					topic_pattern = 0;
-				}else{
-					topic_pattern = 1;
-				}
+	}
+	token = strtok(buf, " ");
+	if(token){
+		if(!strcmp(token, "topic") || !strcmp(token, "pattern")){
+			if(!strcmp(token, "topic")){
+				topic_pattern = 0;
+			}else{
+				topic_pattern = 1;
+			}
 
-				access_s = strtok(NULL, " ");
-				if(!access_s){
-					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty topic in acl_file.");
-					if(user) _mosquitto_free(user);
-					fclose(aclfile);
-					return MOSQ_ERR_INVAL;
-				}
-				token = strtok(NULL, " ");
-				if(token){
-					topic = token;
-				}else{
-					topic = access_s;
-					access_s = NULL;
-				}
-				if(access_s){
-					if(!strcmp(access_s, "read")){
-						access = MOSQ_ACL_READ;
-					}else if(!strcmp(access_s, "write")){
-						access = MOSQ_ACL_WRITE;
-					}else{
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty invalid topic access type in acl_file.");
-						if(user) _mosquitto_free(user);
-						fclose(aclfile);
-						return MOSQ_ERR_INVAL;
-					}
-				}else{
-					access = MOSQ_ACL_READ | MOSQ_ACL_WRITE;
-				}
-				if(topic_pattern == 0){
-					rc = _add_acl(db, user, topic, access);
-				}else{
-					rc = _add_acl_pattern(db, topic, access);
-				}
-				if(rc) return rc;
-			}else if(!strcmp(token, "user")){
-				token = strtok(NULL, " ");
-				if(token){
-					if(user) _mosquitto_free(user);
-					user = _mosquitto_strdup(token);
-					if(!user){
-						fclose(aclfile);
-						return MOSQ_ERR_NOMEM;
-					}
+			access_s = strtok(NULL, " ");
+			if(!access_s){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty topic in acl_file.");
+				return MOSQ_ERR_INVAL;
+			}
+			token = strtok(NULL, " ");
+			if(token){
+				topic = token;
+			}else{
+				topic = access_s;
+				access_s = NULL;
+			}
+			if(access_s){
+				if(!strcmp(access_s, "read")){
+					access = MOSQ_ACL_READ;
+				}else if(!strcmp(access_s, "write")){
+					access = MOSQ_ACL_WRITE;
 				}else{
-					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Missing username in acl_file.");
-					if(user) _mosquitto_free(user);
-					fclose(aclfile);
-					return 1;
+					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty invalid topic access type in acl_file.");
+					return MOSQ_ERR_INVAL;
 				}
+			}else{
+				access = MOSQ_ACL_READ | MOSQ_ACL_WRITE;
+			}
+			if(topic_pattern == 0){
+				return _add_acl(db, *user, topic, access);
+			}else{
+				return _add_acl_pattern(db, topic, access);
+			}
+		}else if(!strcmp(token, "user")){
+			token = strtok(NULL, " ");
+			if(token){
+				if(*user) _mosquitto_free(*user);
+				*user = _mosquitto_strdup(token);
+				if(!*user) return MOSQ_ERR_NOMEM;
+			}else{
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Missing username in acl_file.");
+				return 1;
 			}
 		}
 	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_aclfile_parse(struct _mosquitto_db *db)
+{
+	FILE *aclfile;
+	char buf[1024];
+	char *user = NULL;
+	int rc = MOSQ_ERR_SUCCESS;
+	struct _mosquitto_acl_user *acl_user;
+
+	if(!db || !db->config) return MOSQ_ERR_INVAL;
+	if(!db->config->acl_file) return MOSQ_ERR_SUCCESS;
+
+	aclfile = fopen(db->config->acl_file, "rt");
+	if(!aclfile) return 1;
+
+	while(!rc && fgets(buf, 1024, aclfile)){
+		rc = _aclfile_line(db, buf, &user);
+	}
 
 	if(user) _mosquitto_free(user);
 	fclose(aclfile);
+	if(rc) return rc;
 
-	return MOSQ_ERR_SUCCESS;
+	rc = _acl_compile_patterns(db);
+	for(acl_user = db->acl_list; acl_user && !rc; acl_user = acl_user->next){
+		rc = _acl_compile_user(db, acl_user);
+	}
+	return rc;
 }
 
 static void _free_acl(struct _mosquitto_acl *acl)
@@ -551,7 +1016,21 @@ void mosquitto_acl_cleanup(struct _mosquitto_db *db)
 	int i;
 	struct _mosquitto_acl_user *user_tail;
 
-	if(!db || !db->acl_list) return;
+	if(!db) return;
+
+	_acl_tree_free(db->acl_pattern_tree);
+	db->acl_pattern_tree = NULL;
+	if(db->acl_patterns){
+		_free_acl(db->acl_patterns);
+		db->acl_patterns = NULL;
+	}
+	if(db->acl_user_hash){
+		_mosquitto_free(db->acl_user_hash);
+		db->acl_user_hash = NULL;
+	}
+	db->acl_user_hash_size = 0;
+	db->acl_user_count = 0;
+	if(!db->acl_list) return;
 
 	/* As we're freeing ACLs, we must clear context->acl_list to ensure no
 	 * invalid memory accesses take place later.
@@ -563,6 +1042,7 @@ void mosquitto_acl_cleanup(struct _mosquitto_db *db)
 		for(i=0; i<db->context_count; i++){
 			if(db->contexts[i] && db->contexts[i]->acl_list){
 				db->contexts[i]->acl_list = NULL;
+				mosquitto_acl_context_changed(db->contexts[i]);
 			}
 		}
 	}
@@ -571,6 +1051,7 @@ void mosquitto_acl_cleanup(struct _mosquitto_db *db)
 		user_tail = db->acl_list->next;
 
 		_free_acl(db->acl_list->acl);
+		_acl_tree_free(db->acl_list->tree);
 		if(db->acl_list->username){
 			_mosquitto_free(db->acl_list->username);
 		}
@@ -578,20 +1059,209 @@ void mosquitto_acl_cleanup(struct _mosquitto_db *db)
 		
 		db->acl_list = user_tail;
 	}
+}
 
-	if(db->acl_patterns){
-		_free_acl(db->acl_patterns);
+static int _unpwd_hash_add(struct _mosquitto_db *db, struct _mosquitto_unpwd *unpwd)
+{
+	struct _mosquitto_unpwd **buckets, *tail, *next;
+	int size;
+	int i, b;
+
+	if(db->unpwd_count >= db->unpwd_hash_size){
+		/* Keep the chains short. */
+		size = db->unpwd_hash_size ? db->unpwd_hash_size*2 : 64;
+		buckets = _mosquitto_calloc(size, sizeof(struct _mosquitto_unpwd *));
+		if(!buckets) return MOSQ_ERR_NOMEM;
+		for(i=0; i<db->unpwd_hash_size; i++){
+			tail = db->unpwd_hash[i];
+			while(tail){
+				next = tail->hash_next;
+				b = _mosquitto_str_hash(tail->username) & (size-1);
+				tail->hash_next = buckets[b];
+				buckets[b] = tail;
+				tail = next;
+			}
+		}
+		if(db->unpwd_hash) _mosquitto_free(db->unpwd_hash);
+		db->unpwd_hash = buckets;
+		db->unpwd_hash_size = size;
 	}
+	b = _mosquitto_str_hash(unpwd->username) & (db->unpwd_hash_size-1);
+	unpwd->hash_next = db->unpwd_hash[b];
+	db->unpwd_hash[b] = unpwd;
+	db->unpwd_count++;
+	return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt3_pwfile_parse(struct _mosquitto_db *db)
+#ifdef WITH_PASSWORD_HASHES
+/* Decode base64 from str to end into a new buffer. */
+static unsigned char *_base64_decode(const char *str, const char *end, int *len)
+{
+	unsigned char *buf;
+	int slen = end - str;
+
+	if(slen == 0 || slen%4) return NULL;
+	buf = _mosquitto_malloc(slen/4*3 + 1);
+	if(!buf) return NULL;
+	*len = EVP_DecodeBlock(buf, (const unsigned char *)str, slen);
+	if(*len < 0){
+		_mosquitto_free(buf);
+		return NULL;
+	}
+	/* EVP_DecodeBlock() counts the padding as data. */
+	if(end[-1] == '=') (*len)--;
+	if(end[-2] == '=') (*len)--;
+	return buf;
+}
+#endif
+
+/* Work out what sort of password an entry from the password file has. A
+ * hashed password that can't be used makes the entry unusable, rather than
+ * being taken as plain text. */
+static int _unpwd_parse_password(struct _mosquitto_unpwd *unpwd)
+{
+#ifdef WITH_PASSWORD_HASHES
+	char *iterations, *salt, *hash;
+	char *endptr;
+#endif
+
+	unpwd->type = pw_plain;
+	if(!unpwd->password || strncmp(unpwd->password, "$7$", 3)){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	unpwd->type = pw_invalid;
+#ifdef WITH_PASSWORD_HASHES
+	iterations = unpwd->password+3;
+	salt = strchr(iterations, '$');
+	if(!salt) goto invalid;
+	salt++;
+	hash = strchr(salt, '$');
+	if(!hash) goto invalid;
+	hash++;
+
+	unpwd->iterations = strtol(iterations, &endptr, 10);
+	if(endptr != salt-1 || unpwd->iterations < 1) goto invalid;
+	unpwd->salt = _base64_decode(salt, hash-1, &unpwd->salt_len);
+	if(!unpwd->salt) goto invalid;
+	unpwd->hash = _base64_decode(hash, hash+strlen(hash), &unpwd->hash_len);
+	if(!unpwd->hash || unpwd->hash_len < 1) goto invalid;
+
+	unpwd->type = pw_pbkdf2_sha512;
+	return MOSQ_ERR_SUCCESS;
+
+invalid:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Invalid password hash for user %s, they will be unable to log in.", unpwd->username);
+#else
+	_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Hashed passwords are not supported, user %s will be unable to log in.", unpwd->username);
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+#ifdef WITH_PASSWORD_HASHES
+static int _unpwd_check_hash(struct _mosquitto_unpwd *unpwd, const char *password)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	unsigned char *hash;
+	struct _mosquitto_auth_cache_entry *entry;
+	EVP_MD_CTX *ctx;
+	bool ok;
+
+	/* A cheap digest of everything the answer depends on, to look for in
+	 * the cache before running the expensive check. */
+	ctx = EVP_MD_CTX_create();
+	if(!ctx) return MOSQ_ERR_NOMEM;
+	if(!EVP_DigestInit_ex(ctx, EVP_sha512(), NULL)
+			|| !EVP_DigestUpdate(ctx, unpwd->username, strlen(unpwd->username)+1)
+			|| !EVP_DigestUpdate(ctx, unpwd->password, strlen(unpwd->password)+1)
+			|| !EVP_DigestUpdate(ctx, password, strlen(password))
+			|| !EVP_DigestFinal_ex(ctx, digest, &digest_len)){
+
+		EVP_MD_CTX_destroy(ctx);
+		return MOSQ_ERR_AUTH;
+	}
+	EVP_MD_CTX_destroy(ctx);
+
+	entry = &auth_cache[(digest[0] | (digest[1]<<8)) & (AUTH_CACHE_SIZE-1)];
+	if(entry->used && !memcmp(entry->digest, digest, digest_len)){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	hash = _mosquitto_malloc(unpwd->hash_len);
+	if(!hash) return MOSQ_ERR_NOMEM;
+	ok = PKCS5_PBKDF2_HMAC(password, strlen(password), unpwd->salt, unpwd->salt_len,
+			unpwd->iterations, EVP_sha512(), unpwd->hash_len, hash)
+			&& !CRYPTO_memcmp(hash, unpwd->hash, unpwd->hash_len);
+	_mosquitto_free(hash);
+
+	if(!ok) return MOSQ_ERR_AUTH;
+
+	memcpy(entry->digest, digest, digest_len);
+	entry->used = true;
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+static int _unpwd_check_password(struct _mosquitto_unpwd *unpwd, const char *password)
+{
+	switch(unpwd->type){
+		case pw_plain:
+			if(!strcmp(unpwd->password, password)) return MOSQ_ERR_SUCCESS;
+			return MOSQ_ERR_AUTH;
+#ifdef WITH_PASSWORD_HASHES
+		case pw_pbkdf2_sha512:
+			return _unpwd_check_hash(unpwd, password);
+#endif
+		default:
+			return MOSQ_ERR_AUTH;
+	}
+}
+
+/* Parse a line of the password file. */
+static int _pwfile_line(struct _mosquitto_db *db, char *buf)
 {
-	FILE *pwfile;
 	struct _mosquitto_unpwd *unpwd;
-	char buf[256];
 	char *username, *password;
 	int len;
 
+	username = strtok(buf, ":");
+	if(!username) return MOSQ_ERR_SUCCESS;
+
+	unpwd = _mosquitto_calloc(1, sizeof(struct _mosquitto_unpwd));
+	if(!unpwd) return MOSQ_ERR_NOMEM;
+	/* On the list straight away, so that it is freed along with the rest. */
+	unpwd->next = db->unpwd;
+	db->unpwd = unpwd;
+
+	unpwd->username = _mosquitto_strdup(username);
+	if(!unpwd->username) return MOSQ_ERR_NOMEM;
+	len = strlen(unpwd->username);
+	while(len > 0 && (unpwd->username[len-1] == 10 || unpwd->username[len-1] == 13)){
+		unpwd->username[len-1] = '\0';
+		len = strlen(unpwd->username);
+	}
+	password = strtok(NULL, ":");
+	if(password){
+		unpwd->password = _mosquitto_strdup(password);
+		if(!unpwd->password) return MOSQ_ERR_NOMEM;
+		len = strlen(unpwd->password);
+		while(len > 0 && (unpwd->password[len-1] == 10 || unpwd->password[len-1] == 13)){
+			unpwd->password[len-1] = '\0';
+			len = strlen(unpwd->password);
+		}
+	}
+	if(_unpwd_parse_password(unpwd)) return MOSQ_ERR_NOMEM;
+	if(_unpwd_hash_add(db, unpwd)) return MOSQ_ERR_NOMEM;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_pwfile_parse(struct _mosquitto_db *db)
+{
+	FILE *pwfile;
+	char buf[256];
+	int rc = MOSQ_ERR_SUCCESS;
+
 	if(!db || !db->config) return MOSQ_ERR_INVAL;
 
 	if(!db->config->password_file) return MOSQ_ERR_SUCCESS;
@@ -599,52 +1269,36 @@ int mqtt3_pwfile_parse(struct _mosquitto_db *db)
 	pwfile = fopen(db->config->password_file, "rt");
 	if(!pwfile) return 1;
 
-	while(!feof(pwfile)){
-		if(fgets(buf, 256, pwfile)){
-			username = strtok(buf, ":");
-			if(username){
-				unpwd = _mosquitto_calloc(1, sizeof(struct _mosquitto_unpwd));
-				if(!unpwd) return MOSQ_ERR_NOMEM;
-				unpwd->username = _mosquitto_strdup(username);
-				if(!unpwd->username) return MOSQ_ERR_NOMEM;
-				len = strlen(unpwd->username);
-				while(unpwd->username[len-1] == 10 || unpwd->username[len-1] == 13){
-					unpwd->username[len-1] = '\0';
-					len = strlen(unpwd->username);
-				}
-				password = strtok(NULL, ":");
-				if(password){
-					unpwd->password = _mosquitto_strdup(password);
-					if(!unpwd->password) return MOSQ_ERR_NOMEM;
-					len = strlen(unpwd->password);
-					while(unpwd->password[len-1] == 10 || unpwd->password[len-1] == 13){
-						unpwd->password[len-1] = '\0';
-						len = strlen(unpwd->password);
-					}
-				}
-				unpwd->next = db->unpwd;
-				db->unpwd = unpwd;
-			}
-		}
+	while(!rc && fgets(buf, 256, pwfile)){
+		rc = _pwfile_line(db, buf);
 	}
 	fclose(pwfile);
 
-	return MOSQ_ERR_SUCCESS;
+	return rc;
 }
 
-int mosquitto_unpwd_check(struct _mosquitto_db *db, const char *username, const char *password)
+/* Check the credentials of a client. If the answer is coming from the auth
+ * plugin, this returns MOSQ_ERR_AUTH_PENDING and context->auth_job holds the
+ * check. Passing a NULL context only checks against the password file. */
+int mosquitto_unpwd_check(struct _mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
 {
 	struct _mosquitto_unpwd *tail;
 
 	if(!db || !username) return MOSQ_ERR_INVAL;
+#ifdef WITH_AUTH_PLUGIN
+	if(db->auth_plugin && context){
+		return mqtt3_auth_plugin_unpwd_check(db, context, username, password);
+	}
+#endif
 	if(!db->unpwd) return MOSQ_ERR_SUCCESS;
+	if(!db->unpwd_hash) return MOSQ_ERR_AUTH;
 
-	tail = db->unpwd;
+	tail = db->unpwd_hash[_mosquitto_str_hash(username) & (db->unpwd_hash_size-1)];
 	while(tail){
 		if(!strcmp(tail->username, username)){
 			if(tail->password){
 				if(password){
-					if(!strcmp(tail->password, password)){
+					if(_unpwd_check_password(tail, password) == MOSQ_ERR_SUCCESS){
 						return MOSQ_ERR_SUCCESS;
 					}
 				}else{
@@ -654,7 +1308,7 @@ int mosquitto_unpwd_check(struct _mosquitto_db *db, const char *username, const
 				return MOSQ_ERR_SUCCESS;
 			}
 		}
-		tail = tail->next;
+		tail = tail->hash_next;
 	}
 
 	return MOSQ_ERR_AUTH;
@@ -670,95 +1324,324 @@ int mosquitto_unpwd_cleanup(struct _mosquitto_db *db)
 		tail = db->unpwd->next;
 		if(db->unpwd->password) _mosquitto_free(db->unpwd->password);
 		if(db->unpwd->username) _mosquitto_free(db->unpwd->username);
+		if(db->unpwd->salt) _mosquitto_free(db->unpwd->salt);
+		if(db->unpwd->hash) _mosquitto_free(db->unpwd->hash);
+		if(db->unpwd->reload_password) _mosquitto_free(db->unpwd->reload_password);
 		_mosquitto_free(db->unpwd);
 		db->unpwd = tail;
 	}
+	if(db->unpwd_hash){
+		_mosquitto_free(db->unpwd_hash);
+		db->unpwd_hash = NULL;
+	}
+	db->unpwd_hash_size = 0;
+	db->unpwd_count = 0;
 
 	return MOSQ_ERR_SUCCESS;
 }
 
-/* Apply security settings after a reload.
+/* Are two lists of ACLs, as parsed from the acl file, the same? */
+static bool _acl_equal(struct _mosquitto_acl *a, struct _mosquitto_acl *b)
+{
+	while(a && b){
+		if(a->access != b->access || strcmp(a->topic, b->topic)){
+			return false;
+		}
+		if(!_acl_equal(a->child, b->child)){
+			return false;
+		}
+		a = a->next;
+		b = b->next;
+	}
+	return a == b;
+}
+
+static void _security_move(mosquitto_db *dest, mosquitto_db *src)
+{
+	dest->unpwd = src->unpwd;
+	dest->unpwd_hash = src->unpwd_hash;
+	dest->unpwd_hash_size = src->unpwd_hash_size;
+	dest->unpwd_count = src->unpwd_count;
+	dest->acl_list = src->acl_list;
+	dest->acl_user_hash = src->acl_user_hash;
+	dest->acl_user_hash_size = src->acl_user_hash_size;
+	dest->acl_user_count = src->acl_user_count;
+	dest->acl_patterns = src->acl_patterns;
+	dest->acl_pattern_tree = src->acl_pattern_tree;
+}
+
+/* Replace the current passwords and ACLs with those in reload_new, keeping
+ * the old ones in reload_old for clients that haven't been moved over yet. */
+static void _reload_swap(struct _mosquitto_db *db)
+{
+	struct _mosquitto_acl_user *acl_user, *new_user;
+
+	memset(&reload_old, 0, sizeof(mosquitto_db));
+	_security_move(&reload_old, db);
+	_security_move(db, &reload_new);
+	memset(&reload_new, 0, sizeof(mosquitto_db));
+
+	reload_acl_all = (!reload_old.acl_list != !db->acl_list)
+			|| !_acl_equal(reload_old.acl_patterns, db->acl_patterns);
+	reload_pwd_all = (!reload_old.unpwd && db->unpwd);
+	if(reload_acl_all){
+		acl_generation++;
+	}else{
+		for(acl_user = reload_old.acl_list; acl_user; acl_user = acl_user->next){
+			new_user = mosquitto_acl_user_find(db, acl_user->username);
+			if(new_user && _acl_equal(acl_user->acl, new_user->acl)){
+				acl_user->unchanged = new_user;
+			}
+		}
+	}
+#ifdef WITH_AUTH_PLUGIN
+	/* The plugin may answer differently now. */
+	if(db->auth_plugin) acl_generation++;
+#endif
+
+	reload_state = rs_apply;
+	reload_pos = 0;
+}
+
+/* Throw away a reload that hasn't been swapped in yet. */
+static void _reload_discard(void)
+{
+	if(reload_file){
+		fclose(reload_file);
+		reload_file = NULL;
+	}
+	if(reload_acl_user){
+		_mosquitto_free(reload_acl_user);
+		reload_acl_user = NULL;
+	}
+	mosquitto_acl_cleanup(&reload_new);
+	mosquitto_unpwd_cleanup(&reload_new);
+	reload_state = rs_none;
+}
+
+/* Start loading the password and acl files again. They are loaded by
+ * mosquitto_security_apply() and only replace the current ones once they have
+ * loaded without error. */
+int mosquitto_security_reload(mosquitto_db *db)
+{
+	if(!db) return MOSQ_ERR_INVAL;
+
+	if(reload_state == rs_apply){
+		/* Clients still refer to the data the last reload replaced. */
+		while(mosquitto_security_apply(db)){
+		}
+	}else if(reload_state != rs_none){
+		/* Start again with the files as they are now. */
+		_reload_discard();
+	}
+
+	memset(&reload_new, 0, sizeof(mosquitto_db));
+	reload_new.config = db->config;
+#ifdef WITH_AUTH_PLUGIN
+	/* The plugin replaces the password and acl files. */
+	if(db->auth_plugin){
+		reload_state = rs_compile;
+		reload_compile_pos = NULL;
+		return MOSQ_ERR_SUCCESS;
+	}
+#endif
+
+	reload_state = rs_pwfile;
+	if(db->config->password_file){
+		reload_file = fopen(db->config->password_file, "rt");
+		if(!reload_file){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error opening password file.");
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to reload passwords and ACLs, keeping the current ones.");
+			_reload_discard();
+			return 1;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct _mosquitto_unpwd *_unpwd_find(struct _mosquitto_db *db, const char *username)
+{
+	struct _mosquitto_unpwd *unpwd;
+
+	if(!db->unpwd_hash || !username) return NULL;
+
+	unpwd = db->unpwd_hash[_mosquitto_str_hash(username) & (db->unpwd_hash_size-1)];
+	while(unpwd){
+		if(!strcmp(unpwd->username, username)) return unpwd;
+		unpwd = unpwd->hash_next;
+	}
+	return NULL;
+}
+
+/* Has the password file entry for username changed in a reload? */
+static bool _unpwd_changed(struct _mosquitto_db *db, const char *username)
+{
+	struct _mosquitto_unpwd *old_pw, *new_pw;
+
+	if(reload_pwd_all) return true;
+
+	old_pw = _unpwd_find(&reload_old, username);
+	new_pw = _unpwd_find(db, username);
+	if(!old_pw || !new_pw) return old_pw != new_pw;
+	if(!old_pw->password || !new_pw->password){
+		return old_pw->password != new_pw->password;
+	}
+	return strcmp(old_pw->password, new_pw->password) != 0;
+}
+
+/* Check the password of a connected client against the reloaded password
+ * file. The answer is remembered on the entry of the user, so a user with
+ * many clients has the key derivation function run once rather than once for
+ * each client. */
+static int _unpwd_reload_check(struct _mosquitto_db *db, const char *username, const char *password)
+{
+	struct _mosquitto_unpwd *unpwd;
+	int rc;
+
+	unpwd = _unpwd_find(db, username);
+	if(!unpwd || !unpwd->password || !password){
+		/* No expensive check to save. */
+		return mosquitto_unpwd_check(db, NULL, username, password);
+	}
+	if(unpwd->reload_password && !strcmp(unpwd->reload_password, password)){
+		return unpwd->reload_rc;
+	}
+
+	rc = mosquitto_unpwd_check(db, NULL, username, password);
+	if(unpwd->reload_password) _mosquitto_free(unpwd->reload_password);
+	unpwd->reload_password = _mosquitto_strdup(password);
+	unpwd->reload_rc = rc;
+	return rc;
+}
+
+/* Apply security settings after a reload to a single client.
  * Includes:
  * - Disconnecting anonymous users if appropriate
  * - Disconnecting users with invalid passwords
  * - Reapplying ACLs
  */
-int mosquitto_security_apply(struct _mosquitto_db *db)
+static void _security_apply_context(struct _mosquitto_db *db, struct mosquitto *context)
 {
-	struct _mosquitto_acl_user *acl_user_tail;
-	struct _mosquitto_unpwd *unpwd_tail;
-	bool allow_anonymous;
-	int i;
-	bool unpwd_ok;
+	struct _mosquitto_acl_user *old_user, *new_user;
 
-	if(!db) return MOSQ_ERR_INVAL;
+	/* Check for anonymous clients when allow_anonymous is false */
+	if(!db->config->allow_anonymous && !context->username){
+		context->state = mosq_cs_disconnecting;
+		_mosquitto_socket_close(context);
+		return;
+	}
+	/* Check for connected clients that are no longer authorised */
+	if(db->unpwd && context->username && _unpwd_changed(db, context->username)
+			&& _unpwd_reload_check(db, context->username, context->password) != MOSQ_ERR_SUCCESS){
 
-	allow_anonymous = db->config->allow_anonymous;
-	
-	if(db->contexts){
-		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i]){
-				/* Check for anonymous clients when allow_anonymous is false */
-				if(!allow_anonymous && !db->contexts[i]->username){
-					db->contexts[i]->state = mosq_cs_disconnecting;
-					_mosquitto_socket_close(db->contexts[i]);
-					continue;
-				}
-				/* Check for connected clients that are no longer authorised */
-				if(db->unpwd && db->contexts[i]->username){
-					unpwd_ok = false;
-					unpwd_tail = db->unpwd;
-					while(unpwd_tail){
-						if(!strcmp(db->contexts[i]->username, unpwd_tail->username)){
-							if(unpwd_tail->password){
-								if(!db->contexts[i]->password 
-										|| strcmp(db->contexts[i]->password, unpwd_tail->password)){
-
-									/* Non matching password to username. */
-									db->contexts[i]->state = mosq_cs_disconnecting;
-									_mosquitto_socket_close(db->contexts[i]);
-									continue;
-								}else{
-									/* Username matches, password matches. */
-									unpwd_ok = true;
-								}
-							}else{
-								/* Username matches, password not in password file. */
-								unpwd_ok = true;
-							}
+		context->state = mosq_cs_disconnecting;
+		_mosquitto_socket_close(context);
+		return;
+	}
+
+	/* Clients that connected since the swap already have the new ACLs. */
+	old_user = mosquitto_acl_user_find(&reload_old, context->username);
+	if(context->acl_list != old_user) return;
+
+	new_user = mosquitto_acl_user_find(db, context->username);
+	if(!reload_acl_all && old_user && old_user->unchanged){
+		/* Keep the decisions made with the old copy of the ACLs. */
+		if(context->acl_cache && context->acl_cache->acl_list == old_user){
+			context->acl_cache->acl_list = new_user;
+		}else{
+			mosquitto_acl_cache_cleanup(context);
+		}
+		context->acl_list = new_user;
+	}else if(reload_acl_all || old_user || new_user){
+		context->acl_list = new_user;
+		/* The cache can't be relied on to notice that acl_list has changed,
+		 * because new_user may have the address of a user that has been
+		 * freed. */
+		mosquitto_acl_cache_cleanup(context);
+		mosquitto_acl_context_changed(context);
+	}
+}
+
+/* Do the next batch of a reload started by mosquitto_security_reload(): the
+ * next lines of the password or acl file, the next users to compile or the
+ * next clients to check against the new data. This keeps a reload with large
+ * files or many clients from holding up the main loop. Returns true while
+ * there is more to do. */
+bool mosquitto_security_apply(struct _mosquitto_db *db)
+{
+	char buf[1024];
+	int count;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(!db) return false;
+
+	for(count=0; reload_state != rs_none && count<SECURITY_RELOAD_BATCH && !rc; count++){
+		switch(reload_state){
+			case rs_none:
+				break;
+			case rs_pwfile:
+				if(reload_file && fgets(buf, 256, reload_file)){
+					rc = _pwfile_line(&reload_new, buf);
+				}else{
+					if(reload_file){
+						fclose(reload_file);
+						reload_file = NULL;
+					}
+					reload_state = rs_aclfile;
+					if(db->config->acl_file){
+						reload_file = fopen(db->config->acl_file, "rt");
+						if(!reload_file){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error opening acl file.");
+							rc = 1;
 						}
-						unpwd_tail = unpwd_tail->next;
 					}
-					if(!unpwd_ok){
-						db->contexts[i]->state = mosq_cs_disconnecting;
-						_mosquitto_socket_close(db->contexts[i]);
-						continue;
+				}
+				break;
+			case rs_aclfile:
+				if(reload_file && fgets(buf, 1024, reload_file)){
+					rc = _aclfile_line(&reload_new, buf, &reload_acl_user);
+				}else{
+					if(reload_file){
+						fclose(reload_file);
+						reload_file = NULL;
+						rc = _acl_compile_patterns(&reload_new);
+					}
+					if(reload_acl_user){
+						_mosquitto_free(reload_acl_user);
+						reload_acl_user = NULL;
 					}
+					reload_state = rs_compile;
+					reload_compile_pos = reload_new.acl_list;
 				}
-				/* Check for ACLs and apply to user. */
-				if(db->acl_list){
-  					acl_user_tail = db->acl_list;
-					while(acl_user_tail){
-						if(acl_user_tail->username){
-							if(db->contexts[i]->username){
-								if(!strcmp(acl_user_tail->username, db->contexts[i]->username)){
-									db->contexts[i]->acl_list = acl_user_tail;
-									break;
-								}
-							}
-						}else{
-							if(!db->contexts[i]->username){
-								db->contexts[i]->acl_list = acl_user_tail;
-								break;
-							}
-						}
-						acl_user_tail = acl_user_tail->next;
+				break;
+			case rs_compile:
+				if(reload_compile_pos){
+					rc = _acl_compile_user(&reload_new, reload_compile_pos);
+					reload_compile_pos = reload_compile_pos->next;
+				}else{
+					_reload_swap(db);
+				}
+				break;
+			case rs_apply:
+				if(reload_pos < db->context_count){
+					if(db->contexts[reload_pos]){
+						_security_apply_context(db, db->contexts[reload_pos]);
 					}
+					reload_pos++;
+				}else{
+					/* Nothing refers to the old data any more. */
+					mosquitto_acl_cleanup(&reload_old);
+					mosquitto_unpwd_cleanup(&reload_old);
+					reload_state = rs_none;
 				}
-			}
+				break;
 		}
 	}
-	return MOSQ_ERR_SUCCESS;
+	if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to reload passwords and ACLs, keeping the current ones.");
+		_reload_discard();
+	}
+	return reload_state != rs_none;
 }
 
 #endif
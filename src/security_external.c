@@ -53,12 +53,17 @@ void mosquitto_acl_cleanup(struct _mosquitto_db *db)
 {
 }
 
+enum mqtt3_sub_acl mosquitto_acl_check_sub(struct _mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	return sa_check;
+}
+
 int mosquitto_unpwd_init(struct _mosquitto_db *db)
 {
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mosquitto_unpwd_check(struct _mosquitto_db *db, const char *username, const char *password)
+int mosquitto_unpwd_check(struct _mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
 {
 	return MOSQ_ERR_AUTH;
 }
@@ -68,4 +73,15 @@ int mosquitto_unpwd_cleanup(struct _mosquitto_db *db)
 	return MOSQ_ERR_SUCCESS;
 }
 
+int mosquitto_security_reload(struct _mosquitto_db *db)
+{
+	mosquitto_security_cleanup(db);
+	return mosquitto_security_init(db);
+}
+
+bool mosquitto_security_apply(struct _mosquitto_db *db)
+{
+	return false;
+}
+
 #endif
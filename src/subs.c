@@ -35,6 +35,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mqtt3.h>
 #include <memory_mosq.h>
+#include <net_mosq.h>
+#include <send_mosq.h>
 #include <util_mosq.h>
 
 struct _sub_token {
@@ -42,7 +44,68 @@ struct _sub_token {
 	char *topic;
 };
 
-static int _subs_process(struct _mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+/* A non-retained QoS 0 message that is being delivered without a message
+ * store entry. The PUBLISH is serialised once and the same bytes are queued
+ * for every subscriber that can take it. */
+struct _sub_qos0 {
+	const char *source_id;
+	/* The listener it was published on, for its message_expiry. */
+	struct _mqtt3_listener *listener;
+	uint32_t payloadlen;
+	const uint8_t *payload;
+	struct _mosquitto_packet *packet;
+	/* The mount whose tree is being searched, if any, and the PUBLISH with
+	 * its mount_point removed for the clients of its listeners. */
+	struct _mosquitto_mount *mount;
+	struct _mosquitto_packet *mount_packet;
+	/* Only created if a subscriber needs the normal path. */
+	struct mosquitto_msg_store *stored;
+};
+
+/* Returns true if a QoS 0 message can be sent to context straight away as a
+ * shared packet, rather than through its message list. If the client already
+ * has messages waiting to be sent the normal path is used so that ordering is
+ * preserved, and clients about to be disconnected for queue overflow are left
+ * to the normal path to be dropped. Clients on a listener with a different
+ * mount point need the topic changing and bridges have their own queueing
+ * rules. */
+static bool _subs_qos0_direct(struct mosquitto *context, struct _mosquitto_mount *mount)
+{
+	return context->sock != INVALID_SOCKET
+			&& context->state == mosq_cs_connected
+			&& context->id
+			&& !context->bridge
+			&& !context->write_ready
+			&& !context->queue_overflow
+			&& !(context->listener && context->listener->mount && context->listener->mount != mount);
+}
+
+static int _subs_qos0_send(struct mosquitto *context, const char *topic, struct _sub_qos0 *qos0)
+{
+	struct _mosquitto_packet **packet;
+	int rc;
+
+	if(context->listener && context->listener->mount){
+		packet = &qos0->mount_packet;
+		topic += context->listener->mount->len;
+	}else{
+		packet = &qos0->packet;
+	}
+	if(!*packet){
+		rc = _mosquitto_publish_packet_create(packet, 0, topic, qos0->payloadlen, qos0->payload, 0, false, false);
+		if(rc) return rc;
+		(*packet)->ref_count = 1;
+	}
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d0, q0, r0, m0, '%s', ... (%ld bytes))", context->id, topic, (long)qos0->payloadlen);
+	rc = _mosquitto_send_shared_packet(context, *packet);
+	if(rc == MOSQ_ERR_NOMEM) return rc;
+	/* Any socket error will be picked up by the main loop. */
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* below is true if topic is below the level that the subscriptions of hier
+ * have their trailing # attached to. */
+static int _subs_process(struct _mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, struct _sub_qos0 *qos0, bool below)
 {
 	int rc = 0;
 	int rc2;
@@ -63,14 +126,23 @@ static int _subs_process(struct _mosquitto_db *db, struct _mosquitto_subhier *hi
 		}else{
 			hier->retained = NULL;
 		}
+#ifdef WITH_PERSISTENCE
+		mqtt3_wal_retain(stored);
+#endif
 	}
 	while(source_id && leaf){
 		if(leaf->context->bridge && !strcmp(leaf->context->id, source_id)){
 			leaf = leaf->next;
 			continue;
 		}
-		/* Check for ACL topic access. */
-		rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+		/* Check for ACL topic access, unless the ACLs were known to allow
+		 * everything this subscription matches when it was made. */
+		if(leaf->acl_generation == leaf->context->acl_generation
+				&& (leaf->acl == sa_allow || (leaf->acl == sa_allow_below && below))){
+			rc2 = MOSQ_ERR_SUCCESS;
+		}else{
+			rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+		}
 		if(rc2 == MOSQ_ERR_ACL_DENIED){
 			leaf = leaf->next;
 			continue;
@@ -82,6 +154,29 @@ static int _subs_process(struct _mosquitto_db *db, struct _mosquitto_subhier *hi
 			}else{
 				msg_qos = qos;
 			}
+			if(msg_qos == 0 && mqtt3_overload_shed(leaf->context)){
+				leaf = leaf->next;
+				continue;
+			}
+			if(qos0 && _subs_qos0_direct(leaf->context, qos0->mount)){
+				/* Subject to the same byte limits as the message list. */
+				if(!mqtt3_db_queue_bytes_check(db, leaf->context, qos0->payloadlen)){
+					if(_subs_qos0_send(leaf->context, topic, qos0)) rc = 1;
+				}
+				leaf = leaf->next;
+				continue;
+			}
+			if(!stored && qos0){
+				if(!qos0->stored){
+					if(mqtt3_db_message_store(db, qos0->source_id, 0, topic, 0, qos0->payloadlen, qos0->payload, 0, &qos0->stored, 0)){
+						return 1;
+					}
+					if(qos0->listener && qos0->listener->message_expiry){
+						qos0->stored->expiry_time = mqtt3_db_message_expiry(db, qos0->listener, topic);
+					}
+				}
+				stored = qos0->stored;
+			}
 			if(msg_qos){
 				mid = _mosquitto_mid_generate(leaf->context);
 			}else{
@@ -159,61 +254,105 @@ cleanup:
 	return 1;
 }
 
-static int _sub_add(struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+/* Find the node for tokens below subhier, adding any nodes that are missing. */
+static struct _mosquitto_subhier *_sub_node_add(struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
 {
-	struct _mosquitto_subhier *branch, *last = NULL;
-	struct _mosquitto_subleaf *leaf, *last_leaf;
+	struct _mosquitto_subhier *branch, *last;
 
-	if(!tokens){
-		if(context){
-			leaf = subhier->subs;
-			last_leaf = NULL;
-			while(leaf){
-				if(!strcmp(leaf->context->id, context->id)){
-					/* Client making a second subscription to same topic. Only
-					 * need to update QoS. Return -1 to indicate this to the
-					 * calling function. */
-					leaf->qos = qos;
-					return -1;
-				}
-				last_leaf = leaf;
-				leaf = leaf->next;
+	while(tokens){
+		last = NULL;
+		branch = subhier->children;
+		while(branch){
+			if(!strcmp(branch->topic, tokens->topic)){
+				break;
 			}
-			leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
-			if(!leaf) return MOSQ_ERR_NOMEM;
-			leaf->next = NULL;
-			leaf->context = context;
-			leaf->qos = qos;
-			if(last_leaf){
-				last_leaf->next = leaf;
-				leaf->prev = last_leaf;
+			last = branch;
+			branch = branch->next;
+		}
+		if(!branch){
+			branch = _mosquitto_calloc(1, sizeof(struct _mosquitto_subhier));
+			if(!branch) return NULL;
+			branch->topic = _mosquitto_strdup(tokens->topic);
+			if(!branch->topic){
+				_mosquitto_free(branch);
+				return NULL;
+			}
+			if(!last){
+				subhier->children = branch;
 			}else{
-				subhier->subs = leaf;
-				leaf->prev = NULL;
+				last->next = branch;
 			}
 		}
-		return MOSQ_ERR_SUCCESS;
+		subhier = branch;
+		tokens = tokens->next;
 	}
+	return subhier;
+}
 
-	branch = subhier->children;
-	while(branch){
-		if(!strcmp(branch->topic, tokens->topic)){
-			return _sub_add(context, qos, branch, tokens->next);
+/* Find the node for tokens below subhier, or NULL if there isn't one. */
+static struct _mosquitto_subhier *_sub_node_find(struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+{
+	struct _mosquitto_subhier *branch;
+
+	while(subhier && tokens){
+		branch = subhier->children;
+		while(branch && strcmp(branch->topic, tokens->topic)){
+			branch = branch->next;
 		}
-		last = branch;
-		branch = branch->next;
+		subhier = branch;
+		tokens = tokens->next;
 	}
-	/* Not found */
-	branch = _mosquitto_calloc(1, sizeof(struct _mosquitto_subhier));
-	if(!branch) return MOSQ_ERR_NOMEM;
-	branch->topic = _mosquitto_strdup(tokens->topic);
-	if(!branch->topic) return MOSQ_ERR_NOMEM;
-	if(!last){
-		subhier->children = branch;
+	return subhier;
+}
+
+static struct _mosquitto_subleaf *_sub_leaf_append(struct _mosquitto_subhier *subhier, struct _mosquitto_subleaf *last_leaf, struct mosquitto *context, int qos, enum mqtt3_sub_acl acl)
+{
+	struct _mosquitto_subleaf *leaf;
+
+	leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
+	if(!leaf) return NULL;
+	leaf->next = NULL;
+	leaf->context = context;
+	leaf->qos = qos;
+	leaf->acl = acl;
+	leaf->acl_generation = context->acl_generation;
+	if(last_leaf){
+		last_leaf->next = leaf;
+		leaf->prev = last_leaf;
 	}else{
-		last->next = branch;
+		subhier->subs = leaf;
+		leaf->prev = NULL;
 	}
-	return _sub_add(context, qos, branch, tokens->next);
+	mqtt3_quota_sub_count(context, 1);
+	return leaf;
+}
+
+static int _sub_add(struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, enum mqtt3_sub_acl acl)
+{
+	struct _mosquitto_subleaf *leaf, *last_leaf;
+
+	subhier = _sub_node_add(subhier, tokens);
+	if(!subhier) return MOSQ_ERR_NOMEM;
+
+	if(context){
+		leaf = subhier->subs;
+		last_leaf = NULL;
+		while(leaf){
+			if(!strcmp(leaf->context->id, context->id)){
+				/* Client making a second subscription to same topic. Only
+				 * need to update QoS. Return -1 to indicate this to the
+				 * calling function. */
+				leaf->qos = qos;
+				leaf->acl = acl;
+				leaf->acl_generation = context->acl_generation;
+				return -1;
+			}
+			last_leaf = leaf;
+			leaf = leaf->next;
+		}
+		if(!_sub_leaf_append(subhier, last_leaf, context, qos, acl)) return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
 }
 
 static int _sub_remove(struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
@@ -233,6 +372,7 @@ static int _sub_remove(struct mosquitto *context, struct _mosquitto_subhier *sub
 				if(leaf->next){
 					leaf->next->prev = leaf->prev;
 				}
+				mqtt3_quota_sub_count(context, -1);
 				_mosquitto_free(leaf);
 				return MOSQ_ERR_SUCCESS;
 			}
@@ -262,7 +402,7 @@ static int _sub_remove(struct mosquitto *context, struct _mosquitto_subhier *sub
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int _sub_search(struct _mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+static int _sub_search(struct _mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, struct _sub_qos0 *qos0)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct _mosquitto_subhier *branch;
@@ -273,16 +413,16 @@ static int _sub_search(struct _mosquitto_db *db, struct _mosquitto_subhier *subh
 		if(tokens && tokens->topic && (!strcmp(branch->topic, tokens->topic) || !strcmp(branch->topic, "+"))){
 			/* The topic matches this subscription.
 			 * Doesn't include # wildcards */
-			_sub_search(db, branch, tokens->next, source_id, topic, qos, retain, stored);
+			_sub_search(db, branch, tokens->next, source_id, topic, qos, retain, stored, qos0);
 			if(!tokens->next){
-				_subs_process(db, branch, source_id, topic, qos, retain, stored);
+				_subs_process(db, branch, source_id, topic, qos, retain, stored, qos0, false);
 			}
 		}else if(!strcmp(branch->topic, "#") && !branch->children && (!tokens || strcmp(tokens->topic, "/"))){
 			/* The topic matches due to a # wildcard - process the
 			 * subscriptions but *don't* return. Although this branch has ended
 			 * there may still be other subscriptions to deal with.
 			 */
-			_subs_process(db, branch, source_id, topic, qos, retain, stored);
+			_subs_process(db, branch, source_id, topic, qos, retain, stored, qos0, tokens != NULL);
 			flag = -1;
 		}
 		branch = branch->next;
@@ -290,7 +430,9 @@ static int _sub_search(struct _mosquitto_db *db, struct _mosquitto_subhier *subh
 	return flag;
 }
 
-int mqtt3_sub_add(struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
+/* acl is what mosquitto_acl_check_sub() said about sub, or sa_check if the
+ * ACLs should be checked for every message. */
+int mqtt3_sub_add(struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root, enum mqtt3_sub_acl acl)
 {
 	int tree;
 	int rc = 0;
@@ -313,10 +455,10 @@ int mqtt3_sub_add(struct mosquitto *context, const char *sub, int qos, struct _m
 	subhier = root->children;
 	while(subhier){
 		if(!strcmp(subhier->topic, "") && tree == 0){
-			rc = _sub_add(context, qos, subhier, tokens);
+			rc = _sub_add(context, qos, subhier, tokens, acl);
 			break;
 		}else if(!strcmp(subhier->topic, "$SYS") && tree == 2){
-			rc = _sub_add(context, qos, subhier, tokens);
+			rc = _sub_add(context, qos, subhier, tokens, acl);
 			break;
 		}
 		subhier = subhier->next;
@@ -333,6 +475,77 @@ int mqtt3_sub_add(struct mosquitto *context, const char *sub, int qos, struct _m
 	return rc;
 }
 
+/* Add a subscription that the caller knows isn't already in the tree, as when
+ * restoring the tree from the database file. bulk remembers where the last
+ * subscription went, so that a run of subscriptions to the same topic is
+ * appended without searching the tree or the existing subscribers. Nothing
+ * else may change the tree between calls using the same bulk. */
+int mqtt3_sub_add_bulk(struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root, struct _mosquitto_sub_bulk *bulk)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subleaf *leaf;
+	struct _sub_token *tokens = NULL, *tail;
+	const char *name, *topic = sub;
+
+	assert(context);
+	assert(sub);
+	assert(root);
+	assert(bulk);
+
+	if(!bulk->topic || bulk->root != root || strcmp(bulk->topic, topic)){
+		mqtt3_sub_bulk_clean(bulk);
+
+		if(!strncmp(sub, "$SYS/", 5)){
+			name = "$SYS";
+			sub += 5;
+		}else{
+			name = "";
+		}
+		if(strlen(sub) == 0) return MOSQ_ERR_SUCCESS;
+
+		for(subhier=root->children; subhier; subhier=subhier->next){
+			if(!strcmp(subhier->topic, name)) break;
+		}
+		if(!subhier) return MOSQ_ERR_SUCCESS;
+
+		if(_sub_topic_tokenise(sub, &tokens)) return MOSQ_ERR_NOMEM;
+		subhier = _sub_node_add(subhier, tokens);
+		while(tokens){
+			tail = tokens->next;
+			_mosquitto_free(tokens->topic);
+			_mosquitto_free(tokens);
+			tokens = tail;
+		}
+		if(!subhier) return MOSQ_ERR_NOMEM;
+
+		bulk->topic = _mosquitto_strdup(topic);
+		if(!bulk->topic) return MOSQ_ERR_NOMEM;
+		bulk->root = root;
+		bulk->node = subhier;
+		bulk->tail = subhier->subs;
+		while(bulk->tail && bulk->tail->next){
+			bulk->tail = bulk->tail->next;
+		}
+	}
+
+	leaf = _sub_leaf_append(bulk->node, bulk->tail, context, qos, sa_check);
+	if(!leaf) return MOSQ_ERR_NOMEM;
+	bulk->tail = leaf;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_sub_bulk_clean(struct _mosquitto_sub_bulk *bulk)
+{
+	assert(bulk);
+
+	if(bulk->topic) _mosquitto_free(bulk->topic);
+	bulk->root = NULL;
+	bulk->topic = NULL;
+	bulk->node = NULL;
+	bulk->tail = NULL;
+}
+
 int mqtt3_sub_remove(struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
@@ -373,11 +586,164 @@ int mqtt3_sub_remove(struct mosquitto *context, const char *sub, struct _mosquit
 	return rc;
 }
 
-int mqtt3_db_messages_queue(struct _mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+/* Returns true if context has a subscription to exactly sub. */
+bool mqtt3_sub_exists(struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root)
+{
+	const char *name;
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subleaf *leaf = NULL;
+	struct _sub_token *tokens = NULL, *tail;
+
+	assert(context);
+	assert(sub);
+	assert(root);
+
+	if(!strncmp(sub, "$SYS/", 5)){
+		name = "$SYS";
+		sub += 5;
+	}else{
+		name = "";
+	}
+	for(subhier=root->children; subhier; subhier=subhier->next){
+		if(!strcmp(subhier->topic, name)) break;
+	}
+	if(!subhier || _sub_topic_tokenise(sub, &tokens)) return false;
+
+	subhier = _sub_node_find(subhier, tokens);
+	if(subhier){
+		for(leaf=subhier->subs; leaf; leaf=leaf->next){
+			if(leaf->context == context) break;
+		}
+	}
+	while(tokens){
+		tail = tokens->next;
+		_mosquitto_free(tokens->topic);
+		_mosquitto_free(tokens);
+		tokens = tail;
+	}
+	return leaf != NULL;
+}
+
+/* Find the node that a retained message for tokens is kept in, adding it if
+ * stored isn't empty. Clears retain if context may not retain a message on a
+ * new topic because of the retained topic limits. */
+static struct _mosquitto_subhier *_retain_node_add(struct _mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, struct mosquitto_msg_store *stored, int *retain)
+{
+	struct _mosquitto_subhier *node;
+
+	node = _sub_node_find(subhier, tokens);
+	if(!stored->msg.payloadlen){
+		/* Only clears a retained message, so there is nothing to add. */
+		return node;
+	}
+	if((!node || !node->retained) && mqtt3_quota_retained_refused(db, context)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Not retaining message on %s from %s, over its retained topic limit.", stored->msg.topic, context->id);
+		*retain = 0;
+		return NULL;
+	}
+	if(node) return node;
+	return _sub_node_add(subhier, tokens);
+}
+
+/* Returns the mount whose subscription tree topic belongs in, or NULL for the
+ * main tree. hint is the most likely mount, usually that of the client
+ * listener. */
+static struct _mosquitto_mount *_sub_mount_find(struct _mosquitto_db *db, struct _mosquitto_mount *hint, const char *topic)
+{
+	struct _mosquitto_mount *mount;
+
+	if(hint && !strncmp(topic, hint->mount_point, hint->len)) return hint;
+	for(mount=db->mounts; mount; mount=mount->next){
+		if(!strncmp(topic, mount->mount_point, mount->len)) return mount;
+	}
+	return NULL;
+}
+
+/* Returns the tree that subscriptions to sub are kept in. They are added to it
+ * using &sub[*offset], with any mount_point removed. */
+struct _mosquitto_subhier *mqtt3_sub_root(struct _mosquitto_db *db, struct _mosquitto_mount *mount, const char *sub, int *offset)
+{
+	assert(db);
+	assert(sub);
+	assert(offset);
+
+	mount = _sub_mount_find(db, mount, sub);
+	if(mount){
+		*offset = mount->len;
+		return &mount->subs;
+	}
+	*offset = 0;
+	return &db->subs;
+}
+
+static int _sub_tree_queue(struct _mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, struct _sub_qos0 *qos0)
+{
+	int rc;
+
+	rc = _sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored, qos0);
+	if(rc == -1){
+		_subs_process(db, subhier, source_id, topic, qos, retain, stored, qos0, false);
+		rc = 0;
+	}
+	return rc;
+}
+
+/* Queue a message for the subscribers in the tree of the mount that topic is
+ * within. They subscribed without the mount_point, so it is skipped in the
+ * topic. tokens is topic as tokenised for the main tree. */
+static int _mount_messages_queue(struct _mosquitto_db *db, struct _mosquitto_mount *mount, struct _sub_token *tokens, int tree, const char *source_id, const char *topic, int qos, struct mosquitto_msg_store *stored, struct _sub_qos0 *qos0)
 {
 	int rc = 0;
-	int tree;
+	int i;
+	const char *unmounted = &topic[mount->len];
 	struct _mosquitto_subhier *subhier;
+	struct _sub_token *mount_tokens = NULL, *tail;
+	bool own_tokens = false;
+
+	if(tree == 0 && mount->mount_point[mount->len-1] == '/'
+			&& unmounted[0] != '/' && strncmp(unmounted, "$SYS/", 5)){
+		/* The levels after the mount_point have already been tokenised. */
+		mount_tokens = tokens;
+		for(i=0; i<mount->token_count; i++){
+			mount_tokens = mount_tokens->next;
+		}
+	}else{
+		if(!strncmp(unmounted, "$SYS/", 5)){
+			tree = 2;
+			unmounted += 5;
+		}else{
+			tree = 0;
+		}
+		if(_sub_topic_tokenise(unmounted, &mount_tokens)) return 1;
+		own_tokens = true;
+	}
+
+	for(subhier=mount->subs.children; subhier; subhier=subhier->next){
+		if(!strcmp(subhier->topic, tree == 2 ? "$SYS" : "")) break;
+	}
+	if(subhier){
+		if(qos0) qos0->mount = mount;
+		rc = _sub_tree_queue(db, subhier, mount_tokens, source_id, topic, qos, 0, stored, qos0);
+		if(qos0) qos0->mount = NULL;
+	}
+
+	while(own_tokens && mount_tokens){
+		tail = mount_tokens->next;
+		_mosquitto_free(mount_tokens->topic);
+		_mosquitto_free(mount_tokens);
+		mount_tokens = tail;
+	}
+	return rc;
+}
+
+/* context is the client that published the message, or NULL. */
+static int _db_messages_queue(struct _mosquitto_db *db, struct mosquitto *context, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, struct _sub_qos0 *qos0)
+{
+	int rc = 0;
+	int tree;
+	struct _mosquitto_subhier *subhier, *root = NULL, *node = NULL;
+	struct _mosquitto_mount *mount;
+	bool new_retained = false;
 	struct _sub_token *tokens = NULL, *tail;
 
 	assert(db);
@@ -398,28 +764,38 @@ int mqtt3_db_messages_queue(struct _mosquitto_db *db, const char *source_id, con
 				/* We have a message that needs to be retained, so ensure that the subscription
 				 * tree for its topic exists.
 				 */
-				_sub_add(NULL, 0, subhier, tokens);
-			}
-			rc = _sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored);
-			if(rc == -1){
-				_subs_process(db, subhier, source_id, topic, qos, retain, stored);
-				rc = 0;
+				node = _retain_node_add(db, context, subhier, tokens, stored, &retain);
+				root = subhier;
+				new_retained = node && !node->retained;
 			}
+			rc = _sub_tree_queue(db, subhier, tokens, source_id, topic, qos, retain, stored, qos0);
 		}else if(!strcmp(subhier->topic, "$SYS") && tree == 2){
 			if(retain){
 				/* We have a message that needs to be retained, so ensure that the subscription
 				 * tree for its topic exists.
 				 */
-				_sub_add(NULL, 0, subhier, tokens);
-			}
-			rc = _sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored);
-			if(rc == -1){
-				_subs_process(db, subhier, source_id, topic, qos, retain, stored);
-				rc = 0;
+				node = _retain_node_add(db, context, subhier, tokens, stored, &retain);
+				root = subhier;
+				new_retained = node && !node->retained;
 			}
+			rc = _sub_tree_queue(db, subhier, tokens, source_id, topic, qos, retain, stored, qos0);
 		}
 		subhier = subhier->next;
 	}
+	/* Retained messages are only kept in the main tree. */
+	mount = _sub_mount_find(db, context && context->listener?context->listener->mount:NULL, topic);
+	if(mount){
+		if(_mount_messages_queue(db, mount, tokens, tree, source_id, topic, qos, stored, qos0)) rc = 1;
+	}
+	if(node){
+		if(node->retained){
+			if(new_retained) mqtt3_quota_retained_set(node, context);
+		}else{
+			mqtt3_quota_retained_clear(db, node);
+			/* Don't leave the branch behind if nothing else uses it. */
+			_sub_remove(NULL, root, tokens);
+		}
+	}
 	while(tokens){
 		tail = tokens->next;
 		_mosquitto_free(tokens->topic);
@@ -430,6 +806,43 @@ int mqtt3_db_messages_queue(struct _mosquitto_db *db, const char *source_id, con
 	return rc;
 }
 
+int mqtt3_db_messages_queue(struct _mosquitto_db *db, struct mosquitto *context, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	return _db_messages_queue(db, context, source_id, topic, qos, retain, stored, NULL);
+}
+
+/* Deliver a non-retained QoS 0 message. Connected subscribers with nothing
+ * else queued are sent a shared copy of the serialised PUBLISH directly,
+ * which avoids creating a message store entry and a client message for each
+ * of them. A store entry is only created if some subscriber needs one. */
+int mqtt3_db_messages_queue_qos0(struct _mosquitto_db *db, const char *source_id, struct _mqtt3_listener *listener, const char *topic, uint32_t payloadlen, const uint8_t *payload)
+{
+	struct _sub_qos0 qos0;
+	int rc;
+
+	assert(db);
+	assert(topic);
+
+	qos0.source_id = source_id;
+	qos0.listener = listener;
+	qos0.payloadlen = payloadlen;
+	qos0.payload = payload;
+	qos0.packet = NULL;
+	qos0.mount = NULL;
+	qos0.mount_packet = NULL;
+	qos0.stored = NULL;
+
+	rc = _db_messages_queue(db, NULL, source_id, topic, 0, 0, NULL, &qos0);
+
+	if(qos0.packet){
+		_mosquitto_shared_packet_release(qos0.packet);
+	}
+	if(qos0.mount_packet){
+		_mosquitto_shared_packet_release(qos0.mount_packet);
+	}
+	return rc;
+}
+
 static int _subs_clean_session(struct mosquitto *context, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
@@ -450,6 +863,7 @@ static int _subs_clean_session(struct mosquitto *context, struct _mosquitto_subh
 				leaf->next->prev = leaf->prev;
 			}
 			next = leaf->next;
+			mqtt3_quota_sub_count(context, -1);
 			_mosquitto_free(leaf);
 			leaf = next;
 		}else{
@@ -481,9 +895,7 @@ static int _subs_clean_session(struct mosquitto *context, struct _mosquitto_subh
 	return rc;
 }
 
-/* Remove all subscriptions for a client.
- */
-int mqtt3_subs_clean_session(struct mosquitto *context, struct _mosquitto_subhier *root)
+static void _subs_tree_clean_session(struct mosquitto *context, struct _mosquitto_subhier *root)
 {
 	struct _mosquitto_subhier *child;
 
@@ -492,6 +904,22 @@ int mqtt3_subs_clean_session(struct mosquitto *context, struct _mosquitto_subhie
 		_subs_clean_session(context, child);
 		child = child->next;
 	}
+}
+
+/* Remove all subscriptions for a client.
+ */
+int mqtt3_subs_clean_session(struct _mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_mount *mount;
+
+	if(context->mount){
+		_subs_tree_clean_session(context, &context->mount->subs);
+	}else{
+		_subs_tree_clean_session(context, &db->subs);
+		for(mount=db->mounts; mount; mount=mount->next){
+			_subs_tree_clean_session(context, &mount->subs);
+		}
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
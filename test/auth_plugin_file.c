@@ -0,0 +1,130 @@
+/* A stand in auth plugin for testing and benchmarking the auth plugin
+ * support, without needing an external database.
+ *
+ * Options:
+ * 	auth_opt_password_file <path> - "username:password" lines. Without it
+ * 	                                every username is allowed.
+ * 	auth_opt_delay_ms <ms>        - how long each password check takes, to
+ * 	                                simulate a slow backend.
+ *
+ * Every client may publish and subscribe to anything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+
+struct user{
+	char *username;
+	char *password;
+};
+
+struct plugin_data{
+	struct user *users;
+	int user_count;
+	long delay_ms;
+};
+
+static int load_users(struct plugin_data *data, const char *path)
+{
+	FILE *fptr;
+	char buf[1024];
+	char *sep;
+
+	fptr = fopen(path, "rt");
+	if(!fptr){
+		fprintf(stderr, "auth_plugin_file: unable to open %s.\n", path);
+		return MOSQ_ERR_INVAL;
+	}
+	while(fgets(buf, sizeof(buf), fptr)){
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if(!buf[0] || buf[0] == '#') continue;
+		sep = strchr(buf, ':');
+		if(sep) *sep = '\0';
+
+		data->users = realloc(data->users, sizeof(struct user)*(data->user_count+1));
+		if(!data->users){
+			fclose(fptr);
+			return MOSQ_ERR_NOMEM;
+		}
+		data->users[data->user_count].username = strdup(buf);
+		data->users[data->user_count].password = sep ? strdup(sep+1) : NULL;
+		data->user_count++;
+	}
+	fclose(fptr);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_version(void)
+{
+	return MOSQ_AUTH_PLUGIN_VERSION;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	struct plugin_data *data;
+	int i;
+	int rc;
+
+	data = calloc(1, sizeof(struct plugin_data));
+	if(!data) return MOSQ_ERR_NOMEM;
+	*user_data = data;
+
+	for(i=0; i<auth_opt_count; i++){
+		if(!strcmp(auth_opts[i].key, "password_file")){
+			rc = load_users(data, auth_opts[i].value);
+			if(rc) return rc;
+		}else if(!strcmp(auth_opts[i].key, "delay_ms")){
+			data->delay_ms = atol(auth_opts[i].value);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	struct plugin_data *data = user_data;
+	int i;
+
+	if(!data) return MOSQ_ERR_SUCCESS;
+	for(i=0; i<data->user_count; i++){
+		free(data->users[i].username);
+		free(data->users[i].password);
+	}
+	free(data->users);
+	free(data);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, const char *username, const char *password)
+{
+	struct plugin_data *data = user_data;
+	struct timespec ts;
+	int i;
+
+	if(data->delay_ms){
+		ts.tv_sec = data->delay_ms/1000;
+		ts.tv_nsec = (data->delay_ms%1000)*1000000;
+		nanosleep(&ts, NULL);
+	}
+
+	if(!data->users) return MOSQ_ERR_SUCCESS;
+	for(i=0; i<data->user_count; i++){
+		if(!strcmp(data->users[i].username, username)){
+			if(!data->users[i].password) return MOSQ_ERR_SUCCESS;
+			if(password && !strcmp(data->users[i].password, password)){
+				return MOSQ_ERR_SUCCESS;
+			}
+			return MOSQ_ERR_AUTH;
+		}
+	}
+	return MOSQ_ERR_AUTH;
+}
+
+int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *username, const char *topic, int access)
+{
+	return MOSQ_ERR_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/* This provides a crude manner of testing the performance of a broker in
+ * connections/s, for example to see the effect of a slow auth plugin. It
+ * keeps CONNECT_WINDOW clients connecting at once, each disconnecting as soon
+ * as its CONNACK arrives. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <mosquitto.h>
+
+#ifndef CONNECT_COUNT
+#  define CONNECT_COUNT 1000
+#endif
+#ifndef CONNECT_WINDOW
+#  define CONNECT_WINDOW 100
+#endif
+
+struct client{
+	struct mosquitto *mosq;
+	int rc; /* -1 until the CONNACK arrives. */
+};
+
+void my_connect_callback(void *obj, int rc)
+{
+	((struct client *)obj)->rc = rc;
+}
+
+int main(int argc, char *argv[])
+{
+	struct client clients[CONNECT_WINDOW];
+	struct timeval start, stop;
+	char id[50];
+	int started = 0, finished = 0, refused = 0;
+	int i;
+	double diff;
+
+	mosquitto_lib_init();
+	for(i=0; i<CONNECT_WINDOW; i++){
+		clients[i].mosq = NULL;
+	}
+
+	gettimeofday(&start, NULL);
+	while(finished < CONNECT_COUNT){
+		for(i=0; i<CONNECT_WINDOW; i++){
+			if(!clients[i].mosq && started < CONNECT_COUNT){
+				snprintf(id, 50, "connect_rate_%d", started);
+				clients[i].rc = -1;
+				clients[i].mosq = mosquitto_new(id, &clients[i]);
+				if(!clients[i].mosq){
+					printf("Error: Out of memory.\n");
+					return 1;
+				}
+				mosquitto_connect_callback_set(clients[i].mosq, my_connect_callback);
+				mosquitto_username_pw_set(clients[i].mosq, "perftest", "perftest");
+				if(mosquitto_connect(clients[i].mosq, "127.0.0.1", 1885, 60, true)){
+					printf("Error: Unable to connect.\n");
+					return 1;
+				}
+				started++;
+			}
+			if(clients[i].mosq){
+				if(mosquitto_loop(clients[i].mosq, 0) || clients[i].rc != -1){
+					if(clients[i].rc != 0) refused++;
+					mosquitto_destroy(clients[i].mosq);
+					clients[i].mosq = NULL;
+					finished++;
+				}
+			}
+		}
+	}
+	gettimeofday(&stop, NULL);
+
+	diff = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec)/1.0e6;
+	printf("Connects: %d\nRefused: %d\nDiff: %g\nConnects/s: %g\n", CONNECT_COUNT, refused, diff, CONNECT_COUNT/diff);
+
+	mosquitto_lib_cleanup();
+	return 0;
+}
@@ -1,3 +1,9 @@
 #define MESSAGE_COUNT 100000L
 #define MESSAGE_SIZE 1024L
+/* Build with e.g. -DMESSAGE_QOS=1 to measure QoS 1 or 2 throughput. With the
+ * publisher sending as fast as it can, almost all messages are in flight at
+ * once so this also exercises acknowledgement handling with a large window. */
+#ifndef MESSAGE_QOS
+#  define MESSAGE_QOS 0
+#endif
 
@@ -0,0 +1,100 @@
+/* This provides a crude manner of testing the performance of a broker in
+ * messages/s when each message is delivered to many subscribers. Run it
+ * alongside msgsps_pub. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <mosquitto.h>
+
+#include <msgsps_common.h>
+
+#ifndef FANOUT_COUNT
+#  define FANOUT_COUNT 10
+#endif
+
+static int run = FANOUT_COUNT;
+static long message_count = 0;
+static struct timeval start, stop;
+static time_t last_message = 0;
+
+
+void my_connect_callback(void *obj, int rc)
+{
+	if(rc){
+		printf("rc: %d\n", rc);
+	}
+}
+
+void my_disconnect_callback(void *obj)
+{
+	run--;
+}
+
+void my_message_callback(void *obj, const struct mosquitto_message *msg)
+{
+	if(message_count == 0){
+		gettimeofday(&start, NULL);
+	}
+	message_count++;
+	gettimeofday(&stop, NULL);
+	last_message = stop.tv_sec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquitto *mosq[FANOUT_COUNT];
+	double dstart, dstop, diff;
+	uint16_t mid = 0;
+	char id[50];
+	int i;
+
+	start.tv_sec = 0;
+	start.tv_usec = 0;
+	stop.tv_sec = 0;
+	stop.tv_usec = 0;
+
+	mosquitto_lib_init();
+
+	for(i=0; i<FANOUT_COUNT; i++){
+		snprintf(id, 50, "msgps_fanout_%d_%d", getpid(), i);
+		mosq[i] = mosquitto_new(id, NULL);
+		mosquitto_connect_callback_set(mosq[i], my_connect_callback);
+		mosquitto_disconnect_callback_set(mosq[i], my_disconnect_callback);
+		mosquitto_message_callback_set(mosq[i], my_message_callback);
+
+		mosquitto_connect(mosq[i], "127.0.0.1", 1885, 600, true);
+		mosquitto_subscribe(mosq[i], &mid, "perf/test", MESSAGE_QOS);
+	}
+
+	/* Stop when everything has arrived, or when nothing has arrived for a
+	 * couple of seconds. */
+	while(run == FANOUT_COUNT && message_count < MESSAGE_COUNT*FANOUT_COUNT){
+		for(i=0; i<FANOUT_COUNT; i++){
+			if(mosquitto_loop(mosq[i], 0)){
+				run--;
+			}
+		}
+		if(last_message && time(NULL) > last_message + 2){
+			break;
+		}
+	}
+	dstart = (double)start.tv_sec*1.0e6 + (double)start.tv_usec;
+	dstop = (double)stop.tv_sec*1.0e6 + (double)stop.tv_usec;
+	diff = (dstop-dstart)/1.0e6;
+
+	printf("Subscribers: %d\nDelivered: %ld/%ld\nStart: %g\nStop: %g\nDiff: %g\nMessages/s: %g\nDeliveries/s: %g\n",
+			FANOUT_COUNT, message_count, MESSAGE_COUNT*FANOUT_COUNT, dstart, dstop, diff,
+			(double)message_count/FANOUT_COUNT/diff, (double)message_count/diff);
+
+	for(i=0; i<FANOUT_COUNT; i++){
+		mosquitto_disconnect(mosq[i]);
+		mosquitto_destroy(mosq[i]);
+	}
+	mosquitto_lib_cleanup();
+
+	return 0;
+}
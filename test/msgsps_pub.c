@@ -116,9 +116,10 @@ int main(int argc, char *argv[])
 	mosquitto_connect(mosq, "127.0.0.1", 1885, 600, true);
 
 	i=0;
-	while(!mosquitto_loop(mosq, -1) && run){
+	/* There is nothing to wait for with QoS 0, so don't block in the loop. */
+	while(!mosquitto_loop(mosq, MESSAGE_QOS ? -1 : 0) && run){
 		if(i<MESSAGE_COUNT){
-			mosquitto_publish(mosq, NULL, "perf/test", MESSAGE_SIZE, &buf[i*MESSAGE_SIZE], 0, false);
+			mosquitto_publish(mosq, NULL, "perf/test", MESSAGE_SIZE, &buf[i*MESSAGE_SIZE], MESSAGE_QOS, false);
 			i++;
 		}
 	}